@@ -133,7 +133,15 @@ struct homa_recvmsg_args {
 	 */
 	uint32_t num_bpages;
 
-	uint32_t _pad[2];
+	/**
+	 * @available: (out) Number of bytes at the beginning of the message
+	 * that are present in the buffers described by @bpage_offsets. This
+	 * is the same as the message length unless HOMA_RECVMSG_PARTIAL was
+	 * specified and the message is still arriving.
+	 */
+	uint32_t available;
+
+	uint32_t _pad[1];
 
 	/**
 	 * @bpage_offsets: (in/out) Each entry is an offset into the buffer
@@ -143,7 +151,9 @@ struct homa_recvmsg_args {
      * and are bpage-aligned. The last entry may refer to a bpage fragment and
      * is not necessarily aligned. The application now owns these bpages and
      * must eventually return them to Homa, using bpage_offsets in a future
-     * recvmsg invocation.
+     * recvmsg invocation. If regions have been added to the pool with
+     * HOMA_BUF_ADD, use HOMA_BUF_REGION and HOMA_BUF_REGION_OFFSET to
+     * decode the offsets.
 	 */
 	uint32_t bpage_offsets[HOMA_MAX_BPAGES];
 };
@@ -159,7 +169,8 @@ _Static_assert(sizeof(struct homa_recvmsg_args) <= 96,
 #define HOMA_RECVMSG_REQUEST       0x01
 #define HOMA_RECVMSG_RESPONSE      0x02
 #define HOMA_RECVMSG_NONBLOCKING   0x04
-#define HOMA_RECVMSG_VALID_FLAGS   0x07
+#define HOMA_RECVMSG_PARTIAL       0x08
+#define HOMA_RECVMSG_VALID_FLAGS   0x0f
 
 /**
  * struct homa_abort_args - Structure that passes arguments and results
@@ -186,6 +197,32 @@ _Static_assert(sizeof(struct homa_abort_args) <= 32, "homa_abort_args grew");
 /** define SO_HOMA_SET_BUF: setsockopt option for specifying buffer region. */
 #define SO_HOMA_SET_BUF 10
 
+/**
+ * define HOMA_REGION_SHIFT - A socket's buffer pool may consist of
+ * several regions (see HOMA_BUF_ADD); offsets returned by recvmsg
+ * (bpage_offsets) hold the index of a region in the bits above this
+ * shift, and the offset within that region in the bits below. Regions
+ * are thus limited to HOMA_MAX_REGION_SIZE bytes (SO_HOMA_SET_BUF fails
+ * with EINVAL for larger regions); more buffer space than that must be
+ * provided as multiple regions.
+ */
+#define HOMA_REGION_SHIFT 28
+#define HOMA_MAX_REGION_SIZE (1 << HOMA_REGION_SHIFT)
+
+/**
+ * define HOMA_MAX_REGIONS - Maximum number of regions in a socket's
+ * buffer pool.
+ */
+#define HOMA_MAX_REGIONS 16
+
+/* Decode an offset from bpage_offsets: HOMA_BUF_REGION returns the index
+ * of the region (0 for the region from the initial SO_HOMA_SET_BUF, and
+ * the value returned by setsockopt for regions added later), and
+ * HOMA_BUF_REGION_OFFSET returns the offset within that region.
+ */
+#define HOMA_BUF_REGION(offset) ((offset) >> HOMA_REGION_SHIFT)
+#define HOMA_BUF_REGION_OFFSET(offset) ((offset) & (HOMA_MAX_REGION_SIZE - 1))
+
 /** struct homa_set_buf - setsockopt argument for SO_HOMA_SET_BUF. */
 struct homa_set_buf_args {
 	/** @start: First byte of buffer region. */
@@ -193,8 +230,25 @@ struct homa_set_buf_args {
 
 	/** @length: Total number of bytes available at @start. */
 	size_t length;
+
+	/**
+	 * @flags: OR-ed combination of HOMA_BUF_* bits. Older applications
+	 * pass a structure that ends before this field; this is equivalent
+	 * to passing zero.
+	 */
+	int flags;
+
+	int _pad1;
 };
 
+/* Flag bits for homa_set_buf_args.flags (see man page for documentation):
+ */
+#define HOMA_BUF_PIN               0x01
+#define HOMA_BUF_HUGE              0x02
+#define HOMA_BUF_ADD               0x04
+#define HOMA_BUF_RETIRE            0x08
+#define HOMA_BUF_VALID_FLAGS       0x0f
+
 /**
  * Meanings of the bits in Homa's flag word, which can be set using
  * "sysctl /net/homa/flags".
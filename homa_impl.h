@@ -39,14 +39,17 @@
 #endif
 
 #include <linux/audit.h>
+#include <linux/capability.h>
 #include <linux/icmp.h>
 #include <linux/init.h>
+#include <linux/jhash.h>
 #include <linux/list.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
 #include <linux/completion.h>
 #include <linux/proc_fs.h>
+#include <linux/sched/mm.h>
 #include <linux/sched/signal.h>
 #include <linux/skbuff.h>
 #include <linux/version.h>
@@ -56,6 +59,7 @@
 #include <net/protocol.h>
 #include <net/inet_common.h>
 #include <net/gro.h>
+#include <net/busy_poll.h>
 #pragma GCC diagnostic warning "-Wpointer-sign"
 #pragma GCC diagnostic warning "-Wunused-variable"
 
@@ -74,12 +78,30 @@ extern cycles_t mock_get_cycles(void);
 #define signal_pending(xxx) mock_signal_pending
 extern int mock_signal_pending;
 
+#define rlimit(limit) mock_rlimit
+extern unsigned long mock_rlimit;
+
+#define capable(cap) mock_capable
+extern int mock_capable;
+
+#define mmgrab mock_mmgrab
+extern void mock_mmgrab(struct mm_struct *mm);
+
+#define mmdrop mock_mmdrop
+extern void mock_mmdrop(struct mm_struct *mm);
+
 #define rcu_read_lock mock_rcu_read_lock
 extern void mock_rcu_read_lock(void);
 
 #define rcu_read_unlock mock_rcu_read_unlock
 extern void mock_rcu_read_unlock(void);
 
+#define local_bh_disable mock_local_bh_disable
+extern void mock_local_bh_disable(void);
+
+#define local_bh_enable mock_local_bh_enable
+extern void mock_local_bh_enable(void);
+
 #undef current
 #define current current_task
 
@@ -87,6 +109,20 @@ extern void mock_rcu_read_unlock(void);
 
 #define kmalloc mock_kmalloc
 extern void *mock_kmalloc(size_t size, gfp_t flags);
+
+#undef kmem_cache_create
+#define kmem_cache_create mock_kmem_cache_create
+extern struct kmem_cache *mock_kmem_cache_create(const char *name,
+		unsigned int size, unsigned int align, slab_flags_t flags,
+		void (*ctor)(void *));
+
+#undef kmem_cache_alloc
+#define kmem_cache_alloc mock_kmem_cache_alloc
+extern void *mock_kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags);
+
+#undef cpu_to_node
+#define cpu_to_node mock_cpu_to_node
+extern int mock_cpu_to_node(int core);
 #endif
 
 #include "homa.h"
@@ -101,9 +137,10 @@ struct homa_lcache;
 
 /* Declarations used in this file, so they can't be made at the end. */
 extern void     homa_grantable_lock_slow(struct homa *homa);
-extern void     homa_peer_lock_slow(struct homa_peer *peer);
 extern void     homa_rpc_lock_slow(struct homa_rpc *rpc);
+extern void     homa_sock_dead_lock_slow(struct homa_sock *hsk);
 extern void     homa_sock_lock_slow(struct homa_sock *hsk);
+extern void     homa_sock_ready_lock_slow(struct homa_sock *hsk);
 extern void     homa_throttle_lock_slow(struct homa *homa);
 
 /**
@@ -183,10 +220,16 @@ enum homa_packet_type {
 
 /**
  * define NUM_PEER_UNACKED_IDS - The number of ids for unacked RPCs that
- * can be stored in a struct homa_peer.
+ * can be carried in a single ACK packet.
  */
 #define NUM_PEER_UNACKED_IDS 5
 
+/**
+ * define HOMA_PEER_ACK_SLOTS - The number of ids for unacked RPCs that
+ * can be stored in a struct homa_peer. Must be a power of 2.
+ */
+#define HOMA_PEER_ACK_SLOTS 32
+
 /**
  * struct homa_cache_line - An object whose size equals that of a cache line.
  */
@@ -603,23 +646,6 @@ struct homa_message_in {
 	 */
 	int total_length;
 
-	/**
-	 * @packets: DATA packets received for this message so far. The list
-	 * is sorted in order of offset (head is lowest offset), but
-	 * packets can be received out of order, so there may be times
-	 * when there are holes in the list. Packets in this list contain
-	 * exactly one data_segment. Packets on this list are removed from
-	 * this list and freed once all of their data has been copied
-	 * out to a user buffer.
-	 */
-	struct sk_buff_head packets;
-
-	/**
-	 * @num_skbs: Number of buffers currently in @packets. Will be 0 if
-	 * @total_length is less than 0.
-	 */
-	int num_skbs;
-
 	/**
 	 * @bytes_remaining: Amount of data for this message that has
 	 * not yet been received; will determine the message's priority.
@@ -633,17 +659,45 @@ struct homa_message_in {
 	 * Never larger than @total_length. Note: once initialized, this
 	 * may not be modified without holding @homa->grantable_lock.
 	 */
-        int incoming;
+	int incoming;
 
 	/** @priority: Priority level to include in future GRANTS. */
 	int priority;
 
+	/**
+	 * @num_skbs: Number of buffers currently in @packets. Will be 0 if
+	 * @total_length is less than 0.
+	 */
+	int num_skbs;
+
+	/**
+	 * @copied_out: All of the bytes of the message with offset less
+	 * than this value have been copied to user-space buffers, or are
+	 * being copied by homa_copy_to_user (see @copied).
+	 */
+	int copied_out;
+
 	/**
 	 * @scheduled: True means some of the bytes of this message
 	 * must be scheduled with grants.
 	 */
 	bool scheduled;
 
+	/**
+	 * @packets: DATA packets received for this message so far. The list
+	 * is sorted in order of offset (head is lowest offset), but
+	 * packets can be received out of order, so there may be times
+	 * when there are holes in the list. Packets in this list contain
+	 * exactly one data_segment. Packets on this list are removed from
+	 * this list and freed once all of their data has been copied
+	 * out to a user buffer.
+	 */
+	struct sk_buff_head packets;
+
+	/* Fields above this point are accessed for most incoming DATA
+	 * packets, so they are kept together at the start of the struct
+	 * (see the _Static_asserts below). Fields below are used less often.
+	 */
 	/**
 	 * @birth: get_cycles time when this RPC was added to the grantable
 	 * list. Invalid if RPC isn't in the grantable list.
@@ -651,10 +705,27 @@ struct homa_message_in {
 	__u64 birth;
 
 	/**
-	 * @copied_out: All of the bytes of the message with offset less
-	 * than this value have been copied to user-space buffers.
+	 * @delivered: Number of bytes at the start of the message that have
+	 * already been reported to the application by recvmsg calls with
+	 * HOMA_RECVMSG_PARTIAL. Used to decide whether a partial message
+	 * has made enough progress to return it again. Once this is nonzero,
+	 * the RPC can only be received by asking for it by id.
 	 */
-	int copied_out;
+	int delivered;
+
+	/**
+	 * @copied: Number of bytes at the start of the message whose copies
+	 * to user space have completed. Unlike @copied_out, this doesn't
+	 * include bytes that a homa_copy_to_user call is still copying, so
+	 * it's what recvmsg may report to the application.
+	 */
+	int copied;
+
+	/**
+	 * @copiers: Number of homa_copy_to_user calls currently copying
+	 * data for this message with the RPC lock released.
+	 */
+	int copiers;
 
 	/**
 	 * @num_bpages: The number of entries in @bpage_offsets used for this
@@ -668,6 +739,12 @@ struct homa_message_in {
 	 */
 	__u32 bpage_offsets[HOMA_MAX_BPAGES];
 };
+#if !defined(CONFIG_DEBUG_SPINLOCK) && !defined(CONFIG_DEBUG_LOCK_ALLOC)
+/* (Lock debugging makes struct sk_buff_head much larger.) */
+_Static_assert(offsetof(struct homa_message_in, packets)
+		+ sizeof(struct sk_buff_head) <= CACHE_LINE_SIZE,
+		"hot fields of homa_message_in don't fit in a cache line");
+#endif
 
 /**
  * struct homa_interest - Contains various information used while waiting
@@ -695,6 +772,13 @@ struct homa_interest {
 	 */
 	int locked;
 
+	/**
+	 * @core: Core on which @thread was executing when it registered
+	 * its interest. Used by homa_choose_interest to pick a thread whose
+	 * cache is close to the one where the RPC's packets were processed.
+	 */
+	int core;
+
 	/**
 	 * @reg_rpc: RPC whose @interest field points here, or
 	 * NULL if none.
@@ -725,6 +809,7 @@ static void inline homa_interest_init(struct homa_interest *interest)
 	interest->thread = current;
 	atomic_long_set(&interest->ready_rpc, 0);
 	interest->locked = 0;
+	interest->core = raw_smp_processor_id();
 	interest->reg_rpc = NULL;
 	interest->request_links.next = LIST_POISON1;
 	interest->response_links.next = LIST_POISON1;
@@ -736,15 +821,39 @@ static void inline homa_interest_init(struct homa_interest *interest)
  * clients and incoming RPCs on servers.
  */
 struct homa_rpc {
+	/* The fields from here through @dport are used for nearly every
+	 * packet (lookup, locking, and state checks), so they are packed
+	 * into the first cache line of the struct.
+	 */
 	/** @hsk:  Socket that owns the RPC. */
 	struct homa_sock *hsk;
 
 	/** @lock: Used to synchronize modifications to this structure;
-	 * points to the lock in hsk->client_rpc_buckets or
-	 * hsk->server_rpc_buckets.
+	 * points to the lock in a bucket of hsk->client_rpcs or
+	 * hsk->server_rpcs. Never changes during the life of the RPC.
 	 */
 	struct spinlock *lock;
 
+	/**
+	 * @hash_links: Used to link this object into a hash chain in
+	 * either @hsk->client_rpcs (for a client RPC), or
+	 * @hsk->server_rpcs (for a server RPC).
+	 */
+	struct hlist_node hash_links;
+
+	/**
+	 * @id: Unique identifier for the RPC among all those issued
+	 * from its port. The low-order bit indicates whether we are
+	 * server (1) or client (0) for this RPC.
+	 */
+	__u64 id;
+
+	/**
+	 * @peer: Information about the other machine (the server, if
+	 * this is a client RPC, or the client, if this is a server RPC).
+	 */
+	struct homa_peer *peer;
+
 	/**
 	 * @state: The current state of this RPC:
 	 *
@@ -794,46 +903,57 @@ struct homa_rpc {
 	 * RPC_XMITTING -          homa_xmit_data is actively transmitting
 	 *                         packets for this RPC, so it must not be
 	 *                         reaped.
+	 * RPC_TIMER_CHECK -       homa_wheel_check has removed this RPC from
+	 *                         its timer wheel and is about to check it, so
+	 *                         it must not be reaped.
 	 */
 #define RPC_PKTS_READY        1
 #define RPC_COPYING_FROM_USER 2
 #define RPC_COPYING_TO_USER   4
 #define RPC_HANDING_OFF       8
 #define RPC_XMITTING          0x10
+#define RPC_TIMER_CHECK       0x20
 
 #define RPC_CANT_REAP (RPC_COPYING_FROM_USER | RPC_COPYING_TO_USER \
-		| RPC_HANDING_OFF | RPC_XMITTING)
-
-	/**
-	 * @grants_in_progress: Count of active grant sends for this RPC;
-	 * it's not safe to reap the RPC unless this value is zero.
-	 * This variable is needed so that grantable_lock can be released
-	 * while sending grants, to reduce contention.
-	 */
-	atomic_t grants_in_progress;
+		| RPC_HANDING_OFF | RPC_XMITTING | RPC_TIMER_CHECK)
 
 	/**
-	 * @peer: Information about the other machine (the server, if
-	 * this is a client RPC, or the client, if this is a server RPC).
+	 * @active_ticks: Value of homa->timer_ticks the last time a packet
+	 * indicating progress was received for this RPC (or we transmitted
+	 * data for it), so we don't need to send a resend for a while.
+	 * Used by homa_timer to compute @silent_ticks.
 	 */
-	struct homa_peer *peer;
+	__u32 active_ticks;
 
 	/** @dport: Port number on @peer that will handle packets. */
 	__u16 dport;
 
+	/* Each message starts on a new cache line; the hot fields of
+	 * each message are at the start of its struct.
+	 */
 	/**
-	 * @id: Unique identifier for the RPC among all those issued
-	 * from its port. The low-order bit indicates whether we are
-	 * server (1) or client (0) for this RPC.
+	 * @msgin: Information about the message we receive for this RPC
+	 * (for server RPCs this is the request, for client RPCs this is the
+	 * response).
 	 */
-	__u64 id;
+	struct homa_message_in msgin
+			__attribute__((aligned(CACHE_LINE_SIZE)));
 
 	/**
-	 * @completion_cookie: Only used on clients. Contains identifying
-	 * information about the RPC provided by the application; returned to
-	 * the application with the RPC's result.
+	 * @msgout: Information about the message we send for this RPC
+	 * (for client RPCs this is the request, for server RPCs this is the
+	 * response).
 	 */
-	__u64 completion_cookie;
+	struct homa_message_out msgout
+			__attribute__((aligned(CACHE_LINE_SIZE)));
+
+	/**
+	 * @grants_in_progress: Count of active grant sends for this RPC;
+	 * it's not safe to reap the RPC unless this value is zero.
+	 * This variable is needed so that grantable_lock can be released
+	 * while sending grants, to reduce contention.
+	 */
+	atomic_t grants_in_progress;
 
 	/**
 	 * @error: Only used on clients. If nonzero, then the RPC has
@@ -842,26 +962,23 @@ struct homa_rpc {
 	 */
 	int error;
 
-	/**
-	 * @msgin: Information about the message we receive for this RPC
-	 * (for server RPCs this is the request, for client RPCs this is the
-	 * response).
+	/* The remaining fields are used only occasionally (e.g. once per
+	 * message or by the timer), so they are kept off the cache lines
+	 * above.
 	 */
-	struct homa_message_in msgin;
-
 	/**
-	 * @msgout: Information about the message we send for this RPC
-	 * (for client RPCs this is the request, for server RPCs this is the
-	 * response).
+	 * @interest: Describes a thread that wants to be notified when
+	 * msgin is complete, or NULL if none.
 	 */
-	struct homa_message_out msgout;
+	struct homa_interest *interest
+			__attribute__((aligned(CACHE_LINE_SIZE)));
 
 	/**
-	 * @hash_links: Used to link this object into a hash bucket for
-	 * either @hsk->client_rpc_buckets (for a client RPC), or
-	 * @hsk->server_rpc_buckets (for a server RPC).
+	 * @completion_cookie: Only used on clients. Contains identifying
+	 * information about the RPC provided by the application; returned to
+	 * the application with the RPC's result.
 	 */
-	struct hlist_node hash_links;
+	__u64 completion_cookie;
 
 	/**
 	 * @ready_links: Used to link this object into
@@ -876,14 +993,12 @@ struct homa_rpc {
 	 */
 	struct list_head active_links;
 
-	/** @dead_links: For linking this object into @hsk->dead_rpcs. */
-	struct list_head dead_links;
-
 	/**
-	 * @interest: Describes a thread that wants to be notified when
-	 * msgin is complete, or NULL if none.
+	 * @dead_links: For linking this object into @hsk->dead_rpcs;
+	 * once the RPC has been reaped, used to link it into
+	 * @hsk->free_rpcs.
 	 */
-	struct homa_interest *interest;
+	struct list_head dead_links;
 
 	/**
 	 * @grantable_links: Used to link this RPC into peer->grantable_rpcs.
@@ -901,11 +1016,31 @@ struct homa_rpc {
 
 	/**
 	 * @silent_ticks: Number of times homa_timer has been invoked
-	 * since the last time a packet indicating progress was received
-	 * for this RPC, so we don't need to send a resend for a while.
+	 * since @active_ticks, as of the last time homa_timer checked
+	 * this RPC.
 	 */
 	int silent_ticks;
 
+	/**
+	 * @timer_wheel: The wheel that manages timeouts for this RPC:
+	 * the one for the core on which the RPC was created. Never changes.
+	 */
+	struct homa_timer_wheel *timer_wheel;
+
+	/**
+	 * @timer_links: Used to link this RPC into a slot (or the @due
+	 * list) of @timer_wheel. If the RPC isn't in the wheel (it is being
+	 * checked, or it is dead), this is an empty list pointing to itself.
+	 */
+	struct list_head timer_links;
+
+	/**
+	 * @timer_expires: Value of homa->timer_ticks at which this RPC
+	 * should next be checked; only meaningful when @timer_links
+	 * is non-empty.
+	 */
+	__u32 timer_expires;
+
 	/**
 	 * @resend_timer_ticks: Value of homa->timer_ticks the last time
 	 * we sent a RESEND for this RPC.
@@ -935,6 +1070,13 @@ struct homa_rpc {
 	 */
 	uint64_t start_cycles;
 };
+_Static_assert(offsetof(struct homa_rpc, dport) + sizeof(__u16)
+		<= CACHE_LINE_SIZE,
+		"hot fields of homa_rpc don't fit in a cache line");
+_Static_assert(offsetof(struct homa_rpc, error) + sizeof(int)
+		- offsetof(struct homa_rpc, msgout) <= CACHE_LINE_SIZE,
+		"msgout, grants_in_progress, and error don't fit in a "
+		"cache line");
 
 /**
  * homa_rpc_lock() - Acquire the lock for an RPC.
@@ -1036,16 +1178,123 @@ struct homa_socktab_scan {
 };
 
 /**
- * define HOMA_CLIENT_RPC_BUCKETS - Number of buckets in hash tables for
- * client RPCs. Must be a power of 2.
+ * define HOMA_RPC_BUCKETS - Number of buckets (and hence locks) in each
+ * of a socket's RPC tables (hsk->client_rpcs and hsk->server_rpcs).
+ * Must be a power of 2.
+ */
+#define HOMA_RPC_BUCKETS 64
+
+/**
+ * define HOMA_RPC_BUCKET_MAX_BITS - Upper limit on the log2 of the number
+ * of hash chains in a single homa_rpc_bucket.
+ */
+#define HOMA_RPC_BUCKET_MAX_BITS 12
+
+/**
+ * define HOMA_WHEEL_BITS - log2 of the number of slots in each level
+ * of a homa_timer_wheel.
+ */
+#define HOMA_WHEEL_BITS 6
+#define HOMA_WHEEL_SLOTS (1 << HOMA_WHEEL_BITS)
+
+/**
+ * define HOMA_WHEEL_LEVELS - Number of levels in a homa_timer_wheel.
+ * Deadlines farther than HOMA_WHEEL_SPAN ticks in the future are
+ * clamped to HOMA_WHEEL_SPAN.
+ */
+#define HOMA_WHEEL_LEVELS 2
+#define HOMA_WHEEL_SPAN (1 << (HOMA_WHEEL_LEVELS * HOMA_WHEEL_BITS))
+
+/**
+ * define HOMA_SOFTIRQ_TIMER_RPCS - Maximum number of due RPCs that
+ * homa_timer_softirq will check in a single call, so that timer work
+ * doesn't add much latency to incoming packets.
+ */
+#define HOMA_SOFTIRQ_TIMER_RPCS 20
+
+/**
+ * define HOMA_WHEEL_DEAD_PEERS - Maximum number of timed-out peers that
+ * a homa_timer_wheel can record between calls to homa_timer.
+ */
+#define HOMA_WHEEL_DEAD_PEERS 4
+
+/**
+ * struct homa_timer_wheel - A hierarchical timer wheel that holds RPCs
+ * ordered by the value of homa->timer_ticks at which they must next be
+ * checked (rpc->timer_expires), so that each timer tick touches only the
+ * RPCs that are due. Level 0 has one slot per tick for the next
+ * HOMA_WHEEL_SLOTS ticks; each slot in level 1 covers HOMA_WHEEL_SLOTS
+ * ticks, and its RPCs are moved down to level 0 when its range begins.
+ * There is one wheel per core (in struct homa_core); it is normally
+ * serviced by homa_softirq on that core, and by homa_timer when the
+ * core isn't running SoftIRQ.
+ */
+struct homa_timer_wheel {
+	/**
+	 * @lock: Protects all of the fields below, plus rpc->timer_links
+	 * and rpc->timer_expires for all RPCs in the wheel.
+	 */
+	struct spinlock lock;
+
+	/**
+	 * @now: All RPCs with @timer_expires <= @now have been removed
+	 * from the wheel slots (they are either in @due or have been
+	 * checked).
+	 */
+	__u32 now;
+
+	/**
+	 * @softirq_ticks: the value of homa->timer_ticks the last time
+	 * homa_softirq ran on this wheel's core. homa_timer uses this to
+	 * decide whether it must service the wheel itself. Read without
+	 * holding @lock.
+	 */
+	__u32 softirq_ticks;
+
+	/**
+	 * @due: RPCs whose deadlines have passed but which haven't yet
+	 * been checked, linked through rpc->timer_links.
+	 */
+	struct list_head due;
+
+	/**
+	 * @num_dead_peers: number of valid entries in @dead_addrs.
+	 */
+	int num_dead_peers;
+
+	/**
+	 * @dead_addrs: addresses of peers that timed out while checking
+	 * RPCs from this wheel (no duplicates); homa_timer will abort
+	 * their RPCs.
+	 */
+	struct in6_addr dead_addrs[HOMA_WHEEL_DEAD_PEERS];
+
+	/** @slots: Lists of RPCs, linked through rpc->timer_links. */
+	struct list_head slots[HOMA_WHEEL_LEVELS][HOMA_WHEEL_SLOTS];
+};
+
+/**
+ * define HOMA_MAX_FREE_RPCS - The maximum number of reaped homa_rpc structs
+ * that a socket will retain for reuse (in hsk->free_rpcs).
+ */
+#define HOMA_MAX_FREE_RPCS 64
+
+/**
+ * define HOMA_MAX_REAP_SCALE - Upper limit on how much homa_reap_sockets
+ * scales up a socket's reaping work in one pass, as a multiple of
+ * homa->reap_limit. This bounds the time the reaper spends inside its
+ * RCU read-side critical section.
  */
-#define HOMA_CLIENT_RPC_BUCKETS 1024
+#define HOMA_MAX_REAP_SCALE 4
 
 /**
- * define HOMA_SERVER_RPC_BUCKETS - Number of buckets in hash tables for
- * server RPCs. Must be a power of 2.
+ * define HOMA_POLL_BUCKETS - Number of buckets in the per-socket histogram
+ * of wait times in homa_wait_for_message (see homa_poll_record). Bucket i
+ * counts waits shorter than (1 << (HOMA_POLL_SHIFT + i)) cycles (the last
+ * bucket also counts all longer waits).
  */
-#define HOMA_SERVER_RPC_BUCKETS 1024
+#define HOMA_POLL_BUCKETS 16
+#define HOMA_POLL_SHIFT 10
 
 struct homa_rpc_bucket {
 	/**
@@ -1057,10 +1306,70 @@ struct homa_rpc_bucket {
 	 */
 	struct spinlock lock;
 
-	/** @rpcs: list of RPCs that hash to this bucket. */
-	struct hlist_head rpcs;
+	/** @num_rpcs: Number of RPCs currently in @rpcs. */
+	int num_rpcs;
+
+	/** @bits: log2 of the number of hash chains in @rpcs. */
+	int bits;
+
+	/**
+	 * @rpcs: Hash chains for the RPCs in this bucket (see
+	 * homa_rpc_chain). Initially refers to @first; replaced with a
+	 * larger kmalloc-ed array by homa_rpc_bucket_add as the bucket
+	 * fills up. Protected by @lock.
+	 */
+	struct hlist_head *rpcs;
+
+	/** @first: The only hash chain while @bits is 0. */
+	struct hlist_head first;
+};
+
+/**
+ * struct homa_rpc_table - Hash table used to look up either the client
+ * or the server RPCs for a socket. Tables are allocated when a socket
+ * creates its first RPC of the given type, and the number of buckets
+ * never changes; instead, each bucket grows its own hash chains under
+ * its lock, so an RPC's lock never moves.
+ */
+struct homa_rpc_table {
+	/** @rcu_head: Used to free the table after the socket closes. */
+	struct rcu_head rcu_head;
+
+	/** @buckets: Buckets are selected using homa_rpc_table_bucket. */
+	struct homa_rpc_bucket buckets[HOMA_RPC_BUCKETS];
 };
 
+/**
+ * define HOMA_MIN_SLOT_SHIFT - log2 of the size of the smallest slots used
+ * to allocate the final (partial-bpage) fragments of messages.
+ */
+#define HOMA_MIN_SLOT_SHIFT 8
+
+/**
+ * define HOMA_NUM_SIZE_CLASSES - Number of distinct slot sizes (size
+ * classes) for message fragments smaller than a bpage; slots in class
+ * i have (1 << (HOMA_MIN_SLOT_SHIFT + i)) bytes (256 B - 32 KB).
+ */
+#define HOMA_NUM_SIZE_CLASSES 8
+
+/**
+ * define HOMA_MAX_SLOT_SIZE - Fragments larger than this are given an
+ * entire bpage.
+ */
+#define HOMA_MAX_SLOT_SIZE (1 << (HOMA_MIN_SLOT_SHIFT \
+		+ HOMA_NUM_SIZE_CLASSES - 1))
+
+/**
+ * define HOMA_MAX_SLOTS - The largest number of slots in a single bpage.
+ */
+#define HOMA_MAX_SLOTS (HOMA_BPAGE_SIZE >> HOMA_MIN_SLOT_SHIFT)
+
+/**
+ * define HOMA_SLOT_MAP_LONGS - Number of words in the slot bitmap for
+ * each bpage (see homa_pool_region->slot_maps).
+ */
+#define HOMA_SLOT_MAP_LONGS BITS_TO_LONGS(HOMA_MAX_SLOTS)
+
 /**
  * struct homa_bpage - Contains information about a single page in
  * a buffer pool. Note: this information is stored in user memory, so
@@ -1097,21 +1406,41 @@ struct homa_bpage {
 			 */
 			int owner;
 
+			/**
+			 * @node: NUMA node where the memory for this page
+			 * resides (NUMA_NO_NODE if the page had not yet been
+			 * touched when its region was registered and hasn't
+			 * yet been placed by homa_pool_place_buffers).
+			 */
+			int node;
+
 			/**
 			 * @expiration: time (in get_cycles units) after
 			 * which it's OK to steal this page from its current
 			 * owner.
 			 */
 			__u64 expiration;
+
+			/**
+			 * @size_class: if >= 0, this page is divided into
+			 * slots of this size class, each of which holds
+			 * the final fragment of a message (and @refs counts
+			 * allocated slots; the region's @slot_maps records
+			 * which ones). -1 means the page is used as a whole.
+			 */
+			int size_class;
 		};
 	};
 };
+#ifndef CONFIG_DEBUG_LOCK_ALLOC
+/* (Lockdep makes the spinlock alone nearly a cache line long.) */
 _Static_assert(sizeof(struct homa_bpage) == sizeof(struct homa_cache_line),
 		"homa_bpage overflowed a cache line");
+#endif
 
 /**
- * struct homa_pool_core - Holds core-specific data for a homa_pool (a bpage
- * out of which that core is allocating small chunks).
+ * struct homa_pool_core - Holds core-specific data for a homa_pool (the
+ * bpages out of which that core is allocating slots).
  */
 struct homa_pool_core {
 	union {
@@ -1122,19 +1451,13 @@ struct homa_pool_core {
 		struct homa_cache_line cache_line;
 		struct {
 			/**
-			 * @page_hint: Index of bpage in pool->descriptors,
-			 * which may be owned by this core. If so, we'll use it
-			 * for allocating partial pages.
-			 */
-			int page_hint;
-
-			/**
-			 * @allocated: if the page given by @page_hint is
-			 * owned by this core, this variable gives the number of
-			 * (initial) bytes that have already been allocated
-			 * from the page.
+			 * @class_pages: for each size class, the index (see
+			 * homa_pool_bpage) of a bpage owned by this core
+			 * from which it allocates slots of that class, or -1
+			 * if none. The bpage may no longer be owned by this
+			 * core, in which case it must not be used.
 			 */
-			int allocated;
+			int class_pages[HOMA_NUM_SIZE_CLASSES];
 		};
 	};
 };
@@ -1142,65 +1465,199 @@ _Static_assert(sizeof(struct homa_pool_core) == sizeof(struct homa_cache_line),
 		"homa_pool_core overflowed a cache line");
 
 /**
- * struct homa_pool - Describes a pool of buffer space for incoming
- * messages for a particular socket; managed by homa_pool.c. The pool is
- * divided up into "bpages", which are a multiple of the hardware page size.
- * A bpage may be owned by a particular core so that it can more efficiently
- * allocate space for small messages.
+ * struct homa_pool_node - Describes the bpages of a homa_pool whose memory
+ * resides on a particular NUMA node, along with the state used to scan
+ * them for free pages.
  */
-struct homa_pool {
+struct homa_pool_node {
+	/**
+	 * @num_bpages: number of bpages (in all of the pool's active
+	 * regions) in this partition.
+	 */
+	int num_bpages;
+
+	/**
+	 * @free_map: bitmap with one bit for each possible bpage in the pool
+	 * (indexed as in homa_pool_bpage); a 1 bit means the bpage belongs
+	 * to this partition and is probably free. Bits are set when bpages
+	 * are freed and cleared (atomically) when they are claimed, so
+	 * allocation doesn't need to probe descriptors. A clear bit doesn't
+	 * guarantee the bpage is in use: bpages that were still leased to a
+	 * core when an allocation found them are recorded with
+	 * homa_pool_defer and rediscovered by homa_pool_reclaim.
+	 */
+	unsigned long *free_map;
+
+	/**
+	 * @free_summary: second level of the free bitmap: bit i is set if
+	 * word i of @free_map may be nonzero.
+	 */
+	unsigned long *free_summary;
+};
+
+/**
+ * struct homa_pool_region - Describes one contiguous region of memory
+ * (in the application's address space) in a homa_pool.
+ */
+struct homa_pool_region {
 	/**
-	 * @region: beginning of the pool's region (in the app's virtual
-	 * memory). Initial portion is used for bpage metadata shared
-	 * with the application, and the remainder is divided into pages.
-	 * 0 means the pool hasn't yet been initialized.
+	 * @start: first byte of the region, or NULL if this entry isn't
+	 * currently in use.
 	 */
-	char *region;
+	char *start;
 
-	/** @num_bpages: total number of bpages in the pool. */
+	/** @num_bpages: number of bpages in the region. */
 	int num_bpages;
 
 	/**
-	 * @homa: shared information about the Homa driver.
+	 * @capacity: number of entries in @descriptors. Descriptors are
+	 * not freed when a region is retired, so the entry can be reused
+	 * for a later region with no more than this many bpages.
 	 */
-	struct homa *homa;
+	int capacity;
 
-	/** @descriptors: kmalloced area containing one entry for each bpage. */
+	/**
+	 * @descriptors: kmalloced area containing one entry for each bpage
+	 * in the region.
+	 */
 	struct homa_bpage *descriptors;
 
 	/**
-	 * @active_pages: the number of bpages (always the lowest ones)
-	 * that are currently being used for allocation.  Varies slowly
-	 * depending on active buffer usage. The goal is to keep this
-	 * number small to minimize memory footprint, while keeping it
-	 * large enough so that many pages are free at any given time
-	 * (so allocation is efficient).
+	 * @slot_maps: kmalloced area containing HOMA_SLOT_MAP_LONGS words
+	 * for each entry in @descriptors (in the same order). If the
+	 * bpage's @size_class is >= 0, its words hold one bit for each
+	 * slot in the bpage, which is set if the slot is allocated. Kept
+	 * separate from the descriptors so that each descriptor fits in a
+	 * cache line even with CONFIG_DEBUG_SPINLOCK.
 	 */
-	atomic_t active_pages;
+	unsigned long *slot_maps;
 
 	/**
-	 * @next_scan: index of the next page to check while searching for
-	 * a free bpage.
+	 * @active_bpages: number of bpages in the region whose @refs
+	 * are nonzero.
 	 */
-	atomic_t next_scan;
+	atomic_t active_bpages;
 
 	/**
-	 * @free_bpages_found: the number of pages successfully allocated
-	 * so far in the current scan (i.e. since @next_scan was set to 0).
+	 * @retiring: nonzero means the application has asked to remove
+	 * this region from the pool, so no new space may be allocated in it.
+	 * Only read or written with the lock held for a bpage of the region.
 	 */
-	atomic_t free_bpages_found;
+	int retiring;
 
-	/** @cores: core-specific info; dynamically allocated. */
-	struct homa_pool_core *cores;
+	/**
+	 * @pages: if the region was pinned (HOMA_BUF_PIN), a vmalloced
+	 * array holding the page (PAGE_SIZE bytes) for each part of the
+	 * region; incoming data is copied through kernel mappings of these
+	 * pages rather than through the application's addresses. NULL
+	 * means the region isn't pinned.
+	 */
+	struct page **pages;
 
-	/** @num_cores: number of elements in @cores. */
-	int num_cores;
+	/** @num_pages: number of entries in @pages. */
+	int num_pages;
+
+	/**
+	 * @mm: address space whose pinned_vm was charged for @pages
+	 * (see homa_pool_pin); NULL if the region isn't pinned.
+	 */
+	struct mm_struct *mm;
 };
 
 /**
- * struct homa_sock - Information about an open socket.
+ * struct homa_pool - Describes a pool of buffer space for incoming
+ * messages for a particular socket; managed by homa_pool.c. The pool
+ * consists of one or more regions, each of which is divided up into
+ * "bpages", which are a multiple of the hardware page size. A bpage may
+ * be owned by a particular core so that it can more efficiently allocate
+ * space for small messages.
  */
-struct homa_sock {
+struct homa_pool {
+	/**
+	 * @regions: the regions making up the pool. The offset of a buffer
+	 * (as returned to the application) holds the index of its region
+	 * above HOMA_REGION_SHIFT.
+	 */
+	struct homa_pool_region regions[HOMA_MAX_REGIONS];
+
+	/**
+	 * @num_regions: number of entries in @regions that have ever been
+	 * used (some may have been retired since then). 0 means the pool
+	 * hasn't yet been initialized.
+	 */
+	int num_regions;
+
+	/** @num_bpages: total number of bpages in the pool's active regions. */
+	int num_bpages;
+
+	/**
+	 * @homa: shared information about the Homa driver.
+	 */
+	struct homa *homa;
+
+	/**
+	 * @nodes: kmalloced array with @num_nodes + 1 entries, which
+	 * partitions the bpages by the NUMA node holding their memory.
+	 * The extra entry at the end holds bpages whose memory had not
+	 * been touched when the pool was created (they will be placed by
+	 * first touch, typically on the node of the core that copies into
+	 * them).
+	 */
+	struct homa_pool_node *nodes;
+
+	/** @num_nodes: number of NUMA nodes (not counting the extra entry). */
+	int num_nodes;
+
+	/**
+	 * @class_hints: for each size class, the index of an unowned bpage
+	 * of that class that recently had a slot freed (so it probably has
+	 * free slots), or -1. Used to reuse partially free pages.
+	 */
+	atomic_t class_hints[HOMA_NUM_SIZE_CLASSES];
+
+	/**
+	 * @next_reclaim: earliest time (in get_cycles units) at which a
+	 * bpage left out of the free maps (see homa_pool_defer) may become
+	 * allocatable, so that homa_pool_reclaim has something to find.
+	 * All ones (when read as unsigned) means there is no such bpage.
+	 */
+	atomic64_t next_reclaim;
+
+	/**
+	 * @map_words: number of unsigned longs in the @free_map of each
+	 * entry in @nodes.
+	 */
+	int map_words;
+
+	/**
+	 * @summary_words: number of unsigned longs in the @free_summary of
+	 * each entry in @nodes.
+	 */
+	int summary_words;
+
+	/**
+	 * @free_maps: kmalloced storage for the @free_map and @free_summary
+	 * bitmaps of all the entries in @nodes.
+	 */
+	unsigned long *free_maps;
+
+	/** @cores: core-specific info; dynamically allocated. */
+	struct homa_pool_core *cores;
+
+	/** @num_cores: number of elements in @cores. */
+	int num_cores;
+};
+
+/**
+ * define HOMA_MAX_BVECS - Maximum number of bio_vecs needed to describe
+ * a range of a pinned region that lies within a single bpage.
+ */
+#define HOMA_MAX_BVECS ((HOMA_BPAGE_SIZE + PAGE_SIZE - 1) >> PAGE_SHIFT)
+
+/**
+ * struct homa_sock - Information about an open socket.
+ */
+struct homa_sock {
 	/* Info for other network layers. Note: IPv6 info (struct ipv6_pinfo
 	 * comes at the very end of the struct, *after* Homa's data, if this
 	 * socket uses IPv6).
@@ -1217,11 +1674,13 @@ struct homa_sock {
 	};
 
 	/**
-	 * @lock: Must be held when modifying fields such as interests
-	 * and lists of RPCs. This lock is used in place of sk->sk_lock
-	 * because it's used differently (it's always used as a simple
-	 * spin lock).  See sync.txt for more on Homa's synchronization
-	 * strategy.
+	 * @lock: Must be held when modifying @shutdown, @active_rpcs, the
+	 * port binding, or the buffer pool configuration. This lock is used
+	 * in place of sk->sk_lock because it's used differently (it's always
+	 * used as a simple spin lock). The ready queues and dead RPCs have
+	 * their own locks (@ready_lock and @dead_lock) so that message
+	 * delivery and reaping don't contend with each other or with RPC
+	 * creation. See sync.txt for more on Homa's synchronization strategy.
 	 */
 	struct spinlock lock;
 
@@ -1275,6 +1734,13 @@ struct homa_sock {
 	 */
 	struct list_head active_rpcs;
 
+	/**
+	 * @dead_lock: Must be held when accessing @dead_rpcs or @dead_skbs,
+	 * and when incrementing @protect_count. Kept on its own cache line
+	 * so that reaping doesn't bounce the line holding @lock.
+	 */
+	struct spinlock dead_lock __attribute__((aligned(CACHE_LINE_SIZE)));
+
 	/**
 	 * @dead_rpcs: Contains RPCs for which homa_rpc_free has been
 	 * called, but their packet buffers haven't yet been freed.
@@ -1284,6 +1750,31 @@ struct homa_sock {
 	/** @dead_skbs: Total number of socket buffers in RPCs on dead_rpcs. */
 	int dead_skbs;
 
+	/**
+	 * @free_rpcs_lock: Used to synchronize access to @free_rpcs and
+	 * @num_free_rpcs. Separate from @lock so that allocating an RPC
+	 * doesn't contend with other socket operations.
+	 */
+	struct spinlock free_rpcs_lock;
+
+	/**
+	 * @free_rpcs: homa_rpc structs that have been reaped and can be
+	 * reused for new RPCs on this socket (linked through @dead_links).
+	 */
+	struct list_head free_rpcs;
+
+	/** @num_free_rpcs: Number of entries in @free_rpcs. */
+	int num_free_rpcs;
+
+	/**
+	 * @ready_lock: Must be held when accessing @ready_requests,
+	 * @ready_responses, @request_interests, @response_interests, or
+	 * the ready_links and interest fields of RPCs. The ready queues and
+	 * the interests share a lock because handing off an RPC and
+	 * registering an interest must be atomic with respect to each other.
+	 */
+	struct spinlock ready_lock __attribute__((aligned(CACHE_LINE_SIZE)));
+
 	/**
 	 * @ready_requests: Contains server RPCs whose request message is
 	 * in a state requiring attention from  a user process. The head is
@@ -1311,23 +1802,54 @@ struct homa_sock {
 	struct list_head response_interests;
 
 	/**
-	 * @client_rpc_buckets: Hash table for fast lookup of client RPCs.
-	 * Modifications are synchronized with bucket locks, not
-	 * the socket lock.
+	 * @client_rpcs: Hash table for fast lookup of client RPCs, or
+	 * NULL if this socket hasn't yet issued any requests (see
+	 * homa_rpc_table_get). Modifications are synchronized with
+	 * bucket locks, not the socket lock.
 	 */
-	struct homa_rpc_bucket client_rpc_buckets[HOMA_CLIENT_RPC_BUCKETS];
+	struct homa_rpc_table *client_rpcs;
 
 	/**
-	 * @server_rpc_buckets: Hash table for fast lookup of server RPCs.
+	 * @server_rpcs: Hash table for fast lookup of server RPCs, or
+	 * NULL if this socket hasn't yet received any requests.
 	 * Modifications are synchronized with bucket locks, not
 	 * the socket lock.
 	 */
-	struct homa_rpc_bucket server_rpc_buckets[HOMA_SERVER_RPC_BUCKETS];
+	struct homa_rpc_table *server_rpcs;
 
 	/**
 	 * @buffer_pool: used to allocate buffer space for incoming messages.
 	 */
 	struct homa_pool buffer_pool;
+
+	/**
+	 * @poll_cycles: How long (in get_cycles units) threads in
+	 * homa_wait_for_message should busy-wait on this socket before
+	 * sleeping; recomputed from @poll_waits by homa_poll_update.
+	 * homa->poll_cycles is an upper limit on the value used.
+	 */
+	int poll_cycles;
+
+	/**
+	 * @num_pollers: Number of threads currently busy-waiting in
+	 * homa_wait_for_message for this socket (only maintained if
+	 * homa->max_pollers is nonzero).
+	 */
+	atomic_t num_pollers;
+
+	/**
+	 * @poll_samples: Number of calls to homa_poll_record for this socket;
+	 * used to decide when to invoke homa_poll_update.
+	 */
+	int poll_samples;
+
+	/**
+	 * @poll_waits: Histogram of recent wait times in
+	 * homa_wait_for_message (see HOMA_POLL_BUCKETS). Updated without
+	 * synchronization: races can lose a sample occasionally, which
+	 * doesn't matter for this purpose.
+	 */
+	__u32 poll_waits[HOMA_POLL_BUCKETS];
 };
 
 /**
@@ -1351,29 +1873,54 @@ struct homa_dead_dst {
 };
 
 /**
- * define HOMA_PEERTAB_BUCKETS - Number of bits in the bucket index for a
- * homa_peertab.  Should be large enough to hold an entry for every server
- * in a datacenter without long hash chains.
+ * define HOMA_PEERTAB_MIN_BUCKET_BITS - Number of bits in the bucket index
+ * for a newly created homa_peertab; the table never shrinks below this size.
+ */
+#define HOMA_PEERTAB_MIN_BUCKET_BITS 6
+
+/**
+ * define HOMA_PEERTAB_MAX_BUCKET_BITS - The bucket index for a homa_peertab
+ * never grows larger than this many bits. Should be large enough to hold
+ * an entry for every server in a datacenter without long hash chains.
+ */
+#define HOMA_PEERTAB_MAX_BUCKET_BITS 20
+
+/**
+ * struct homa_peer_buckets - The bucket array for a homa_peertab. The
+ * array is replaced (as a whole) when the table is resized, so the size
+ * is stored with the buckets; this allows RCU readers to see a consistent
+ * combination.
  */
-#define HOMA_PEERTAB_BUCKET_BITS 20
+struct homa_peer_buckets {
+	/** @bits: Number of bits in a bucket index. */
+	int bits;
 
-/** define HOME_PEERTAB_BUCKETS - Number of buckets in a homa_peertab. */
-#define HOMA_PEERTAB_BUCKETS (1 << HOMA_PEERTAB_BUCKET_BITS)
+	/**
+	 * @heads: Heads of chains of homa_peers for each bucket (there
+	 * are 1<<@bits of them).
+	 */
+	struct hlist_head heads[];
+};
+
+/**
+ * define HOMA_PEER_GC_BATCH - Maximum number of peers examined by a
+ * single call to homa_peertab_gc.
+ */
+#define HOMA_PEER_GC_BATCH 1000
 
 /**
  * struct homa_peertab - A hash table that maps from IPv6 addresses
  * to homa_peer objects. IPv4 entries are encapsulated as IPv6 addresses.
- * Entries are gradually added to this table, but they are never removed
- * except when the entire table is deleted. We can't safely delete because
- * results returned by homa_peer_find may be retained indefinitely.
+ * Each peer has a reference count, and entries that have been idle for
+ * a while are removed by homa_peertab_gc.
  *
  * This table is managed exclusively by homa_peertab.c, using RCU to
  * permit efficient lookups.
  */
 struct homa_peertab {
 	/**
-	 * @write_lock: Synchronizes addition of new entries; not needed
-	 * for lookups (RCU is used instead).
+	 * @write_lock: Synchronizes addition and removal of entries; not
+	 * needed for lookups (RCU is used instead).
 	 */
 	struct spinlock write_lock;
 
@@ -1384,11 +1931,47 @@ struct homa_peertab {
 	struct list_head dead_dsts;
 
 	/**
-	 * @buckets: Pointer to heads of chains of homa_peers for each bucket.
-	 * Malloc-ed, and must eventually be freed. NULL means this structure
+	 * @buckets: Current bucket array for the table; vmalloc-ed, and
+	 * replaced by homa_peertab_resize. Readers must use rcu_dereference;
+	 * hold @write_lock to modify the chains. NULL means this structure
 	 * has not been initialized.
 	 */
-	struct hlist_head *buckets;
+	struct homa_peer_buckets __rcu *buckets;
+
+	/**
+	 * @hash_seed: Random value used to key the hash function, so that
+	 * remote hosts can't choose addresses that collide.
+	 */
+	__u32 hash_seed;
+
+	/**
+	 * @lru: Contains all of the peers in the table, linked through
+	 * @lru_links. New peers are added at the tail, and homa_peertab_gc
+	 * scans from the head, moving peers that are still in use back to
+	 * the tail (a clock sweep). Hold @write_lock when manipulating.
+	 */
+	struct list_head lru;
+
+	/** @num_peers: number of peers currently in the table. */
+	int num_peers;
+};
+
+/**
+ * struct homa_peer_ack_slot - One entry in the ring of pending acks
+ * for a homa_peer.
+ */
+struct homa_peer_ack_slot {
+	/**
+	 * @seq: indicates the state of this slot. If @seq equals the
+	 * position of the slot (a value of homa_peer's @ack_head), the slot
+	 * is empty and may be filled; if it equals the position plus one,
+	 * @ack is valid and may be removed. Any other value means another
+	 * thread is still working on the slot.
+	 */
+	atomic_t seq;
+
+	/** @ack: info about one client RPC that can be acked. */
+	struct homa_ack ack;
 };
 
 /**
@@ -1455,6 +2038,26 @@ struct homa_peer {
 	 */
 	struct hlist_node peertab_links;
 
+	/**
+	 * @refs: number of references to this peer (one from each RPC
+	 * involving the peer, plus any held temporarily by callers of
+	 * homa_peer_find). A negative value means the peer is being
+	 * deleted, so new references may not be taken.
+	 */
+	atomic_t refs;
+
+	/**
+	 * @access_jiffies: time (in jiffies) when a reference to this peer
+	 * was most recently taken or released.
+	 */
+	unsigned long access_jiffies;
+
+	/** @lru_links: Used to link this peer into peertab->lru. */
+	struct list_head lru_links;
+
+	/** @rcu: Used to free the peer once RCU readers are done with it. */
+	struct rcu_head rcu;
+
 	/**
 	 * @outstanding_resends: the number of resend requests we have
 	 * sent to this server (spaced @homa.resend_interval apart) since
@@ -1496,21 +2099,25 @@ struct homa_peer {
 	struct homa_rpc *resend_rpc;
 
 	/**
-	 * @num_acks: the number of (initial) entries in @acks that
-	 * currently hold valid information.
+	 * @ack_head: the total number of slots in @ack_slots that have
+	 * been claimed by homa_peer_push_ack (the next slot to fill is
+	 * @ack_head modulo HOMA_PEER_ACK_SLOTS).
 	 */
-	int num_acks;
+	atomic_t ack_head;
 
 	/**
-	 * @acks: info about client RPCs whose results have been completely
-	 * received.
+	 * @ack_tail: the total number of acks that have been claimed by
+	 * homa_peer_get_acks (the oldest pending ack is at @ack_tail
+	 * modulo HOMA_PEER_ACK_SLOTS).
 	 */
-	struct homa_ack acks[NUM_PEER_UNACKED_IDS];
+	atomic_t ack_tail;
 
 	/**
-	 * @ack_lock: used to synchronize access to @num_acks and @acks.
+	 * @ack_slots: a bounded lock-free ring holding info about client
+	 * RPCs whose results have been completely received. Any number of
+	 * threads may add and remove acks concurrently.
 	 */
-	struct spinlock ack_lock;
+	struct homa_peer_ack_slot ack_slots[HOMA_PEER_ACK_SLOTS];
 };
 
 /**
@@ -1665,6 +2272,12 @@ struct homa {
 	 */
 	struct homa_peertab peers;
 
+	/**
+	 * @rpc_cache: Slab cache from which homa_rpc structs are allocated.
+	 * NULL means the cache couldn't be created.
+	 */
+	struct kmem_cache *rpc_cache;
+
 	/**
 	 * @rtt_bytes: An estimate of the amount of data that can be transmitted
          * over the wire in the time it takes to send a full-size data packet
@@ -1699,6 +2312,22 @@ struct homa {
 	 */
 	int poll_cycles;
 
+	/**
+	 * @poll_percentile: If nonzero, each socket adjusts the time its
+	 * threads busy-wait (up to @poll_usecs) so that this percentage of
+	 * recent waits in homa_wait_for_message would have ended while
+	 * polling. Zero (the default) means always poll for @poll_usecs.
+	 * Set externally via sysctl.
+	 */
+	int poll_percentile;
+
+	/**
+	 * @max_pollers: If nonzero, at most this many threads may busy-wait
+	 * on a single socket at once; additional threads go to sleep
+	 * immediately. Set externally via sysctl.
+	 */
+	int max_pollers;
+
 	/**
 	 * @num_priorities: The total number of priority levels available for
 	 * Homa's use. Internally, Homa will use priorities from 0 to
@@ -1850,6 +2479,18 @@ struct homa {
 	 */
 	bool pacer_exit;
 
+	/**
+	 * @reaper_kthread: Kernel thread that frees the resources of
+	 * dead RPCs in the background (see reap.txt); woken by homa_timer.
+	 */
+	struct task_struct *reaper_kthread;
+
+	/**
+	 * @reaper_exit: true means that the reaper thread should exit as
+	 * soon as possible.
+	 */
+	bool reaper_exit;
+
 	/**
 	 * @max_nic_queue_ns: Limits the NIC queue length: we won't queue
 	 * up a packet for transmission if link_idle_time is this many
@@ -1918,6 +2559,21 @@ struct homa {
 	 *                            homa_softirq during GRO.
 	 * HOMA_GRO_SHORT_BYPASS      Pass all short packets directly to
 	 *                            homa_softirq during GR).
+	 * HOMA_GRO_RPC_AFFINE        Batch packets by RPC rather than by
+	 *                            peer, and select the SoftIRQ core for a
+	 *                            batch with a hash of its peer and RPC id,
+	 *                            so that an RPC's packets are always
+	 *                            handled on the same core (unless that
+	 *                            core's backlog exceeds
+	 *                            gro_affine_max_backlog).
+	 *                            Takes precedence over HOMA_GRO_IDLE_NEW,
+	 *                            HOMA_GRO_IDLE, and HOMA_GRO_NEXT.
+	 * HOMA_GRO_LOAD_FEEDBACK     Select the SoftIRQ core with the least
+	 *                            estimated queued work within this core's
+	 *                            NUMA node, skipping softirq_excluded
+	 *                            cores. Takes precedence over
+	 *                            HOMA_GRO_IDLE_NEW, HOMA_GRO_IDLE, and
+	 *                            HOMA_GRO_NEXT.
 	 */
 	#define HOMA_GRO_BYPASS          1
 	#define HOMA_GRO_SAME_CORE       2
@@ -1926,6 +2582,8 @@ struct homa {
 	#define HOMA_GRO_IDLE_NEW       16
 	#define HOMA_GRO_FAST_GRANTS    32
 	#define HOMA_GRO_SHORT_BYPASS   64
+	#define HOMA_GRO_RPC_AFFINE    128
+	#define HOMA_GRO_LOAD_FEEDBACK 256
 	#define HOMA_GRO_NORMAL      (HOMA_GRO_SAME_CORE|HOMA_GRO_IDLE_NEW \
 			|HOMA_GRO_SHORT_BYPASS)
 
@@ -1943,6 +2601,83 @@ struct homa {
 	 */
 	int gro_busy_cycles;
 
+	/**
+	 * @gro_affine_max_backlog: under HOMA_GRO_RPC_AFFINE, if the
+	 * softirq_backlog of an RPC's preferred core exceeds this value, the
+	 * batch is steered to a less-loaded nearby core instead. Set
+	 * externally via sysctl.
+	 */
+	int gro_affine_max_backlog;
+
+	/**
+	 * @softirq_excluded: bitmap with one bit per core; a 1 bit means
+	 * that HOMA_GRO_LOAD_FEEDBACK will never select that core for SoftIRQ
+	 * processing (e.g., because it is dedicated to an application).
+	 * Set externally via sysctl as a list of core ranges, such as "0-3,8".
+	 */
+	DECLARE_BITMAP(softirq_excluded, NR_CPUS);
+
+	/**
+	 * @softirq_excluded_ptr: always points to @softirq_excluded (the
+	 * sysctl handler for bitmaps requires a pointer).
+	 */
+	unsigned long *softirq_excluded_ptr;
+
+	/**
+	 * @poll_cores: bitmap with one bit per core; each core whose bit
+	 * is set runs a dedicated Homa polling thread (homa_poll_core_main),
+	 * and all SoftIRQ processing for Homa is steered to these cores.
+	 * Empty means this mode is disabled. Set externally via sysctl as a
+	 * list of core ranges, such as "2,3".
+	 */
+	DECLARE_BITMAP(poll_cores, NR_CPUS);
+
+	/**
+	 * @poll_cores_ptr: always points to @poll_cores (the sysctl handler
+	 * for bitmaps requires a pointer).
+	 */
+	unsigned long *poll_cores_ptr;
+
+	/**
+	 * @num_poll_cores: number of cores currently running dedicated
+	 * polling threads; 0 means that mode is disabled.
+	 */
+	int num_poll_cores;
+
+	/**
+	 * @gro_candidates: the cores that homa_gro_least_loaded_core may
+	 * select. Normally these are all of the cores not in
+	 * @softirq_excluded, grouped by NUMA node; if there are polling
+	 * cores, it holds just those cores. The range used by a given core
+	 * is given by its homa_core's @gro_first_candidate and
+	 * @gro_num_candidates. Recomputed by homa_gro_candidates_changed.
+	 */
+	int gro_candidates[NR_CPUS];
+
+	/**
+	 * @napi_ids: NAPI ids of the NIC receive queues on which Homa packets
+	 * have arrived (zero entries are unused); these are the queues
+	 * polled by dedicated polling cores. Only recorded when
+	 * @num_poll_cores is nonzero.
+	 */
+#define HOMA_MAX_NAPI_IDS 16
+	unsigned int napi_ids[HOMA_MAX_NAPI_IDS];
+
+	/**
+	 * @max_gro_usecs: if a batch of packets has been accumulating in
+	 * homa_gro_receive for at least this many microseconds, it is pushed
+	 * up the stack when the next packet is added to it, even if it
+	 * hasn't reached @max_gro_skbs. Zero means no age limit. Set
+	 * externally via sysctl.
+	 */
+	int max_gro_usecs;
+
+	/**
+	 * @max_gro_cycles: Same as max_gro_usecs, except in units
+	 * of get_cycles().
+	 */
+	int max_gro_cycles;
+
 	/**
 	 * @timer_ticks: number of times that homa_timer has been invoked
 	 * (may wraparound, which is safe).
@@ -2009,6 +2744,20 @@ struct homa {
 	 */
 	int bpage_lease_cycles;
 
+	/**
+	 * @peer_idle_secs: a peer with no RPCs, grantable messages, or
+	 * pending acks is removed from the peer table once it has been
+	 * unused for this many seconds. Set externally via sysctl.
+	 */
+	int peer_idle_secs;
+
+	/**
+	 * @peer_gc_threshold: idle peers are removed only when the peer
+	 * table contains more than this many entries. Set externally
+	 * via sysctl.
+	 */
+	int peer_gc_threshold;
+
 	/**
 	 * @temp: the values in this array can be read and written with sysctl.
 	 * They have no officially defined purpose, and are available for
@@ -2105,6 +2854,26 @@ struct homa_metrics {
 	 */
 	__u64 responses_queued;
 
+	/**
+	 * @handoffs_same_core: total number of times that homa_rpc_handoff
+	 * gave an RPC to a thread that registered its interest on the core
+	 * where the handoff occurred.
+	 */
+	__u64 handoffs_same_core;
+
+	/**
+	 * @handoffs_same_node: total number of times that homa_rpc_handoff
+	 * gave an RPC to a thread on a different core, but in the same NUMA
+	 * node as the handoff.
+	 */
+	__u64 handoffs_same_node;
+
+	/**
+	 * @handoffs_cross_node: total number of times that homa_rpc_handoff
+	 * gave an RPC to a thread in a different NUMA node from the handoff.
+	 */
+	__u64 handoffs_cross_node;
+
 	/**
 	 * @fast_wakeups: total number of times that a message arrived for
 	 * a receiving thread that was polling in homa_wait_for_message.
@@ -2123,6 +2892,78 @@ struct homa_metrics {
 	 */
 	__u64 poll_cycles;
 
+	/**
+	 * @poll_budget_updates: total number of times that a socket's
+	 * busy-wait time was recomputed by homa_poll_update.
+	 */
+	__u64 poll_budget_updates;
+
+	/**
+	 * @pollers_limited: total number of times a thread in
+	 * homa_wait_for_message slept without polling because
+	 * homa->max_pollers threads were already polling on its socket.
+	 */
+	__u64 pollers_limited;
+
+	/**
+	 * @napi_polls: total number of times a thread in
+	 * homa_wait_for_message busy-polled a NIC queue (via
+	 * napi_busy_loop) instead of just yielding the core.
+	 */
+	__u64 napi_polls;
+
+	/**
+	 * @napi_poll_pkts: total number of incoming packets that were
+	 * processed in GRO while a thread on the same core was busy-polling
+	 * for a Homa socket (these bypass the SoftIRQ handoff).
+	 */
+	__u64 napi_poll_pkts;
+
+	/**
+	 * @gro_age_flushes: total number of times homa_gro_receive pushed
+	 * a batch of packets up the stack because it had been accumulating
+	 * for at least homa->max_gro_usecs.
+	 */
+	__u64 gro_age_flushes;
+
+	/**
+	 * @gro_affine_batches: total number of batches that were steered to
+	 * their RPC's preferred SoftIRQ core under HOMA_GRO_RPC_AFFINE.
+	 */
+	__u64 gro_affine_batches;
+
+	/**
+	 * @gro_affine_overrides: total number of batches that were steered
+	 * away from their RPC's preferred SoftIRQ core under
+	 * HOMA_GRO_RPC_AFFINE because that core was overloaded.
+	 */
+	__u64 gro_affine_overrides;
+
+	/**
+	 * @gro_load_feedback_batches: total number of batches steered by
+	 * the HOMA_GRO_LOAD_FEEDBACK policy.
+	 */
+	__u64 gro_load_feedback_batches;
+
+	/**
+	 * @gro_load_feedback_busy: total number of batches steered by the
+	 * HOMA_GRO_LOAD_FEEDBACK policy to a core that already had
+	 * queued SoftIRQ work (i.e., no idle core was available).
+	 */
+	__u64 gro_load_feedback_busy;
+
+	/**
+	 * @poll_core_loops: total number of iterations of the main loop in
+	 * dedicated polling threads (homa_poll_core_main).
+	 */
+	__u64 poll_core_loops;
+
+	/**
+	 * @poll_core_napi_polls: total number of times that dedicated
+	 * polling threads invoked napi_busy_loop.
+	 */
+	__u64 poll_core_napi_polls;
+
 	/**
 	 * @softirq_calls: total number of calls to homa_softirq (i.e.,
 	 * total number of GRO packets processed, each of which could contain
@@ -2142,6 +2983,38 @@ struct homa_metrics {
 	 */
 	__u64 bypass_softirq_cycles;
 
+	/**
+	 * @softirq_control_pkts: total number of non-DATA packets that
+	 * homa_softirq processed ahead of the DATA packets in their batch.
+	 */
+	__u64 softirq_control_pkts;
+
+	/**
+	 * @softirq_data_regrouped: total number of DATA packets that
+	 * homa_softirq moved ahead of packets for other RPCs in their batch,
+	 * so that they could be processed with the same RPC lock.
+	 */
+	__u64 softirq_data_regrouped;
+
+	/**
+	 * @softirq_grant_delay_cycles: total time (in get_cycles units)
+	 * between the start of homa_softirq and the dispatching of each
+	 * GRANT packet in its batch.
+	 */
+	__u64 softirq_grant_delay_cycles;
+
+	/**
+	 * @lcache_hits: total number of incoming packets whose RPC was
+	 * already locked in the homa_lcache when the packet was dispatched.
+	 */
+	__u64 lcache_hits;
+
+	/**
+	 * @lcache_misses: total number of incoming packets for which
+	 * homa_pkt_dispatch had to look up (and lock) the packet's RPC.
+	 */
+	__u64 lcache_misses;
+
 	/**
 	 * @linux_softirq_cycles: total time spent executing all softirq
 	 * activities, as measured by the linux softirq module, in get_cycles()
@@ -2174,12 +3047,57 @@ struct homa_metrics {
 	/** @recv_calls: total number of invocations of homa_recvmsg. */
 	__u64 recv_calls;
 
+	/**
+	 * @partial_recvs: total number of times that homa_recvmsg returned
+	 * an incomplete message (HOMA_RECVMSG_PARTIAL).
+	 */
+	__u64 partial_recvs;
+
 	/**
 	 * @blocked_cycles: total time threads spend in blocked state
 	 * while executing the homa_recvmsg kernel call handler.
 	 */
 	__u64 blocked_cycles;
 
+	/**
+	 * @copy_out_cycles: total time spent in homa_copy_to_user copying
+	 * message data to user space (with the RPC unlocked).
+	 */
+	__u64 copy_out_cycles;
+
+	/**
+	 * @copy_out_bytes: total bytes of message data copied to user space
+	 * by homa_copy_to_user; divide by @copy_out_cycles to get copy
+	 * throughput.
+	 */
+	__u64 copy_out_bytes;
+
+	/**
+	 * @copy_out_batches: total number of batches of chunks copied by
+	 * homa_copy_to_user (each batch requires the RPC lock to be
+	 * released and reacquired).
+	 */
+	__u64 copy_out_batches;
+
+	/**
+	 * @copy_out_merges: total number of chunks in homa_copy_to_user
+	 * whose user-space destination was contiguous with the previous
+	 * chunk, so that the same iov_iter could be used for both.
+	 */
+	__u64 copy_out_merges;
+
+	/**
+	 * @copy_out_pinned_bytes: portion of @copy_out_bytes that was
+	 * copied through kernel mappings of a pinned buffer region.
+	 */
+	__u64 copy_out_pinned_bytes;
+
+	/**
+	 * @copy_out_pinned_cycles: portion of @copy_out_cycles spent
+	 * copying batches into pinned buffer regions.
+	 */
+	__u64 copy_out_pinned_cycles;
+
 	/**
 	 * @reply_cycles: total time spent executing the homa_ioc_reply
 	 * kernel call handler, as measured with get_cycles().
@@ -2213,6 +3131,30 @@ struct homa_metrics {
 	 */
 	__u64 so_set_buf_calls;
 
+	/**
+	 * @buf_pinned_pages: total number of pages pinned for buffer
+	 * regions by SO_HOMA_SET_BUF.
+	 */
+	__u64 buf_pinned_pages;
+
+	/**
+	 * @buf_regions_added: total number of regions added to buffer
+	 * pools (including the initial region of each pool).
+	 */
+	__u64 buf_regions_added;
+
+	/**
+	 * @buf_regions_retired: total number of regions removed from
+	 * buffer pools with HOMA_BUF_RETIRE.
+	 */
+	__u64 buf_regions_retired;
+
+	/**
+	 * @buf_retire_busy: total number of HOMA_BUF_RETIRE requests that
+	 * failed because the region still contained messages.
+	 */
+	__u64 buf_retire_busy;
+
 	/**
 	 * @grant_cycles: total time spent in homa_send_grants, as measured
 	 * with get_cycles().
@@ -2232,12 +3174,38 @@ struct homa_metrics {
 	 */
 	__u64 timer_reap_cycles;
 
+	/**
+	 * @timer_rpc_checks: total number of RPCs that homa_timer removed
+	 * from the timer wheel and checked.
+	 */
+	__u64 timer_rpc_checks;
+
+	/**
+	 * @softirq_timer_checks: the number of RPC checks (included in
+	 * @timer_rpc_checks) performed by homa_softirq rather than by the
+	 * timer thread.
+	 */
+	__u64 softirq_timer_checks;
+
 	/**
 	 * @data_pkt_reap_cycles: total time spent by homa_data_pkt to reap
 	 * dead RPCs, as measured with get_cycles().
 	 */
 	__u64 data_pkt_reap_cycles;
 
+	/**
+	 * @reaper_thread_cycles: total time spent by the reaper thread
+	 * (homa_reaper_main) freeing dead RPCs, as measured with
+	 * get_cycles().
+	 */
+	__u64 reaper_thread_cycles;
+
+	/**
+	 * @wait_reap_cycles: total time spent by homa_wait_for_message
+	 * to reap dead RPCs, as measured with get_cycles().
+	 */
+	__u64 wait_reap_cycles;
+
 	/**
 	 * @pacer_cycles: total time spent executing in homa_pacer_main
 	 * (not including blocked time), as measured with get_cycles().
@@ -2287,6 +3255,13 @@ struct homa_metrics {
 	 */
 	__u64 peer_hash_links;
 
+	/**
+	 * @peer_lookups: total # of calls to homa_peer_find; dividing
+	 * @peer_hash_links by this gives the average number of extra links
+	 * traversed per lookup.
+	 */
+	__u64 peer_lookups;
+
 	/**
 	 * @peer_new_entries: total # of new entries created in Homa's
 	 * peer table (this value doesn't increment if the desired peer is
@@ -2307,6 +3282,24 @@ struct homa_metrics {
 	 */
 	__u64 peer_route_errors;
 
+	/**
+	 * @peer_evictions: total number of idle entries removed from
+	 * Homa's peer table.
+	 */
+	__u64 peer_evictions;
+
+	/**
+	 * @peer_table_resizes: total number of times the bucket array
+	 * for Homa's peer table was replaced with one of a different size.
+	 */
+	__u64 peer_table_resizes;
+
+	/**
+	 * @peer_gc_cycles: total time spent in homa_peertab_gc, as
+	 * measured with get_cycles().
+	 */
+	__u64 peer_gc_cycles;
+
 	/**
 	 * @control_xmit_errors errors: total number of times ip_queue_xmit
 	 * failed when transmitting a control packet.
@@ -2413,6 +3406,30 @@ struct homa_metrics {
 	 */
 	__u64 socket_lock_misses;
 
+	/**
+	 * @ready_lock_miss_cycles: total time spent waiting for socket
+	 * ready lock misses, measured by get_cycles().
+	 */
+	__u64 ready_lock_miss_cycles;
+
+	/**
+	 * @ready_lock_misses: total number of times that Homa had to wait
+	 * to acquire a socket's ready lock.
+	 */
+	__u64 ready_lock_misses;
+
+	/**
+	 * @dead_lock_miss_cycles: total time spent waiting for socket
+	 * dead lock misses, measured by get_cycles().
+	 */
+	__u64 dead_lock_miss_cycles;
+
+	/**
+	 * @dead_lock_misses: total number of times that Homa had to wait
+	 * to acquire a socket's dead lock.
+	 */
+	__u64 dead_lock_misses;
+
 	/**
 	 * @throttle_lock_miss_cycles: total time spent waiting for throttle
 	 * lock misses, measured by get_cycles().
@@ -2438,16 +3455,11 @@ struct homa_metrics {
 	__u64 grantable_lock_misses;
 
 	/**
-	 * @peer_acklock_miss_cycles: total time spent waiting for peer
-	 * lock misses, measured by get_cycles().
-	 */
-	__u64 peer_ack_lock_miss_cycles;
-
-	/**
-	 * @peer_ack_lock_misses: total number of times that Homa had to wait
-	 * to acquire the lock used for managing acks for a peer.
+	 * @peer_ack_retries: total number of times that a thread adding
+	 * or removing an ack for a peer had to retry because another thread
+	 * modified the peer's ack ring concurrently.
 	 */
-	__u64 peer_ack_lock_misses;
+	__u64 peer_ack_retries;
 
 	/**
 	 * @disabled_reaps: total number of times that the reaper couldn't
@@ -2473,6 +3485,36 @@ struct homa_metrics {
 	 */
 	__u64 reaper_dead_skbs;
 
+	/**
+	 * @rpc_allocs: total number of homa_rpc structs allocated by
+	 * homa_rpc_alloc.
+	 */
+	__u64 rpc_allocs;
+
+	/**
+	 * @rpc_alloc_cycles: total time spent in homa_rpc_alloc, as
+	 * measured with get_cycles().
+	 */
+	__u64 rpc_alloc_cycles;
+
+	/**
+	 * @rpc_recycles: total number of calls to homa_rpc_alloc that were
+	 * satisfied from a socket's free list (rather than the slab cache).
+	 */
+	__u64 rpc_recycles;
+
+	/**
+	 * @rpc_tables: total number of RPC tables allocated by
+	 * homa_rpc_table_get.
+	 */
+	__u64 rpc_tables;
+
+	/**
+	 * @rpc_bucket_grows: total number of times that a homa_rpc_bucket
+	 * enlarged its array of hash chains.
+	 */
+	__u64 rpc_bucket_grows;
+
 	/**
 	 * @forced_reaps: total number of times that homa_wait_for_message
 	 * invoked the reaper because dead_skbs was too high.
@@ -2504,7 +3546,7 @@ struct homa_metrics {
 	__u64 fifo_grants_no_incoming;
 
 	/**
-	 * @unacked_overflows: total number of times that homa_peer_add_ack
+	 * @ack_overflows: total number of times that homa_peer_add_ack
 	 * found insufficient space for the new id and hence had to send an
 	 * ACK message.
 	 */
@@ -2517,17 +3559,112 @@ struct homa_metrics {
 	__u64 ignored_need_acks;
 
 	/**
-	 * @bpage_resuses: total number of times that, when an owned page
-	 * reached the end, it could be reused because all existing
-	 * allocations had been released.
+	 * @slot_allocs: total number of message fragments allocated from
+	 * size-class slots (rather than whole bpages).
 	 */
-	__u64 bpage_reuses;
+	__u64 slot_allocs;
+
+	/**
+	 * @slot_page_adoptions: total number of times that a core started
+	 * allocating slots from a partially free bpage abandoned by another
+	 * core, rather than allocating a new bpage.
+	 */
+	__u64 slot_page_adoptions;
+
+	/**
+	 * @bpage_local_allocs: total number of bpages allocated from the
+	 * NUMA node of the core that requested them.
+	 */
+	__u64 bpage_local_allocs;
+
+	/**
+	 * @bpage_remote_allocs: total number of bpages allocated from a
+	 * NUMA node other than that of the core that requested them
+	 * (because no local bpages were available).
+	 */
+	__u64 bpage_remote_allocs;
+
+	/**
+	 * @bpage_unplaced_allocs: total number of bpages allocated whose
+	 * memory had not yet been touched when the pool was created (so
+	 * their node wasn't known).
+	 */
+	__u64 bpage_unplaced_allocs;
+
+	/**
+	 * @bpage_late_placements: total number of bpages whose NUMA node
+	 * wasn't known when their region was registered, but was found
+	 * later by homa_pool_place_buffers.
+	 */
+	__u64 bpage_late_placements;
+
+	/**
+	 * @bpage_alloc_probes: total number of candidate bpages examined
+	 * by homa_pool_get_pages (at least one for each bpage allocated).
+	 */
+	__u64 bpage_alloc_probes;
+
+	/**
+	 * @bpage_reclaim_sweeps: total number of times that a buffer pool
+	 * ran out of free bpages in its free bitmaps while some bpages
+	 * were deferred, so all of its bpages were checked by
+	 * homa_pool_reclaim.
+	 */
+	__u64 bpage_reclaim_sweeps;
 
 	/** @temp: For temporary use during testing. */
 #define NUM_TEMP_METRICS 10
 	__u64 temp[NUM_TEMP_METRICS];
 };
 
+/**
+ * define HOMA_GRO_SLOTS - Number of distinct batches of packets that
+ * homa_gro_receive can accumulate at once on each core. Must be a
+ * power of 2.
+ */
+#define HOMA_GRO_SLOTS 4
+
+/**
+ * struct homa_gro_slot - Information about one batch of incoming packets
+ * being accumulated by homa_gro_receive. Packets from a given peer are
+ * always accumulated in the same slot (under HOMA_GRO_RPC_AFFINE, packets
+ * from a given RPC).
+ */
+struct homa_gro_slot {
+	/**
+	 * @skb: first packet in the batch (additional packets are linked
+	 * through its frag_list), or NULL if none. Note: this packet may
+	 * no longer be available for merging (the kernel may have passed it
+	 * up the stack), so it must be validated before use.
+	 */
+	struct sk_buff *skb;
+
+	/**
+	 * @bucket: the index, within napi->gro_hash, of the list
+	 * containing @skb; undefined if @skb is NULL. Used to verify that
+	 * @skb is still available.
+	 */
+	int bucket;
+
+	/**
+	 * @saddr: address of the peer whose packets are accumulated in
+	 * this batch (canonical IPv6 form).
+	 */
+	struct in6_addr saddr;
+
+	/**
+	 * @id: under HOMA_GRO_RPC_AFFINE, the RPC id (as returned by
+	 * homa_local_id) of all the packets in this batch; otherwise 0.
+	 */
+	__u64 id;
+
+	/**
+	 * @start: time (in get_cycles units) when @skb arrived; used to
+	 * flush batches that have been accumulating too long.
+	 */
+	__u64 start;
+};
+
 /**
  * struct homa_core - Homa allocates one of these structures for each
  * core, to hold information that needs to be kept on a per-core basis.
@@ -2564,19 +3701,11 @@ struct homa_core {
 	 */
 	int softirq_offset;
 
-        /**
-         * held_skb: last packet buffer known to be available for
-         * merging other packets into on this core (note: may not still
-         * be available), or NULL if none.
-         */
-        struct sk_buff *held_skb;
-
 	/**
-	 * @held_bucket: the index, within napi->gro_hash, of the list
-         * containing @held_skb; undefined if @held_skb is NULL. Used to
-         * verify that @held_skb is still available.
+	 * @gro_slots: batches of packets currently being accumulated by
+	 * homa_gro_receive on this core; indexed by homa_gro_slot_index.
 	 */
-	int held_bucket;
+	struct homa_gro_slot gro_slots[HOMA_GRO_SLOTS];
 
 	/**
 	 * @thread: the most recent thread to invoke a Homa system call
@@ -2591,6 +3720,70 @@ struct homa_core {
 	 */
 	__u64 syscall_end_time;
 
+	/**
+	 * @napi_polling: nonzero means a thread on this core is currently
+	 * busy-polling a NIC queue on behalf of a Homa socket (see
+	 * homa_napi_poll); packets arriving in GRO should be processed
+	 * immediately on this core, since the polling thread is waiting
+	 * for them.
+	 */
+	int napi_polling;
+
+	/**
+	 * @softirq_load: estimate of the SoftIRQ work (in get_cycles units)
+	 * queued for this core as of @softirq_load_time. The estimate drains
+	 * as time passes; see homa_softirq_load. Updated without
+	 * synchronization by the cores that steer packets here, so it's
+	 * only approximate.
+	 */
+	__u64 softirq_load;
+
+	/**
+	 * @softirq_load_time: time (in get_cycles units) when
+	 * @softirq_load was last updated.
+	 */
+	__u64 softirq_load_time;
+
+	/**
+	 * @softirq_kb_cycles: running average of the time (in get_cycles
+	 * units) that homa_softirq has needed on this core for each 1000
+	 * bytes of incoming packets; used to estimate @softirq_load.
+	 */
+	int softirq_kb_cycles;
+
+	/**
+	 * @poll_thread: the dedicated polling thread running on this core
+	 * (see homa->poll_cores), or NULL if none.
+	 */
+	struct task_struct *poll_thread;
+
+	/**
+	 * @poll_rank: if @poll_thread is non-NULL, the index of this core
+	 * among all of the dedicated polling cores; used to divide NIC
+	 * queues among the polling threads.
+	 */
+	int poll_rank;
+
+	/**
+	 * @gro_first_candidate: index in homa->gro_candidates of the first
+	 * core that homa_gro_least_loaded_core may select when invoked on
+	 * this core.
+	 */
+	int gro_first_candidate;
+
+	/**
+	 * @gro_num_candidates: number of entries in homa->gro_candidates,
+	 * starting at @gro_first_candidate, that may be selected when
+	 * homa_gro_least_loaded_core is invoked on this core.
+	 */
+	int gro_num_candidates;
+
+	/**
+	 * @timer_wheel: holds the RPCs created on this core, ordered by
+	 * when they need to be checked next.
+	 */
+	struct homa_timer_wheel timer_wheel;
+
 	/** @metrics: performance statistics for this core. */
 	struct homa_metrics metrics;
 };
@@ -2658,22 +3851,63 @@ static inline __u64 homa_local_id(__be64 sender_id)
 		INC_METRIC(type##_lock_miss_cycles, get_cycles() - start); \
 	}
 
+/**
+ * homa_rpc_table_bucket() - Find the bucket of an RPC table that holds
+ * a given RPC.
+ * @table:    Either hsk->client_rpcs or hsk->server_rpcs.
+ * @id:       Id of the desired RPC.
+ *
+ * Return:    The bucket in which this RPC will appear, if the RPC exists.
+ */
+static inline struct homa_rpc_bucket *homa_rpc_table_bucket(
+		struct homa_rpc_table *table, __u64 id)
+{
+	/* We can use a really simple hash function here because RPC ids
+	 * are allocated sequentially (for server RPCs, each client allocates
+	 * ids sequentially, so they will still distribute themselves
+	 * naturally across the hash space).
+	 */
+	return &table->buckets[(id >> 1) & (HOMA_RPC_BUCKETS - 1)];
+}
+
+/**
+ * homa_rpc_chain() - Find the hash chain within a bucket that holds a
+ * given RPC. The caller must hold the bucket's lock.
+ * @bucket:   Bucket returned by homa_rpc_table_bucket for @id.
+ * @id:       Id of the desired RPC.
+ *
+ * Return:    The chain in which this RPC will appear, if the RPC exists.
+ */
+static inline struct hlist_head *homa_rpc_chain(
+		struct homa_rpc_bucket *bucket, __u64 id)
+{
+	/* The low-order bits of the id were already used to select the
+	 * bucket, so use the next ones to select the chain.
+	 */
+	return &bucket->rpcs[((id >> 1) / HOMA_RPC_BUCKETS)
+			& ((1 << bucket->bits) - 1)];
+}
+
 /**
  * homa_client_rpc_bucket() - Find the bucket containing a given
  * client RPC.
  * @hsk:      Socket associated with the RPC.
  * @id:       Id of the desired RPC.
  *
- * Return:    The bucket in which this RPC will appear, if the RPC exists.
+ * Return:    The bucket in which this RPC will appear, if the RPC exists,
+ *            or NULL if the socket has no client RPC table (yet, or any
+ *            longer). The table is freed via RCU, so the caller must be
+ *            in an RCU read-side critical section from before this call
+ *            until it has locked the bucket.
  */
 static inline struct homa_rpc_bucket *homa_client_rpc_bucket(
 		struct homa_sock *hsk, __u64 id)
 {
-	/* We can use a really simple hash function here because RPC ids
-	 * are allocated sequentially.
-	 */
-	return &hsk->client_rpc_buckets[(id >> 1)
-			& (HOMA_CLIENT_RPC_BUCKETS - 1)];
+	struct homa_rpc_table *table = smp_load_acquire(&hsk->client_rpcs);
+
+	if (unlikely(!table))
+		return NULL;
+	return homa_rpc_table_bucket(table, id);
 }
 
 /**
@@ -2713,17 +3947,20 @@ static inline int homa_port_hash(__u16 port)
  * @hsk:         Socket associated with the RPC.
  * @id:          Id of the desired RPC.
  *
- * Return:    The bucket in which this RPC will appear, if the RPC exists.
+ * Return:    The bucket in which this RPC will appear, if the RPC exists,
+ *            or NULL if the socket has no server RPC table (yet, or any
+ *            longer). The table is freed via RCU, so the caller must be
+ *            in an RCU read-side critical section from before this call
+ *            until it has locked the bucket.
  */
 static inline struct homa_rpc_bucket *homa_server_rpc_bucket(
 		struct homa_sock *hsk, __u64 id)
 {
-	/* Each client allocates RPC ids sequentially, so they will
-	 * naturally distribute themselves across the hash space.
-	 * Thus we can use the id directly as hash.
-	 */
-	return &hsk->server_rpc_buckets[(id >> 1)
-			& (HOMA_SERVER_RPC_BUCKETS - 1)];
+	struct homa_rpc_table *table = smp_load_acquire(&hsk->server_rpcs);
+
+	if (unlikely(!table))
+		return NULL;
+	return homa_rpc_table_bucket(table, id);
 }
 
 /**
@@ -2766,24 +4003,64 @@ static inline void homa_sock_unlock(struct homa_sock *hsk) {
 }
 
 /**
- * homa_peer_lock() - Acquire the lock for a peer's @unacked_lock. If the lock
- * isn't immediately available, record stats on the waiting time.
- * @peer:    Peer to lock.
+ * homa_sock_ready_lock() - Acquire the lock for a socket's ready queues
+ * and interests. If the lock isn't immediately available, record stats
+ * on the waiting time.
+ * @hsk:     Socket whose ready lock should be acquired.
+ */
+static inline void homa_sock_ready_lock(struct homa_sock *hsk) {
+	if (!spin_trylock_bh(&hsk->ready_lock))
+		homa_sock_ready_lock_slow(hsk);
+}
+
+/**
+ * homa_sock_ready_unlock() - Release the lock for a socket's ready queues
+ * and interests.
+ * @hsk:   Socket whose ready lock should be released.
+ */
+static inline void homa_sock_ready_unlock(struct homa_sock *hsk) {
+	spin_unlock_bh(&hsk->ready_lock);
+}
+
+/**
+ * homa_sock_dead_lock() - Acquire the lock for a socket's dead RPCs.
+ * If the lock isn't immediately available, record stats on the
+ * waiting time.
+ * @hsk:     Socket whose dead lock should be acquired.
  */
-static inline void homa_peer_lock(struct homa_peer *peer)
+static inline void homa_sock_dead_lock(struct homa_sock *hsk) {
+	if (!spin_trylock_bh(&hsk->dead_lock))
+		homa_sock_dead_lock_slow(hsk);
+}
+
+/**
+ * homa_sock_dead_unlock() - Release the lock for a socket's dead RPCs.
+ * @hsk:   Socket whose dead lock should be released.
+ */
+static inline void homa_sock_dead_unlock(struct homa_sock *hsk) {
+	spin_unlock_bh(&hsk->dead_lock);
+}
+
+/**
+ * homa_peer_num_acks() - Returns the number of acks currently pending
+ * for a peer. The result is only a hint, since other threads may be
+ * adding or removing acks concurrently.
+ * @peer:   Peer of interest.
+ */
+static inline int homa_peer_num_acks(struct homa_peer *peer)
 {
-	if (!spin_trylock_bh(&peer->ack_lock)) {
-		homa_peer_lock_slow(peer);
-	}
+	return atomic_read(&peer->ack_head) - atomic_read(&peer->ack_tail);
 }
 
 /**
- * homa_peer_unlock() - Release the lock for a peer's @unacked_lock.
- * @peer:   Peer to lock.
+ * homa_peer_put() - Release a reference to a peer (one obtained from
+ * homa_peer_find).
+ * @peer:   Peer whose reference is no longer needed.
  */
-static inline void homa_peer_unlock(struct homa_peer *peer)
+static inline void homa_peer_put(struct homa_peer *peer)
 {
-	spin_unlock_bh(&peer->ack_lock);
+	peer->access_jiffies = jiffies;
+	atomic_dec(&peer->refs);
 }
 
 /**
@@ -2792,8 +4069,8 @@ static inline void homa_peer_unlock(struct homa_peer *peer)
  * used by functions that want to scan the active RPCs for a socket
  * without holding the socket lock.  Multiple calls to this function may
  * be in effect at once.
- * @hsk:    Socket whose RPCs should be protected. Must not be locked
- *          by the caller; will be locked here.
+ * @hsk:    Socket whose RPCs should be protected. Its dead lock must
+ *          not be held by the caller; it will be locked here.
  *
  * Return:  1 for success, 0 if the socket has been shutdown, in which
  *          case its RPCs cannot be protected.
@@ -2801,11 +4078,11 @@ static inline void homa_peer_unlock(struct homa_peer *peer)
 static inline int homa_protect_rpcs(struct homa_sock *hsk)
 {
 	int result;
-	homa_sock_lock(hsk, "homa_sock_protect");
+	homa_sock_dead_lock(hsk);
 	result = !hsk->shutdown;
 	if (result)
 		atomic_inc(&hsk->protect_count);
-	homa_sock_unlock(hsk);
+	homa_sock_dead_unlock(hsk);
 	return result;
 }
 
@@ -2978,6 +4255,8 @@ extern void     homa_check_grantable(struct homa *homa, struct homa_rpc *rpc);
 extern int      homa_check_rpc(struct homa_rpc *rpc);
 extern int      homa_check_nic_queue(struct homa *homa, struct sk_buff *skb,
                     bool force);
+extern struct homa_interest
+               *homa_choose_interest(struct list_head *head, int offset);
 extern void     homa_close(struct sock *sock, long timeout);
 extern int      homa_copy_to_user(struct homa_rpc *rpc);
 extern void     homa_cutoffs_pkt(struct sk_buff *skb, struct homa_sock *hsk);
@@ -2988,6 +4267,8 @@ extern void     homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 extern void     homa_destroy(struct homa *homa);
 extern int      homa_diag_destroy(struct sock *sk, int err);
 extern int      homa_disconnect(struct sock *sk, int flags);
+extern int      homa_dobitmap(struct ctl_table *table, int write,
+		    void __user *buffer, size_t *lenp, loff_t *ppos);
 extern int      homa_dointvec(struct ctl_table *table, int write,
                     void __user *buffer, size_t *lenp, loff_t *ppos);
 extern void     homa_dst_refresh(struct homa_peertab *peertab,
@@ -2997,6 +4278,8 @@ extern int      homa_err_handler_v6(struct sk_buff *skb, struct inet6_skb_parm *
                     , u8,  u8,  int,  __be32);
 extern struct homa_rpc
                *homa_find_client_rpc(struct homa_sock *hsk, __u64 id);
+extern struct homa_rpc
+               *homa_find_partial_rpc(struct homa_sock *hsk, __u64 id);
 extern struct homa_rpc
                *homa_find_server_rpc(struct homa_sock *hsk,
 		const struct in6_addr *saddr, __u16 sport, __u64 id);
@@ -3010,6 +4293,9 @@ extern int      homa_getsockopt(struct sock *sk, int level, int optname,
                     char __user *optval, int __user *option);
 extern int      homa_grant_fifo(struct homa *homa);
 extern void     homa_grant_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
+extern int      homa_gro_affine_core(struct sk_buff *skb);
+extern void     homa_gro_candidates_changed(struct homa *homa);
+extern int      homa_gro_least_loaded_core(struct sk_buff *skb);
 extern int      homa_gro_complete(struct sk_buff *skb, int thoff);
 extern struct sk_buff
                *homa_gro_receive(struct list_head *gro_list,
@@ -3036,6 +4322,7 @@ extern int      homa_metrics_open(struct inode *inode, struct file *file);
 extern ssize_t  homa_metrics_read(struct file *file, char __user *buffer,
                     size_t length, loff_t *offset);
 extern int      homa_metrics_release(struct inode *inode, struct file *file);
+extern int      homa_napi_poll(struct homa_sock *hsk);
 extern void     homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 		    struct homa_rpc *rpc);
 extern int      homa_offload_end(void);
@@ -3055,23 +4342,50 @@ extern int      homa_peer_get_acks(struct homa_peer *peer, int count,
 extern struct dst_entry
                *homa_peer_get_dst(struct homa_peer *peer,
 			struct inet_sock *inet);
+extern int      homa_peer_push_ack(struct homa_peer *peer,
+		    struct homa_ack *ack);
 extern void     homa_peer_set_cutoffs(struct homa_peer *peer, int c0, int c1,
                     int c2, int c3, int c4, int c5, int c6, int c7);
+extern int      homa_peertab_gc(struct homa_peertab *peertab, int threshold,
+		    unsigned long idle_jiffies);
 extern void     homa_peertab_gc_dsts(struct homa_peertab *peertab, __u64 now);
+extern int      homa_peertab_resize(struct homa_peertab *peertab, int bits);
+extern void     homa_peertab_check_size(struct homa_peertab *peertab);
 extern void     homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk,
 		    struct homa_lcache *lcache, int *delta);
 extern __poll_t homa_poll(struct file *file, struct socket *sock,
                     struct poll_table_struct *wait);
+extern int      homa_poll_core_main(void *transportInfo);
+extern void     homa_poll_cores_changed(struct homa *homa);
+extern void     homa_poll_record(struct homa_sock *hsk, __u64 wait);
+extern void     homa_poll_update(struct homa_sock *hsk);
+extern int      homa_pool_add_region(struct homa_pool *pool, void *region,
+		    __u64 region_size);
 extern int      homa_pool_allocate(struct homa_rpc *rpc);
 extern void     homa_pool_destroy(struct homa_pool *pool);
 extern void    *homa_pool_get_buffer(struct homa_rpc *rpc, int offset,
 		    int *available);
+extern int      homa_pool_get_bvecs(struct homa_pool *pool, char *dst,
+		    int length, struct bio_vec *bvecs, int max_bvecs,
+		    int *num_bvecs);
 extern int      homa_pool_get_pages(struct homa_pool *pool, int num_pages,
 		    __u32 *pages, int leave_locked);
 extern int      homa_pool_init(struct homa_pool *pool, struct homa *homa,
 		    void *buf_region, __u64 region_size);
+extern void     homa_pool_mark_free(struct homa_pool *pool, int index);
+extern struct page
+              **homa_pool_pin(void *region, __u64 region_size, int flags,
+		    int *num_pages, struct mm_struct **mm);
+extern void     homa_pool_place_buffers(struct homa_sock *hsk,
+		    int num_buffers, __u32 *buffers);
+extern int      homa_pool_reclaim(struct homa_pool *pool);
 extern void     homa_pool_release_buffers(struct homa_pool *pool,
 		    int num_buffers, __u32 *buffers);
+extern int      homa_pool_retire_region(struct homa_pool *pool,
+		    void *region, struct page ***pages, int *num_pages,
+		    struct mm_struct **mm);
+extern void     homa_pool_unpin(struct page **pages, int num_pages,
+		    struct mm_struct *mm);
 extern char    *homa_print_ipv4_addr(__be32 addr);
 extern char    *homa_print_ipv6_addr(const struct in6_addr *addr);
 extern char    *homa_print_metrics(struct homa *homa);
@@ -3096,9 +4410,16 @@ extern void     homa_resend_data(struct homa_rpc *rpc, int start, int end,
 extern void     homa_resend_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
                     struct homa_sock *hsk);
 extern void     homa_rpc_abort(struct homa_rpc *crpc, int error);
+extern struct homa_rpc
+               *homa_rpc_alloc(struct homa_sock *hsk);
+extern void     homa_rpc_bucket_add(struct homa_rpc_bucket *bucket,
+			struct homa_rpc *rpc);
 extern void     homa_rpc_acked(struct homa_sock *hsk,
 			const struct in6_addr *saddr, struct homa_ack *ack);
+extern void     homa_rpc_arm_timer(struct homa_rpc *rpc, __u32 expires);
+extern void     homa_rpc_cancel_timer(struct homa_rpc *rpc);
 extern void     homa_rpc_free(struct homa_rpc *rpc);
+extern void     homa_rpc_free_list_destroy(struct homa_sock *hsk);
 extern void     homa_rpc_free_rcu(struct rcu_head *rcu_head);
 extern void     homa_rpc_handoff(struct homa_rpc *rpc);
 extern void     homa_rpc_log(struct homa_rpc *rpc);
@@ -3109,7 +4430,14 @@ extern struct homa_rpc
 extern struct homa_rpc
                *homa_rpc_new_server(struct homa_sock *hsk,
 			const struct in6_addr *source, struct data_header *h);
+extern int      homa_reap_sockets(struct homa *homa);
+extern int      homa_reaper_main(void *transportInfo);
+extern void     homa_reaper_stop(struct homa *homa);
 extern int      homa_rpc_reap(struct homa_sock *hsk, int count);
+extern void     homa_rpc_table_destroy(struct homa_rpc_table **slot);
+extern struct homa_rpc_table
+               *homa_rpc_table_get(struct homa_sock *hsk,
+			struct homa_rpc_table **slot, gfp_t gfp);
 extern void     homa_send_grants(struct homa *homa);
 extern int      homa_sendmsg(struct sock *sk, struct msghdr *msg, size_t len);
 extern int      homa_sendpage(struct sock *sk, struct page *page, int offset,
@@ -3136,10 +4464,17 @@ extern struct homa_sock
                *homa_socktab_start_scan(struct homa_socktab *socktab,
                     struct homa_socktab_scan *scan);
 extern int      homa_softirq(struct sk_buff *skb);
+extern __u64    homa_softirq_load(struct homa_core *core, __u64 now);
+extern void     homa_softirq_napi_id(struct homa *homa, unsigned int napi_id);
 extern void     homa_spin(int usecs);
 extern char    *homa_symbol_for_state(struct homa_rpc *rpc);
 extern char    *homa_symbol_for_type(uint8_t type);
 extern void     homa_timer(struct homa *homa);
+extern void     homa_timer_softirq(struct homa *homa);
+extern void     homa_wheel_advance(struct homa_timer_wheel *wheel, __u32 now);
+extern int      homa_wheel_check(struct homa *homa,
+			struct homa_timer_wheel *wheel, int limit);
+extern void     homa_wheel_init(struct homa_timer_wheel *wheel, __u32 now);
 extern int      homa_timer_main(void *transportInfo);
 extern void     homa_unhash(struct sock *sk);
 extern void     homa_unknown_pkt(struct sk_buff *skb, struct homa_rpc *rpc);
@@ -3202,4 +4537,5 @@ static inline struct dst_entry *homa_get_dst(struct homa_peer *peer,
 }
 
 extern struct completion homa_pacer_kthread_done;
+extern struct completion homa_reaper_kthread_done;
 #endif /* _HOMA_IMPL_H */
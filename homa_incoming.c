@@ -45,6 +45,9 @@ void homa_message_in_init(struct homa_message_in *msgin, int length,
 		INC_METRIC(large_msg_bytes, length);
 	}
 	msgin->copied_out = 0;
+	msgin->delivered = 0;
+	msgin->copied = 0;
+	msgin->copiers = 0;
 	msgin->num_bpages = 0;
 }
 
@@ -130,8 +133,10 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 {
 #ifdef __UNIT_TEST__
 #define MAX_CHUNKS 3
+#define MAX_BATCH_BYTES 3000
 #else
-#define MAX_CHUNKS 10
+#define MAX_CHUNKS 32
+#define MAX_BATCH_BYTES 65536
 #endif
 	/* Each element of this array describes one copy from an skb
 	 * to user space. Note: the same skb can appear in multiple
@@ -143,22 +148,38 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 		char *dst;
 		int length;
 		int free_skb;
+
+		/* If nonzero, this chunk starts a range of chunks whose
+		 * destinations are contiguous in user space (typically the
+		 * same bpage), which are copied with a single iov_iter;
+		 * this is the total number of bytes in the range. Zero
+		 * means this chunk continues the range of the previous one.
+		 */
+		int range_length;
 	} chunks[MAX_CHUNKS];
 	int error = 0;
-	int count;
+	int count, pinned_count;
 	int n = 0;             /* Number of filled entries in chunks. */
+	int range_start = 0;   /* Index of first chunk in current range. */
+	int batch_bytes = 0;   /* Total bytes in chunks. */
+	struct homa_pool *pool = &rpc->hsk->buffer_pool;
+	struct bio_vec bvecs[HOMA_MAX_BVECS];
 
 	/* Tricky note: we can't hold the RPC lock while we're actually
 	 * copying to user space, because (a) it's illegal to hold a spinlock
 	 * while copying to user space and (b) we'd like for homa_softirq
 	 * to add more packets to the RPC while we're copying these out.
-	 * So, collect a bunch of chunks to copy, then release the lock,
-	 * copy them, and reacquire the lock.
+	 * So, collect a bunch of chunks to copy (limited by both count and
+	 * total bytes), then release the lock, copy them, and reacquire
+	 * the lock.
 	 */
 	while (true) {
 		struct sk_buff *skb = skb_peek(&rpc->msgin.packets);
 		int data_offset, skb_bytes, buf_bytes;
 		struct data_header *h;
+		struct iovec iov;
+		struct iov_iter iter;
+		__u64 start;
 		int i;
 
 		if (!skb || (rpc->msgin.copied_out == rpc->msgin.total_length))
@@ -190,58 +211,113 @@ int homa_copy_to_user(struct homa_rpc *rpc)
 			chunks[n].length = buf_bytes;
 			chunks[n].free_skb = 0;
 		}
+		/* A range mustn't cross a bpage boundary (a new bpage starts
+		 * at each multiple of HOMA_BPAGE_SIZE in the message): this
+		 * keeps each range within a single region of the pool and
+		 * bounds the number of bio_vecs needed to describe it.
+		 */
+		if ((n > 0) && (chunks[n].dst == chunks[n-1].dst
+				+ chunks[n-1].length)
+				&& (rpc->msgin.copied_out & (HOMA_BPAGE_SIZE - 1))) {
+			chunks[range_start].range_length += chunks[n].length;
+			chunks[n].range_length = 0;
+			INC_METRIC(copy_out_merges, 1);
+		} else {
+			range_start = n;
+			chunks[n].range_length = chunks[n].length;
+		}
 		rpc->msgin.copied_out += chunks[n].length;
+		batch_bytes += chunks[n].length;
 		n++;
-		if (n < MAX_CHUNKS)
+		if ((n < MAX_CHUNKS) && (batch_bytes < MAX_BATCH_BYTES))
 			continue;
 
 copy_out:
 		if (n == 0)
 			break;
 		atomic_or(RPC_COPYING_TO_USER, &rpc->flags);
+		rpc->msgin.copiers++;
 		homa_rpc_unlock(rpc);
+		UNIT_HOOK("copy_out");
 
 		/* Copy data to user space. */
 		tt_record1("starting copy to user space for id %d",
 				rpc->id);
+		start = get_cycles();
 		count = 0;
+		pinned_count = 0;
 		for (i = 0; i < n; i++) {
-			struct iovec iov;
-			struct iov_iter iter;
+			int num_bvecs, bytes;
 
 			if (error)
 				break;
-			error = import_single_range(READ, chunks[i].dst,
-					chunks[i].length, &iov, &iter);
-			if (error)
-				break;
+			if (chunks[i].range_length) {
+				/* If the range's region is pinned, copy
+				 * through kernel mappings of its pages.
+				 */
+				bytes = homa_pool_get_bvecs(pool,
+						chunks[i].dst,
+						chunks[i].range_length, bvecs,
+						HOMA_MAX_BVECS, &num_bvecs);
+				if (num_bvecs > 0) {
+					iov_iter_bvec(&iter, READ, bvecs,
+							num_bvecs, bytes);
+					pinned_count += chunks[i].range_length;
+				} else {
+					error = import_single_range(READ,
+							chunks[i].dst,
+							chunks[i].range_length,
+							&iov, &iter);
+					if (error)
+						break;
+				}
+			}
 			error = skb_copy_datagram_iter(chunks[i].skb,
 						chunks[i].offset,
 						&iter, chunks[i].length);
 			count += chunks[i].length;
 		}
+		start = get_cycles() - start;
+		INC_METRIC(copy_out_cycles, start);
+		INC_METRIC(copy_out_bytes, count);
+		if (pinned_count) {
+			INC_METRIC(copy_out_pinned_cycles, start);
+			INC_METRIC(copy_out_pinned_bytes, pinned_count);
+		}
+		INC_METRIC(copy_out_batches, 1);
 		tt_record3("finished copying %d bytes for id %d, copied_out %d",
 				count, rpc->id, rpc->msgin.copied_out);
 
-		/* Free skbs. */
+		/* Free the skbs consumed by this batch while the RPC is still
+		 * unlocked. With BH disabled and a nonzero budget,
+		 * napi_consume_skb can stash the sk_buffs in the per-core
+		 * NAPI cache, which returns them to the slab allocator in
+		 * bulk.
+		 */
 		count = 0;
+		local_bh_disable();
 		for (i = 0; i < n; i++) {
 			if (!chunks[i].free_skb)
 				continue;
-			h = (struct data_header *) chunks[i].skb->data;
-//			tt_record4("homa_copy_out freeing skb 0x%08x%08x "
-//					"for id %d, offset %d",
-//					tt_hi(chunks[i].skb),
-//					tt_lo(chunks[i].skb),
-//					rpc->id, ntohl(h->seg.offset));
-			kfree_skb(chunks[i].skb);
+			napi_consume_skb(chunks[i].skb, n);
 			count++;
 		}
+		local_bh_enable();
 		tt_record2("finished freeing %d skbs for id %d",
 				count, rpc->id);
 		n = 0;
+		batch_bytes = 0;
 		homa_rpc_lock(rpc);
-		atomic_andnot(RPC_COPYING_TO_USER, &rpc->flags);
+
+		/* Other threads may be copying other parts of this message;
+		 * only when the last of them finishes is everything below
+		 * copied_out really in user space.
+		 */
+		rpc->msgin.copiers--;
+		if (rpc->msgin.copiers == 0) {
+			atomic_andnot(RPC_COPYING_TO_USER, &rpc->flags);
+			rpc->msgin.copied = rpc->msgin.copied_out;
+		}
 		if (error)
 			break;
 	}
@@ -372,8 +448,11 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk,
 
 	/* Find and lock the RPC for this packet. */
 	rpc = homa_lcache_get(lcache, id, &saddr, ntohs(h->sport));
-	if (!rpc) {
+	if (rpc)
+		INC_METRIC(lcache_hits, 1);
+	else {
 		/* To avoid deadlock, must release old RPC before locking new. */
+		INC_METRIC(lcache_misses, 1);
 		homa_lcache_release(lcache);
 		if (!homa_is_client(id)) {
 			/* We are the server for this RPC. */
@@ -415,7 +494,7 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk,
 	} else {
 		if ((h->type == DATA) || (h->type == GRANT)
 				|| (h->type == BUSY))
-			rpc->silent_ticks = 0;
+			rpc->active_ticks = hsk->homa->timer_ticks;
 		rpc->peer->outstanding_resends = 0;
 		if (hsk->homa->sync_freeze) {
 			hsk->homa->sync_freeze = 0;
@@ -437,8 +516,8 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk,
 		homa_data_pkt(skb, rpc, lcache, delta);
 		INC_METRIC(packets_received[DATA - DATA], 1);
 		if (hsk->dead_skbs >= 2*hsk->homa->dead_buffs_limit) {
-			/* We get here if neither homa_wait_for_message
-			 * nor homa_timer can keep up with reaping dead
+			/* We get here if neither the reaper thread nor
+			 * homa_timer can keep up with reaping dead
 			 * RPCs. See reap.txt for details.
 			 */
 			uint64_t start = get_cycles();
@@ -467,7 +546,7 @@ void homa_pkt_dispatch(struct sk_buff *skb, struct homa_sock *hsk,
 		INC_METRIC(packets_received[BUSY - DATA], 1);
 		tt_record2("received BUSY for id %d, peer 0x%x",
 				id, tt_addr(rpc->peer->addr));
-		/* Nothing to do for these packets except reset silent_ticks,
+		/* Nothing to do for these packets except update active_ticks,
 		 * which happened above.
 		 */
 		goto discard;
@@ -546,9 +625,9 @@ void homa_data_pkt(struct sk_buff *skb, struct homa_rpc *rpc,
 	if ((ntohl(h->seg.offset) == rpc->msgin.copied_out)
 			&& !(atomic_read(&rpc->flags) & RPC_PKTS_READY)) {
 		atomic_or(RPC_PKTS_READY, &rpc->flags);
-		homa_sock_lock(rpc->hsk, "homa_data_pkt");
+		homa_sock_ready_lock(rpc->hsk);
 		homa_rpc_handoff(rpc);
-		homa_sock_unlock(rpc->hsk);
+		homa_sock_ready_unlock(rpc->hsk);
 	}
 	if (rpc->msgin.scheduled)
 		homa_check_grantable(homa, rpc);
@@ -741,6 +820,7 @@ void homa_cutoffs_pkt(struct sk_buff *skb, struct homa_sock *hsk)
 		for (i = 1; i <HOMA_MAX_PRIORITIES; i++)
 			peer->unsched_cutoffs[i] = ntohl(h->unsched_cutoffs[i]);
 		peer->cutoff_version = h->cutoff_version;
+		homa_peer_put(peer);
 	}
 	kfree_skb(skb);
 }
@@ -788,6 +868,7 @@ void homa_need_ack_pkt(struct sk_buff *skb, struct homa_sock *hsk,
 	ack.num_acks = htons(homa_peer_get_acks(peer,
 			NUM_PEER_UNACKED_IDS, ack.acks));
 	__homa_xmit_control(&ack, sizeof(ack), peer, hsk);
+	homa_peer_put(peer);
 	tt_record3("Responded to NEED_ACK for id %d, peer %0x%x with %d "
 			"other acks", id, tt_addr(saddr), ntohs(ack.num_acks));
 
@@ -1075,7 +1156,7 @@ void homa_send_grants(struct homa *homa)
 		 * resend (until we send the grant, timeouts won't occur
 		 * because there's no granted data).
 		 */
-		candidate->silent_ticks = 0;
+		candidate->active_ticks = homa->timer_ticks;
 
 		/* Create a grant for this message. */
 		candidate->msgin.incoming = new_grant;
@@ -1178,7 +1259,7 @@ int homa_grant_fifo(struct homa *homa)
 			== oldest->msgin.incoming)
 		INC_METRIC(fifo_grants_no_incoming, 1);
 
-	oldest->silent_ticks = 0;
+	oldest->active_ticks = homa->timer_ticks;
 	granted = homa->fifo_grant_increment;
 	oldest->msgin.incoming += granted;
 	if (oldest->msgin.incoming >= oldest->msgin.total_length) {
@@ -1284,14 +1365,17 @@ void homa_remove_from_grantable(struct homa *homa, struct homa_rpc *rpc)
  */
 void homa_log_grantable_list(struct homa *homa)
 {
-	int bucket, count;
+	struct homa_peer_buckets *buckets;
 	struct homa_peer *peer, *peer2;
 	struct homa_rpc *rpc;
+	int bucket, count;
 
 	printk(KERN_NOTICE "Logging Homa grantable list\n");
 	homa_grantable_lock(homa);
-	for (bucket = 0; bucket < HOMA_PEERTAB_BUCKETS; bucket++) {
-		hlist_for_each_entry_rcu(peer, &homa->peers.buckets[bucket],
+	rcu_read_lock();
+	buckets = rcu_dereference(homa->peers.buckets);
+	for (bucket = 0; bucket < (1 << buckets->bits); bucket++) {
+		hlist_for_each_entry_rcu(peer, &buckets->heads[bucket],
 				peertab_links) {
 			printk(KERN_NOTICE "Checking peer %s\n",
 					homa_print_ipv6_addr(&peer->addr));
@@ -1320,6 +1404,7 @@ void homa_log_grantable_list(struct homa *homa)
 			continue;
 		}
 	}
+	rcu_read_unlock();
 	homa_grantable_unlock(homa);
 	printk(KERN_NOTICE "Finished logging Homa grantable list\n");
 }
@@ -1334,10 +1419,10 @@ void homa_rpc_abort(struct homa_rpc *crpc, int error)
 {
 	homa_remove_from_grantable(crpc->hsk->homa, crpc);
 	crpc->error = error;
-	homa_sock_lock(crpc->hsk, "homa_rpc_abort");
+	homa_sock_ready_lock(crpc->hsk);
 	if (!crpc->hsk->shutdown)
 		homa_rpc_handoff(crpc);
-	homa_sock_unlock(crpc->hsk);
+	homa_sock_ready_unlock(crpc->hsk);
 }
 
 /**
@@ -1447,7 +1532,10 @@ void homa_abort_sock_rpcs(struct homa_sock *hsk, int error)
  * @flags:        Flags field from homa_recvmsg_args; see manual entry for
  *                details.
  * @id:           If non-zero, then the caller is interested in receiving
- *                the response for this RPC (@id must be a client request).
+ *                the response for this RPC (@id must be a client request,
+ *                unless @flags includes HOMA_RECVMSG_PARTIAL, in which case
+ *                it may also be a server RPC whose request has been
+ *                partially returned already).
  * Return:        Either zero or a negative errno value. If a matching RPC
  *                is already available, information about it will be stored in
  *                interest.
@@ -1460,9 +1548,12 @@ int homa_register_interests(struct homa_interest *interest,
 	homa_interest_init(interest);
 	interest->locked = 1;
 	if (id != 0) {
-		if (!homa_is_client(id))
+		if (homa_is_client(id))
+			rpc = homa_find_client_rpc(hsk, id);
+		else if (flags & HOMA_RECVMSG_PARTIAL)
+			rpc = homa_find_partial_rpc(hsk, id);
+		else
 			return -EINVAL;
-		rpc = homa_find_client_rpc(hsk, id);
 		if (rpc == NULL)
 			return -EINVAL;
 		if ((rpc->interest != NULL) && (rpc->interest != interest)) {
@@ -1471,12 +1562,12 @@ int homa_register_interests(struct homa_interest *interest,
 		}
 	}
 
-	/* Need both the RPC lock (acquired above) and the socket lock to
-	 * avoid races.
+	/* Need both the RPC lock (acquired above) and the socket's ready
+	 * lock to avoid races.
 	 */
-	homa_sock_lock(hsk, "homa_register_interests");
+	homa_sock_ready_lock(hsk);
 	if (hsk->shutdown) {
-		homa_sock_unlock(hsk);
+		homa_sock_ready_unlock(hsk);
 		if (rpc)
 			homa_rpc_unlock(rpc);
 		return -ESHUTDOWN;
@@ -1485,6 +1576,13 @@ int homa_register_interests(struct homa_interest *interest,
 	if (id != 0) {
 		if ((atomic_read(&rpc->flags) & RPC_PKTS_READY) || rpc->error)
 			goto claim_rpc;
+		if ((flags & HOMA_RECVMSG_PARTIAL)
+				&& (rpc->msgin.total_length >= 0)
+				&& (rpc->msgin.copied > rpc->msgin.delivered))
+			/* Another thread copied data since the last partial
+			 * return, so there is already progress to report.
+			 */
+			goto claim_rpc;
 		rpc->interest = interest;
 		interest->reg_rpc = rpc;
 		homa_rpc_unlock(rpc);
@@ -1520,22 +1618,25 @@ int homa_register_interests(struct homa_interest *interest,
 		}
 		list_add(&interest->request_links, &hsk->request_interests);
 	}
-	homa_sock_unlock(hsk);
+	homa_sock_ready_unlock(hsk);
 	return 0;
 
     claim_rpc:
+	/* This flag is needed to keep the RPC from being reaped during the
+	 * gap between when we release the ready lock and we acquire the
+	 * RPC lock. It must be set before unlinking the RPC: homa_rpc_free
+	 * doesn't acquire the ready lock for RPCs that aren't queued, so
+	 * it could put this RPC on the dead list as soon as it sees
+	 * ready_links empty.*/
+	atomic_or(RPC_HANDING_OFF, &rpc->flags);
+	smp_mb__after_atomic();
 	list_del_init(&rpc->ready_links);
 	if (!list_empty(&hsk->ready_requests) ||
 			!list_empty(&hsk->ready_responses)) {
 		// There are still more RPCs available, so let Linux know.
 		hsk->sock.sk_data_ready(&hsk->sock);
 	}
-
-	/* This flag is needed to keep the RPC from being reaped during the
-	 * gap between when we release the socket lock and we acquire the
-	 * RPC lock.*/
-	atomic_or(RPC_HANDING_OFF, &rpc->flags);
-	homa_sock_unlock(hsk);
+	homa_sock_ready_unlock(hsk);
 	if (!interest->locked) {
 		homa_rpc_lock(rpc);
 		interest->locked = 1;
@@ -1553,10 +1654,16 @@ int homa_register_interests(struct homa_interest *interest,
  * @flags:        Flags field from homa_recvmsg_args; see manual entry for
  *                details.
  * @id:           If non-zero, then a response message matching this id may
- *                be returned (@id must refer to a client request).
+ *                be returned (@id must refer to a client request, or to
+ *                a partially returned request if @flags includes
+ *                HOMA_RECVMSG_PARTIAL).
  *
  * Return:   Pointer to an RPC that matches @flags and @id, or a negative
  *           errno value. The RPC will be locked; the caller must unlock.
+ *           Normally the RPC's incoming message will be complete, but if
+ *           @flags includes HOMA_RECVMSG_PARTIAL then the RPC may be returned
+ *           as soon as more of its message has been copied to user space
+ *           than was previously reported (msgin.delivered).
  */
 struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 		__u64 id)
@@ -1564,8 +1671,10 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 	struct homa_rpc *result = NULL;
 	struct homa_interest interest;
 	struct homa_rpc *rpc = NULL;
+	uint64_t start = get_cycles();
 	uint64_t poll_start, now;
-	int error, blocked = 0, polled = 0;
+	int error, blocked = 0, polled = 0, recorded = 0;
+	int poll_budget, counted;
 
 	/* Each iteration of this loop finds an RPC, but it might not be
 	 * in a state where we can return it (e.g., there might be packets
@@ -1587,11 +1696,15 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 //		tt_record3("Preparing to poll, socket %d, flags 0x%x, pid %d",
 //				hsk->client_port, flags, current->pid);
 
-	        /* There is no ready RPC so far. Clean up dead RPCs before
-		 * going to sleep (or returning, if in nonblocking mode).
+	        /* There is no ready RPC so far. Dead RPCs are normally
+		 * cleaned up by the reaper thread, but if it is falling
+		 * behind, help out before going to sleep (or returning, if
+		 * in nonblocking mode).
 		 */
-		while (1) {
+		while (hsk->dead_skbs >= hsk->homa->dead_buffs_limit) {
 			int reaper_result;
+			__u64 start;
+
 			rpc = (struct homa_rpc *) atomic_long_read(
 					&interest.ready_rpc);
 			if (rpc) {
@@ -1599,8 +1712,10 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 						rpc->id);
 				goto found_rpc;
 			}
+			start = get_cycles();
 			reaper_result = homa_rpc_reap(hsk,
 					hsk->homa->reap_limit);
+			INC_METRIC(wait_reap_cycles, get_cycles() - start);
 			if (reaper_result == 0)
 				break;
 
@@ -1614,8 +1729,21 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 		}
 
 		/* Busy-wait for a while before going to sleep; this avoids
-		 * context-switching overhead to wake up.
+		 * context-switching overhead to wake up. The polling time
+		 * adapts to recent wait times on this socket (see
+		 * homa_poll_update), and there may be a limit on how many
+		 * threads can poll at once.
 		 */
+		poll_budget = hsk->homa->poll_cycles;
+		if (hsk->homa->poll_percentile && (hsk->poll_cycles
+				< poll_budget))
+			poll_budget = hsk->poll_cycles;
+		counted = hsk->homa->max_pollers > 0;
+		if (counted && (atomic_inc_return(&hsk->num_pollers)
+				> hsk->homa->max_pollers)) {
+			INC_METRIC(pollers_limited, 1);
+			poll_budget = 0;
+		}
 		poll_start = now = get_cycles();
 		while (1) {
 			__u64 blocked;
@@ -1627,10 +1755,19 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 						current->pid);
 				polled = 1;
 				INC_METRIC(poll_cycles, now - poll_start);
+				if (counted)
+					atomic_dec(&hsk->num_pollers);
 				goto found_rpc;
 			}
-			if (now >= (poll_start + hsk->homa->poll_cycles))
+			if (now >= (poll_start + poll_budget))
 				break;
+
+			/* If the application enabled busy polling (SO_BUSY_POLL),
+			 * drive the NIC queue where our packets arrive
+			 * directly; this is done before measuring blocked
+			 * time, since packet processing here is on our behalf.
+			 */
+			homa_napi_poll(hsk);
 			blocked = get_cycles();
 			schedule();
 			now = get_cycles();
@@ -1643,6 +1780,8 @@ struct homa_rpc *homa_wait_for_message(struct homa_sock *hsk, int flags,
 				poll_start += blocked;
 			}
 		}
+		if (counted)
+			atomic_dec(&hsk->num_pollers);
 		tt_record2("Poll ended unsuccessfully on socket %d, pid %d",
 				hsk->port, current->pid);
 		INC_METRIC(poll_cycles, now - poll_start);
@@ -1671,22 +1810,22 @@ found_rpc:
 		 * message could still be passed to us. Note: if we went to
 		 * sleep, then this info was already cleaned up by whoever
 		 * woke us up. Also, values in the interest may change between
-		 * when we test them below and when we acquire the socket lock,
-		 * so they have to be checked again after locking the socket.
+		 * when we test them below and when we acquire the ready lock,
+		 * so they have to be checked again after locking.
 		 */
 		UNIT_HOOK("found_rpc");
 		if ((interest.reg_rpc)
 				|| (interest.request_links.next != LIST_POISON1)
 				|| (interest.response_links.next
 				!= LIST_POISON1)) {
-			homa_sock_lock(hsk, "homa_wait_for_message");
+			homa_sock_ready_lock(hsk);
 			if (interest.reg_rpc)
 				interest.reg_rpc->interest = NULL;
 			if (interest.request_links.next != LIST_POISON1)
 				list_del(&interest.request_links);
 			if (interest.response_links.next != LIST_POISON1)
 				list_del(&interest.response_links);
-			homa_sock_unlock(hsk);
+			homa_sock_ready_unlock(hsk);
 		}
 
 		/* Now check to see if we received an RPC handoff (note that
@@ -1704,12 +1843,26 @@ found_rpc:
 				homa_rpc_unlock(rpc);
 				continue;
 			}
+
+			/* Record how long we waited for the first handoff
+			 * before copying: the polling time should adapt to
+			 * how long messages take to arrive, not to how long
+			 * they take to copy.
+			 */
+			if (!recorded && !(flags & HOMA_RECVMSG_NONBLOCKING)) {
+				homa_poll_record(hsk, get_cycles() - start);
+				recorded = 1;
+			}
 			if (!rpc->error)
 				rpc->error = homa_copy_to_user(rpc);
 			if (rpc->error)
 				goto done;
 			atomic_andnot(RPC_PKTS_READY, &rpc->flags);
-			if (rpc->msgin.copied_out == rpc->msgin.total_length)
+			if (rpc->msgin.copied == rpc->msgin.total_length)
+				goto done;
+			if ((flags & HOMA_RECVMSG_PARTIAL) &&
+					(rpc->msgin.copied
+					> rpc->msgin.delivered))
 				goto done;
 			homa_rpc_unlock(rpc);
 		}
@@ -1732,12 +1885,171 @@ done:
 
 }
 
+/**
+ * homa_napi_poll() - If busy polling has been enabled for a socket
+ * (SO_BUSY_POLL or net.core.busy_read), make one pass over the NAPI
+ * context (NIC receive queue) where the socket's packets most recently
+ * arrived. This allows a thread waiting in homa_wait_for_message to
+ * process its own incoming packets, rather than waiting for an interrupt
+ * and a SoftIRQ handoff to another core.
+ * @hsk:    Socket for which the current thread is waiting.
+ *
+ * Return:  Nonzero means a NAPI context was polled; zero means busy polling
+ *          isn't enabled for @hsk (or no packets have arrived for it yet).
+ */
+int homa_napi_poll(struct homa_sock *hsk)
+{
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	unsigned int napi_id = READ_ONCE(hsk->sock.sk_napi_id);
+	struct homa_core *core;
+
+	if (!READ_ONCE(hsk->sock.sk_ll_usec) || (napi_id < MIN_NAPI_ID))
+		return 0;
+
+	/* Note: napi_polling is only a hint (if this thread migrates to
+	 * a different core, packets will simply take the normal SoftIRQ
+	 * path), so there's no need to disable preemption here.
+	 */
+	core = homa_cores[raw_smp_processor_id()];
+	core->napi_polling = 1;
+	napi_busy_loop(napi_id, NULL, NULL,
+			READ_ONCE(hsk->sock.sk_prefer_busy_poll),
+			BUSY_POLL_BUDGET);
+	core->napi_polling = 0;
+	INC_METRIC(napi_polls, 1);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * homa_poll_record() - Record the time that a thread spent waiting for
+ * a message in homa_wait_for_message (up until an RPC was handed to it,
+ * not including the time to copy the message out); this information is
+ * used to adjust how long threads poll before sleeping.
+ * @hsk:     Socket on which the thread waited.
+ * @wait:    How long the thread waited, in get_cycles units.
+ */
+void homa_poll_record(struct homa_sock *hsk, __u64 wait)
+{
+#ifdef __UNIT_TEST__
+#define POLL_SAMPLES 4
+#else
+#define POLL_SAMPLES 64
+#endif
+	int bucket;
+
+	if (hsk->homa->poll_percentile == 0)
+		return;
+	bucket = fls64(wait >> HOMA_POLL_SHIFT);
+	if (bucket >= HOMA_POLL_BUCKETS)
+		bucket = HOMA_POLL_BUCKETS - 1;
+	hsk->poll_waits[bucket]++;
+	hsk->poll_samples++;
+	if ((hsk->poll_samples % POLL_SAMPLES) == 0)
+		homa_poll_update(hsk);
+}
+
+/**
+ * homa_poll_update() - Recompute how long threads should poll for
+ * messages on a socket, based on the socket's histogram of recent wait
+ * times. The goal is to poll just long enough that homa->poll_percentile
+ * percent of waits end while polling, without exceeding homa->poll_cycles.
+ * If most waits are too long to be caught even with the maximum polling
+ * time (e.g. on a lightly loaded server), polling is just wasted CPU
+ * time, so it is disabled until wait times get shorter.
+ * @hsk:     Socket whose polling time should be updated.
+ */
+void homa_poll_update(struct homa_sock *hsk)
+{
+	struct homa *homa = hsk->homa;
+	int total = 0, caught = 0, cum = 0, target, i;
+	__u64 limit = 0;
+
+	for (i = 0; i < HOMA_POLL_BUCKETS; i++) {
+		total += hsk->poll_waits[i];
+		if ((((__u64) 1) << (HOMA_POLL_SHIFT + i)) <= homa->poll_cycles)
+			caught += hsk->poll_waits[i];
+	}
+	if (total == 0)
+		return;
+	target = (total * homa->poll_percentile + 99)/100;
+	for (i = 0; i < HOMA_POLL_BUCKETS; i++) {
+		cum += hsk->poll_waits[i];
+		if (cum >= target) {
+			limit = ((__u64) 1) << (HOMA_POLL_SHIFT + i);
+			break;
+		}
+	}
+	if ((limit != 0) && (limit <= homa->poll_cycles))
+		hsk->poll_cycles = limit;
+	else if (2*caught < total)
+		hsk->poll_cycles = 0;
+	else
+		hsk->poll_cycles = homa->poll_cycles;
+
+	/* Age the histogram so that it reflects recent behavior. */
+	for (i = 0; i < HOMA_POLL_BUCKETS; i++)
+		hsk->poll_waits[i] >>= 1;
+	INC_METRIC(poll_budget_updates, 1);
+	tt_record2("homa_poll_update set poll_cycles %d for port %d",
+			hsk->poll_cycles, hsk->port);
+}
+
+/**
+ * homa_choose_interest() - Given a list of interests for an incoming
+ * message, choose the best one to handle it (if any).
+ * @head:        Head of the list of interests: either request_interests
+ *               or response_interests in a homa_sock.
+ * @offset:      Offset of the list links within a homa_interest
+ *               (offsetof(struct homa_interest, request_links) or
+ *               offsetof(struct homa_interest, response_links)).
+ * Return:       An interest to use for the incoming message, or NULL if none
+ *               is available. The RPC's packets were just processed on
+ *               the current core, so this function prefers a thread that
+ *               registered on this core; failing that, one on the same NUMA
+ *               node; otherwise it returns the first interest on the list.
+ *               Only the first few interests are considered, to bound the
+ *               time spent here with the ready lock held.
+ */
+struct homa_interest *homa_choose_interest(struct list_head *head, int offset)
+{
+#ifdef __UNIT_TEST__
+#define MAX_INTERESTS_TO_SCAN 3
+#else
+#define MAX_INTERESTS_TO_SCAN 8
+#endif
+	int core = raw_smp_processor_id();
+	int node = cpu_to_node(core);
+	struct homa_interest *backup = NULL;
+	struct list_head *pos;
+	int count = 0;
+
+	list_for_each(pos, head) {
+		struct homa_interest *interest = (struct homa_interest *)
+				(((char *) pos) - offset);
+		if (interest->core == core)
+			return interest;
+		if (!backup && (cpu_to_node(interest->core) == node))
+			backup = interest;
+		count++;
+		if (count >= MAX_INTERESTS_TO_SCAN)
+			break;
+	}
+	if (backup)
+		return backup;
+	if (list_empty(head))
+		return NULL;
+	return (struct homa_interest *) (((char *) head->next) - offset);
+}
+
 /**
  * @homa_rpc_handoff: This function is called when the input message for
  * an RPC is ready for attention from a user thread. It either notifies
  * a waiting reader or queues the RPC.
  * @rpc:                RPC to handoff; must be locked. The caller must
- *			also have locked the socket for this RPC.
+ *			also have locked the ready lock for this RPC's socket.
  */
 void homa_rpc_handoff(struct homa_rpc *rpc)
 {
@@ -1755,19 +2067,26 @@ void homa_rpc_handoff(struct homa_rpc *rpc)
 		goto thread_waiting;
 	}
 
+	/* Once part of the message has been returned by a
+	 * HOMA_RECVMSG_PARTIAL recvmsg, the rest belongs to whichever thread
+	 * asks for the RPC by id; it must not go to a generic receiver. The
+	 * RPC isn't queued: homa_register_interests will find it (via
+	 * RPC_PKTS_READY) when that thread asks for it.
+	 */
+	if (rpc->msgin.delivered > 0)
+		return;
+
 	/* Second, check the interest list for this type of RPC. */
 	if (homa_is_client(rpc->id)) {
-		interest = list_first_entry_or_null(
-				&hsk->response_interests,
-				struct homa_interest, response_links);
+		interest = homa_choose_interest(&hsk->response_interests,
+				offsetof(struct homa_interest, response_links));
 		if (interest)
 			goto thread_waiting;
 		list_add_tail(&rpc->ready_links, &hsk->ready_responses);
 		INC_METRIC(responses_queued, 1);
 	} else {
-		interest = list_first_entry_or_null(
-				&hsk->request_interests,
-				struct homa_interest, request_links);
+		interest = homa_choose_interest(&hsk->request_interests,
+				offsetof(struct homa_interest, request_links));
 		if (interest)
 			goto thread_waiting;
 		list_add_tail(&rpc->ready_links, &hsk->ready_requests);
@@ -1787,15 +2106,22 @@ void homa_rpc_handoff(struct homa_rpc *rpc)
 thread_waiting:
 	/* We found a waiting thread. The following 3 lines must be here,
 	 * before clearing the interest, in order to avoid a race with
-	 * homa_wait_for_message (which won't acquire the socket lock if
+	 * homa_wait_for_message (which won't acquire the ready lock if
 	 * the interest is clear).
 	 */
 	atomic_or(RPC_HANDING_OFF, &rpc->flags);
 	interest->locked = 0;
 	atomic_long_set_release(&interest->ready_rpc, (long) rpc);
+	if (interest->core == raw_smp_processor_id())
+		INC_METRIC(handoffs_same_core, 1);
+	else if (cpu_to_node(interest->core)
+			== cpu_to_node(raw_smp_processor_id()))
+		INC_METRIC(handoffs_same_node, 1);
+	else
+		INC_METRIC(handoffs_cross_node, 1);
 
 	/* Clear the interest. This serves two purposes. First, it saves
-	 * the waking thread from acquiring the socket lock again, which
+	 * the waking thread from acquiring the ready lock again, which
 	 * reduces contention on that lock). Second, it ensures that
 	 * no-one else attempts to give this interest a different RPC.
 	 */
@@ -1843,6 +2169,10 @@ void homa_incoming_sysctl_changed(struct homa *homa)
 	tmp = (tmp*cpu_khz)/1000;
 	homa->gro_busy_cycles = tmp;
 
+	tmp = homa->max_gro_usecs;
+	tmp = (tmp*cpu_khz)/1000;
+	homa->max_gro_cycles = tmp;
+
 	tmp = homa->rtt_bytes * homa->duty_cycle;
 	homa->grant_threshold = tmp/1000;
 	if (homa->grant_threshold > homa->rtt_bytes)
@@ -29,6 +29,12 @@ static const struct net_offload homa_offload = {
 
 extern struct homa *homa;
 
+/* Number of cores (following the current one, or a preferred one) that
+ * the SoftIRQ steering policies consider when looking for a core that
+ * isn't busy.
+ */
+#define CORES_TO_CHECK 4
+
 /**
  * homa_offload_init() - Invoked to enable GRO and GSO. Typically invoked
  * when the Homa module loads.
@@ -80,6 +86,67 @@ static inline void homa_set_softirq_cpu(struct sk_buff *skb, int cpu)
 	__skb_set_sw_hash(skb, hash, false);
 }
 
+/**
+ * homa_gro_peer_hash() - Hash a packet's source for steering purposes.
+ * Both the GRO slot for a packet (homa_gro_slot_index) and, under
+ * HOMA_GRO_RPC_AFFINE, its SoftIRQ core (homa_gro_affine_core) are derived
+ * from this value, so the two always agree.
+ * @saddr:  The peer's address (canonical IPv6 form).
+ * @id:     RPC id of the packet under HOMA_GRO_RPC_AFFINE, otherwise 0.
+ *
+ * Return:  The hash value. The whole address is hashed (keyed the same way
+ *          as the peer table), so that peers that differ only in their
+ *          high-order bits don't all collide.
+ */
+static inline __u32 homa_gro_peer_hash(const struct in6_addr *saddr, __u64 id)
+{
+	return jhash2(saddr->in6_u.u6_addr32, 4,
+			homa->peers.hash_seed + (__u32) id);
+}
+
+/**
+ * homa_gro_slot_index() - Return the index (within homa_core->gro_slots)
+ * of the slot used to accumulate packets from a given peer.
+ * @saddr:  The peer's address (canonical IPv6 form).
+ * @id:     RPC id of the packet under HOMA_GRO_RPC_AFFINE, otherwise 0.
+ *
+ * Return:  The slot index.
+ */
+static inline int homa_gro_slot_index(const struct in6_addr *saddr, __u64 id)
+{
+	return homa_gro_peer_hash(saddr, id) & (HOMA_GRO_SLOTS - 1);
+}
+
+/**
+ * homa_gro_slot_valid() - Determine whether the packet held in a GRO slot
+ * is still available for merging, i.e. it is still in napi's GRO lists
+ * (the kernel may have passed it up the stack, in which case it may have
+ * been freed).
+ * @napi:   NAPI structure that holds the GRO lists for this core.
+ * @slot:   Slot whose skb should be checked; its skb must not be NULL.
+ *
+ * Return:  Nonzero means the slot's skb is still valid.
+ */
+static inline int homa_gro_slot_valid(struct napi_struct *napi,
+		struct homa_gro_slot *slot)
+{
+	struct gro_list *gro_list = &napi->gro_hash[slot->bucket];
+	struct sk_buff *skb;
+
+	/* Fast path: the kernel normally flushes all GRO lists at the end
+	 * of each NAPI poll, so an empty list means the slot is stale.
+	 * Otherwise the list contains at most MAX_GRO_SKBS entries, so the
+	 * scan below takes bounded time.
+	 */
+	if (gro_list->count == 0)
+		return 0;
+	list_for_each_entry(skb, &gro_list->list, list) {
+		if (skb == slot->skb)
+			return 1;
+	}
+	return 0;
+}
+
 /**
  * homa_gso_segment() - Split up a large outgoing Homa packet (larger than MTU)
  * into multiple smaller packets.
@@ -107,9 +174,12 @@ struct sk_buff *homa_gso_segment(struct sk_buff *skb,
 /**
  * homa_gro_receive() - Invoked for each input packet at a very low
  * level in the stack to perform GRO. However, this code does GRO in an
- * unusual way: it simply aggregates all packets targeted to a particular
- * destination port, so that the entire bundle can get through the networking
- * stack in a single traversal.
+ * unusual way: it simply aggregates packets regardless of their RPCs (each
+ * core accumulates a few batches at once, with all of the packets from a
+ * given peer going to the same batch), so that an entire bundle can get
+ * through the networking stack in a single traversal. The exception is
+ * HOMA_GRO_RPC_AFFINE, which steers each batch by its RPC, so it batches
+ * each RPC's packets separately.
  * @held_list:  Pointer to header for list of packets that are being
  *              held for possible GRO merging. Note: this list contains
  *              only packets matching a given hash.
@@ -136,10 +206,14 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 	struct sk_buff *held_skb;
 	struct sk_buff *result = NULL;
 	struct homa_core *core = homa_cores[raw_smp_processor_id()];
+	struct homa_gro_slot *slot;
+	int flush = 0;
+	__u64 id = 0;
 	__u32 hash;
 	__u64 saved_softirq_metric, softirq_cycles;
 	struct data_header *h_new = (struct data_header *)
 			skb_transport_header(skb);
+	struct in6_addr saddr6 = skb_canonical_ipv6_saddr(skb);
 	int priority;
 	__u32 saddr;
 	if (skb_is_ipv6(skb)) {
@@ -186,27 +260,40 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 			&& (skb->len < 1400)))
 		goto bypass;
 
+	/* If a thread on this core is busy-polling for Homa (see
+	 * homa_napi_poll), process the packet right here: handing it off
+	 * to SoftIRQ on another core would defeat the purpose of polling.
+	 */
+	if (core->napi_polling) {
+		INC_METRIC(napi_poll_pkts, 1);
+		goto bypass;
+	}
+
 	/* The GRO mechanism tries to separate packets onto different
 	 * gro_lists by hash. This is bad for us, because we want to batch
 	 * packets together regardless of their RPCs. So, instead of
-	 * checking the list they gave us, check the last list where this
-	 * core added a Homa packet (if there is such a list).
+	 * checking the list they gave us, each core keeps a few batches of
+	 * its own (see homa_gro_slot), selected by the packet's source.
+	 * HOMA_GRO_RPC_AFFINE picks a SoftIRQ core for an entire batch
+	 * based on its first packet's RPC, so under that policy each
+	 * batch must contain packets from only one RPC.
 	 */
 	hash = skb_get_hash_raw(skb) & (GRO_HASH_BUCKETS - 1);
-	if (core->held_skb) {
+	if (homa->gro_policy & HOMA_GRO_RPC_AFFINE)
+		id = homa_local_id(h_new->common.sender_id);
+	slot = &core->gro_slots[homa_gro_slot_index(&saddr6, id)];
+	if (slot->skb && ipv6_addr_equal(&slot->saddr, &saddr6)
+			&& (slot->id == id)) {
 		/* Reverse-engineer the location of the napi_struct, so we
-		 * can verify that held_skb is still valid.
+		 * can verify that the slot's skb is still valid.
 		 */
 		struct gro_list *gro_list = container_of(held_list,
 				struct gro_list, list);
 		struct napi_struct *napi = container_of(gro_list,
 				struct napi_struct, gro_hash[hash]);
 
-		/* Make sure that core->held_skb is on the list. */
-		list_for_each_entry(held_skb,
-				&napi->gro_hash[core->held_bucket].list, list) {
-			if (held_skb != core->held_skb)
-				continue;
+		if (homa_gro_slot_valid(napi, slot)) {
+			held_skb = slot->skb;
 
 			/* Aggregate skb into held_skb. We don't update the
 			 * length of held_skb because we'll eventually split
@@ -220,39 +307,53 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 			skb->next = NULL;
 			NAPI_GRO_CB(skb)->same_flow = 1;
 			NAPI_GRO_CB(held_skb)->count++;
-			if (NAPI_GRO_CB(held_skb)->count >= homa->max_gro_skbs) {
-				/* Push this batch up through the SoftIRQ
-				 * layer. This code is a hack, needed because
-				 * returning skb as result is no longer
-				 * sufficient (as of 5.4.80) to push it up
-				 * the stack; the packet just gets queued on
-				 * napi->rx_list. This code basically steals
-				 * the packet from dev_gro_receive and
-				 * pushes it upward.
-				 */
-				skb_list_del_init(held_skb);
-				homa_gro_complete(held_skb, 0);
-				netif_receive_skb(held_skb);
-				napi->gro_hash[core->held_bucket].count--;
-				if (napi->gro_hash[core->held_bucket].count == 0)
-					__clear_bit(core->held_bucket,
-							&napi->gro_bitmask);
-				result = ERR_PTR(-EINPROGRESS);
+			if (NAPI_GRO_CB(held_skb)->count >= homa->max_gro_skbs)
+				flush = 1;
+			else if ((homa->max_gro_cycles != 0)
+					&& ((core->last_active - slot->start)
+					>= homa->max_gro_cycles)) {
+				INC_METRIC(gro_age_flushes, 1);
+				flush = 1;
 			}
+			if (!flush)
+				goto done;
+
+			/* Push this batch up through the SoftIRQ
+			 * layer. This code is a hack, needed because
+			 * returning skb as result is no longer
+			 * sufficient (as of 5.4.80) to push it up
+			 * the stack; the packet just gets queued on
+			 * napi->rx_list. This code basically steals
+			 * the packet from dev_gro_receive and
+			 * pushes it upward.
+			 */
+			skb_list_del_init(held_skb);
+			homa_gro_complete(held_skb, 0);
+			netif_receive_skb(held_skb);
+			napi->gro_hash[slot->bucket].count--;
+			if (napi->gro_hash[slot->bucket].count == 0)
+				__clear_bit(slot->bucket, &napi->gro_bitmask);
+			slot->skb = NULL;
+			result = ERR_PTR(-EINPROGRESS);
 			goto done;
 		}
 	}
 
 	/* There was no existing Homa packet that this packet could be
-	 * batched with, so this packet will become the new merge_skb.
+	 * batched with, so this packet will start a new batch in its slot
+	 * (any previous batch in the slot remains in the GRO lists; it
+	 * will be flushed by the kernel in the normal way).
 	 * If the packet is sent up the stack before another packet
 	 * arrives for batching, we want it to be processed on this same
 	 * core (it's faster that way, and if batching doesn't occur it
 	 * means we aren't heavily loaded; if batching does occur,
 	 * homa_gro_complete will pick a different core).
 	 */
-	core->held_skb = skb;
-	core->held_bucket = hash;
+	slot->skb = skb;
+	slot->bucket = hash;
+	slot->saddr = saddr6;
+	slot->id = id;
+	slot->start = core->last_active;
 	if (likely(homa->gro_policy & HOMA_GRO_SAME_CORE))
 		homa_set_softirq_cpu(skb, raw_smp_processor_id());
 
@@ -280,6 +381,221 @@ struct sk_buff *homa_gro_receive(struct list_head *held_list,
 
 }
 
+/**
+ * homa_gro_affine_core() - Select the core that should perform SoftIRQ
+ * processing for a batch of packets under the HOMA_GRO_RPC_AFFINE policy.
+ * Normally this is a core chosen by hashing the peer address and RPC id
+ * of the batch's first packet with homa_gro_peer_hash, the same hash that
+ * selected its GRO slot (under this policy homa_gro_receive puts only one
+ * RPC's packets in each batch), so that all of an RPC's packets are
+ * processed on the same core (keeping its lock, message state, etc. in
+ * that core's cache). If that core is overloaded, a less-loaded nearby
+ * core is chosen instead.
+ * @skb:    First packet in the batch.
+ *
+ * Return:  Index of the selected core.
+ */
+int homa_gro_affine_core(struct sk_buff *skb)
+{
+	struct common_header *h = (struct common_header *)
+			skb_transport_header(skb);
+	__u64 id = homa_local_id(h->sender_id);
+	struct in6_addr saddr = skb_canonical_ipv6_saddr(skb);
+	int preferred, candidate, best, backlog, best_backlog, i;
+
+	preferred = reciprocal_scale(homa_gro_peer_hash(&saddr, id),
+			nr_cpu_ids);
+	best_backlog = atomic_read(&homa_cores[preferred]->softirq_backlog);
+	if (best_backlog <= homa->gro_affine_max_backlog) {
+		INC_METRIC(gro_affine_batches, 1);
+		return preferred;
+	}
+
+	/* The preferred core is overloaded; use whichever of the next few
+	 * cores has the shortest backlog (stay with the preferred core if
+	 * none of them is any better).
+	 */
+	best = candidate = preferred;
+	for (i = 0; i < CORES_TO_CHECK; i++) {
+		candidate++;
+		if (unlikely(candidate >= nr_cpu_ids))
+			candidate = 0;
+		backlog = atomic_read(&homa_cores[candidate]->softirq_backlog);
+		if (backlog < best_backlog) {
+			best = candidate;
+			best_backlog = backlog;
+		}
+	}
+	if (best == preferred)
+		INC_METRIC(gro_affine_batches, 1);
+	else {
+		tt_record3("homa_gro_affine_core moved id %d from core %d "
+				"to core %d", id, preferred, best);
+		INC_METRIC(gro_affine_overrides, 1);
+	}
+	return best;
+}
+
+/**
+ * homa_softirq_load() - Return the current estimate of the SoftIRQ work
+ * queued for a core.
+ * @core:   Core whose load is desired.
+ * @now:    Current time, in get_cycles units.
+ *
+ * Return:  Estimated time (in get_cycles units) needed for @core to finish
+ *          the SoftIRQ work that has been steered to it. This assumes that
+ *          the core works continuously on its queued work, so the estimate
+ *          drains at one cycle per cycle.
+ */
+__u64 homa_softirq_load(struct homa_core *core, __u64 now)
+{
+	__u64 elapsed = now - core->softirq_load_time;
+
+	if (core->softirq_load <= elapsed)
+		return 0;
+	return core->softirq_load - elapsed;
+}
+
+/**
+ * homa_gro_candidates_changed() - Recompute homa->gro_candidates and the
+ * candidate range for each core. Invoked whenever homa->softirq_excluded
+ * or the set of polling cores may have changed.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_gro_candidates_changed(struct homa *homa)
+{
+	static DEFINE_MUTEX(candidates_mutex);
+	int i, j, node, first, count;
+
+	mutex_lock(&candidates_mutex);
+	count = 0;
+	if (homa->num_poll_cores > 0) {
+		for (i = 0; i < nr_cpu_ids; i++) {
+			if (test_bit(i, homa->poll_cores)) {
+				WRITE_ONCE(homa->gro_candidates[count], i);
+				count++;
+			}
+		}
+		for (i = 0; i < nr_cpu_ids; i++) {
+			WRITE_ONCE(homa_cores[i]->gro_first_candidate, 0);
+			WRITE_ONCE(homa_cores[i]->gro_num_candidates, count);
+		}
+		goto done;
+	}
+
+	/* Each iteration of this loop handles all of the cores in one NUMA
+	 * node (the first time a core from that node is encountered). This
+	 * is quadratic in the number of cores, but it only runs when
+	 * configuration changes.
+	 */
+	for (i = 0; i < nr_cpu_ids; i++) {
+		node = cpu_to_node(i);
+		for (j = 0; j < i; j++) {
+			if (cpu_to_node(j) == node)
+				break;
+		}
+		if (j < i)
+			continue;
+		first = count;
+		for (j = i; j < nr_cpu_ids; j++) {
+			if ((cpu_to_node(j) != node)
+					|| test_bit(j, homa->softirq_excluded))
+				continue;
+			WRITE_ONCE(homa->gro_candidates[count], j);
+			count++;
+		}
+		for (j = i; j < nr_cpu_ids; j++) {
+			if (cpu_to_node(j) != node)
+				continue;
+			WRITE_ONCE(homa_cores[j]->gro_first_candidate, first);
+			WRITE_ONCE(homa_cores[j]->gro_num_candidates,
+					count - first);
+		}
+	}
+
+    done:
+	mutex_unlock(&candidates_mutex);
+}
+
+/**
+ * homa_gro_least_loaded_core() - Select the core that should perform
+ * SoftIRQ processing for a batch of packets under the
+ * HOMA_GRO_LOAD_FEEDBACK policy: this is the core in the current core's
+ * NUMA node with the least estimated queued SoftIRQ work (cores in
+ * homa->softirq_excluded are never chosen). If there are dedicated
+ * polling cores (homa->poll_cores) then the least loaded of those cores
+ * is chosen instead, regardless of node. Only the precomputed candidates
+ * (homa->gro_candidates) are scanned. The batch's estimated work
+ * is added to the selected core's load.
+ * @skb:    First packet in the batch (other packets are linked through
+ *          its frag_list).
+ *
+ * Return:  Index of the selected core.
+ */
+int homa_gro_least_loaded_core(struct sk_buff *skb)
+{
+	int this_core = raw_smp_processor_id();
+	__u64 now = get_cycles();
+	int best = -1;
+	__u64 best_load = ~0;
+	struct sk_buff *frag;
+	struct homa_core *core = homa_cores[this_core];
+	int first, num, start, bytes, candidate, i;
+	__u64 load;
+
+	/* The candidate range can change underneath us (see
+	 * homa_gro_candidates_changed); make sure we stay within the
+	 * array, even if we see a mix of old and new values.
+	 */
+	first = READ_ONCE(core->gro_first_candidate);
+	num = READ_ONCE(core->gro_num_candidates);
+	if (unlikely(first + num > nr_cpu_ids))
+		num = nr_cpu_ids - first;
+
+	/* Start the scan at a position that depends on this core, so that
+	 * different cores don't all favor the same idle core.
+	 */
+	start = (num > 0) ? (this_core + 1) % num : 0;
+	for (i = 0; i < num; i++) {
+		candidate = READ_ONCE(homa->gro_candidates[first
+				+ (start + i) % num]);
+		core = homa_cores[candidate];
+		load = homa_softirq_load(core, now);
+
+		/* Cores that are busy with GRO are treated as loaded (same
+		 * rationale as for HOMA_GRO_IDLE_NEW).
+		 */
+		if ((core->last_gro + homa->gro_busy_cycles) > now)
+			load += homa->gro_busy_cycles;
+		if (load < best_load) {
+			best = candidate;
+			best_load = load;
+			if (load == 0)
+				break;
+		}
+	}
+	if (best < 0) {
+		/* Every core in the node has been excluded (or the polling
+		 * cores are in the process of changing).
+		 */
+		best = this_core;
+		best_load = 1;
+	}
+	INC_METRIC(gro_load_feedback_batches, 1);
+	if (best_load != 0)
+		INC_METRIC(gro_load_feedback_busy, 1);
+
+	bytes = skb->len;
+	for (frag = skb_shinfo(skb)->frag_list; frag != NULL;
+			frag = frag->next)
+		bytes += frag->len;
+	core = homa_cores[best];
+	core->softirq_load = homa_softirq_load(core, now)
+			+ ((__u64) bytes * core->softirq_kb_cycles)/1000;
+	core->softirq_load_time = now;
+	return best;
+}
+
 /**
  * homa_gro_complete() - This function is invoked just before a packet that
  * was held for GRO processing is passed up the network stack, in case the
@@ -295,12 +611,44 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 	struct common_header *h = (struct common_header *)
 			skb_transport_header(skb);
 	struct data_header *d = (struct data_header *) h;
+	struct homa_gro_slot *slots =
+			homa_cores[raw_smp_processor_id()]->gro_slots;
+	int slot;
+
+	/* If this packet was held in a slot, it's no longer available. */
+	for (slot = 0; slot < HOMA_GRO_SLOTS; slot++) {
+		if (slots[slot].skb == skb)
+			slots[slot].skb = NULL;
+	}
 //	tt_record4("homa_gro_complete type %d, id %d, offset %d, count %d",
 //			h->type, homa_local_id(h->sender_id), ntohl(d->seg.offset),
 //			NAPI_GRO_CB(skb)->count);
 
-#define CORES_TO_CHECK 4
-	if (homa->gro_policy & HOMA_GRO_IDLE_NEW) {
+	if (homa->num_poll_cores > 0) {
+		/* All SoftIRQ work goes to the dedicated polling cores. */
+		int target = homa_gro_least_loaded_core(skb);
+		homa_set_softirq_cpu(skb, target);
+		tt_record3("homa_gro_complete chose polling core %d for id %d "
+				"offset %d", target, homa_local_id(h->sender_id),
+				ntohl(d->seg.offset));
+	} else if (homa->gro_policy & HOMA_GRO_RPC_AFFINE) {
+		int target = homa_gro_affine_core(skb);
+		atomic_inc(&homa_cores[target]->softirq_backlog);
+		homa_cores[raw_smp_processor_id()]->last_gro = get_cycles();
+		homa_set_softirq_cpu(skb, target);
+		tt_record3("homa_gro_complete chose core %d for id %d "
+				"offset %d with RPC_AFFINE policy",
+				target, homa_local_id(h->sender_id),
+				ntohl(d->seg.offset));
+	} else if (homa->gro_policy & HOMA_GRO_LOAD_FEEDBACK) {
+		int target = homa_gro_least_loaded_core(skb);
+		homa_cores[raw_smp_processor_id()]->last_gro = get_cycles();
+		homa_set_softirq_cpu(skb, target);
+		tt_record3("homa_gro_complete chose core %d for id %d "
+				"offset %d with LOAD_FEEDBACK policy",
+				target, homa_local_id(h->sender_id),
+				ntohl(d->seg.offset));
+	} else if (homa->gro_policy & HOMA_GRO_IDLE_NEW) {
 		/* Pick a specific core to handle SoftIRQ processing for this
 		 * group of packets. This policy scans the next several cores
 		 * in order after this, trying to find one that is not
@@ -394,3 +742,132 @@ int homa_gro_complete(struct sk_buff *skb, int hoffset)
 
 	return 0;
 }
+
+/**
+ * homa_softirq_napi_id() - Invoked by homa_softirq to record the NAPI id
+ * (NIC receive queue) on which a Homa packet arrived, so that dedicated
+ * polling cores will poll that queue.
+ * @homa:     Overall data about the Homa protocol implementation.
+ * @napi_id:  NAPI id from an incoming packet.
+ */
+void homa_softirq_napi_id(struct homa *homa, unsigned int napi_id)
+{
+	int i;
+
+	if (napi_id == 0)
+		return;
+	for (i = 0; i < HOMA_MAX_NAPI_IDS; i++) {
+		unsigned int old = READ_ONCE(homa->napi_ids[i]);
+
+		if (old == napi_id)
+			return;
+		if ((old == 0) && (cmpxchg(&homa->napi_ids[i], 0, napi_id)
+				== 0))
+			return;
+	}
+}
+
+/**
+ * homa_poll_core_main() - Top-level function for the dedicated polling
+ * threads that run on the cores in homa->poll_cores. Each thread runs a
+ * run-to-completion loop: it polls NIC receive queues used by Homa (the
+ * packets are processed by homa_softirq right on this core, via the
+ * GRO bypass in homa_gro_receive), and transmits from the pacer's
+ * throttled list.
+ * @transportInfo:  Pointer to struct homa.
+ *
+ * Return:         Always 0.
+ */
+int homa_poll_core_main(void *transportInfo)
+{
+	struct homa *homa = (struct homa *) transportInfo;
+	struct homa_core *core;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	int i, rank, num_cores;
+#endif
+
+	while (!kthread_should_stop()) {
+		core = homa_cores[raw_smp_processor_id()];
+		INC_METRIC(poll_core_loops, 1);
+#ifdef CONFIG_NET_RX_BUSY_POLL
+		/* The NIC queues are divided among the polling cores, so
+		 * they don't contend for the same queues. The rank and
+		 * count can change underneath us (homa_poll_cores_changed
+		 * zeroes the count while it starts and stops threads), so
+		 * work from a snapshot, and skip polling entirely while the
+		 * count is zero.
+		 */
+		rank = READ_ONCE(core->poll_rank);
+		num_cores = READ_ONCE(homa->num_poll_cores);
+		for (i = rank; (num_cores > 0) && (i < HOMA_MAX_NAPI_IDS);
+				i += num_cores) {
+			unsigned int napi_id = READ_ONCE(homa->napi_ids[i]);
+
+			if ((napi_id == 0) || kthread_should_stop())
+				break;
+			core->napi_polling = 1;
+			napi_busy_loop(napi_id, NULL, NULL, true,
+					BUSY_POLL_BUDGET);
+			core->napi_polling = 0;
+			INC_METRIC(poll_core_napi_polls, 1);
+		}
+#endif
+		homa_pacer_xmit(homa);
+
+		/* Give other threads (e.g. the pacer) a chance to run. */
+		schedule();
+	}
+	return 0;
+}
+
+/**
+ * homa_poll_cores_changed() - Invoked whenever homa->poll_cores may have
+ * been modified; starts and stops dedicated polling threads so that there
+ * is exactly one on each core in homa->poll_cores.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_poll_cores_changed(struct homa *homa)
+{
+	static DEFINE_MUTEX(poll_cores_mutex);
+	struct task_struct *thread;
+	struct homa_core *core;
+	int i, rank;
+
+	mutex_lock(&poll_cores_mutex);
+
+	/* Disable the mode while threads are changing, so that they
+	 * don't see inconsistent ranks.
+	 */
+	homa->num_poll_cores = 0;
+	rank = 0;
+	for (i = 0; i < nr_cpu_ids; i++) {
+		core = homa_cores[i];
+		if (!test_bit(i, homa->poll_cores)) {
+			if (core->poll_thread) {
+				kthread_stop(core->poll_thread);
+				core->poll_thread = NULL;
+			}
+			continue;
+		}
+		core->poll_rank = rank;
+		rank++;
+		if (core->poll_thread)
+			continue;
+		thread = kthread_create_on_node(homa_poll_core_main, homa,
+				cpu_to_node(i), "homa_poll/%d", i);
+		if (IS_ERR(thread)) {
+			printk(KERN_ERR "Homa couldn't create polling thread "
+					"for core %d: error %ld\n", i,
+					PTR_ERR(thread));
+			clear_bit(i, homa->poll_cores);
+			rank--;
+			continue;
+		}
+		kthread_bind(thread, i);
+		core->poll_thread = thread;
+		wake_up_process(thread);
+	}
+	homa->num_poll_cores = rank;
+	mutex_unlock(&poll_cores_mutex);
+	homa_gro_candidates_changed(homa);
+}
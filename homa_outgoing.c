@@ -371,8 +371,10 @@ void homa_xmit_unknown(struct sk_buff *skb, struct homa_sock *hsk)
 	unknown.common.sender_id = cpu_to_be64(homa_local_id(h->sender_id));
 	unknown.common.type = UNKNOWN;
 	peer = homa_peer_find(&hsk->homa->peers, &saddr, &hsk->inet);
-	if (!IS_ERR(peer))
-		 __homa_xmit_control(&unknown, sizeof(unknown), peer, hsk);
+	if (!IS_ERR(peer)) {
+		__homa_xmit_control(&unknown, sizeof(unknown), peer, hsk);
+		homa_peer_put(peer);
+	}
 }
 
 /**
@@ -427,6 +429,7 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 		rpc->msgout.next_xmit_offset += rpc->msgout.gso_pkt_data;
 		if (rpc->msgout.next_xmit_offset > rpc->msgout.length)
 			 rpc->msgout.next_xmit_offset = rpc->msgout.length;
+		rpc->active_ticks = homa->timer_ticks;
 
 		homa_rpc_unlock(rpc);
 		skb_get(skb);
@@ -435,6 +438,15 @@ void homa_xmit_data(struct homa_rpc *rpc, bool force)
 		homa_rpc_lock(rpc);
 	}
 	atomic_andnot(RPC_XMITTING, &rpc->flags);
+
+	/* Once a response has been fully transmitted, homa_timer needs to
+	 * start the clock for requesting an ack (see homa_check_rpc).
+	 */
+	if (!homa_is_client(rpc->id) && (rpc->state == RPC_OUTGOING)
+			&& (rpc->done_timer_ticks == 0)
+			&& (rpc->msgout.next_xmit_offset
+			>= rpc->msgout.length))
+		homa_rpc_arm_timer(rpc, homa->timer_ticks + 1);
 }
 
 /**
@@ -19,6 +19,46 @@
 
 #include "homa_impl.h"
 
+/**
+ * homa_peer_buckets_alloc() - Allocate and initialize a bucket array for
+ * a homa_peertab.
+ * @bits:    Number of bits in a bucket index for the new array.
+ *
+ * Return:   The new array, or NULL if memory couldn't be allocated.
+ */
+static struct homa_peer_buckets *homa_peer_buckets_alloc(int bits)
+{
+	struct homa_peer_buckets *buckets;
+	int i;
+
+	buckets = (struct homa_peer_buckets *) vmalloc(sizeof(*buckets)
+			+ (sizeof(buckets->heads[0]) << bits));
+	if (!buckets)
+		return NULL;
+	buckets->bits = bits;
+	for (i = 0; i < (1 << bits); i++)
+		INIT_HLIST_HEAD(&buckets->heads[i]);
+	return buckets;
+}
+
+/**
+ * homa_peer_bucket() - Find the hash chain in which a given address
+ * belongs.
+ * @peertab:  Table containing the address.
+ * @buckets:  Bucket array for @peertab (must be consistent with the
+ *            synchronization used by the caller).
+ * @addr:     Address of the desired host.
+ *
+ * Return:    The head of the chain that will contain @addr.
+ */
+static inline struct hlist_head *homa_peer_bucket(struct homa_peertab *peertab,
+		struct homa_peer_buckets *buckets, const struct in6_addr *addr)
+{
+	__u32 hash = jhash2(addr->in6_u.u6_addr32, 4, peertab->hash_seed);
+
+	return &buckets->heads[hash & ((1 << buckets->bits) - 1)];
+}
+
 /**
  * homa_peertab_init() - Constructor for homa_peertabs.
  * @peertab:  The object to initialize; previous contents are discarded.
@@ -31,16 +71,17 @@ int homa_peertab_init(struct homa_peertab *peertab)
 	 * safe to call homa_peertab_destroy, even if this function returns
 	 * an error.
 	 */
-	int i;
+	struct homa_peer_buckets *buckets;
+
 	spin_lock_init(&peertab->write_lock);
 	INIT_LIST_HEAD(&peertab->dead_dsts);
-	peertab->buckets = (struct hlist_head *) vmalloc(
-			HOMA_PEERTAB_BUCKETS * sizeof(*peertab->buckets));
-	if (!peertab->buckets)
+	INIT_LIST_HEAD(&peertab->lru);
+	peertab->num_peers = 0;
+	get_random_bytes(&peertab->hash_seed, sizeof(peertab->hash_seed));
+	buckets = homa_peer_buckets_alloc(HOMA_PEERTAB_MIN_BUCKET_BITS);
+	RCU_INIT_POINTER(peertab->buckets, buckets);
+	if (!buckets)
 		return -ENOMEM;
-	for (i = 0; i < HOMA_PEERTAB_BUCKETS; i++) {
-		INIT_HLIST_HEAD(&peertab->buckets[i]);
-	}
 	return 0;
 }
 
@@ -53,21 +94,172 @@ int homa_peertab_init(struct homa_peertab *peertab)
  */
 void homa_peertab_destroy(struct homa_peertab *peertab)
 {
-	int i;
+	struct homa_peer_buckets *buckets;
+	struct homa_peer *peer, *next;
+
+	buckets = rcu_dereference_protected(peertab->buckets, 1);
+	if (!buckets)
+		return;
+
+	/* Wait for any peers evicted by homa_peertab_gc to be freed. */
+	rcu_barrier();
+	list_for_each_entry_safe(peer, next, &peertab->lru, lru_links) {
+		dst_release(peer->dst);
+		kfree(peer);
+	}
+	vfree(buckets);
+	RCU_INIT_POINTER(peertab->buckets, NULL);
+	homa_peertab_gc_dsts(peertab, ~0);
+}
+
+/**
+ * homa_peer_free_rcu() - RCU callback that frees a peer once it's
+ * certain that no RCU readers can still be referencing it.
+ * @head:   The @rcu field of the peer to free.
+ */
+static void homa_peer_free_rcu(struct rcu_head *head)
+{
+	struct homa_peer *peer = container_of(head, struct homa_peer, rcu);
+
+	dst_release(peer->dst);
+	kfree(peer);
+}
+
+/**
+ * homa_peertab_gc() - Remove idle peers from a peer table. A peer is idle
+ * if it has no references, has no pending acks or grantable messages,
+ * and hasn't been used for a while. This function is invoked periodically
+ * by homa_timer; each call examines a bounded number of peers, so it may
+ * take several calls to remove all of the idle peers.
+ * @peertab:       Table from which to remove peers.
+ * @threshold:     Don't remove any peers unless the table contains more
+ *                 than this many entries.
+ * @idle_jiffies:  A peer must have been unused for at least this long
+ *                 before it can be removed.
+ *
+ * Return:         The number of peers removed.
+ */
+int homa_peertab_gc(struct homa_peertab *peertab, int threshold,
+		unsigned long idle_jiffies)
+{
+	struct homa_peer *peer;
+	int evicted = 0;
+	int examined;
+	__u64 start;
+
+	if (peertab->num_peers <= threshold)
+		return 0;
+
+	start = get_cycles();
+	spin_lock_bh(&peertab->write_lock);
+	for (examined = 0; examined < HOMA_PEER_GC_BATCH; examined++) {
+		if ((peertab->num_peers <= threshold)
+				|| list_empty(&peertab->lru))
+			break;
+		peer = list_first_entry(&peertab->lru, struct homa_peer,
+				lru_links);
+
+		/* Setting refs to -1 prevents homa_peer_find from returning
+		 * this peer while we decide whether to evict it.
+		 */
+		if (atomic_cmpxchg(&peer->refs, 0, -1) != 0)
+			goto keep;
+		if ((homa_peer_num_acks(peer) != 0)
+				|| !list_empty(&peer->grantable_rpcs)
+				|| time_before(jiffies,
+				peer->access_jiffies + idle_jiffies)) {
+			atomic_set(&peer->refs, 0);
+			goto keep;
+		}
+		hlist_del_rcu(&peer->peertab_links);
+		list_del(&peer->lru_links);
+		peertab->num_peers--;
+		call_rcu(&peer->rcu, homa_peer_free_rcu);
+		evicted++;
+		continue;
+
+	    keep:
+		list_move_tail(&peer->lru_links, &peertab->lru);
+	}
+	spin_unlock_bh(&peertab->write_lock);
+	INC_METRIC(peer_evictions, evicted);
+	INC_METRIC(peer_gc_cycles, get_cycles() - start);
+	return evicted;
+}
+
+/**
+ * homa_peertab_resize() - Replace the bucket array for a peer table with
+ * one of a different size. Lookups may proceed concurrently: a lookup
+ * that misses because its chain is being rehashed falls back to the
+ * locked path in homa_peer_find, which sees the new array. This function
+ * may block, so it must not be invoked in atomic context.
+ * @peertab:    Table to resize.
+ * @bits:       Number of bits in a bucket index for the new array.
+ *
+ * Return:      0 for success, otherwise a negative errno.
+ */
+int homa_peertab_resize(struct homa_peertab *peertab, int bits)
+{
+	struct homa_peer_buckets *old, *new;
 	struct homa_peer *peer;
 	struct hlist_node *next;
-	if (!peertab->buckets)
-		return;
+	int i;
+
+	new = homa_peer_buckets_alloc(bits);
+	if (!new)
+		return -ENOMEM;
 
-	for (i = 0; i < HOMA_PEERTAB_BUCKETS; i++) {
-		hlist_for_each_entry_safe(peer, next, &peertab->buckets[i],
+	spin_lock_bh(&peertab->write_lock);
+	old = rcu_dereference_protected(peertab->buckets,
+			lockdep_is_held(&peertab->write_lock));
+	for (i = 0; i < (1 << old->bits); i++) {
+		hlist_for_each_entry_safe(peer, next, &old->heads[i],
 				peertab_links) {
-			dst_release(peer->dst);
-			kfree(peer);
+			hlist_del_rcu(&peer->peertab_links);
+			hlist_add_head_rcu(&peer->peertab_links,
+					homa_peer_bucket(peertab, new,
+					&peer->addr));
 		}
 	}
-	vfree(peertab->buckets);
-	homa_peertab_gc_dsts(peertab, ~0);
+	rcu_assign_pointer(peertab->buckets, new);
+	spin_unlock_bh(&peertab->write_lock);
+
+	UNIT_HOOK("peertab_resize");
+	synchronize_rcu();
+	vfree(old);
+	INC_METRIC(peer_table_resizes, 1);
+	return 0;
+}
+
+/**
+ * homa_peertab_check_size() - Grow or shrink the bucket array for a peer
+ * table if its load factor has drifted too far from 1/2. Invoked
+ * periodically by homa_timer; may block.
+ * @peertab:    Table to check.
+ */
+void homa_peertab_check_size(struct homa_peertab *peertab)
+{
+	int bits, new_bits;
+
+	rcu_read_lock();
+	bits = rcu_dereference(peertab->buckets)->bits;
+	rcu_read_unlock();
+
+	/* Grow when there are more peers than buckets; shrink when there
+	 * are fewer than 1/8 as many. Either way, the new array has about
+	 * twice as many buckets as peers.
+	 */
+	if ((peertab->num_peers > (1 << bits))
+			&& (bits < HOMA_PEERTAB_MAX_BUCKET_BITS))
+		new_bits = order_base_2(2 * peertab->num_peers);
+	else if ((peertab->num_peers < (1 << (bits - 3)))
+			&& (bits > HOMA_PEERTAB_MIN_BUCKET_BITS))
+		new_bits = order_base_2(2 * peertab->num_peers);
+	else
+		return;
+	new_bits = clamp(new_bits, HOMA_PEERTAB_MIN_BUCKET_BITS,
+			HOMA_PEERTAB_MAX_BUCKET_BITS);
+	homa_peertab_resize(peertab, new_bits);
 }
 
 /**
@@ -101,9 +293,9 @@ void homa_peertab_gc_dsts(struct homa_peertab *peertab, __u64 now)
  * @inet:       Socket that will be used for sending packets.
  *
  * Return:      The peer associated with @addr, or a negative errno if an
- *              error occurred. The caller can retain this pointer
- *              indefinitely: peer entries are never deleted except in
- *              homa_peertab_destroy.
+ *              error occurred. A reference has been taken on the peer;
+ *              the caller must eventually release it by calling
+ *              homa_peer_put.
  */
 struct homa_peer *homa_peer_find(struct homa_peertab *peertab,
 		const struct in6_addr *addr, struct inet_sock *inet)
@@ -113,30 +305,45 @@ struct homa_peer *homa_peer_find(struct homa_peertab *peertab,
 	 */
 	struct homa_peer *peer;
 	struct dst_entry *dst;
-	// Should use siphash or jhash here:
-	__u32 bucket = hash_32(addr->in6_u.u6_addr32[0], HOMA_PEERTAB_BUCKET_BITS);
-	bucket ^= hash_32(addr->in6_u.u6_addr32[1], HOMA_PEERTAB_BUCKET_BITS);
-	bucket ^= hash_32(addr->in6_u.u6_addr32[2], HOMA_PEERTAB_BUCKET_BITS);
-	bucket ^= hash_32(addr->in6_u.u6_addr32[3], HOMA_PEERTAB_BUCKET_BITS);
-	hlist_for_each_entry_rcu(peer, &peertab->buckets[bucket],
-			peertab_links) {
+	struct hlist_head *bucket;
+	int i;
+
+	INC_METRIC(peer_lookups, 1);
+	rcu_read_lock();
+	bucket = homa_peer_bucket(peertab, rcu_dereference(peertab->buckets),
+			addr);
+	hlist_for_each_entry_rcu(peer, bucket, peertab_links) {
 		if (ipv6_addr_equal(&peer->addr, addr)) {
+			/* If this fails, the peer is being considered for
+			 * eviction; fall through to the slow path, which
+			 * will wait for homa_peertab_gc to decide.
+			 */
+			if (!atomic_inc_unless_negative(&peer->refs))
+				break;
+			rcu_read_unlock();
 			return peer;
 		}
 		INC_METRIC(peer_hash_links, 1);
 	}
+	rcu_read_unlock();
 
 	/* No existing entry; create a new one.
 	 *
 	 * Note: after we acquire the lock, we have to check again to
 	 * make sure the entry still doesn't exist (it might have been
-	 * created by a concurrent invocation of this function).
+	 * created by a concurrent invocation of this function). Holding
+	 * the lock also excludes homa_peertab_gc, so any peer found here
+	 * can't be evicted.
 	 */
 	spin_lock_bh(&peertab->write_lock);
-	hlist_for_each_entry_rcu(peer, &peertab->buckets[bucket],
-			peertab_links) {
-		if (ipv6_addr_equal(&peer->addr, addr))
+	bucket = homa_peer_bucket(peertab, rcu_dereference_protected(
+			peertab->buckets, lockdep_is_held(&peertab->write_lock)),
+			addr);
+	hlist_for_each_entry_rcu(peer, bucket, peertab_links) {
+		if (ipv6_addr_equal(&peer->addr, addr)) {
+			atomic_inc(&peer->refs);
 			goto done;
+		}
 	}
 	peer = kmalloc(sizeof(*peer), GFP_ATOMIC);
 	if (!peer) {
@@ -159,15 +366,21 @@ struct homa_peer *homa_peer_find(struct homa_peertab *peertab,
 	peer->last_update_jiffies = 0;
 	INIT_LIST_HEAD(&peer->grantable_rpcs);
 	INIT_LIST_HEAD(&peer->grantable_links);
-	hlist_add_head_rcu(&peer->peertab_links, &peertab->buckets[bucket]);
 	peer->outstanding_resends = 0;
 	peer->most_recent_resend = 0;
 	peer->least_recent_rpc = NULL;
 	peer->least_recent_ticks = 0;
 	peer->current_ticks = -1;
 	peer->resend_rpc = NULL;
-	peer->num_acks = 0;
-	spin_lock_init(&peer->ack_lock);
+	atomic_set(&peer->ack_head, 0);
+	atomic_set(&peer->ack_tail, 0);
+	for (i = 0; i < HOMA_PEER_ACK_SLOTS; i++)
+		atomic_set(&peer->ack_slots[i].seq, i);
+	atomic_set(&peer->refs, 1);
+	peer->access_jiffies = jiffies;
+	hlist_add_head_rcu(&peer->peertab_links, bucket);
+	list_add_tail(&peer->lru_links, &peertab->lru);
+	peertab->num_peers++;
 	INC_METRIC(peer_new_entries, 1);
 
     done:
@@ -312,20 +525,73 @@ void homa_peer_set_cutoffs(struct homa_peer *peer, int c0, int c1, int c2,
 }
 
 /**
- * homa_peer_lock_slow() - This function implements the slow path for
- * acquiring a peer's @unacked_lock. It is invoked when the lock isn't
- * immediately available. It waits for the lock, but also records statistics
- * about the waiting time.
- * @peer:    Peer to  lock.
+ * homa_peer_push_ack() - Append an ack to a peer's ring of pending acks.
+ * This function is lock-free: it may be invoked concurrently with other
+ * calls to this function and to homa_peer_get_acks.
+ * @peer:    Peer that will eventually receive the ack.
+ * @ack:     Information to store.
+ *
+ * Return:   0 for success, or -ENOSPC if the ring is full.
  */
-void homa_peer_lock_slow(struct homa_peer *peer)
+int homa_peer_push_ack(struct homa_peer *peer, struct homa_ack *ack)
 {
-	__u64 start = get_cycles();
-	tt_record("beginning wait for peer lock");
-	spin_lock_bh(&peer->ack_lock);
-	tt_record("ending wait for peer lock");
-	INC_METRIC(peer_ack_lock_misses, 1);
-	INC_METRIC(peer_ack_lock_miss_cycles, get_cycles() - start);
+	struct homa_peer_ack_slot *slot;
+	int pos = atomic_read(&peer->ack_head);
+	int diff;
+
+	while (1) {
+		slot = &peer->ack_slots[pos & (HOMA_PEER_ACK_SLOTS - 1)];
+		diff = atomic_read_acquire(&slot->seq) - pos;
+		if (diff == 0) {
+			/* Slot is empty; try to claim it. */
+			if (atomic_try_cmpxchg(&peer->ack_head, &pos, pos + 1))
+				break;
+			INC_METRIC(peer_ack_retries, 1);
+		} else if (diff < 0) {
+			/* Slot still holds an ack from the previous lap. */
+			return -ENOSPC;
+		} else {
+			/* Another thread claimed the slot before us. */
+			pos = atomic_read(&peer->ack_head);
+		}
+	}
+	slot->ack = *ack;
+	atomic_set_release(&slot->seq, pos + 1);
+	return 0;
+}
+
+/**
+ * homa_peer_pop_ack() - Remove the oldest ack from a peer's ring of
+ * pending acks. Lock-free, like homa_peer_push_ack.
+ * @peer:    Peer whose ring should be checked.
+ * @dst:     The ack is copied here.
+ *
+ * Return:   Nonzero if an ack was returned, zero if the ring was empty.
+ */
+static int homa_peer_pop_ack(struct homa_peer *peer, struct homa_ack *dst)
+{
+	struct homa_peer_ack_slot *slot;
+	int pos = atomic_read(&peer->ack_tail);
+	int diff;
+
+	while (1) {
+		slot = &peer->ack_slots[pos & (HOMA_PEER_ACK_SLOTS - 1)];
+		diff = atomic_read_acquire(&slot->seq) - (pos + 1);
+		if (diff == 0) {
+			if (atomic_try_cmpxchg(&peer->ack_tail, &pos, pos + 1))
+				break;
+			INC_METRIC(peer_ack_retries, 1);
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = atomic_read(&peer->ack_tail);
+		}
+	}
+	*dst = slot->ack;
+
+	/* Make the slot available to homa_peer_push_ack on its next lap. */
+	atomic_set_release(&slot->seq, pos + HOMA_PEER_ACK_SLOTS);
+	return 1;
 }
 
 /**
@@ -338,31 +604,28 @@ void homa_peer_add_ack(struct homa_rpc *rpc)
 {
 	struct homa_peer *peer = rpc->peer;
 	struct ack_header ack;
+	struct homa_ack new_ack = {
+		.client_id = cpu_to_be64(rpc->id),
+		.client_port = htons(rpc->hsk->port),
+		.server_port = htons(rpc->dport)};
 
-	homa_peer_lock(peer);
-	if (peer->num_acks < NUM_PEER_UNACKED_IDS) {
-		peer->acks[peer->num_acks].client_id = cpu_to_be64(rpc->id);
-		peer->acks[peer->num_acks].client_port = htons(rpc->hsk->port);
-		peer->acks[peer->num_acks].server_port = htons(rpc->dport);
-		peer->num_acks++;
-		homa_peer_unlock(peer);
+	if (homa_peer_push_ack(peer, &new_ack) == 0)
 		return;
-	}
 
-	/* The peer has filled up; send an ACK message to empty it. The
-	 * RPC in the message header will also be considered ACKed.
+	/* The peer has filled up; send an ACK message to drain a batch
+	 * of acks from it. The RPC in the message header will also be
+	 * considered ACKed.
 	 */
 	INC_METRIC(ack_overflows, 1);
-	memcpy(ack.acks, peer->acks, sizeof(peer->acks));
-	ack.num_acks = htons(peer->num_acks);
-	peer->num_acks = 0;
-	homa_peer_unlock(peer);
+	ack.num_acks = htons(homa_peer_get_acks(peer, NUM_PEER_UNACKED_IDS,
+			ack.acks));
 	homa_xmit_control(ACK, &ack, sizeof(ack), rpc);
 }
 
 /**
  * homa_peer_get_acks() - Copy acks out of a peer, and remove them from the
- * peer.
+ * peer. The oldest acks are returned first. Lock-free, like
+ * homa_peer_push_ack.
  * @peer:    Peer to check for possible unacked RPCs.
  * @count:   Maximum number of acks to return.
  * @dst:     The acks are copied to this location.
@@ -371,18 +634,11 @@ void homa_peer_add_ack(struct homa_rpc *rpc)
  */
 int homa_peer_get_acks(struct homa_peer *peer, int count, struct homa_ack *dst)
 {
-	/* Don't waste time acquiring the lock if there are no ids available. */
-	if (peer->num_acks == 0)
-		return 0;
-
-	homa_peer_lock(peer);
-
-	if (count > peer->num_acks)
-		count = peer->num_acks;
-	memcpy(dst, &peer->acks[peer->num_acks - count],
-			count * sizeof(peer->acks[0]));
-	peer->num_acks -= count;
+	int i;
 
-	homa_peer_unlock(peer);
-	return count;
+	for (i = 0; i < count; i++) {
+		if (!homa_peer_pop_ack(peer, &dst[i]))
+			break;
+	}
+	return i;
 }
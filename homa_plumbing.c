@@ -47,6 +47,11 @@ static bool exiting = false;
 /* Thread that runs timer code to detect lost packets and crashed peers. */
 static struct task_struct *timer_kthread;
 
+/* Log base 2 of the number of entries in the table homa_softirq uses to
+ * find the most recent packet of each RPC when grouping DATA packets.
+ */
+#define SOFTIRQ_GROUP_BITS 4
+
 /* Set via sysctl to request that information on a particular topic
  * be printed to the system log. The value written determines the
  * topic.
@@ -270,6 +275,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "gro_affine_max_backlog",
+		.data		= &homa_data.gro_affine_max_backlog,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "gro_busy_us",
 		.data		= &homa_data.gro_busy_usecs,
@@ -326,6 +338,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "max_gro_usecs",
+		.data		= &homa_data.max_gro_usecs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= homa_dointvec
+	},
 	{
 		.procname	= "max_gso_size",
 		.data		= &homa_data.max_gso_size,
@@ -347,6 +366,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "max_pollers",
+		.data		= &homa_data.max_pollers,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "max_sched_prio",
 		.data		= &homa_data.max_sched_prio,
@@ -354,6 +380,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0444,
 		.proc_handler	= proc_dointvec
 	},
+	{
+		.procname	= "num_peers",
+		.data		= &homa_data.peers.num_peers,
+		.maxlen		= sizeof(int),
+		.mode		= 0444,
+		.proc_handler	= proc_dointvec
+	},
 	{
 		.procname	= "num_priorities",
 		.data		= &homa_data.num_priorities,
@@ -361,6 +394,34 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "peer_gc_threshold",
+		.data		= &homa_data.peer_gc_threshold,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "peer_idle_secs",
+		.data		= &homa_data.peer_idle_secs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "poll_percentile",
+		.data		= &homa_data.poll_percentile,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec
+	},
+	{
+		.procname	= "poll_cores",
+		.data		= &homa_data.poll_cores_ptr,
+		.maxlen		= NR_CPUS,
+		.mode		= 0644,
+		.proc_handler	= homa_dobitmap
+	},
 	{
 		.procname	= "poll_usecs",
 		.data		= &homa_data.poll_usecs,
@@ -410,6 +471,13 @@ static struct ctl_table homa_ctl_table[] = {
 		.mode		= 0644,
 		.proc_handler	= homa_dointvec
 	},
+	{
+		.procname	= "softirq_excluded_cores",
+		.data		= &homa_data.softirq_excluded_ptr,
+		.maxlen		= NR_CPUS,
+		.mode		= 0644,
+		.proc_handler	= proc_do_large_bitmap
+	},
 	{
 		.procname	= "sync_freeze",
 		.data		= &homa_data.sync_freeze,
@@ -781,7 +849,9 @@ int homa_socket(struct sock *sk)
  * @optname: Identifies a particular setsockopt operation.
  * @optval:  Address in user space of information about the option.
  * @optlen:  Number of bytes of data at @optval.
- * Return:   0 on success, otherwise a negative errno.
+ * Return:   0 on success, otherwise a negative errno. When a buffer region
+ *           is added with HOMA_BUF_ADD, the result on success is the index
+ *           of the new region.
  */
 int homa_setsockopt(struct sock *sk, int level, int optname, sockptr_t optval,
 		unsigned int optlen)
@@ -789,14 +859,35 @@ int homa_setsockopt(struct sock *sk, int level, int optname, sockptr_t optval,
 	struct homa_sock *hsk = homa_sk(sk);
 	struct homa_set_buf_args args;
 	__u64 start = get_cycles();
+	struct mm_struct *mm = NULL;
+	struct page **pages = NULL;
+	int num_pages = 0;
 	int ret;
 
+	/* Applications compiled before @flags was added pass a shorter
+	 * structure.
+	 */
 	if ((level != IPPROTO_HOMA) || (optname != SO_HOMA_SET_BUF)
-			|| (optlen != sizeof(struct homa_set_buf_args)))
+			|| ((optlen != sizeof(struct homa_set_buf_args))
+			&& (optlen != offsetof(struct homa_set_buf_args,
+			flags))))
 		return -EINVAL;
 
+	args.flags = 0;
 	if (copy_from_sockptr(&args, optval, optlen))
 		return -EFAULT;
+	if (args.flags & ~HOMA_BUF_VALID_FLAGS)
+		return -EINVAL;
+
+	if (args.flags & HOMA_BUF_RETIRE) {
+		if (args.flags != HOMA_BUF_RETIRE)
+			return -EINVAL;
+		homa_sock_lock(hsk, "homa_setsockopt HOMA_BUF_RETIRE");
+		ret = homa_pool_retire_region(&hsk->buffer_pool, args.start,
+				&pages, &num_pages, &mm);
+		homa_sock_unlock(hsk);
+		goto done;
+	}
 
 	/* Do a trivial test to make sure we can at least write the first
 	 * page of the region.
@@ -804,10 +895,41 @@ int homa_setsockopt(struct sock *sk, int level, int optname, sockptr_t optval,
 	if (copy_to_user(args.start, &args, sizeof(args)))
 		return -EFAULT;
 
+	if (args.length > HOMA_MAX_REGION_SIZE)
+		return -EINVAL;
+
+	/* Pinning may sleep, so it must happen before locking the socket. */
+	if (args.flags & (HOMA_BUF_PIN|HOMA_BUF_HUGE)) {
+		pages = homa_pool_pin(args.start, args.length, args.flags,
+				&num_pages, &mm);
+		if (IS_ERR(pages))
+			return PTR_ERR(pages);
+	}
+
+	/* On success, ret holds the index of the new region (0 for the
+	 * initial region).
+	 */
 	homa_sock_lock(hsk, "homa_setsockopt SO_HOMA_SET_BUF");
-	ret = homa_pool_init(&hsk->buffer_pool, hsk->homa, args.start,
-			args.length);
+	if ((hsk->buffer_pool.num_regions == 0)
+			== ((args.flags & HOMA_BUF_ADD) != 0))
+		ret = -EINVAL;
+	else if (args.flags & HOMA_BUF_ADD)
+		ret = homa_pool_add_region(&hsk->buffer_pool, args.start,
+				args.length);
+	else
+		ret = homa_pool_init(&hsk->buffer_pool, hsk->homa, args.start,
+				args.length);
+	if ((ret >= 0) && pages) {
+		hsk->buffer_pool.regions[ret].pages = pages;
+		hsk->buffer_pool.regions[ret].num_pages = num_pages;
+		hsk->buffer_pool.regions[ret].mm = mm;
+		pages = NULL;
+	}
 	homa_sock_unlock(hsk);
+
+	done:
+	if (pages)
+		homa_pool_unpin(pages, num_pages, mm);
 	INC_METRIC(so_set_buf_calls, 1);
 	INC_METRIC(so_set_buf_cycles, get_cycles() - start);
 	return ret;
@@ -991,7 +1113,8 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len,
 		goto done;
 	}
 	control.completion_cookie = 0;
-	if (control._pad[0] || control._pad[1]) {
+	control.available = 0;
+	if (control._pad[0]) {
 		result = -EINVAL;
 		goto done;
 	}
@@ -1003,6 +1126,8 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len,
 		result = -EINVAL;
 		goto done;
 	}
+	homa_pool_place_buffers(hsk, control.num_bpages,
+			control.bpage_offsets);
 	homa_pool_release_buffers(&hsk->buffer_pool, control.num_bpages,
 			control.bpage_offsets);
 	control.num_bpages = 0;
@@ -1046,6 +1171,7 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len,
 		control.num_bpages = rpc->msgin.num_bpages;
 		memcpy(control.bpage_offsets, rpc->msgin.bpage_offsets,
 				sizeof(control.bpage_offsets));
+		control.available = rpc->msgin.copied;
 	}
 	if (sk->sk_family == AF_INET6) {
 		struct sockaddr_in6 *in6 = msg->msg_name;
@@ -1061,6 +1187,21 @@ int homa_recvmsg(struct sock *sk, struct msghdr *msg, size_t len,
 				rpc->peer->addr);
 		*addr_len = sizeof(*in4);
 	}
+
+	if ((result >= 0) && (rpc->msgin.copied
+			< rpc->msgin.total_length)) {
+		/* HOMA_RECVMSG_PARTIAL: the application may read the first
+		 * control.available bytes, but the buffers still belong to
+		 * the RPC until the message is complete (so num_bpages is
+		 * returned as 0 to keep the application from recycling them).
+		 */
+		control.num_bpages = 0;
+		rpc->msgin.delivered = rpc->msgin.copied;
+		INC_METRIC(partial_recvs, 1);
+		homa_rpc_unlock(rpc);
+		goto done;
+	}
+
 	/* This indicates that the application now owns the buffers, so
 	 * we won't free them in homa_rpc_free.
 	 */
@@ -1191,6 +1332,30 @@ int homa_v4_early_demux_handler(struct sk_buff *skb) {
 	return 0;
 }
 
+/**
+ * homa_same_rpc_pkt() - Determine whether two incoming packets belong
+ * to the same RPC.
+ * @skb1:   First packet; its Homa header must be available at skb->data.
+ * @skb2:   Second packet; its Homa header must be available at skb->data.
+ *
+ * Return:  Nonzero if the packets have the same source address, ports,
+ *          and RPC id; zero otherwise.
+ */
+static inline int homa_same_rpc_pkt(struct sk_buff *skb1,
+		struct sk_buff *skb2)
+{
+	struct common_header *h1 = (struct common_header *) skb1->data;
+	struct common_header *h2 = (struct common_header *) skb2->data;
+	struct in6_addr saddr1, saddr2;
+
+	if ((h1->sender_id != h2->sender_id) || (h1->sport != h2->sport)
+			|| (h1->dport != h2->dport))
+		return 0;
+	saddr1 = skb_canonical_ipv6_saddr(skb1);
+	saddr2 = skb_canonical_ipv6_saddr(skb2);
+	return ipv6_addr_equal(&saddr1, &saddr2);
+}
+
 /**
  * homa_softirq() - This function is invoked at SoftIRQ level to handle
  * incoming packets.
@@ -1199,8 +1364,11 @@ int homa_v4_early_demux_handler(struct sk_buff *skb) {
  */
 int homa_softirq(struct sk_buff *skb) {
 	struct common_header *h;
-	struct sk_buff *packets, *short_packets, *next;
-	struct sk_buff **prev_link, **short_link;
+	struct sk_buff *packets, *short_packets, *next, *group_end;
+	struct sk_buff *control_packets, *data_packets;
+	struct sk_buff *group_ends[1 << SOFTIRQ_GROUP_BITS];
+	struct sk_buff **prev_link, **short_link, **control_link, **data_link;
+	struct sk_buff **group_slot;
 	__u16 dport;
 	static __u64 last = 0;
 	__u64 start;
@@ -1208,7 +1376,10 @@ int homa_softirq(struct sk_buff *skb) {
 	int first_packet = 1;
 	struct homa_sock *hsk;
 	int num_packets = 0;
+	int bytes = 0;
 	int pull_length;
+	struct homa_core *core;
+	__u64 cycles;
 	struct homa_lcache lcache;
 
 	/* Accumulates changes to homa->incoming, to avoid repeated
@@ -1258,10 +1429,25 @@ int homa_softirq(struct sk_buff *skb) {
 	*short_link = packets;
 	packets = short_packets;
 
+	/* Next, make a pass over the packets to validate them and separate
+	 * control packets (GRANT, RESEND, BUSY, etc.) from DATA packets.
+	 * Control packets are processed first, since they are small and
+	 * cheap and may unblock our own transmissions (e.g., a GRANT stuck
+	 * behind many full-size DATA packets would delay output by the cost
+	 * of copying all of those packets). DATA packets are grouped by RPC
+	 * (preserving the order in which RPCs first appear) so that the
+	 * lcache holds the RPC's lock across each group.
+	 */
+	control_packets = NULL;
+	control_link = &control_packets;
+	data_packets = NULL;
+	data_link = &data_packets;
+	memset(group_ends, 0, sizeof(group_ends));
 	for (skb = packets; skb != NULL; skb = next) {
 		const struct in6_addr saddr = skb_canonical_ipv6_saddr(skb);
 		next = skb->next;
 		num_packets++;
+		bytes += skb->len;
 
 		/* The code below makes the header available at skb->data, even
 		 * if the packet is fragmented. One complication: it's possible
@@ -1326,6 +1512,48 @@ int homa_softirq(struct sk_buff *skb) {
 			goto discard;
 		}
 
+		if (h->type != DATA) {
+			*control_link = skb;
+			control_link = &skb->next;
+			INC_METRIC(softirq_control_pkts, 1);
+			continue;
+		}
+
+		/* Place this packet just after the last packet already
+		 * queued for the same RPC (if any). group_ends remembers the
+		 * last packet of the most recent RPC in each slot; if two RPCs
+		 * collide in a slot, the older one just won't be grouped any
+		 * further (the grouping is only an optimization).
+		 */
+		group_slot = &group_ends[hash_64(be64_to_cpu(h->sender_id),
+				SOFTIRQ_GROUP_BITS)];
+		group_end = *group_slot;
+		if (group_end && homa_same_rpc_pkt(skb, group_end)) {
+			if (group_end->next)
+				INC_METRIC(softirq_data_regrouped, 1);
+			skb->next = group_end->next;
+			group_end->next = skb;
+			if (data_link == &group_end->next)
+				data_link = &skb->next;
+		} else {
+			skb->next = NULL;
+			*data_link = skb;
+			data_link = &skb->next;
+		}
+		*group_slot = skb;
+		continue;
+
+discard:
+		kfree_skb(skb);
+	}
+	*control_link = data_packets;
+	*data_link = NULL;
+	packets = control_packets;
+
+	/* Finally, dispatch the packets to their sockets and RPCs. */
+	for (skb = packets; skb != NULL; skb = next) {
+		next = skb->next;
+		h = (struct common_header *) skb->data;
 		dport = ntohs(h->dport);
 		hsk = homa_sock_find(&homa->port_map, dport);
 		if (!hsk) {
@@ -1339,21 +1567,39 @@ int homa_softirq(struct sk_buff *skb) {
 			tt_record3("Discarding packet for unknown port %u, "
 					"id %llu, type %d", dport,
 					homa_local_id(h->sender_id), h->type);
-			goto discard;
+			kfree_skb(skb);
+			continue;
 		}
 
+		/* Remember where this socket's packets arrive, so that
+		 * waiting threads can busy-poll that NIC queue.
+		 */
+		sk_mark_napi_id(&hsk->sock, skb);
+#ifdef CONFIG_NET_RX_BUSY_POLL
+		if (homa->num_poll_cores > 0)
+			homa_softirq_napi_id(homa, skb->napi_id);
+#endif
+		if (h->type == GRANT)
+			INC_METRIC(softirq_grant_delay_cycles,
+					get_cycles() - start);
 		homa_pkt_dispatch(skb, hsk, &lcache, &incoming_delta);
-		continue;
-
-discard:
-		kfree_skb(skb);
 	}
 
 	homa_lcache_release(&lcache);
 	atomic_add(incoming_delta, &homa->total_incoming);
 	homa_send_grants(homa);
-	atomic_dec(&homa_cores[raw_smp_processor_id()]->softirq_backlog);
-	INC_METRIC(softirq_cycles, get_cycles() - start);
+	homa_timer_softirq(homa);
+	core = homa_cores[raw_smp_processor_id()];
+	atomic_dec(&core->softirq_backlog);
+	cycles = get_cycles() - start;
+	if (bytes > 0) {
+		/* Update this core's cost estimate for HOMA_GRO_LOAD_FEEDBACK
+		 * (exponentially weighted average).
+		 */
+		core->softirq_kb_cycles = (7*core->softirq_kb_cycles
+				+ (int) ((cycles*1000)/bytes))/8;
+	}
+	INC_METRIC(softirq_cycles, cycles);
 	return 0;
 }
 
@@ -1564,6 +1810,30 @@ int homa_metrics_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/**
+ * homa_dobitmap() - This function is a wrapper around proc_do_large_bitmap.
+ * It is invoked to read and write bitmap-valued sysctl values (such as
+ * lists of cores) and also update other values that depend on them.
+ * @table:    sysctl table describing value to be read or written.
+ * @write:    Nonzero means value is being written, 0 means read.
+ * @buffer:   Address in user space of the input/output data.
+ * @lenp:     Not exactly sure.
+ * @ppos:     Not exactly sure.
+ *
+ * Return: 0 for success, nonzero for error.
+ */
+int homa_dobitmap(struct ctl_table *table, int write,
+		void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	int result;
+	result = proc_do_large_bitmap(table, write, buffer, lenp, ppos);
+	if (write && (table->data == &homa_data.poll_cores_ptr))
+		homa_poll_cores_changed(homa);
+	else if (write && (table->data == &homa_data.softirq_excluded_ptr))
+		homa_gro_candidates_changed(homa);
+	return result;
+}
+
 /**
  * homa_dointvec() - This function is a wrapper around proc_dointvec. It is
  * invoked to read and write sysctl values and also update other values
@@ -15,8 +15,8 @@
 
 #include "homa_impl.h"
 
-/* Pools must always have at least this many active pages. */
-#define MIN_ACTIVE 4
+/* Pools must always have at least this many bpages. */
+#define MIN_POOL_SIZE 4
 
 /* When running unit tests, allow HOMA_BPAGE_SIZE and HOMA_BPAGE_SHIFT
  * to be overriden.
@@ -29,48 +29,244 @@
 #define HOMA_BPAGE_SHIFT mock_bpage_shift
 #endif
 
+/* Number of bits in a bpage index that hold the index of the bpage
+ * within its region (see homa_pool_bpage).
+ */
+#define HOMA_REGION_BPAGES_SHIFT (HOMA_REGION_SHIFT - HOMA_BPAGE_SHIFT)
+
+/**
+ * homa_pool_page_node() - Find out which NUMA node holds the memory for a
+ * page in user space, without faulting it in.
+ * @addr:    User-space address within the page.
+ * Return:   The node number, or NUMA_NO_NODE if the page isn't currently
+ *           present in memory.
+ */
+static int homa_pool_page_node(void *addr)
+{
+#ifdef __UNIT_TEST__
+	return mock_page_node(addr);
+#else
+	struct page *page;
+	int node;
+
+	if (get_user_pages_fast_only((unsigned long) addr, 1, FOLL_WRITE,
+			&page) != 1)
+		return NUMA_NO_NODE;
+	node = page_to_nid(page);
+	put_page(page);
+	return node;
+#endif
+}
+
+/**
+ * homa_pool_huge_page() - Indicate whether a page is part of a huge page
+ * (2 MB or larger).
+ * @page:    Page to check.
+ * Return:   Nonzero if @page is part of a huge page, zero otherwise.
+ */
+static inline int homa_pool_huge_page(struct page *page)
+{
+#ifdef __UNIT_TEST__
+	return mock_page_huge(page);
+#else
+	return PageCompound(page) && (page_size(compound_head(page))
+			>= PMD_SIZE);
+#endif
+}
+
+/**
+ * homa_pool_charge() - Charge pages that are about to be pinned long-term
+ * against the pinned_vm of a process, the way RDMA and io_uring do, so
+ * that HOMA_BUF_PIN can't be used to lock down more memory than
+ * RLIMIT_MEMLOCK allows.
+ * @mm:         Address space of the process; a reference is taken on it,
+ *              which homa_pool_uncharge releases.
+ * @num_pages:  Number of pages to charge.
+ * Return:      0 for success, or -ENOMEM if the charge would exceed
+ *              RLIMIT_MEMLOCK and the caller lacks CAP_IPC_LOCK.
+ */
+static int homa_pool_charge(struct mm_struct *mm, int num_pages)
+{
+	unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+
+	if ((atomic64_add_return(num_pages, &mm->pinned_vm) > limit)
+			&& !capable(CAP_IPC_LOCK)) {
+		atomic64_sub(num_pages, &mm->pinned_vm);
+		return -ENOMEM;
+	}
+	mmgrab(mm);
+	return 0;
+}
+
+/**
+ * homa_pool_uncharge() - Reverse the effect of homa_pool_charge.
+ * @mm:         Address space passed to homa_pool_charge.
+ * @num_pages:  Number of pages that were charged.
+ */
+static void homa_pool_uncharge(struct mm_struct *mm, int num_pages)
+{
+	atomic64_sub(num_pages, &mm->pinned_vm);
+	mmdrop(mm);
+}
+
+/**
+ * homa_pool_pin() - Pin all of the pages of a buffer region in memory, so
+ * that incoming data can be copied through kernel mappings of the pages
+ * instead of the application's addresses (no page faults during copies).
+ * The pages are charged against the current process's RLIMIT_MEMLOCK.
+ * This function may sleep, so it must not be invoked with locks held.
+ * @region:       First byte of the region; must be page-aligned.
+ * @region_size:  Total number of bytes in the region.
+ * @flags:        HOMA_BUF_* flags from SO_HOMA_SET_BUF. If HOMA_BUF_HUGE
+ *                is set, every page of the region must be part of a huge
+ *                page (e.g., the region was mmapped with MAP_HUGETLB).
+ * @num_pages:    Filled in with the number of entries in the result.
+ * @mm:           Filled in with the address space that was charged for
+ *                the pages.
+ * Return:        A vmalloced array of the pinned pages, which must
+ *                eventually be passed to homa_pool_unpin (along with
+ *                @num_pages and @mm), or an ERR_PTR for failure.
+ */
+struct page **homa_pool_pin(void *region, __u64 region_size, int flags,
+		int *num_pages, struct mm_struct **mm)
+{
+	int n = region_size >> PAGE_SHIFT;
+	struct page **pages;
+	int pinned, result, i;
+
+	if (((__u64) region) & ~PAGE_MASK)
+		return ERR_PTR(-EINVAL);
+	pages = (struct page **) vmalloc(n * sizeof(struct page *));
+	if (!pages)
+		return ERR_PTR(-ENOMEM);
+
+	/* Charge before pinning, so that an over-limit request never
+	 * pins anything.
+	 */
+	result = homa_pool_charge(current->mm, n);
+	if (result != 0) {
+		vfree(pages);
+		return ERR_PTR(result);
+	}
+	for (pinned = 0; pinned < n; pinned += result) {
+		result = pin_user_pages_fast((unsigned long) region
+				+ ((unsigned long) pinned << PAGE_SHIFT),
+				n - pinned, FOLL_WRITE|FOLL_LONGTERM,
+				pages + pinned);
+		if (result <= 0) {
+			if (result == 0)
+				result = -EFAULT;
+			goto error;
+		}
+	}
+	if (flags & HOMA_BUF_HUGE) {
+		for (i = 0; i < n; i++) {
+			if (!homa_pool_huge_page(pages[i])) {
+				result = -EINVAL;
+				goto error;
+			}
+		}
+	}
+	INC_METRIC(buf_pinned_pages, n);
+	*num_pages = n;
+	*mm = current->mm;
+	return pages;
+
+	error:
+	unpin_user_pages(pages, pinned);
+	vfree(pages);
+	homa_pool_uncharge(current->mm, n);
+	return ERR_PTR(result);
+}
+
+/**
+ * homa_pool_unpin() - Release pages pinned by homa_pool_pin and return
+ * their charge to the process that pinned them.
+ * @pages:      Array returned by homa_pool_pin; will be freed.
+ * @num_pages:  Number of pinned pages in @pages.
+ * @mm:         Address space returned by homa_pool_pin.
+ */
+void homa_pool_unpin(struct page **pages, int num_pages,
+		struct mm_struct *mm)
+{
+	unpin_user_pages(pages, num_pages);
+	vfree(pages);
+	homa_pool_uncharge(mm, num_pages);
+}
+
+/**
+ * homa_pool_bpage() - Find the descriptor for a bpage.
+ * @pool:     Pool containing the bpage.
+ * @index:    Index of the bpage within the pool: the index of its region
+ *            in the high-order bits (above HOMA_REGION_BPAGES_SHIFT) and
+ *            the index of the bpage within its region in the low-order bits.
+ *            This is the bpage's offset (as returned to the application)
+ *            shifted right by HOMA_BPAGE_SHIFT.
+ * Return:    The descriptor for the bpage.
+ */
+static inline struct homa_bpage *homa_pool_bpage(struct homa_pool *pool,
+		int index)
+{
+	return &pool->regions[index >> HOMA_REGION_BPAGES_SHIFT].descriptors[
+			index & ((1 << HOMA_REGION_BPAGES_SHIFT) - 1)];
+}
+
+/**
+ * homa_pool_slot_map() - Find the slot bitmap for a bpage.
+ * @pool:     Pool containing the bpage.
+ * @index:    Index of the bpage (see homa_pool_bpage).
+ * Return:    The first of the HOMA_SLOT_MAP_LONGS words of the bitmap.
+ */
+static inline unsigned long *homa_pool_slot_map(struct homa_pool *pool,
+		int index)
+{
+	return &pool->regions[index >> HOMA_REGION_BPAGES_SHIFT].slot_maps[
+			(index & ((1 << HOMA_REGION_BPAGES_SHIFT) - 1))
+			* HOMA_SLOT_MAP_LONGS];
+}
+
+/**
+ * homa_pool_node_of() - Return the partition of a pool containing a
+ * given bpage.
+ * @pool:     Pool containing the bpage.
+ * @index:    Index of the bpage (see homa_pool_bpage).
+ * Return:    The entry in @pool->nodes for the bpage.
+ */
+static inline struct homa_pool_node *homa_pool_node_of(struct homa_pool *pool,
+		int index)
+{
+	int node = homa_pool_bpage(pool, index)->node;
+
+	return &pool->nodes[((node >= 0) && (node < pool->num_nodes))
+			? node : pool->num_nodes];
+}
+
 /**
  * homa_pool_init() - Initialize a homa_pool; any previous contents of the
  * objects are overwritten.
  * @pool:         Pool to initialize.
  * @homa          Overall information about Homa.
  * @region        First byte of the memory region for the pool, allocated
- *                by the application; must be page-aligned.
+ *                by the application; must be page-aligned. This becomes
+ *                region 0 of the pool; more regions may be added later
+ *                with homa_pool_add_region.
  * @region_size   Total number of bytes available at @buf_region.
  * Return: Either zero (for success) or a negative errno for failure.
  */
 int homa_pool_init(struct homa_pool *pool, struct homa *homa,
 		void *region, __u64 region_size)
 {
-	int i, result;
+	int i, j, node, result;
 
-	if (((__u64) region) & ~PAGE_MASK)
+	memset(pool, 0, sizeof(*pool));
+	if ((region_size >> HOMA_BPAGE_SHIFT) < MIN_POOL_SIZE)
 		return -EINVAL;
-	pool->cores = NULL;
-	pool->region = (char *) region;
-	pool->num_bpages = region_size >> HOMA_BPAGE_SHIFT;
-	if (pool->num_bpages < MIN_ACTIVE) {
-		result = -EINVAL;
-		goto error;
-	}
 	pool->homa = homa;
-	pool->descriptors = (struct homa_bpage *) kmalloc(
-			pool->num_bpages * sizeof(struct homa_bpage),
-			GFP_ATOMIC);
-	if (!pool->descriptors) {
-		result = -ENOMEM;
-		goto error;
-	}
-	for (i = 0; i < pool->num_bpages; i++) {
-		struct homa_bpage *bp = &pool->descriptors[i];
-		spin_lock_init(&bp->lock);
-		atomic_set(&bp->refs, 0);
-		bp->owner = -1;
-		bp->expiration = 0;
+	pool->num_nodes = 1;
+	for (i = 0; i < nr_cpu_ids; i++) {
+		if (cpu_to_node(i) >= pool->num_nodes)
+			pool->num_nodes = cpu_to_node(i) + 1;
 	}
-	atomic_set(&pool->active_pages, MIN_ACTIVE);
-	atomic_set(&pool->next_scan, 0);
-	atomic_set(&pool->free_bpages_found, 0);
 
 	/* Allocate and initialize core-specific data. */
 	pool->cores = (struct homa_pool_core *) kmalloc(nr_cpu_ids *
@@ -81,21 +277,242 @@ int homa_pool_init(struct homa_pool *pool, struct homa *homa,
 	}
 	pool->num_cores = nr_cpu_ids;
 	for (i = 0; i < pool->num_cores; i++) {
-		pool->cores[i].page_hint = 0;
-		pool->cores[i].allocated = 0;
+		for (j = 0; j < HOMA_NUM_SIZE_CLASSES; j++)
+			pool->cores[i].class_pages[j] = -1;
 	}
+	for (j = 0; j < HOMA_NUM_SIZE_CLASSES; j++)
+		atomic_set(&pool->class_hints[j], -1);
+	atomic64_set(&pool->next_reclaim, -1);
 
+	/* Create the NUMA partitions. The free maps have room for every
+	 * bpage in every region the pool could ever have, so that regions
+	 * can be added without reallocating them.
+	 */
+	pool->nodes = (struct homa_pool_node *) kmalloc((pool->num_nodes + 1)
+			* sizeof(struct homa_pool_node), GFP_ATOMIC);
+	if (!pool->nodes) {
+		result = -ENOMEM;
+		goto error;
+	}
+	pool->map_words = BITS_TO_LONGS(HOMA_MAX_REGIONS
+			<< HOMA_REGION_BPAGES_SHIFT);
+	pool->summary_words = BITS_TO_LONGS(pool->map_words);
+	pool->free_maps = (unsigned long *) kmalloc((pool->num_nodes + 1)
+			* (pool->map_words + pool->summary_words)
+			* sizeof(unsigned long), GFP_ATOMIC);
+	if (!pool->free_maps) {
+		result = -ENOMEM;
+		goto error;
+	}
+	for (node = 0; node <= pool->num_nodes; node++) {
+		struct homa_pool_node *pn = &pool->nodes[node];
+
+		pn->free_map = &pool->free_maps[node * (pool->map_words
+				+ pool->summary_words)];
+		pn->free_summary = pn->free_map + pool->map_words;
+		bitmap_zero(pn->free_map, pool->map_words * BITS_PER_LONG);
+		bitmap_zero(pn->free_summary, pool->summary_words
+				* BITS_PER_LONG);
+		pn->num_bpages = 0;
+	}
+
+	result = homa_pool_add_region(pool, region, region_size);
+	if (result < 0)
+		goto error;
 	return 0;
 
 	error:
-	if (pool->descriptors)
-		kfree(pool->descriptors);
 	if (pool->cores)
 		kfree(pool->cores);
-	pool->region = NULL;
+	if (pool->nodes)
+		kfree(pool->nodes);
+	if (pool->free_maps)
+		kfree(pool->free_maps);
+	memset(pool, 0, sizeof(*pool));
 	return result;
 }
 
+/**
+ * homa_pool_add_region() - Add a region of memory to an existing pool.
+ * @pool:         Pool to which the region should be added; must have
+ *                been initialized with homa_pool_init.
+ * @region        First byte of the memory region, allocated by the
+ *                application; must be page-aligned.
+ * @region_size   Total number of bytes available at @region. Must not be
+ *                larger than HOMA_MAX_REGION_SIZE (offsets of buffers
+ *                can't address more than that within a region).
+ * Return: The index of the new region within @pool (offsets of buffers
+ * in the region will contain this index above HOMA_REGION_SHIFT), or a
+ * negative errno for failure.
+ */
+int homa_pool_add_region(struct homa_pool *pool, void *region,
+		__u64 region_size)
+{
+	struct homa_pool_region *pr = NULL;
+	int num_bpages, r, i;
+
+	if (((__u64) region) & ~PAGE_MASK)
+		return -EINVAL;
+	if (region_size > HOMA_MAX_REGION_SIZE)
+		return -EINVAL;
+	num_bpages = region_size >> HOMA_BPAGE_SHIFT;
+	if (num_bpages == 0)
+		return -EINVAL;
+
+	/* Find an unused entry, preferring one whose descriptors (left
+	 * behind by a retired region) can be reused.
+	 */
+	for (r = 0; r < HOMA_MAX_REGIONS; r++) {
+		pr = &pool->regions[r];
+		if (pr->start == region)
+			return -EINVAL;
+	}
+	for (r = 0; r < HOMA_MAX_REGIONS; r++) {
+		pr = &pool->regions[r];
+		if (!pr->start && (pr->capacity >= num_bpages))
+			break;
+	}
+	if (r >= HOMA_MAX_REGIONS) {
+		for (r = 0; r < HOMA_MAX_REGIONS; r++) {
+			pr = &pool->regions[r];
+			if (pr->capacity == 0)
+				break;
+		}
+		if (r >= HOMA_MAX_REGIONS)
+			return -ENOSPC;
+		pr->descriptors = (struct homa_bpage *) kmalloc(num_bpages
+				* sizeof(struct homa_bpage), GFP_ATOMIC);
+		if (!pr->descriptors)
+			return -ENOMEM;
+		pr->slot_maps = (unsigned long *) kmalloc(num_bpages
+				* HOMA_SLOT_MAP_LONGS * sizeof(unsigned long),
+				GFP_ATOMIC);
+		if (!pr->slot_maps) {
+			kfree(pr->descriptors);
+			pr->descriptors = NULL;
+			return -ENOMEM;
+		}
+		pr->capacity = num_bpages;
+		for (i = 0; i < num_bpages; i++)
+			spin_lock_init(&pr->descriptors[i].lock);
+	}
+
+	/* Stale indexes (in core->class_pages or pool->class_hints) may
+	 * still refer to reused descriptors, so they must be reset under
+	 * their locks.
+	 */
+	for (i = 0; i < num_bpages; i++) {
+		struct homa_bpage *bp = &pr->descriptors[i];
+
+		spin_lock_bh(&bp->lock);
+		atomic_set(&bp->refs, 0);
+		bp->owner = -1;
+		bp->expiration = 0;
+		bp->size_class = -1;
+		bp->node = homa_pool_page_node((char *) region
+				+ ((__u64) i << HOMA_BPAGE_SHIFT));
+		spin_unlock_bh(&bp->lock);
+	}
+	pr->num_bpages = num_bpages;
+	atomic_set(&pr->active_bpages, 0);
+	pr->retiring = 0;
+	pr->pages = NULL;
+	pr->num_pages = 0;
+	pr->start = (char *) region;
+	if (r >= pool->num_regions)
+		pool->num_regions = r + 1;
+	pool->num_bpages += num_bpages;
+	for (i = 0; i < num_bpages; i++) {
+		int index = (r << HOMA_REGION_BPAGES_SHIFT) + i;
+
+		homa_pool_node_of(pool, index)->num_bpages++;
+		homa_pool_mark_free(pool, index);
+	}
+	INC_METRIC(buf_regions_added, 1);
+	return r;
+}
+
+/**
+ * homa_pool_retire_region() - Remove a region from a pool. This succeeds
+ * only if no part of the region is in use (no incoming message has data
+ * there); otherwise no new space will be allocated in the region, and the
+ * caller can retry once the application has returned the region's
+ * buffers.
+ * @pool:       Pool containing the region.
+ * @region:     First byte of the region (as passed to homa_pool_init or
+ *              homa_pool_add_region).
+ * @pages:      If the region was pinned, filled in with its pinned pages
+ *              (the caller must pass them to homa_pool_unpin once it no
+ *              longer holds locks); otherwise filled in with NULL.
+ * @num_pages:  Filled in with the number of entries in @pages.
+ * @mm:         Filled in with the address space charged for @pages.
+ * Return: 0 for success, -EBUSY if the region is still in use, or
+ * -EINVAL if @region isn't a region of @pool.
+ */
+int homa_pool_retire_region(struct homa_pool *pool, void *region,
+		struct page ***pages, int *num_pages, struct mm_struct **mm)
+{
+	struct homa_pool_region *pr;
+	int r, i, busy;
+
+	*pages = NULL;
+	*num_pages = 0;
+	*mm = NULL;
+	if (!region)
+		return -EINVAL;
+	for (r = 0; r < pool->num_regions; r++) {
+		if (pool->regions[r].start == region)
+			break;
+	}
+	if (r >= pool->num_regions)
+		return -EINVAL;
+	pr = &pool->regions[r];
+
+	/* Once @retiring has been set, any allocation in the region that
+	 * acquires a bpage lock after we have released it will see the
+	 * flag and fail; any allocation that acquired the lock earlier
+	 * will have incremented the bpage's @refs. The flag stays set if
+	 * we return -EBUSY, so that the region drains even under load:
+	 * the region remains registered (and occupies one of the pool's
+	 * HOMA_MAX_REGIONS entries) but unused until a retry succeeds.
+	 */
+	pr->retiring = 1;
+	busy = 0;
+	for (i = 0; (i < pr->num_bpages) && !busy; i++) {
+		struct homa_bpage *bp = &pr->descriptors[i];
+
+		spin_lock_bh(&bp->lock);
+		if (atomic_read(&bp->refs) != 0)
+			busy = 1;
+		spin_unlock_bh(&bp->lock);
+	}
+	if (busy) {
+		INC_METRIC(buf_retire_busy, 1);
+		return -EBUSY;
+	}
+
+	for (i = 0; i < pr->num_bpages; i++) {
+		int index = (r << HOMA_REGION_BPAGES_SHIFT) + i;
+		struct homa_pool_node *pn = homa_pool_node_of(pool, index);
+
+		clear_bit(index, pn->free_map);
+		pn->num_bpages--;
+		pr->descriptors[i].owner = -1;
+		pr->descriptors[i].size_class = -1;
+	}
+	pool->num_bpages -= pr->num_bpages;
+	*pages = pr->pages;
+	*num_pages = pr->num_pages;
+	*mm = pr->mm;
+	pr->pages = NULL;
+	pr->num_pages = 0;
+	pr->mm = NULL;
+	pr->num_bpages = 0;
+	pr->start = NULL;
+	INC_METRIC(buf_regions_retired, 1);
+	return 0;
+}
+
 /**
  * homa_pool_destroy() - Destructor for homa_pool. After this method
  * returns, the object should not be used unless it has been reinitialized.
@@ -103,94 +520,275 @@ int homa_pool_init(struct homa_pool *pool, struct homa *homa,
  */
 void homa_pool_destroy(struct homa_pool *pool)
 {
-	if (!pool->region)
+	int r;
+
+	if (pool->num_regions == 0)
 		return;
-	kfree(pool->descriptors);
+	for (r = 0; r < HOMA_MAX_REGIONS; r++) {
+		struct homa_pool_region *pr = &pool->regions[r];
+
+		if (pr->descriptors)
+			kfree(pr->descriptors);
+		if (pr->slot_maps)
+			kfree(pr->slot_maps);
+		if (pr->pages)
+			homa_pool_unpin(pr->pages, pr->num_pages, pr->mm);
+	}
 	kfree(pool->cores);
-	pool->region = NULL;
+	kfree(pool->nodes);
+	kfree(pool->free_maps);
+	memset(pool, 0, sizeof(*pool));
 }
 
 /**
- * homa_pool_get_pages() - Allocate one or more full pages from the pool.
+ * homa_pool_mark_free() - Record that a bpage is (probably) free, so that
+ * homa_pool_get_pages will consider it for allocation.
+ * @pool:     Pool containing the bpage.
+ * @index:    Index of the bpage (see homa_pool_bpage).
+ */
+void homa_pool_mark_free(struct homa_pool *pool, int index)
+{
+	struct homa_pool_node *pn = homa_pool_node_of(pool, index);
+
+	/* Order matters: the summary bit must be set after the map bit,
+	 * so that homa_pool_claim never misses a free bpage.
+	 */
+	set_bit(index, pn->free_map);
+	set_bit(index / BITS_PER_LONG, pn->free_summary);
+}
+
+/**
+ * homa_pool_claim() - Find a bpage that is marked free in a partition and
+ * claim it (clear its bit in the free map).
+ * @pool:     Pool from which to allocate.
+ * @pn:       Partition of @pool from which to allocate.
+ * Return:    Index of the claimed bpage (see homa_pool_bpage), or -1 if
+ *            the partition's free map is empty. The caller must still
+ *            check that the bpage is really free.
+ */
+static int homa_pool_claim(struct homa_pool *pool, struct homa_pool_node *pn)
+{
+	unsigned long summary, word;
+	int i, w, index;
+
+	for (i = 0; i < pool->summary_words; ) {
+		summary = READ_ONCE(pn->free_summary[i]);
+		if (summary == 0) {
+			i++;
+			continue;
+		}
+		w = i*BITS_PER_LONG + __ffs(summary);
+		word = READ_ONCE(pn->free_map[w]);
+		if (word == 0) {
+			/* Stale summary bit. Clear it, but recheck in case
+			 * a bpage was freed concurrently.
+			 */
+			clear_bit(w, pn->free_summary);
+			if (READ_ONCE(pn->free_map[w]))
+				set_bit(w, pn->free_summary);
+			continue;
+		}
+		index = w*BITS_PER_LONG + __ffs(word);
+		if (test_and_clear_bit(index, pn->free_map))
+			return index;
+	}
+	return -1;
+}
+
+/**
+ * homa_pool_defer() - Record that a bpage was left out of its partition's
+ * free map even though it may become allocatable later (e.g. when its
+ * owner's lease expires), so that homa_pool_reclaim will look for it.
+ * @pool:     Pool containing the bpage.
+ * @when:     Time (in get_cycles units) at which the bpage may become
+ *            allocatable.
+ */
+static void homa_pool_defer(struct homa_pool *pool, __u64 when)
+{
+	__u64 old, prev;
+
+	old = atomic64_read(&pool->next_reclaim);
+	while (when < old) {
+		prev = atomic64_cmpxchg(&pool->next_reclaim, old, when);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
+
+/**
+ * homa_pool_reclaim() - Mark free any bpages in a pool that can be
+ * allocated but aren't in their partition's free map (such as pages
+ * whose owner's lease has expired). A single sweep covers every partition.
+ * It's only performed if homa_pool_defer has recorded a bpage that may
+ * have become allocatable since the last sweep, so when the pool is
+ * simply full this function returns without scanning anything.
+ * @pool:     Pool whose bpages should be checked.
+ * Return:    The number of bpages that were marked free.
+ */
+int homa_pool_reclaim(struct homa_pool *pool)
+{
+	__u64 now = get_cycles();
+	int r, i, found = 0;
+
+	if ((__u64) atomic64_read(&pool->next_reclaim) > now)
+		return 0;
+
+	/* Bpages deferred from now on (including by this sweep) will be
+	 * found by a later sweep.
+	 */
+	atomic64_set(&pool->next_reclaim, -1);
+	INC_METRIC(bpage_reclaim_sweeps, 1);
+	for (r = 0; r < pool->num_regions; r++) {
+		struct homa_pool_region *pr = &pool->regions[r];
+
+		if (!pr->start || READ_ONCE(pr->retiring))
+			continue;
+		for (i = 0; i < pr->num_bpages; i++) {
+			struct homa_bpage *bpage = &pr->descriptors[i];
+
+			if (atomic_read(&bpage->refs))
+				continue;
+			if ((bpage->owner >= 0) && (bpage->expiration > now)) {
+				homa_pool_defer(pool, bpage->expiration);
+				continue;
+			}
+			homa_pool_mark_free(pool,
+					(r << HOMA_REGION_BPAGES_SHIFT) + i);
+			found++;
+		}
+	}
+	return found;
+}
+
+/**
+ * homa_pool_alloc_node() - Allocate full pages from one NUMA node's
+ * partition of a pool.
  * @pool:         Pool from which to allocate pages
+ * @pn:           Partition of @pool from which to allocate.
  * @num_pages:    Number of pages needed
- * @pages:        The indices of the allocated pages are stored here; caller
- *                must ensure this array is big enough. Reference counts have
- *                been set to 1 on all of these pages.
+ * @pages:        The indices of the allocated pages are stored here,
+ *                starting at index @alloced.
+ * @alloced:      Number of pages already allocated (in other partitions).
  * @set_owner:    If nonzero, the current core is marked as owner of all
  *                of the allocated pages (and the expiration time is also
  *                set). Otherwises the pages are left unowned.
- * Return: 0 for success, -1 if there wasn't enough free space in the pool.
-*/
-int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
-		int set_owner)
+ * Return: The total number of pages now allocated in @pages (less than
+ * @num_pages if the partition ran out of free pages).
+ */
+static int homa_pool_alloc_node(struct homa_pool *pool,
+		struct homa_pool_node *pn, int num_pages, __u32 *pages,
+		int alloced, int set_owner)
 {
-	int alloced = 0;
 	__u64 now = get_cycles();
 
-	int active = atomic_read(&pool->active_pages);
-	int i;
-
-	while (1) {
-		int cur = atomic_fetch_inc(&pool->next_scan);
+	if (pn->num_bpages == 0)
+		return alloced;
+	while (alloced < num_pages) {
+		struct homa_pool_region *pr;
 		struct homa_bpage *bpage;
+		int index = homa_pool_claim(pool, pn);
 
-		if (cur >= active) {
-			int free = atomic_read(&pool->free_bpages_found);
-			if ((free == 0) && (active == pool->num_bpages)) {
-				break;
-			}
-			if (active > 4*free) {
-				/* < 25% of pages free; grow active pool. */
-				active += num_pages - alloced;
-				if (active > pool->num_bpages)
-					active = pool->num_bpages;
-				atomic_set(&pool->active_pages, active);
-			} else if (2*free > active) {
-				/* > 50% of pages free; shrink active
-				 * pool by 10%.
-				 */
-				active -= active/10;
-				atomic_set(&pool->active_pages,
-						(active >= MIN_ACTIVE)
-						? active : MIN_ACTIVE);
-			}
-			if (cur >= active) {
-				atomic_set(&pool->free_bpages_found, 0);
-				atomic_set(&pool->next_scan, 0);
-				continue;
-			}
-		}
+		if (index < 0)
+			break;
+		INC_METRIC(bpage_alloc_probes, 1);
 
-		bpage = &pool->descriptors[cur];
-		/* Don't lock the bpage unless there is some chance we can
-		 * use it. */
-		if (atomic_read(&bpage->refs) || ((bpage->owner >= 0)
-				&& (bpage->expiration > now)))
+		/* The bit in the free map is only a hint: make sure the
+		 * bpage is really free. If it isn't, leave its bit clear;
+		 * it will be marked free again when released, or (if it
+		 * is deferred) by homa_pool_reclaim.
+		 */
+		pr = &pool->regions[index >> HOMA_REGION_BPAGES_SHIFT];
+		bpage = homa_pool_bpage(pool, index);
+		if (atomic_read(&bpage->refs))
 			continue;
-		if (!spin_trylock_bh(&bpage->lock))
+		if ((bpage->owner >= 0) && (bpage->expiration > now)) {
+			homa_pool_defer(pool, bpage->expiration);
 			continue;
+		}
+		if (!spin_trylock_bh(&bpage->lock)) {
+			homa_pool_defer(pool, now);
+			continue;
+		}
 
 		/* Must recheck after acquiring the lock (another core
-		 * could have snuck in and grabbed the bpage).
+		 * could have snuck in and grabbed the bpage). Bpages in
+		 * retiring regions are left out of the free map.
 		 */
-		if (atomic_read(&bpage->refs) || ((bpage->owner >= 0)
-				&& (bpage->expiration > now))) {
+		if (atomic_read(&bpage->refs) || pr->retiring) {
+			spin_unlock_bh(&bpage->lock);
+			continue;
+		}
+		if ((bpage->owner >= 0) && (bpage->expiration > now)) {
+			homa_pool_defer(pool, bpage->expiration);
 			spin_unlock_bh(&bpage->lock);
 			continue;
 		}
-		atomic_inc(&pool->free_bpages_found);
 		atomic_set(&bpage->refs, 1);
+		atomic_inc(&pr->active_bpages);
+		bpage->size_class = -1;
 		if (set_owner) {
 			bpage->owner = raw_smp_processor_id();
 			bpage->expiration = now + pool->homa->bpage_lease_cycles;
 		} else
 			bpage->owner = -1;
 		spin_unlock_bh(&bpage->lock);
-		pages[alloced] = cur;
+		pages[alloced] = index;
 		alloced++;
-		if (alloced == num_pages)
-			return 0;
+	}
+	return alloced;
+}
+
+/**
+ * homa_pool_get_pages() - Allocate one or more full pages from the pool.
+ * Pages are allocated from the NUMA node of the current core if possible,
+ * then from pages whose node isn't yet known, then from other nodes.
+ * @pool:         Pool from which to allocate pages
+ * @num_pages:    Number of pages needed
+ * @pages:        The indices of the allocated pages are stored here; caller
+ *                must ensure this array is big enough. Reference counts have
+ *                been set to 1 on all of these pages.
+ * @set_owner:    If nonzero, the current core is marked as owner of all
+ *                of the allocated pages (and the expiration time is also
+ *                set). Otherwises the pages are left unowned.
+ * Return: 0 for success, -1 if there wasn't enough free space in the pool.
+*/
+int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
+		int set_owner)
+{
+	int local = cpu_to_node(raw_smp_processor_id());
+	int alloced = 0, reclaimed = 0;
+	int prev, node, i;
+
+	retry:
+	prev = alloced;
+	alloced = homa_pool_alloc_node(pool, &pool->nodes[local], num_pages,
+			pages, alloced, set_owner);
+	INC_METRIC(bpage_local_allocs, alloced - prev);
+	if (alloced == num_pages)
+		return 0;
+	prev = alloced;
+	alloced = homa_pool_alloc_node(pool, &pool->nodes[pool->num_nodes],
+			num_pages, pages, alloced, set_owner);
+	INC_METRIC(bpage_unplaced_allocs, alloced - prev);
+	for (node = 0; (node < pool->num_nodes) && (alloced < num_pages);
+			node++) {
+		if (node == local)
+			continue;
+		prev = alloced;
+		alloced = homa_pool_alloc_node(pool, &pool->nodes[node],
+				num_pages, pages, alloced, set_owner);
+		INC_METRIC(bpage_remote_allocs, alloced - prev);
+	}
+	if (alloced == num_pages)
+		return 0;
+
+	/* The free maps are exhausted; bpages left out of them earlier
+	 * may have become allocatable since then.
+	 */
+	if (!reclaimed && (homa_pool_reclaim(pool) != 0)) {
+		reclaimed = 1;
+		goto retry;
 	}
 
 	/* If we get here, it means we ran out of space in the pool. Free
@@ -198,10 +796,104 @@ int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
 	 * before modifying it; the ref count provides sufficient protection.
 	 */
 	for (i = 0; i < alloced; i++) {
-		struct homa_bpage *bpage = &pool->descriptors[pages[i]];
+		struct homa_bpage *bpage = homa_pool_bpage(pool, pages[i]);
 		bpage->owner = -1;
 		atomic_set(&bpage->refs, 0);
+		atomic_dec(&pool->regions[pages[i] >> HOMA_REGION_BPAGES_SHIFT]
+				.active_bpages);
+		homa_pool_mark_free(pool, pages[i]);
+	}
+	return -1;
+}
+
+/**
+ * homa_pool_size_class() - Return the size class to use for a message
+ * fragment.
+ * @length:   Number of bytes in the fragment; must be no larger than
+ *            HOMA_MAX_SLOT_SIZE.
+ * Return:    The smallest size class whose slots can hold @length bytes.
+ */
+static inline int homa_pool_size_class(int length)
+{
+	if (length <= (1 << HOMA_MIN_SLOT_SHIFT))
+		return 0;
+	return fls(length - 1) - HOMA_MIN_SLOT_SHIFT;
+}
+
+/**
+ * homa_pool_alloc_slot() - Try to allocate a slot from a given bpage.
+ * @pool:        Pool containing the bpage.
+ * @index:       Index of the bpage (see homa_pool_bpage; < 0 means
+ *               there is no bpage; this function just returns failure).
+ * @size_class:  Size class of the desired slot; the bpage must be
+ *               divided into slots of this class.
+ * @core_id:     Core that is allocating the slot.
+ * @adopt:       Zero means the bpage must already be owned by @core_id;
+ *               nonzero means the bpage must be unowned (or its lease
+ *               must have expired), and @core_id will become its owner.
+ * @offset:      If successful, filled in with the offset in the pool of
+ *               the allocated slot.
+ * Return:       0 for success, or -1 if the bpage couldn't be used. In
+ *               the latter case, if the bpage was owned by @core_id but
+ *               full, it is abandoned.
+ */
+static int homa_pool_alloc_slot(struct homa_pool *pool, int index,
+		int size_class, int core_id, int adopt, __u32 *offset)
+{
+	int slot_shift = HOMA_MIN_SLOT_SHIFT + size_class;
+	int num_slots = HOMA_BPAGE_SIZE >> slot_shift;
+	struct homa_pool_region *pr;
+	struct homa_bpage *bpage;
+	unsigned long *slots;
+	__u64 now = get_cycles();
+	int slot, w;
+
+	if (index < 0)
+		return -1;
+	pr = &pool->regions[index >> HOMA_REGION_BPAGES_SHIFT];
+	bpage = homa_pool_bpage(pool, index);
+	if (!spin_trylock_bh(&bpage->lock)) {
+		/* Someone else has the lock, which means they are stealing
+		 * the bpage from us. Abandon it.
+		 */
+		return -1;
 	}
+	if ((bpage->size_class != size_class) || pr->retiring)
+		goto fail;
+	if (adopt) {
+		if ((bpage->owner >= 0) && (bpage->expiration > now))
+			goto fail;
+	} else if (bpage->owner != core_id)
+		goto fail;
+
+	slots = homa_pool_slot_map(pool, index);
+	slot = num_slots;
+	for (w = 0; w < BITS_TO_LONGS(num_slots); w++) {
+		unsigned long free = ~READ_ONCE(slots[w]);
+
+		if (free) {
+			slot = w*BITS_PER_LONG + __ffs(free);
+			break;
+		}
+	}
+	if (slot >= num_slots) {
+		/* The page is full; give it up so that it can be freed
+		 * (or adopted) once some of its slots are released.
+		 */
+		bpage->owner = -1;
+		goto fail;
+	}
+	set_bit(slot, slots);
+	if (atomic_inc_return(&bpage->refs) == 1)
+		atomic_inc(&pr->active_bpages);
+	bpage->owner = core_id;
+	bpage->expiration = now + pool->homa->bpage_lease_cycles;
+	spin_unlock_bh(&bpage->lock);
+	*offset = ((__u32) index << HOMA_BPAGE_SHIFT) + (slot << slot_shift);
+	return 0;
+
+	fail:
+	spin_unlock_bh(&bpage->lock);
 	return -1;
 }
 
@@ -215,13 +907,14 @@ int homa_pool_get_pages(struct homa_pool *pool, int num_pages, __u32 *pages,
 int homa_pool_allocate(struct homa_rpc *rpc)
 {
 	struct homa_pool *pool = &rpc->hsk->buffer_pool;
-	int full_pages, partial, i, core_id;
+	int full_pages, partial, i, core_id, size_class;
 	__u32 pages[HOMA_MAX_BPAGES];
 	struct homa_pool_core *core;
+	__u32 offset;
 	struct homa_bpage *bpage;
-	__u64 now = get_cycles();
+	unsigned long *slots;
 
-	if (!pool->region)
+	if (pool->num_regions == 0)
 		return -1;
 
 	/* First allocate any full bpages that are needed. */
@@ -234,57 +927,63 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 	}
 	rpc->msgin.num_bpages = full_pages;
 
-	/* The last chunk may be less than a full bpage; for this we use
-	 * a bpage that we own (and reuse for multiple messages).
+	/* The last chunk may be less than a full bpage; if it is small
+	 * enough, it is allocated from a slot in a bpage that is shared with
+	 * other messages of similar size. Each slot is freed individually.
 	 */
 	partial = rpc->msgin.total_length - (full_pages << HOMA_BPAGE_SHIFT);
 	if (unlikely(partial == 0))
 		return 0;
+	if (partial > HOMA_MAX_SLOT_SIZE) {
+		if (homa_pool_get_pages(pool, 1, pages, 0) != 0)
+			goto out_of_space;
+		offset = pages[0] << HOMA_BPAGE_SHIFT;
+		goto done;
+	}
+	size_class = homa_pool_size_class(partial);
 	core_id = raw_smp_processor_id();
 	core = &pool->cores[core_id];
-	bpage = &pool->descriptors[core->page_hint];
-	if (!spin_trylock_bh(&bpage->lock)) {
-		/* Someone else has the lock, which means they are stealing
-		 * the bpage from us. Abandon it.
-		 */
-		goto new_page;
-	}
-	if (bpage->owner != core_id) {
-		spin_unlock_bh(&bpage->lock);
-		goto new_page;
-	}
-	if ((core->allocated + partial) > HOMA_BPAGE_SIZE) {
-		if (atomic_read(&bpage->refs) > 0) {
-			bpage->owner = -1;
-			spin_unlock_bh(&bpage->lock);
-			goto new_page;
-		}
-		/* Bpage is totally free, so we can reuse it. */
-		core->allocated = 0;
-		INC_METRIC(bpage_reuses, 1);
+	if (homa_pool_alloc_slot(pool, core->class_pages[size_class],
+			size_class, core_id, 0, &offset) == 0)
+		goto slot_done;
+
+	/* Can't use our current page; see if we can adopt a partially
+	 * free page abandoned by another core.
+	 */
+	core->class_pages[size_class] = atomic_xchg(
+			&pool->class_hints[size_class], -1);
+	if (homa_pool_alloc_slot(pool, core->class_pages[size_class],
+			size_class, core_id, 1, &offset) == 0) {
+		INC_METRIC(slot_page_adoptions, 1);
+		goto slot_done;
 	}
-	bpage->expiration = now + pool->homa->bpage_lease_cycles;
-	atomic_inc(&bpage->refs);
-	spin_unlock_bh(&bpage->lock);
-	goto allocate_partial;
 
-	/* Can't use the current page; get another one. */
-	new_page:
+	/* Start a new page for this size class. */
 	if (homa_pool_get_pages(pool, 1, pages, 1) != 0) {
-		homa_pool_release_buffers(pool, rpc->msgin.num_bpages,
-				rpc->msgin.bpage_offsets);
-		rpc->msgin.num_bpages = 0;
-		return -1;
+		core->class_pages[size_class] = -1;
+		goto out_of_space;
 	}
-	core->page_hint = pages[0];
-	core->allocated = 0;
+	bpage = homa_pool_bpage(pool, pages[0]);
+	slots = homa_pool_slot_map(pool, pages[0]);
+	bitmap_zero(slots, HOMA_MAX_SLOTS);
+	set_bit(0, slots);
+	bpage->size_class = size_class;
+	core->class_pages[size_class] = pages[0];
+	offset = pages[0] << HOMA_BPAGE_SHIFT;
+
+	slot_done:
+	INC_METRIC(slot_allocs, 1);
 
-	allocate_partial:
-	rpc->msgin.bpage_offsets[rpc->msgin.num_bpages] = core->allocated
-			+ (core->page_hint << HOMA_BPAGE_SHIFT);
+	done:
+	rpc->msgin.bpage_offsets[rpc->msgin.num_bpages] = offset;
 	rpc->msgin.num_bpages++;
-	core->allocated += partial;
 	return 0;
+
+	out_of_space:
+	homa_pool_release_buffers(pool, rpc->msgin.num_bpages,
+			rpc->msgin.bpage_offsets);
+	rpc->msgin.num_bpages = 0;
+	return -1;
 }
 
 /**
@@ -302,6 +1001,7 @@ int homa_pool_allocate(struct homa_rpc *rpc)
 void *homa_pool_get_buffer(struct homa_rpc *rpc, int offset, int *available)
 {
 	int bpage_index, bpage_offset;
+	__u32 buf_offset;
 
 	if (rpc->msgin.num_bpages == 0)
 		if (homa_pool_allocate(rpc) != 0)
@@ -312,8 +1012,146 @@ void *homa_pool_get_buffer(struct homa_rpc *rpc, int offset, int *available)
 	*available = (bpage_index < (rpc->msgin.num_bpages-1))
 			? HOMA_BPAGE_SIZE - bpage_offset
 			: rpc->msgin.total_length - offset;
-	return rpc->hsk->buffer_pool.region + rpc->msgin.bpage_offsets[bpage_index]
-			+ bpage_offset;
+	buf_offset = rpc->msgin.bpage_offsets[bpage_index];
+	return rpc->hsk->buffer_pool.regions[buf_offset >> HOMA_REGION_SHIFT].start
+			+ (buf_offset & (HOMA_MAX_REGION_SIZE - 1)) + bpage_offset;
+}
+
+/**
+ * homa_pool_get_bvecs() - Describe a range of a pinned buffer region with
+ * bio_vecs referring to the region's pages, so that data can be copied
+ * into the range through kernel mappings.
+ * @pool:       Pool containing the range.
+ * @dst:        Address (in the application's address space) of the first
+ *              byte of the range; must lie within one of @pool's regions.
+ * @length:     Number of bytes in the range.
+ * @bvecs:      Filled in with descriptions of the range; physically
+ *              contiguous pages of a huge page share a single entry.
+ * @max_bvecs:  Number of entries available at @bvecs.
+ * @num_bvecs:  Filled in with the number of entries used at @bvecs
+ *              (0 if the range's region isn't pinned).
+ * Return:      The number of bytes described by @bvecs. This will be less
+ *              than @length if @max_bvecs entries weren't enough or the
+ *              range extends past the end of the region.
+ */
+int homa_pool_get_bvecs(struct homa_pool *pool, char *dst, int length,
+		struct bio_vec *bvecs, int max_bvecs, int *num_bvecs)
+{
+	struct homa_pool_region *pr = NULL;
+	unsigned long offset = 0;
+	int covered = 0;
+	int n = 0;
+	int r;
+
+	for (r = 0; r < pool->num_regions; r++) {
+		pr = &pool->regions[r];
+		if (pr->pages && (dst >= pr->start) && (dst < pr->start
+				+ ((__u64) pr->num_bpages << HOMA_BPAGE_SHIFT))) {
+			offset = dst - pr->start;
+			break;
+		}
+	}
+	if (r >= pool->num_regions)
+		length = 0;
+
+	while (length > 0) {
+		unsigned long index = offset >> PAGE_SHIFT;
+		int page_offset = offset & (PAGE_SIZE - 1);
+		int bytes = PAGE_SIZE - page_offset;
+		struct page *page;
+
+		if (index >= pr->num_pages)
+			break;
+		page = pr->pages[index];
+		if (bytes > length)
+			bytes = length;
+		if ((n > 0) && (page == bvecs[n-1].bv_page + ((bvecs[n-1].bv_offset
+				+ bvecs[n-1].bv_len) >> PAGE_SHIFT))
+				&& (compound_head(page)
+				== compound_head(bvecs[n-1].bv_page))) {
+			bvecs[n-1].bv_len += bytes;
+		} else {
+			if (n >= max_bvecs)
+				break;
+			bvecs[n].bv_page = page;
+			bvecs[n].bv_offset = page_offset;
+			bvecs[n].bv_len = bytes;
+			n++;
+		}
+		offset += bytes;
+		length -= bytes;
+		covered += bytes;
+	}
+	*num_bvecs = n;
+	return covered;
+}
+
+/**
+ * homa_pool_place_buffers() - Find the NUMA nodes of bpages whose memory
+ * hadn't been touched when their region was registered (the usual case for
+ * a freshly mmapped region), so that homa_pool_get_pages can allocate them
+ * node-locally from now on. This is invoked by recvmsg just before the
+ * buffers are released: by then their memory has been written by
+ * copy_to_user, and we are running in the process that owns the region.
+ * @hsk:          Socket whose pool the buffers belong to. Must not be
+ *                locked by the caller; it is locked here only if there
+ *                is a bpage to place.
+ * @num_buffers:  How many buffers to check.
+ * @buffers:      Points to @num_buffers values, each of which is the
+ *                offset in the pool of a buffer (as returned to the
+ *                application by recvmsg).
+ */
+void homa_pool_place_buffers(struct homa_sock *hsk, int num_buffers,
+		__u32 *buffers)
+{
+	struct homa_pool *pool = &hsk->buffer_pool;
+	struct homa_pool_node *unplaced;
+	int i, node, locked = 0;
+
+	if ((pool->num_regions == 0) || (num_buffers == 0))
+		return;
+	unplaced = &pool->nodes[pool->num_nodes];
+	if (READ_ONCE(unplaced->num_bpages) == 0)
+		return;
+	for (i = 0; i < num_buffers; i++) {
+		__u32 bpage_index = buffers[i] >> HOMA_BPAGE_SHIFT;
+		int i_in_region = bpage_index
+				& ((1 << HOMA_REGION_BPAGES_SHIFT) - 1);
+		struct homa_pool_region *pr;
+		struct homa_bpage *bpage;
+
+		pr = &pool->regions[bpage_index >> HOMA_REGION_BPAGES_SHIFT];
+		if ((i_in_region >= READ_ONCE(pr->num_bpages))
+				|| (homa_pool_node_of(pool, bpage_index)
+				!= unplaced))
+			continue;
+		node = homa_pool_page_node(pr->start
+				+ ((__u64) i_in_region << HOMA_BPAGE_SHIFT));
+		if ((node < 0) || (node >= pool->num_nodes))
+			continue;
+
+		/* The partition counts are protected by the socket lock.
+		 * Recheck after locking, in case another thread placed
+		 * the bpage or the region was retired.
+		 */
+		if (!locked) {
+			homa_sock_lock(hsk, "homa_pool_place_buffers");
+			locked = 1;
+		}
+		if ((i_in_region >= pr->num_bpages)
+				|| (homa_pool_node_of(pool, bpage_index)
+				!= unplaced))
+			continue;
+		bpage = &pr->descriptors[i_in_region];
+		spin_lock_bh(&bpage->lock);
+		unplaced->num_bpages--;
+		bpage->node = node;
+		pool->nodes[node].num_bpages++;
+		spin_unlock_bh(&bpage->lock);
+		INC_METRIC(bpage_late_placements, 1);
+	}
+	if (locked)
+		homa_sock_unlock(hsk);
 }
 
 /**
@@ -321,19 +1159,39 @@ void *homa_pool_get_buffer(struct homa_rpc *rpc, int offset, int *available)
  * reused. This method may be invoked without holding any locks.
  * @pool:         Pool that the buffer space belongs to.
  * @num_buffers:  How many buffers to release.
- * @buffers:      Points to @num_buffers values, each of which is an offset
- *                from the start of the pool to the buffer to be released.
+ * @buffers:      Points to @num_buffers values, each of which is the
+ *                offset in the pool of a buffer to be released (as
+ *                returned to the application by recvmsg).
  */
 void homa_pool_release_buffers(struct homa_pool *pool, int num_buffers,
 		__u32 *buffers)
 {
 	int i;
 
-	if (!pool->region)
+	if (pool->num_regions == 0)
 		return;
 	for (i = 0; i < num_buffers; i++) {
 		__u32 bpage_index = buffers[i] >> HOMA_BPAGE_SHIFT;
-		if (bpage_index < pool->num_bpages)
-			 atomic_dec(&pool->descriptors[bpage_index].refs);
+		struct homa_pool_region *pr;
+		struct homa_bpage *bpage;
+		int size_class;
+
+		pr = &pool->regions[bpage_index >> HOMA_REGION_BPAGES_SHIFT];
+		if ((bpage_index & ((1 << HOMA_REGION_BPAGES_SHIFT) - 1))
+				>= READ_ONCE(pr->num_bpages))
+			continue;
+		bpage = homa_pool_bpage(pool, bpage_index);
+		size_class = READ_ONCE(bpage->size_class);
+		if ((size_class >= 0) && (size_class < HOMA_NUM_SIZE_CLASSES))
+			clear_bit((buffers[i] & (HOMA_BPAGE_SIZE - 1))
+					>> (HOMA_MIN_SLOT_SHIFT + size_class),
+					homa_pool_slot_map(pool, bpage_index));
+		if (atomic_dec_and_test(&bpage->refs)) {
+			atomic_dec(&pr->active_bpages);
+			homa_pool_mark_free(pool, bpage_index);
+		}
+		else if ((size_class >= 0) && (bpage->owner < 0))
+			atomic_set(&pool->class_hints[size_class],
+					bpage_index);
 	}
 }
\ No newline at end of file
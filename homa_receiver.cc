@@ -25,7 +25,8 @@
  *              The file descriptor must be valid for the lifetime of this
  *              object.
  * @buf_region: Location of the buffer region that was allocated for
- *              this socket.
+ *              this socket (region 0). If more regions are added later
+ *              with HOMA_BUF_ADD, they must be passed to set_region.
  */
 homa::receiver::receiver(int fd, void *buf_region)
 	: fd(fd)
@@ -33,8 +34,9 @@ homa::receiver::receiver(int fd, void *buf_region)
 	, control()
 	, source()
         , msg_length(-1)
-        , buf_region(reinterpret_cast<char *>(buf_region))
+        , regions()
 {
+	regions[0] = reinterpret_cast<char *>(buf_region);
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.msg_name = &source;
 	hdr.msg_namelen = sizeof(source);
@@ -45,7 +45,7 @@ namespace homa {
  */
 class receiver {
 public:
-	receiver(int fd, void *buf_regio);
+	receiver(int fd, void *buf_region);
 	~receiver();
 
 	/**
@@ -96,10 +96,13 @@ public:
 		int buf_num = offset >> HOMA_BPAGE_SHIFT;
 		if (static_cast<ssize_t>(offset + sizeof(T)) > msg_length)
 			return nullptr;
-		if (contiguous(offset) >= sizeof(T))
-			return reinterpret_cast<T*>(buf_region
-					+ control.bpage_offsets[buf_num]
+		if (contiguous(offset) >= sizeof(T)) {
+			uint32_t bpage = control.bpage_offsets[buf_num];
+			return reinterpret_cast<T*>(
+					regions[HOMA_BUF_REGION(bpage)]
+					+ HOMA_BUF_REGION_OFFSET(bpage)
 					+ (offset & (HOMA_BPAGE_SIZE - 1)));
+		}
 		if (storage)
 			copy_out(storage, offset, sizeof(T));
 		return storage;
@@ -137,6 +140,21 @@ public:
 	size_t receive(int flags, uint64_t id);
 	void release();
 
+	/**
+	 * homa::receiver::set_region() - Tell the receiver where a region
+	 * of the socket's buffer space is located; must be invoked after
+	 * adding a region with HOMA_BUF_ADD, before receiving messages
+	 * that may use it.
+	 * @index:   Index of the region (the value returned by setsockopt
+	 *           for HOMA_BUF_ADD).
+	 * @start:   First byte of the region, or nullptr once the region
+	 *           has been retired.
+	 */
+	void set_region(int index, void *start)
+	{
+		regions[index] = static_cast<char *>(start);
+	}
+
 	/**
 	 * homa::receiver::src_addr() - Return a pointer to the address
 	 * of the sender of the current message. The result is undefined
@@ -168,7 +186,11 @@ protected:
 	/** @length: Length of the current message, or < 0  if none. */
 	ssize_t msg_length;
 
-	/** @buf_region: First byte of buffer space for this message. */
-	char *buf_region;
+	/**
+	 * @regions: First byte of each region of the socket's buffer space,
+	 * indexed by HOMA_BUF_REGION of a buffer's offset. Entry 0 is the
+	 * region passed to the constructor; others are set by set_region.
+	 */
+	char *regions[HOMA_MAX_REGIONS];
 };
 }    // namespace homa
\ No newline at end of file
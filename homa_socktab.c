@@ -117,11 +117,12 @@ struct homa_sock *homa_socktab_next(struct homa_socktab_scan *scan)
 void homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 {
 	struct homa_socktab *socktab = &homa->port_map;
-	int i;
 
 	spin_lock_bh(&socktab->write_lock);
 	atomic_set(&hsk->protect_count, 0);
 	spin_lock_init(&hsk->lock);
+	spin_lock_init(&hsk->ready_lock);
+	spin_lock_init(&hsk->dead_lock);
 	hsk->last_locker = "none";
 	atomic_set(&hsk->protect_count, 0);
 	hsk->homa = homa;
@@ -147,21 +148,20 @@ void homa_sock_init(struct homa_sock *hsk, struct homa *homa)
 	INIT_LIST_HEAD(&hsk->active_rpcs);
 	INIT_LIST_HEAD(&hsk->dead_rpcs);
 	hsk->dead_skbs = 0;
+	spin_lock_init(&hsk->free_rpcs_lock);
+	INIT_LIST_HEAD(&hsk->free_rpcs);
+	hsk->num_free_rpcs = 0;
 	INIT_LIST_HEAD(&hsk->ready_requests);
 	INIT_LIST_HEAD(&hsk->ready_responses);
 	INIT_LIST_HEAD(&hsk->request_interests);
 	INIT_LIST_HEAD(&hsk->response_interests);
-	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
-		struct homa_rpc_bucket *bucket = &hsk->client_rpc_buckets[i];
-		spin_lock_init(&bucket->lock);
-		INIT_HLIST_HEAD(&bucket->rpcs);
-	}
-	for (i = 0; i < HOMA_SERVER_RPC_BUCKETS; i++) {
-		struct homa_rpc_bucket *bucket = &hsk->server_rpc_buckets[i];
-		spin_lock_init(&bucket->lock);
-		INIT_HLIST_HEAD(&bucket->rpcs);
-	}
+	hsk->client_rpcs = NULL;
+	hsk->server_rpcs = NULL;
 	memset(&hsk->buffer_pool, 0, sizeof(hsk->buffer_pool));
+	hsk->poll_cycles = INT_MAX;
+	atomic_set(&hsk->num_pollers, 0);
+	hsk->poll_samples = 0;
+	memset(hsk->poll_waits, 0, sizeof(hsk->poll_waits));
 	spin_unlock_bh(&socktab->write_lock);
 }
 
@@ -207,12 +207,16 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 		homa_rpc_unlock(rpc);
 	}
 
-	homa_sock_lock(hsk, "homa_socket_shutdown #2");
+	/* @shutdown was set above, so any thread that registers an interest
+	 * after we release the ready lock will see it and return without
+	 * sleeping.
+	 */
+	homa_sock_ready_lock(hsk);
 	list_for_each_entry(interest, &hsk->request_interests, request_links)
 		wake_up_process(interest->thread);
 	list_for_each_entry(interest, &hsk->response_interests, response_links)
 		wake_up_process(interest->thread);
-	homa_sock_unlock(hsk);
+	homa_sock_ready_unlock(hsk);
 
 	homa_pool_destroy(&hsk->buffer_pool);
 
@@ -225,6 +229,9 @@ void homa_sock_shutdown(struct homa_sock *hsk)
 			tt_freeze();
 		}
 	}
+	homa_rpc_free_list_destroy(hsk);
+	homa_rpc_table_destroy(&hsk->client_rpcs);
+	homa_rpc_table_destroy(&hsk->server_rpcs);
 }
 
 /**
@@ -326,3 +333,37 @@ void homa_sock_lock_slow(struct homa_sock *hsk)
 	INC_METRIC(socket_lock_misses, 1);
 	INC_METRIC(socket_lock_miss_cycles, get_cycles() - start);
 }
+
+/**
+ * homa_sock_ready_lock_slow() - This function implements the slow path for
+ * acquiring a socket's ready lock. It is invoked when the lock isn't
+ * immediately available. It waits for the lock, but also records
+ * statistics about the waiting time.
+ * @hsk:    Socket whose ready lock is needed.
+ */
+void homa_sock_ready_lock_slow(struct homa_sock *hsk)
+{
+	__u64 start = get_cycles();
+	tt_record("beginning wait for socket ready lock");
+	spin_lock_bh(&hsk->ready_lock);
+	tt_record("ending wait for socket ready lock");
+	INC_METRIC(ready_lock_misses, 1);
+	INC_METRIC(ready_lock_miss_cycles, get_cycles() - start);
+}
+
+/**
+ * homa_sock_dead_lock_slow() - This function implements the slow path for
+ * acquiring a socket's dead lock. It is invoked when the lock isn't
+ * immediately available. It waits for the lock, but also records
+ * statistics about the waiting time.
+ * @hsk:    Socket whose dead lock is needed.
+ */
+void homa_sock_dead_lock_slow(struct homa_sock *hsk)
+{
+	__u64 start = get_cycles();
+	tt_record("beginning wait for socket dead lock");
+	spin_lock_bh(&hsk->dead_lock);
+	tt_record("ending wait for socket dead lock");
+	INC_METRIC(dead_lock_misses, 1);
+	INC_METRIC(dead_lock_miss_cycles, get_cycles() - start);
+}
@@ -19,11 +19,219 @@
 #include "homa_impl.h"
 
 /**
- * homa_check_rpc() -  Invoked for each RPC during each timer pass; does
- * most of the work of checking for time-related actions such as sending
- * resends, declaring a host dead, and sending requests for acks. Itt is
- * separate from homa_timer because homa_timer got too long and deeply
- * indented.
+ * homa_wheel_init() - Constructor for homa_timer_wheels.
+ * @wheel:    Object to initialize.
+ * @now:      Current value of homa->timer_ticks.
+ */
+void homa_wheel_init(struct homa_timer_wheel *wheel, __u32 now)
+{
+	int level, i;
+
+	spin_lock_init(&wheel->lock);
+	wheel->now = now;
+
+	/* Make the wheel look idle to homa_timer until homa_softirq runs. */
+	wheel->softirq_ticks = now - 2;
+	INIT_LIST_HEAD(&wheel->due);
+	wheel->num_dead_peers = 0;
+	for (level = 0; level < HOMA_WHEEL_LEVELS; level++) {
+		for (i = 0; i < HOMA_WHEEL_SLOTS; i++)
+			INIT_LIST_HEAD(&wheel->slots[level][i]);
+	}
+}
+
+/**
+ * homa_wheel_insert() - Add an RPC to the slot of a timer wheel that
+ * corresponds to rpc->timer_expires.
+ * @wheel:    Wheel in which to insert @rpc; must be locked by the caller.
+ * @rpc:      RPC to insert; must not currently be in a wheel. If its
+ *            @timer_expires has already passed, it is changed to the
+ *            next tick; if it is more than HOMA_WHEEL_SPAN ticks in the
+ *            future, it is clamped (the RPC will simply be checked early).
+ */
+static void homa_wheel_insert(struct homa_timer_wheel *wheel,
+		struct homa_rpc *rpc)
+{
+	int delta = rpc->timer_expires - wheel->now;
+	struct list_head *slot;
+
+	if (delta <= 0) {
+		delta = 1;
+		rpc->timer_expires = wheel->now + 1;
+	} else if (delta > HOMA_WHEEL_SPAN) {
+		delta = HOMA_WHEEL_SPAN;
+		rpc->timer_expires = wheel->now + HOMA_WHEEL_SPAN;
+	}
+	if (delta <= HOMA_WHEEL_SLOTS)
+		slot = &wheel->slots[0][rpc->timer_expires
+				& (HOMA_WHEEL_SLOTS - 1)];
+	else
+		slot = &wheel->slots[1][(rpc->timer_expires >> HOMA_WHEEL_BITS)
+				& (HOMA_WHEEL_SLOTS - 1)];
+	list_add_tail(&rpc->timer_links, slot);
+}
+
+/**
+ * homa_wheel_advance() - Move a timer wheel forward to a given tick and
+ * collect all of the RPCs that are due by then.
+ * @wheel:    Wheel to advance; must be locked by the caller.
+ * @now:      New value for @wheel->now (normally homa->timer_ticks).
+ *            RPCs whose @timer_expires is <= @now are moved to the end
+ *            of @wheel->due.
+ */
+void homa_wheel_advance(struct homa_timer_wheel *wheel, __u32 now)
+{
+	struct list_head *due = &wheel->due;
+	struct homa_rpc *rpc, *next;
+	int level, i;
+	__u32 tick;
+
+	if ((int) (now - wheel->now) > HOMA_WHEEL_SPAN) {
+		/* Everything in the wheel is due. */
+		for (level = 0; level < HOMA_WHEEL_LEVELS; level++) {
+			for (i = 0; i < HOMA_WHEEL_SLOTS; i++)
+				list_splice_tail_init(&wheel->slots[level][i],
+						due);
+		}
+		wheel->now = now;
+		return;
+	}
+
+	while ((int) (now - wheel->now) > 0) {
+		tick = wheel->now + 1;
+		if ((tick & (HOMA_WHEEL_SLOTS - 1)) == 0) {
+			/* Move the RPCs for the next HOMA_WHEEL_SLOTS ticks
+			 * down from level 1; this must happen before the
+			 * level 0 slot for @tick is collected below.
+			 */
+			LIST_HEAD(cascade);
+
+			list_splice_init(&wheel->slots[1][(tick
+					>> HOMA_WHEEL_BITS)
+					& (HOMA_WHEEL_SLOTS - 1)], &cascade);
+			list_for_each_entry_safe(rpc, next, &cascade,
+					timer_links) {
+				list_del(&rpc->timer_links);
+				homa_wheel_insert(wheel, rpc);
+			}
+		}
+		list_splice_tail_init(&wheel->slots[0][tick
+				& (HOMA_WHEEL_SLOTS - 1)], due);
+		wheel->now = tick;
+	}
+}
+
+/**
+ * homa_rpc_arm_timer() - Make sure that an RPC will be checked for
+ * timeouts no later than a given tick.
+ * @rpc:      RPC to schedule; must be locked by the caller.
+ * @expires:  Value of homa->timer_ticks at which @rpc should be checked.
+ *            If @rpc is already scheduled to be checked at or before
+ *            this time, nothing happens.
+ */
+void homa_rpc_arm_timer(struct homa_rpc *rpc, __u32 expires)
+{
+	struct homa_timer_wheel *wheel = rpc->timer_wheel;
+
+	if (rpc->state == RPC_DEAD)
+		return;
+
+	/* Unlocked check, to avoid the wheel lock in the common case where
+	 * nothing needs to change. If we race with homa_wheel_check removing
+	 * the RPC from the wheel, that's OK: it will rearm the RPC after
+	 * checking it, and it can't do that until we release the RPC lock.
+	 */
+	if (!list_empty(&rpc->timer_links)
+			&& ((int) (rpc->timer_expires - expires) <= 0))
+		return;
+
+	spin_lock_bh(&wheel->lock);
+	if (!list_empty(&rpc->timer_links)) {
+		if ((int) (rpc->timer_expires - expires) <= 0) {
+			spin_unlock_bh(&wheel->lock);
+			return;
+		}
+		list_del_init(&rpc->timer_links);
+	}
+	rpc->timer_expires = expires;
+	homa_wheel_insert(wheel, rpc);
+	spin_unlock_bh(&wheel->lock);
+}
+
+/**
+ * homa_rpc_cancel_timer() - Remove an RPC from the timer wheel (if it
+ * is there). Invoked when the RPC is freed.
+ * @rpc:      RPC to remove; must be locked by the caller.
+ */
+void homa_rpc_cancel_timer(struct homa_rpc *rpc)
+{
+	struct homa_timer_wheel *wheel = rpc->timer_wheel;
+
+	spin_lock_bh(&wheel->lock);
+	list_del_init(&rpc->timer_links);
+	spin_unlock_bh(&wheel->lock);
+}
+
+/**
+ * homa_rpc_next_check() - Compute when an RPC should next be checked
+ * for timeouts, based on its current state.
+ * @rpc:      RPC of interest; must be locked by the caller.
+ *
+ * Return:    The value of homa->timer_ticks at which @rpc should be
+ *            checked; always in the future.
+ */
+static __u32 homa_rpc_next_check(struct homa_rpc *rpc)
+{
+	struct homa *homa = rpc->hsk->homa;
+	__u32 next, ack;
+
+	/* Once an RPC has been silent long enough to be considered for a
+	 * resend (see homa_check_rpc), it must be checked on every tick so
+	 * that it takes part in the rotation of resends among the RPCs for
+	 * its peer. Before that, there is nothing to do for it.
+	 */
+	next = rpc->active_ticks + homa->resend_ticks - 1;
+	if (rpc->done_timer_ticks != 0) {
+		ack = rpc->done_timer_ticks + homa->request_ack_ticks;
+		if ((int) (ack - next) < 0)
+			next = ack;
+	}
+	if ((int) (next - homa->timer_ticks) <= 0)
+		next = homa->timer_ticks + 1;
+	return next;
+}
+
+/**
+ * homa_timer_rpc() - Invoked by homa_wheel_check for each RPC whose
+ * deadline in the timer wheel has arrived: brings @rpc->silent_ticks up to date,
+ * checks the RPC, and puts it back in the wheel.
+ * @rpc:     RPC to check; must be locked by the caller.
+ *
+ * Return:   Nonzero means the RPC's peer has timed out (see homa_check_rpc).
+ */
+static int homa_timer_rpc(struct homa_rpc *rpc)
+{
+	struct homa *homa = rpc->hsk->homa;
+	int result = 0;
+
+	INC_METRIC(timer_rpc_checks, 1);
+	if (rpc->state == RPC_IN_SERVICE) {
+		rpc->silent_ticks = 0;
+		rpc->active_ticks = homa->timer_ticks;
+	} else {
+		rpc->silent_ticks = homa->timer_ticks - rpc->active_ticks;
+		result = homa_check_rpc(rpc);
+	}
+	homa_rpc_arm_timer(rpc, homa_rpc_next_check(rpc));
+	return result;
+}
+
+/**
+ * homa_check_rpc() -  Invoked by homa_wheel_check for each RPC that is due
+ * in its timer wheel; does most of the work of checking for time-related
+ * actions such as sending resends, declaring a host dead, and sending
+ * requests for acks. It is separate from homa_timer because homa_timer
+ * got too long and deeply indented.
  * @rpc:     RPC to check; must be locked by the caller.
  * Return    Nonzero means this server has timed out; it's up to the caller
  *           to abort RPCs involving that server.
@@ -65,6 +273,7 @@ int homa_check_rpc(struct homa_rpc *rpc)
 		 * no need to be concerned about lack of traffic from the peer.
 		 */
 		rpc->silent_ticks = 0;
+		rpc->active_ticks = homa->timer_ticks;
 		return 0;
 	}
 
@@ -75,6 +284,7 @@ int homa_check_rpc(struct homa_rpc *rpc)
 		 * shouldn't expect to hear anything until we grant more.
 		 */
 		rpc->silent_ticks = 0;
+		rpc->active_ticks = homa->timer_ticks;
 		return 0;
 	}
 
@@ -122,7 +332,9 @@ int homa_check_rpc(struct homa_rpc *rpc)
 
 	/* First, collect information that will identify the RPC most
 	 * in need of a resend; this will be used during the *next*
-	 * homa_timer pass.
+	 * timer tick. RPCs for the same peer may be checked concurrently
+	 * on different cores, so this information is only a hint: races
+	 * can delay a resend or send an extra one, but that's harmless.
 	 */
 	if (peer->current_ticks != homa->timer_ticks) {
 		/* Reset info for this peer.*/
@@ -181,32 +393,148 @@ int homa_check_rpc(struct homa_rpc *rpc)
 	return 0;
 }
 
+/**
+ * homa_wheel_record_dead() - Remember that a peer has timed out, so that
+ * homa_timer will abort its RPCs.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @wheel:   Wheel from which the timed-out RPC was checked; must not be
+ *           locked by the caller.
+ * @peer:    The peer that timed out.
+ */
+static void homa_wheel_record_dead(struct homa *homa,
+		struct homa_timer_wheel *wheel, struct homa_peer *peer)
+{
+	int i;
+
+	spin_lock_bh(&wheel->lock);
+	for (i = 0; i < wheel->num_dead_peers; i++) {
+		if (ipv6_addr_equal(&wheel->dead_addrs[i], &peer->addr))
+			goto done;
+	}
+	if (wheel->num_dead_peers < HOMA_WHEEL_DEAD_PEERS) {
+		wheel->dead_addrs[wheel->num_dead_peers] = peer->addr;
+		wheel->num_dead_peers++;
+	} else {
+		/* No room to record this peer. homa_check_rpc has already
+		 * reset its resend count, so restore it: the peer will then
+		 * time out again the next time one of its RPCs is checked,
+		 * rather than being forgotten.
+		 */
+		peer->outstanding_resends = homa->timeout_resends;
+	}
+    done:
+	spin_unlock_bh(&wheel->lock);
+}
+
+/**
+ * homa_wheel_check() - Bring a timer wheel up to date with
+ * homa->timer_ticks and check the RPCs that are due. May be invoked
+ * concurrently for the same wheel (e.g. from homa_softirq and homa_timer);
+ * each due RPC is checked only once.
+ * @homa:    Overall data about the Homa protocol implementation.
+ * @wheel:   Wheel to service.
+ * @limit:   Maximum number of RPCs to check; any others that are due
+ *           remain in @wheel->due for the next call.
+ *
+ * Return:   The number of RPCs removed from @wheel->due.
+ */
+int homa_wheel_check(struct homa *homa, struct homa_timer_wheel *wheel,
+		int limit)
+{
+	struct homa_rpc *rpc;
+	int count = 0;
+
+	/* RPC_TIMER_CHECK keeps each RPC from being reaped between the time
+	 * we remove it from the wheel and the time we finish with it
+	 * (homa_rpc_free removes an RPC from the wheel before making it
+	 * reapable, so an RPC that is still in the wheel can't have been
+	 * reaped).
+	 */
+	spin_lock_bh(&wheel->lock);
+	homa_wheel_advance(wheel, homa->timer_ticks);
+	while ((count < limit) && !list_empty(&wheel->due)) {
+		rpc = list_first_entry(&wheel->due, struct homa_rpc,
+				timer_links);
+		list_del_init(&rpc->timer_links);
+		atomic_or(RPC_TIMER_CHECK, &rpc->flags);
+		spin_unlock_bh(&wheel->lock);
+
+		count++;
+		homa_rpc_lock(rpc);
+		if ((rpc->state != RPC_DEAD) && !rpc->hsk->shutdown) {
+			if (homa_timer_rpc(rpc)) {
+				/* Aborting RPCs requires locks we can't
+				 * acquire here (and may not be safe in
+				 * SoftIRQ context), so leave that to
+				 * homa_timer.
+				 */
+				homa_wheel_record_dead(homa, wheel, rpc->peer);
+			}
+		}
+		homa_rpc_unlock(rpc);
+		atomic_andnot(RPC_TIMER_CHECK, &rpc->flags);
+		spin_lock_bh(&wheel->lock);
+	}
+	spin_unlock_bh(&wheel->lock);
+	return count;
+}
+
+/**
+ * homa_timer_softirq() - Invoked by homa_softirq after it has processed a
+ * batch of packets; checks the RPCs in this core's timer wheel that are
+ * due. This spreads timer work across the cores that handle Homa traffic,
+ * rather than having the timer thread check every RPC.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_timer_softirq(struct homa *homa)
+{
+	struct homa_timer_wheel *wheel =
+			&homa_cores[raw_smp_processor_id()]->timer_wheel;
+	__u32 now = READ_ONCE(homa->timer_ticks);
+
+	WRITE_ONCE(wheel->softirq_ticks, now);
+
+	/* Unlocked check, so that the common case (nothing due) doesn't
+	 * touch the wheel lock.
+	 */
+	if ((READ_ONCE(wheel->now) == now) && list_empty_careful(&wheel->due))
+		return;
+	INC_METRIC(softirq_timer_checks, homa_wheel_check(homa, wheel,
+			HOMA_SOFTIRQ_TIMER_RPCS));
+}
+
 /**
  * homa_timer() - This function is invoked at regular intervals ("ticks")
- * to implement retries and aborts for Homa.
+ * to implement retries and aborts for Homa. Most RPC checks are done by
+ * homa_timer_softirq; this function handles global work (waking the
+ * reaper, peer timeouts, peer table maintenance) plus the timer wheels of cores that
+ * aren't currently running Homa SoftIRQ.
  * @homa:    Overall data about the Homa protocol implementation.
  */
 void homa_timer(struct homa *homa)
 {
+	struct homa_timer_wheel *wheel;
 	struct homa_socktab_scan scan;
 	struct homa_sock *hsk;
-	struct homa_rpc *rpc;
+	struct in6_addr dead_addrs[HOMA_WHEEL_DEAD_PEERS];
 	cycles_t start, end;
-	struct homa_peer *dead_peer = NULL;
-	int rpc_count = 0;
 	int total_rpcs = 0;
+	int core, count, num_dead, i;
+	int wake_reaper = 0;
 
 	start = get_cycles();
 	homa->timer_ticks++;
 
-	/* Scan all existing RPCs in all sockets.  The rcu_read_lock
-	 * below prevents sockets from being deleted during the scan.
+	/* The rcu_read_lock below prevents sockets from being deleted
+	 * during the scan.
 	 */
 	rcu_read_lock();
 	for (hsk = homa_socktab_start_scan(&homa->port_map, &scan);
 			hsk !=  NULL; hsk = homa_socktab_next(&scan)) {
+		if (!list_empty(&hsk->dead_rpcs))
+			wake_reaper = 1;
 		while (hsk->dead_skbs >= homa->dead_buffs_limit) {
-			/* If we get here, it means that homa_wait_for_message
+			/* If we get here, it means that the reaper thread
 			 * isn't keeping up with RPC reaping, so we'll help
 			 * out.  See reap.txt for more info. */
 			uint64_t start = get_cycles();
@@ -215,49 +543,49 @@ void homa_timer(struct homa *homa)
 				break;
 			INC_METRIC(timer_reap_cycles, get_cycles() - start);
 		}
+	}
+	rcu_read_unlock();
+	if (wake_reaper && homa->reaper_kthread)
+		wake_up_process(homa->reaper_kthread);
 
-		if (list_empty(&hsk->active_rpcs) || hsk->shutdown)
-			continue;
+	for (core = 0; core < nr_cpu_ids; core++) {
+		wheel = &homa_cores[core]->timer_wheel;
+
+		/* If homa_softirq has run on this core since the previous
+		 * tick began, leave the wheel to it. Otherwise the core may
+		 * not run SoftIRQ again soon, so check its RPCs here. Either
+		 * way, each RPC gets checked within about a tick of its
+		 * deadline.
+		 */
+		if ((int) (homa->timer_ticks - 1
+				- READ_ONCE(wheel->softirq_ticks)) > 0) {
+			while (1) {
+				count = homa_wheel_check(homa, wheel, 10);
+				total_rpcs += count;
+				if (count < 10)
+					break;
 
-		if (!homa_protect_rpcs(hsk))
-			continue;
-		list_for_each_entry_rcu(rpc, &hsk->active_rpcs, active_links) {
-			total_rpcs++;
-			homa_rpc_lock(rpc);
-			if (rpc->state == RPC_IN_SERVICE) {
-				rpc->silent_ticks = 0;
-				homa_rpc_unlock(rpc);
-				continue;
-			}
-			rpc->silent_ticks++;
-			if (homa_check_rpc(rpc))
-				dead_peer = rpc->peer;
-			homa_rpc_unlock(rpc);
-			rpc_count++;
-			if (rpc_count >= 10) {
 				/* Give other kernel threads a chance to run
-				 * on this core. Must release the RCU read lock
-				 * while doing this.
+				 * on this core.
 				 */
-				rcu_read_unlock();
 				schedule();
-				rcu_read_lock();
-				rpc_count = 0;
 			}
 		}
-		homa_unprotect_rpcs(hsk);
-	}
-	rcu_read_unlock();
-	if (dead_peer) {
-		/* We only timeout one peer per call to this function (it's
-		 * tricky from a synchronization standpoint to handle the
-		 * crash in the middle of the loop above, and trying to
-		 * remember more than one dead peer until we get here adds
-		 * complexity). If there's more than one dead peer, we'll
-		 * timeout another one in the next call.
-		 */
-		homa_abort_rpcs(homa, &dead_peer->addr, 0, -ETIMEDOUT);
+
+		if (!READ_ONCE(wheel->num_dead_peers))
+			continue;
+		spin_lock_bh(&wheel->lock);
+		num_dead = wheel->num_dead_peers;
+		memcpy(dead_addrs, wheel->dead_addrs,
+				num_dead * sizeof(dead_addrs[0]));
+		wheel->num_dead_peers = 0;
+		spin_unlock_bh(&wheel->lock);
+		for (i = 0; i < num_dead; i++)
+			homa_abort_rpcs(homa, &dead_addrs[i], 0, -ETIMEDOUT);
 	}
+	homa_peertab_gc(&homa->peers, homa->peer_gc_threshold,
+			homa->peer_idle_secs * HZ);
+	homa_peertab_check_size(&homa->peers);
 
 //	if (total_rpcs > 0)
 //		tt_record1("homa_timer finished scanning %d RPCs", total_rpcs);
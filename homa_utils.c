@@ -26,6 +26,7 @@ struct homa_core *homa_cores[NR_CPUS];
 char *core_memory;
 
 struct completion homa_pacer_kthread_done;
+struct completion homa_reaper_kthread_done;
 
 /**
  * homa_init() - Constructor for homa objects.
@@ -63,14 +64,24 @@ int homa_init(struct homa *homa)
 			core->last_gro = 0;
 			atomic_set(&core->softirq_backlog, 0);
 			core->softirq_offset = 0;
-			core->held_skb = NULL;
-			core->held_bucket = 0;
+			memset(core->gro_slots, 0, sizeof(core->gro_slots));
+			core->napi_polling = 0;
+			core->softirq_load = 0;
+			core->softirq_load_time = 0;
+			core->softirq_kb_cycles = cpu_khz/1000;
+			core->poll_thread = NULL;
+			core->poll_rank = 0;
+			core->gro_first_candidate = 0;
+			core->gro_num_candidates = 0;
+			homa_wheel_init(&core->timer_wheel, 0);
 			memset(&core->metrics, 0, sizeof(core->metrics));
 		}
 	}
 
 	homa->pacer_kthread = NULL;
 	init_completion(&homa_pacer_kthread_done);
+	homa->reaper_kthread = NULL;
+	init_completion(&homa_reaper_kthread_done);
 	atomic64_set(&homa->next_outgoing_id, 2);
 	atomic64_set(&homa->link_idle_time, get_cycles());
 	spin_lock_init(&homa->grantable_lock);
@@ -89,18 +100,27 @@ int homa_init(struct homa *homa)
 	atomic_set(&homa->total_incoming, 0);
 	homa->next_client_port = HOMA_MIN_DEFAULT_PORT;
 	homa_socktab_init(&homa->port_map);
+	homa->rpc_cache = NULL;
 	err = homa_peertab_init(&homa->peers);
 	if (err) {
 		printk(KERN_ERR "Couldn't initialize peer table (errno %d)\n",
 			-err);
 		return err;
 	}
+	homa->rpc_cache = kmem_cache_create("homa_rpc",
+			sizeof(struct homa_rpc), 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!homa->rpc_cache) {
+		printk(KERN_ERR "Couldn't create slab cache for homa_rpcs\n");
+		return -ENOMEM;
+	}
 
 	/* Wild guesses to initialize configuration values... */
 	homa->rtt_bytes = 10000;
 	homa->max_grant_window = 0;
 	homa->link_mbps = 10000;
 	homa->poll_usecs = 50;
+	homa->poll_percentile = 0;
+	homa->max_pollers = 0;
 	homa->num_priorities = HOMA_MAX_PRIORITIES;
 	for (i = 0; i < HOMA_MAX_PRIORITIES; i++)
 		homa->priority_map[i] = i;
@@ -140,13 +160,33 @@ int homa_init(struct homa *homa)
 		return err;
 	}
 	homa->pacer_exit = false;
+	homa->reaper_exit = false;
+	homa->reaper_kthread = kthread_run(homa_reaper_main, homa,
+			"homa_reaper");
+	if (IS_ERR(homa->reaper_kthread)) {
+		err = PTR_ERR(homa->reaper_kthread);
+		homa->reaper_kthread = NULL;
+		printk(KERN_ERR "couldn't create homa reaper thread: "
+				"error %d\n", err);
+		return err;
+	}
 	homa->max_nic_queue_ns = 2000;
 	homa->cycles_per_kbyte = 0;
 	homa->verbose = 0;
 	homa->max_gso_size = 10000;
 	homa->max_gro_skbs = 20;
+	homa->max_gro_usecs = 0;
 	homa->gro_policy = HOMA_GRO_NORMAL;
 	homa->gro_busy_usecs = 10;
+	homa->gro_affine_max_backlog = 2;
+	bitmap_zero(homa->softirq_excluded, NR_CPUS);
+	homa->softirq_excluded_ptr = homa->softirq_excluded;
+	bitmap_zero(homa->poll_cores, NR_CPUS);
+	homa->poll_cores_ptr = homa->poll_cores;
+	homa->num_poll_cores = 0;
+	memset(homa->gro_candidates, 0, sizeof(homa->gro_candidates));
+	homa_gro_candidates_changed(homa);
+	memset(homa->napi_ids, 0, sizeof(homa->napi_ids));
 	homa->timer_ticks = 0;
 	spin_lock_init(&homa->metrics_lock);
 	homa->metrics = NULL;
@@ -157,6 +197,8 @@ int homa_init(struct homa *homa)
 	homa->freeze_type = 0;
 	homa->sync_freeze = 0;
 	homa->bpage_lease_usecs = 10000;
+	homa->peer_idle_secs = 120;
+	homa->peer_gc_threshold = 5000;
 	homa_outgoing_sysctl_changed(homa);
 	homa_incoming_sysctl_changed(homa);
 	return 0;
@@ -173,10 +215,23 @@ void homa_destroy(struct homa *homa)
 		homa_pacer_stop(homa);
 		wait_for_completion(&homa_pacer_kthread_done);
 	}
+	if (homa->reaper_kthread) {
+		homa_reaper_stop(homa);
+		wait_for_completion(&homa_reaper_kthread_done);
+	}
+
+	if (homa->num_poll_cores > 0) {
+		bitmap_zero(homa->poll_cores, NR_CPUS);
+		homa_poll_cores_changed(homa);
+	}
 
 	/* The order of the following 2 statements matters! */
 	homa_socktab_destroy(&homa->port_map);
 	homa_peertab_destroy(&homa->peers);
+	if (homa->rpc_cache) {
+		kmem_cache_destroy(homa->rpc_cache);
+		homa->rpc_cache = NULL;
+	}
 	if (core_memory) {
 		vfree(core_memory);
 		core_memory = NULL;
@@ -188,6 +243,226 @@ void homa_destroy(struct homa *homa)
 		kfree(homa->metrics);
 }
 
+/**
+ * homa_rpc_alloc() - Allocate memory for a new homa_rpc. A struct reaped
+ * from an earlier RPC on the same socket is reused if one is available;
+ * otherwise a new one is allocated from the slab cache.
+ * @hsk:    Socket that will own the RPC.
+ *
+ * Return:  The new struct (its contents are undefined), or NULL if
+ *          memory couldn't be allocated.
+ */
+struct homa_rpc *homa_rpc_alloc(struct homa_sock *hsk)
+{
+	struct homa_rpc *rpc = NULL;
+	__u64 start = get_cycles();
+
+	/* Don't bother with the lock if the free list looks empty. */
+	if (!list_empty(&hsk->free_rpcs)) {
+		spin_lock_bh(&hsk->free_rpcs_lock);
+		rpc = list_first_entry_or_null(&hsk->free_rpcs,
+				struct homa_rpc, dead_links);
+		if (rpc) {
+			list_del(&rpc->dead_links);
+			hsk->num_free_rpcs--;
+		}
+		spin_unlock_bh(&hsk->free_rpcs_lock);
+	}
+	if (rpc)
+		INC_METRIC(rpc_recycles, 1);
+	else
+		rpc = kmem_cache_alloc(hsk->homa->rpc_cache, GFP_KERNEL);
+	INC_METRIC(rpc_allocs, 1);
+	INC_METRIC(rpc_alloc_cycles, get_cycles() - start);
+	return rpc;
+}
+
+/**
+ * homa_rpc_recycle() - Invoked by the reaper to dispose of homa_rpc structs
+ * that are no longer in use. They are saved on the socket's free list for
+ * use by future RPCs, up to a limit; any excess is returned to the slab
+ * cache.
+ * @hsk:    Socket that owned the RPCs.
+ * @rpcs:   The structs to dispose of.
+ * @count:  Number of entries in @rpcs.
+ */
+static void homa_rpc_recycle(struct homa_sock *hsk, struct homa_rpc **rpcs,
+		int count)
+{
+	int i = 0;
+
+	if (count == 0)
+		return;
+	spin_lock_bh(&hsk->free_rpcs_lock);
+
+	/* Once the socket has shut down, its free list is about to be
+	 * (or has been) destroyed, so don't add anything to it.
+	 */
+	if (!hsk->shutdown) {
+		for ( ; (i < count) && (hsk->num_free_rpcs
+				< HOMA_MAX_FREE_RPCS); i++) {
+			list_add(&rpcs[i]->dead_links, &hsk->free_rpcs);
+			hsk->num_free_rpcs++;
+		}
+	}
+	spin_unlock_bh(&hsk->free_rpcs_lock);
+	for ( ; i < count; i++)
+		kmem_cache_free(hsk->homa->rpc_cache, rpcs[i]);
+}
+
+/**
+ * homa_rpc_free_list_destroy() - Release all of the homa_rpc structs on a
+ * socket's free list. Invoked when the socket is shut down.
+ * @hsk:    Socket whose free list should be emptied.
+ */
+void homa_rpc_free_list_destroy(struct homa_sock *hsk)
+{
+	struct homa_rpc *rpc, *next;
+	LIST_HEAD(rpcs);
+
+	spin_lock_bh(&hsk->free_rpcs_lock);
+	list_splice_init(&hsk->free_rpcs, &rpcs);
+	hsk->num_free_rpcs = 0;
+	spin_unlock_bh(&hsk->free_rpcs_lock);
+	list_for_each_entry_safe(rpc, next, &rpcs, dead_links)
+		kmem_cache_free(hsk->homa->rpc_cache, rpc);
+}
+
+/**
+ * homa_rpc_table_get() - Return one of a socket's RPC tables, allocating
+ * it if this is the first RPC of its type for the socket. Sockets that
+ * only issue requests never need a server table, and vice versa.
+ * @hsk:    Socket that owns the table.
+ * @slot:   Either &hsk->client_rpcs or &hsk->server_rpcs.
+ * @gfp:    Flags to use if the table must be allocated.
+ *
+ * Return:  The table, or a negative errno if it couldn't be allocated
+ *          or the socket has been shut down. Invoked with no locks held.
+ */
+struct homa_rpc_table *homa_rpc_table_get(struct homa_sock *hsk,
+		struct homa_rpc_table **slot, gfp_t gfp)
+{
+	struct homa_rpc_table *table = smp_load_acquire(slot);
+	int i;
+
+	if (likely(table))
+		return table;
+	table = kmalloc(sizeof(*table), gfp);
+	if (!table)
+		return ERR_PTR(-ENOMEM);
+	for (i = 0; i < HOMA_RPC_BUCKETS; i++) {
+		struct homa_rpc_bucket *bucket = &table->buckets[i];
+
+		spin_lock_init(&bucket->lock);
+		bucket->num_rpcs = 0;
+		bucket->bits = 0;
+		INIT_HLIST_HEAD(&bucket->first);
+		bucket->rpcs = &bucket->first;
+	}
+
+	/* Tables are installed under the socket lock so that they can't
+	 * appear after homa_sock_shutdown has released them.
+	 */
+	homa_sock_lock(hsk, "homa_rpc_table_get");
+	if (hsk->shutdown) {
+		homa_sock_unlock(hsk);
+		kfree(table);
+		return ERR_PTR(-ESHUTDOWN);
+	}
+	if (*slot) {
+		/* Someone else got here first. */
+		homa_sock_unlock(hsk);
+		kfree(table);
+		return *slot;
+	}
+	smp_store_release(slot, table);
+	homa_sock_unlock(hsk);
+	INC_METRIC(rpc_tables, 1);
+	return table;
+}
+
+/**
+ * homa_rpc_table_free_rcu() - Invoked by RCU to free an RPC table once
+ * there can no longer be any lookups in it.
+ * @rcu_head:    Identifies the table.
+ */
+static void homa_rpc_table_free_rcu(struct rcu_head *rcu_head)
+{
+	struct homa_rpc_table *table = container_of(rcu_head,
+			struct homa_rpc_table, rcu_head);
+	int i;
+
+	for (i = 0; i < HOMA_RPC_BUCKETS; i++) {
+		if (table->buckets[i].rpcs != &table->buckets[i].first)
+			kfree(table->buckets[i].rpcs);
+	}
+	kfree(table);
+}
+
+/**
+ * homa_rpc_table_destroy() - Release one of a socket's RPC tables. Invoked
+ * at the end of homa_sock_shutdown, when there are no RPCs left in the
+ * table, but the table is freed via RCU because packet handlers may still
+ * be looking up RPCs in it.
+ * @slot:   Either &hsk->client_rpcs or &hsk->server_rpcs; will be set
+ *          to NULL.
+ */
+void homa_rpc_table_destroy(struct homa_rpc_table **slot)
+{
+	struct homa_rpc_table *table = *slot;
+
+	if (!table)
+		return;
+	WRITE_ONCE(*slot, NULL);
+	call_rcu(&table->rcu_head, homa_rpc_table_free_rcu);
+}
+
+/**
+ * homa_rpc_bucket_add() - Add an RPC to a bucket of an RPC table. If the
+ * bucket has more RPCs than hash chains, its chains are enlarged first.
+ * @bucket:   Bucket in which the RPC belongs; must be locked by the caller.
+ * @rpc:      RPC to add; its id must already be set.
+ */
+void homa_rpc_bucket_add(struct homa_rpc_bucket *bucket,
+		struct homa_rpc *rpc)
+{
+	struct hlist_head *old_rpcs = bucket->rpcs;
+	int old_bits = bucket->bits;
+	struct hlist_head *new_rpcs;
+	struct homa_rpc *other;
+	struct hlist_node *next;
+	int i;
+
+	bucket->num_rpcs++;
+	if ((bucket->num_rpcs > (1 << old_bits))
+			&& (old_bits < HOMA_RPC_BUCKET_MAX_BITS)) {
+		/* We're holding a spinlock, so the allocation must be atomic;
+		 * if it fails, just live with longer chains for now.
+		 */
+		new_rpcs = kmalloc_array(2 << old_bits, sizeof(*new_rpcs),
+				GFP_ATOMIC);
+		if (new_rpcs) {
+			for (i = 0; i < (2 << old_bits); i++)
+				INIT_HLIST_HEAD(&new_rpcs[i]);
+			bucket->rpcs = new_rpcs;
+			bucket->bits = old_bits + 1;
+			for (i = 0; i < (1 << old_bits); i++) {
+				hlist_for_each_entry_safe(other, next,
+						&old_rpcs[i], hash_links) {
+					__hlist_del(&other->hash_links);
+					hlist_add_head(&other->hash_links,
+							homa_rpc_chain(bucket,
+							other->id));
+				}
+			}
+			if (old_rpcs != &bucket->first)
+				kfree(old_rpcs);
+			INC_METRIC(rpc_bucket_grows, 1);
+		}
+	}
+	hlist_add_head(&rpc->hash_links, homa_rpc_chain(bucket, rpc->id));
+}
+
 /**
  * homa_rpc_new_client() - Allocate and construct a client RPC (one that is used
  * to issue an outgoing request). Doesn't send any packets. Invoked with no
@@ -204,17 +479,21 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 {
 	int err;
 	struct homa_rpc *crpc;
+	struct homa_rpc_table *table;
 	struct homa_rpc_bucket *bucket;
 	struct in6_addr dest_addr_as_ipv6 = canonical_ipv6_addr(dest);
 
-	crpc = (struct homa_rpc *) kmalloc(sizeof(*crpc), GFP_KERNEL);
+	table = homa_rpc_table_get(hsk, &hsk->client_rpcs, GFP_KERNEL);
+	if (IS_ERR(table))
+		return ERR_CAST(table);
+	crpc = homa_rpc_alloc(hsk);
 	if (unlikely(!crpc))
 		return ERR_PTR(-ENOMEM);
 
 	/* Initialize fields that don't require the socket lock. */
 	crpc->hsk = hsk;
 	crpc->id = atomic64_fetch_add(2, &hsk->homa->next_outgoing_id);
-	bucket = homa_client_rpc_bucket(hsk, crpc->id);
+	bucket = homa_rpc_table_bucket(table, crpc->id);
 	crpc->lock = &bucket->lock;
 	crpc->state = RPC_OUTGOING;
 	atomic_set(&crpc->flags, 0);
@@ -231,6 +510,9 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	crpc->error = 0;
 	crpc->msgin.total_length = -1;
 	crpc->msgin.num_skbs = 0;
+	crpc->msgin.delivered = 0;
+	crpc->msgin.copied = 0;
+	crpc->msgin.copiers = 0;
 	crpc->msgin.num_bpages = 0;
 	crpc->msgout.length = -1;
 	crpc->msgout.num_skbs = 0;
@@ -239,7 +521,10 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	crpc->interest = NULL;
 	INIT_LIST_HEAD(&crpc->grantable_links);
 	INIT_LIST_HEAD(&crpc->throttled_links);
+	crpc->active_ticks = hsk->homa->timer_ticks;
 	crpc->silent_ticks = 0;
+	crpc->timer_wheel = &homa_cores[raw_smp_processor_id()]->timer_wheel;
+	INIT_LIST_HEAD(&crpc->timer_links);
 	crpc->resend_timer_ticks = hsk->homa->timer_ticks;
 	crpc->done_timer_ticks = 0;
 	crpc->magic = HOMA_RPC_MAGIC;
@@ -250,30 +535,45 @@ struct homa_rpc *homa_rpc_new_client(struct homa_sock *hsk,
 	 * to be performed without holding locks. Also, can't hold spin
 	 * locks while doing things that could block, such as memory allocation.
 	 */
+	rcu_read_lock();
+	if (unlikely(smp_load_acquire(&hsk->client_rpcs) != table)) {
+		/* The socket was shut down and the table is on its way to
+		 * being freed; don't touch its bucket locks.
+		 */
+		rcu_read_unlock();
+		homa_peer_put(crpc->peer);
+		err = -ESHUTDOWN;
+		goto error;
+	}
 	homa_bucket_lock(bucket, client);
 	homa_sock_lock(hsk, "homa_rpc_new_client");
 	if (hsk->shutdown) {
 		homa_sock_unlock(hsk);
 		homa_rpc_unlock(crpc);
+		rcu_read_unlock();
+		homa_peer_put(crpc->peer);
 		err = -ESHUTDOWN;
 		goto error;
 	}
-	hlist_add_head(&crpc->hash_links, &bucket->rpcs);
+	homa_rpc_bucket_add(bucket, crpc);
 	list_add_tail_rcu(&crpc->active_links, &hsk->active_rpcs);
 	homa_sock_unlock(hsk);
+	rcu_read_unlock();
+	homa_rpc_arm_timer(crpc, crpc->active_ticks
+			+ hsk->homa->resend_ticks - 1);
 
 	return crpc;
 
 error:
-	kfree(crpc);
+	kmem_cache_free(hsk->homa->rpc_cache, crpc);
 	return ERR_PTR(err);
 }
 
 /**
  * homa_rpc_new_server() - Allocate and construct a server RPC (one that is
  * used to manage an incoming request). If appropriate, the RPC will also
- * be handed off (we do it here, while we have the socket locked, to avoid
- * acquiring the socket lock a second time).
+ * be handed off (we do it here, while we still hold the bucket lock, so
+ * that no-one else can touch the RPC before it is on the ready queue).
  * @hsk:    Socket that owns this RPC.
  * @source: IP address (network byte order) of the RPC's client.
  * @h:      Header for the first data packet received for this RPC; used
@@ -289,13 +589,19 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	int err;
 	struct homa_rpc *srpc = NULL;
 	__u64 id = homa_local_id(h->common.sender_id);
-	struct homa_rpc_bucket *bucket = homa_server_rpc_bucket(hsk, id);
+	struct homa_rpc_table *table;
+	struct homa_rpc_bucket *bucket;
+
+	table = homa_rpc_table_get(hsk, &hsk->server_rpcs, GFP_ATOMIC);
+	if (IS_ERR(table))
+		return ERR_CAST(table);
+	bucket = homa_rpc_table_bucket(table, id);
 
 	/* Lock the bucket, and make sure no-one else has already created
 	 * the desired RPC.
 	 */
 	homa_bucket_lock(bucket, server);
-	hlist_for_each_entry_rcu(srpc, &bucket->rpcs, hash_links) {
+	hlist_for_each_entry_rcu(srpc, homa_rpc_chain(bucket, id), hash_links) {
 		if ((srpc->id == id) &&
 				(srpc->dport == ntohs(h->common.sport)) &&
 				ipv6_addr_equal(&srpc->peer->addr, source)) {
@@ -307,7 +613,7 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	}
 
 	/* Initialize fields that don't require the socket lock. */
-	srpc = (struct homa_rpc *) kmalloc(sizeof(*srpc), GFP_KERNEL);
+	srpc = homa_rpc_alloc(hsk);
 	if (!srpc) {
 		err = -ENOMEM;
 		goto error;
@@ -328,6 +634,9 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	srpc->error = 0;
 	srpc->msgin.total_length = -1;
 	srpc->msgin.num_skbs = 0;
+	srpc->msgin.delivered = 0;
+	srpc->msgin.copied = 0;
+	srpc->msgin.copiers = 0;
 	srpc->msgin.num_bpages = 0;
 	srpc->msgout.length = -1;
 	srpc->msgout.num_skbs = 0;
@@ -336,7 +645,10 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	srpc->interest = NULL;
 	INIT_LIST_HEAD(&srpc->grantable_links);
 	INIT_LIST_HEAD(&srpc->throttled_links);
+	srpc->active_ticks = hsk->homa->timer_ticks;
 	srpc->silent_ticks = 0;
+	srpc->timer_wheel = &homa_cores[raw_smp_processor_id()]->timer_wheel;
+	INIT_LIST_HEAD(&srpc->timer_links);
 	srpc->resend_timer_ticks = hsk->homa->timer_ticks;
 	srpc->done_timer_ticks = 0;
 	srpc->magic = HOMA_RPC_MAGIC;
@@ -346,23 +658,28 @@ struct homa_rpc *homa_rpc_new_server(struct homa_sock *hsk,
 	homa_sock_lock(hsk, "homa_rpc_new_server");
 	if (hsk->shutdown) {
 		homa_sock_unlock(hsk);
+		homa_peer_put(srpc->peer);
 		err = -ESHUTDOWN;
 		goto error;
 	}
-	hlist_add_head(&srpc->hash_links, &bucket->rpcs);
+	homa_rpc_bucket_add(bucket, srpc);
 	list_add_tail_rcu(&srpc->active_links, &hsk->active_rpcs);
+	homa_sock_unlock(hsk);
 	if (ntohl(h->seg.offset) == 0) {
 		atomic_or(RPC_PKTS_READY, &srpc->flags);
+		homa_sock_ready_lock(hsk);
 		homa_rpc_handoff(srpc);
+		homa_sock_ready_unlock(hsk);
 	}
-	homa_sock_unlock(hsk);
+	homa_rpc_arm_timer(srpc, srpc->active_ticks
+			+ hsk->homa->resend_ticks - 1);
 	INC_METRIC(requests_received, 1);
 	return srpc;
 
 error:
 	spin_unlock_bh(&bucket->lock);
 	if (srpc)
-		kfree(srpc);
+		kmem_cache_free(hsk->homa->rpc_cache, srpc);
 	return ERR_PTR(err);
 }
 
@@ -429,8 +746,8 @@ void homa_rpc_acked(struct homa_sock *hsk, const struct in6_addr *saddr,
 /**
  * homa_rpc_free() - Destructor for homa_rpc; will arrange for all resources
  * associated with the RPC to be released (eventually).
- * @rpc:  Structure to clean up, or NULL. Must be locked. Its socket must
- *        not be locked.
+ * @rpc:  Structure to clean up, or NULL. Must be locked. None of its
+ *        socket's locks may be held by the caller.
  */
 void homa_rpc_free(struct homa_rpc *rpc)
 {
@@ -445,11 +762,48 @@ void homa_rpc_free(struct homa_rpc *rpc)
 	 */
 	rpc->state = RPC_DEAD;
 	homa_remove_from_grantable(rpc->hsk->homa, rpc);
+	homa_rpc_cancel_timer(rpc);
 
-	/* Unlink from all lists, so no-one will ever find this RPC again. */
-	homa_sock_lock(rpc->hsk, "homa_rpc_free");
+	/* Unlink from all lists, so no-one will ever find this RPC again.
+	 * Each list has its own socket lock; these are acquired one at a
+	 * time (never nested).
+	 */
 	__hlist_del(&rpc->hash_links);
+	container_of(rpc->lock, struct homa_rpc_bucket, lock)->num_rpcs--;
+	homa_sock_lock(rpc->hsk, "homa_rpc_free");
 	list_del_rcu(&rpc->active_links);
+	if (unlikely(rpc->msgin.num_bpages))
+		homa_pool_release_buffers(&rpc->hsk->buffer_pool,
+				rpc->msgin.num_bpages, rpc->msgin.bpage_offsets);
+	homa_sock_unlock(rpc->hsk);
+
+	/* RPCs are only added to ready queues and given interests with
+	 * their lock held (which we hold), so it's safe to check these
+	 * without the ready lock.
+	 */
+	if (!list_empty(&rpc->ready_links) || (rpc->interest != NULL)) {
+		homa_sock_ready_lock(rpc->hsk);
+		list_del_init(&rpc->ready_links);
+		if (rpc->interest != NULL) {
+			rpc->interest->reg_rpc = NULL;
+			wake_up_process(rpc->interest->thread);
+			rpc->interest = NULL;
+		}
+		homa_sock_ready_unlock(rpc->hsk);
+	}
+
+	/* If the RPC had incoming bytes, remove them from the global count. */
+	delta = (rpc->msgin.total_length < 0) ? 0
+			: (rpc->msgin.incoming - (rpc->msgin.total_length
+			- rpc->msgin.bytes_remaining));
+	if (delta != 0)
+		atomic_add(-delta, &rpc->hsk->homa->total_incoming);
+	homa_remove_from_throttled(rpc);
+
+	/* This must come last: once the RPC is on dead_rpcs, the reaper
+	 * may start dismantling it.
+	 */
+	homa_sock_dead_lock(rpc->hsk);
 	list_add_tail_rcu(&rpc->dead_links, &rpc->hsk->dead_rpcs);
 	rpc->hsk->dead_skbs += rpc->msgin.num_skbs + rpc->msgout.num_skbs;
 	if (rpc->hsk->dead_skbs > rpc->hsk->homa->max_dead_buffs)
@@ -458,28 +812,10 @@ void homa_rpc_free(struct homa_rpc *rpc)
 		 * missed.
 		 */
 		rpc->hsk->homa->max_dead_buffs = rpc->hsk->dead_skbs;
-	__list_del_entry(&rpc->ready_links);
-	if (rpc->interest != NULL) {
-		rpc->interest->reg_rpc = NULL;
-		wake_up_process(rpc->interest->thread);
-		rpc->interest = NULL;
-	}
+	homa_sock_dead_unlock(rpc->hsk);
 //	tt_record3("Freeing rpc id %d, socket %d, dead_skbs %d", rpc->id,
 //			rpc->hsk->client_port,
 //			rpc->hsk->dead_skbs);
-
-	/* If the RPC had incoming bytes, remove them from the global count. */
-	delta = (rpc->msgin.total_length < 0) ? 0
-			: (rpc->msgin.incoming - (rpc->msgin.total_length
-			- rpc->msgin.bytes_remaining));
-	if (delta != 0)
-		atomic_add(-delta, &rpc->hsk->homa->total_incoming);
-	if (unlikely(rpc->msgin.num_bpages))
-		homa_pool_release_buffers(&rpc->hsk->buffer_pool,
-				rpc->msgin.num_bpages, rpc->msgin.bpage_offsets);
-
-	homa_sock_unlock(rpc->hsk);
-	homa_remove_from_throttled(rpc);
 }
 
 /**
@@ -507,6 +843,7 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 #endif
 	struct sk_buff *skbs[BATCH_MAX];
 	struct homa_rpc *rpcs[BATCH_MAX];
+	struct sk_buff *skb;
 	int num_skbs, num_rpcs;
 	struct homa_rpc *rpc;
 	int i, batch_size;
@@ -525,14 +862,14 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 		count -= batch_size;
 		num_skbs = num_rpcs = 0;
 
-		homa_sock_lock(hsk, "homa_rpc_reap");
+		homa_sock_dead_lock(hsk);
 		if (atomic_read(&hsk->protect_count)) {
 			INC_METRIC(disabled_reaps, 1);
 			tt_record2("homa_rpc_reap returning: protect_count "
 					"%d, dead_skbs %d",
 					atomic_read(&hsk->protect_count),
 					hsk->dead_skbs);
-			homa_sock_unlock(hsk);
+			homa_sock_dead_unlock(hsk);
 			return 0;
 		}
 
@@ -560,7 +897,6 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 			i = 0;
 			if (rpc->msgin.total_length >= 0) {
 				while (1) {
-					struct sk_buff *skb;
 					skb = skb_dequeue(&rpc->msgin.packets);
 					if (!skb)
 						break;
@@ -582,16 +918,31 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 				goto release;
 		}
 
-		/* Free all of the collected resources; release the socket
+		/* Free all of the collected resources; release the dead
 		 * lock while doing this.
 		 */
 	release:
 		hsk->dead_skbs -= num_skbs;
 		result = !list_empty(&hsk->dead_rpcs)
 				&& ((num_skbs + num_rpcs) != 0);
-		homa_sock_unlock(hsk);
-		for (i = 0; i < num_skbs; i++)
-			kfree_skb(skbs[i]);
+		homa_sock_dead_unlock(hsk);
+
+		/* Free skbs now that the dead lock has been released. With
+		 * BH disabled and a nonzero budget, napi_consume_skb can
+		 * stash the sk_buffs in the per-core NAPI cache, which
+		 * returns them to the slab allocator in bulk. Outgoing
+		 * packets may still be referenced by the NIC (see
+		 * homa_xmit_data); just drop our references to those.
+		 */
+		local_bh_disable();
+		for (i = 0; i < num_skbs; i++) {
+			skb = skbs[i];
+			if (refcount_read(&skb->users) > 1)
+				kfree_skb(skb);
+			else
+				napi_consume_skb(skb, num_skbs);
+		}
+		local_bh_enable();
 		for (i = 0; i < num_rpcs; i++) {
 			UNIT_LOG("; ", "reaped %llu", rpcs[i]->id);
 			/* Lock and unlock the RPC before freeing it. This
@@ -602,8 +953,9 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 			homa_rpc_lock(rpcs[i]);
 			homa_rpc_unlock(rpcs[i]);
 			rpcs[i]->state = 0;
-			kfree(rpcs[i]);
+			homa_peer_put(rpcs[i]->peer);
 		}
+		homa_rpc_recycle(hsk, rpcs, num_rpcs);
 		tt_record4("reaped %d skbs, %d rpcs; %d skbs remain for port %d",
 				num_skbs, num_rpcs, hsk->dead_skbs, hsk->port);
 		if (!result)
@@ -612,6 +964,93 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 	return result;
 }
 
+/**
+ * homa_reap_sockets() - Make one pass over all of the Homa sockets,
+ * freeing resources for dead RPCs. Invoked by the reaper thread.
+ * @homa:    Overall data about the Homa protocol implementation.
+ *
+ * Return:   Nonzero means there is still reaping work to do.
+ */
+int homa_reap_sockets(struct homa *homa)
+{
+	struct homa_socktab_scan scan;
+	struct homa_sock *hsk;
+	int count, result = 0;
+
+	/* The rcu_read_lock below prevents sockets from being deleted
+	 * during the scan.
+	 */
+	rcu_read_lock();
+	for (hsk = homa_socktab_start_scan(&homa->port_map, &scan);
+			hsk != NULL; hsk = homa_socktab_next(&scan)) {
+		if (list_empty(&hsk->dead_rpcs))
+			continue;
+
+		/* The more dead buffers a socket has accumulated, the more
+		 * we free in this pass, so that a large backlog shrinks
+		 * quickly, while a small one is handled in short bursts.
+		 * The work is capped because we can't reschedule while
+		 * holding rcu_read_lock; the reaper thread calls us again
+		 * (after yielding) if work remains.
+		 */
+		count = homa->reap_limit + hsk->dead_skbs/4;
+		if (count > HOMA_MAX_REAP_SCALE*homa->reap_limit)
+			count = HOMA_MAX_REAP_SCALE*homa->reap_limit;
+		if (homa_rpc_reap(hsk, count))
+			result = 1;
+	}
+	rcu_read_unlock();
+	return result;
+}
+
+/**
+ * homa_reaper_main() - Top-level function for the reaper thread, which
+ * frees the resources of dead RPCs so that this work doesn't have to be
+ * done by application threads or in SoftIRQ. See reap.txt.
+ * @transportInfo:  Pointer to struct homa.
+ *
+ * Return:         Always 0.
+ */
+int homa_reaper_main(void *transportInfo)
+{
+	struct homa *homa = (struct homa *) transportInfo;
+	__u64 start;
+	int more;
+
+	while (1) {
+		if (homa->reaper_exit)
+			break;
+		start = get_cycles();
+		more = homa_reap_sockets(homa);
+		INC_METRIC(reaper_thread_cycles, get_cycles() - start);
+
+		/* Sleep if there is nothing left to reap (homa_timer will
+		 * wake us up when more dead RPCs accumulate). Otherwise
+		 * just give other threads a chance to run.
+		 */
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (more)
+			__set_current_state(TASK_RUNNING);
+		schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+	complete_and_exit(&homa_reaper_kthread_done, 0);
+	return 0;
+}
+
+/**
+ * homa_reaper_stop() - Will cause the reaper thread to exit (waking it up
+ * if necessary); doesn't return until after the reaper thread has exited.
+ * @homa:    Overall data about the Homa protocol implementation.
+ */
+void homa_reaper_stop(struct homa *homa)
+{
+	homa->reaper_exit = true;
+	wake_up_process(homa->reaper_kthread);
+	kthread_stop(homa->reaper_kthread);
+	homa->reaper_kthread = NULL;
+}
+
 /**
  * homa_find_client_rpc() - Locate client-side information about the RPC that
  * a packet belongs to, if there is any. Thread-safe without socket lock.
@@ -625,14 +1064,27 @@ int homa_rpc_reap(struct homa_sock *hsk, int count)
 struct homa_rpc *homa_find_client_rpc(struct homa_sock *hsk, __u64 id)
 {
 	struct homa_rpc *crpc;
-	struct homa_rpc_bucket *bucket = homa_client_rpc_bucket(hsk, id);
+	struct homa_rpc_bucket *bucket;
+
+	rcu_read_lock();
+	bucket = homa_client_rpc_bucket(hsk, id);
+	if (unlikely(!bucket)) {
+		rcu_read_unlock();
+		return NULL;
+	}
 	homa_bucket_lock(bucket, client);
-	hlist_for_each_entry_rcu(crpc, &bucket->rpcs, hash_links) {
+	hlist_for_each_entry_rcu(crpc, homa_rpc_chain(bucket, id), hash_links) {
 		if (crpc->id == id) {
+			/* Once we hold a live RPC's lock, the table can't be
+			 * destroyed until that RPC has been reaped, so RCU
+			 * protection is no longer needed.
+			 */
+			rcu_read_unlock();
 			return crpc;
 		}
 	}
 	spin_unlock_bh(&bucket->lock);
+	rcu_read_unlock();
 	return NULL;
 }
 
@@ -652,15 +1104,61 @@ struct homa_rpc *homa_find_server_rpc(struct homa_sock *hsk,
 		const struct in6_addr *saddr, __u16 sport, __u64 id)
 {
 	struct homa_rpc *srpc;
-	struct homa_rpc_bucket *bucket = homa_server_rpc_bucket(hsk, id);
+	struct homa_rpc_bucket *bucket;
+
+	rcu_read_lock();
+	bucket = homa_server_rpc_bucket(hsk, id);
+	if (unlikely(!bucket)) {
+		rcu_read_unlock();
+		return NULL;
+	}
 	homa_bucket_lock(bucket, server);
-	hlist_for_each_entry_rcu(srpc, &bucket->rpcs, hash_links) {
+	hlist_for_each_entry_rcu(srpc, homa_rpc_chain(bucket, id), hash_links) {
 		if ((srpc->id == id) && (srpc->dport == sport) &&
 				ipv6_addr_equal(&srpc->peer->addr, saddr)) {
+			rcu_read_unlock();
 			return srpc;
 		}
 	}
 	spin_unlock_bh(&bucket->lock);
+	rcu_read_unlock();
+	return NULL;
+}
+
+/**
+ * homa_find_partial_rpc() - Locate a server RPC whose request has been
+ * partially returned to the application by recvmsg (HOMA_RECVMSG_PARTIAL).
+ * The application doesn't supply the client's address when it waits for
+ * more of such a request, so the lookup is by id only.
+ * @hsk:      Socket on which the request is arriving.
+ * @id:       Unique identifier for the RPC (must have server bit set).
+ *
+ * Return:    A pointer to the first RPC with the given id whose request
+ *            has been partially delivered, or NULL if none. The RPC will
+ *            be locked; the caller must eventually unlock it by invoking
+ *            homa_rpc_unlock.
+ */
+struct homa_rpc *homa_find_partial_rpc(struct homa_sock *hsk, __u64 id)
+{
+	struct homa_rpc *srpc;
+	struct homa_rpc_bucket *bucket;
+
+	rcu_read_lock();
+	bucket = homa_server_rpc_bucket(hsk, id);
+	if (unlikely(!bucket)) {
+		rcu_read_unlock();
+		return NULL;
+	}
+	homa_bucket_lock(bucket, server);
+	hlist_for_each_entry_rcu(srpc, homa_rpc_chain(bucket, id), hash_links) {
+		if ((srpc->id == id) && (srpc->state == RPC_INCOMING)
+				&& (srpc->msgin.delivered > 0)) {
+			rcu_read_unlock();
+			return srpc;
+		}
+	}
+	spin_unlock_bh(&bucket->lock);
+	rcu_read_unlock();
 	return NULL;
 }
 
@@ -1265,6 +1763,18 @@ char *homa_print_metrics(struct homa *homa)
 				"responses_queued          %15llu  "
 				"Responses for which no thread was waiting\n",
 				m->responses_queued);
+		homa_append_metric(homa,
+				"handoffs_same_core        %15llu  "
+				"Handoffs to threads on the SoftIRQ core\n",
+				m->handoffs_same_core);
+		homa_append_metric(homa,
+				"handoffs_same_node        %15llu  "
+				"Handoffs to other cores in the same NUMA node\n",
+				m->handoffs_same_node);
+		homa_append_metric(homa,
+				"handoffs_cross_node       %15llu  "
+				"Handoffs to threads in a different NUMA node\n",
+				m->handoffs_cross_node);
 		homa_append_metric(homa,
 				"fast_wakeups              %15llu  "
 				"Messages received while polling\n",
@@ -1277,6 +1787,53 @@ char *homa_print_metrics(struct homa *homa)
 				"poll_cycles               %15llu  "
 				"Time spent polling for incoming messages\n",
 				m->poll_cycles);
+		homa_append_metric(homa,
+				"poll_budget_updates       %15llu  "
+				"Recomputations of per-socket polling times\n",
+				m->poll_budget_updates);
+		homa_append_metric(homa,
+				"pollers_limited           %15llu  "
+				"Waits that slept without polling (max_pollers)\n",
+				m->pollers_limited);
+		homa_append_metric(homa,
+				"napi_polls                %15llu  "
+				"Calls to napi_busy_loop while waiting for "
+				"messages\n",
+				m->napi_polls);
+		homa_append_metric(homa,
+				"napi_poll_pkts            %15llu  "
+				"Packets handled in GRO on a busy-polling "
+				"core\n",
+				m->napi_poll_pkts);
+		homa_append_metric(homa,
+				"gro_age_flushes           %15llu  "
+				"GRO batches flushed because of max_gro_usecs\n",
+				m->gro_age_flushes);
+		homa_append_metric(homa,
+				"gro_affine_batches        %15llu  "
+				"GRO batches steered to RPC's preferred core\n",
+				m->gro_affine_batches);
+		homa_append_metric(homa,
+				"gro_affine_overrides      %15llu  "
+				"GRO batches moved off overloaded preferred "
+				"core\n",
+				m->gro_affine_overrides);
+		homa_append_metric(homa,
+				"gro_load_feedback_batches %15llu  "
+				"GRO batches steered by LOAD_FEEDBACK policy\n",
+				m->gro_load_feedback_batches);
+		homa_append_metric(homa,
+				"gro_load_feedback_busy    %15llu  "
+				"LOAD_FEEDBACK batches steered to a busy core\n",
+				m->gro_load_feedback_busy);
+		homa_append_metric(homa,
+				"poll_core_loops           %15llu  "
+				"Iterations of dedicated polling core loops\n",
+				m->poll_core_loops);
+		homa_append_metric(homa,
+				"poll_core_napi_polls      %15llu  "
+				"NIC queue polls by dedicated polling cores\n",
+				m->poll_core_napi_polls);
 		homa_append_metric(homa,
 				"softirq_calls             %15llu  "
 				"Calls to homa_softirq (i.e. # GRO pkts "
@@ -1291,6 +1848,28 @@ char *homa_print_metrics(struct homa *homa)
 				"Time spent in homa_softirq during bypass "
 				"from GRO\n",
 				m->bypass_softirq_cycles);
+		homa_append_metric(homa,
+				"softirq_control_pkts      %15llu  "
+				"Control packets handled ahead of DATA in "
+				"homa_softirq\n",
+				m->softirq_control_pkts);
+		homa_append_metric(homa,
+				"softirq_data_regrouped    %15llu  "
+				"DATA packets regrouped by RPC in homa_softirq\n",
+				m->softirq_data_regrouped);
+		homa_append_metric(homa,
+				"softirq_grant_delay_cycles%15llu  "
+				"Time from homa_softirq start until GRANTs "
+				"dispatched\n",
+				m->softirq_grant_delay_cycles);
+		homa_append_metric(homa,
+				"lcache_hits               %15llu  "
+				"Incoming packets whose RPC was already locked\n",
+				m->lcache_hits);
+		homa_append_metric(homa,
+				"lcache_misses             %15llu  "
+				"Incoming packets that required RPC lookup\n",
+				m->lcache_misses);
 		homa_append_metric(homa,
 				"linux_softirq_cycles      %15llu  "
 				"Time spent in all Linux SoftIRQ\n",
@@ -1315,10 +1894,42 @@ char *homa_print_metrics(struct homa *homa)
 				"recv_calls                %15llu  "
 				"Total invocations of recvmsg kernel call\n",
 				m->recv_calls);
+		homa_append_metric(homa,
+				"partial_recvs             %15llu  "
+				"Incomplete messages returned by recvmsg\n",
+				m->partial_recvs);
 		homa_append_metric(homa,
 				"blocked_cycles            %15llu  "
 				"Time spent blocked in homa_recvmsg\n",
 				m->blocked_cycles);
+		homa_append_metric(homa,
+				"copy_out_cycles           %15llu  "
+				"Time spent copying message data to user "
+				"space\n",
+				m->copy_out_cycles);
+		homa_append_metric(homa,
+				"copy_out_bytes            %15llu  "
+				"Bytes of message data copied to user space\n",
+				m->copy_out_bytes);
+		homa_append_metric(homa,
+				"copy_out_batches          %15llu  "
+				"Batches of copies (RPC unlocks) in "
+				"homa_copy_to_user\n",
+				m->copy_out_batches);
+		homa_append_metric(homa,
+				"copy_out_merges           %15llu  "
+				"Chunks sharing an iov_iter with the "
+				"previous chunk\n",
+				m->copy_out_merges);
+		homa_append_metric(homa,
+				"copy_out_pinned_bytes     %15llu  "
+				"Bytes copied out through kernel mappings "
+				"of pinned regions\n",
+				m->copy_out_pinned_bytes);
+		homa_append_metric(homa,
+				"copy_out_pinned_cycles    %15llu  "
+				"Time spent copying out to pinned regions\n",
+				m->copy_out_pinned_cycles);
 		homa_append_metric(homa,
 				"reply_cycles              %15llu  "
 				"Time spent in homa_ioc_reply kernel call\n",
@@ -1343,6 +1954,22 @@ char *homa_print_metrics(struct homa *homa)
 				"so_set_buf_calls          %15llu  "
 				"Total invocations of setsockopt SO_HOMA_SET_BUF\n",
 				m->so_set_buf_calls);
+		homa_append_metric(homa,
+				"buf_pinned_pages          %15llu  "
+				"Pages pinned for buffer regions\n",
+				m->buf_pinned_pages);
+		homa_append_metric(homa,
+				"buf_regions_added         %15llu  "
+				"Regions added to buffer pools\n",
+				m->buf_regions_added);
+		homa_append_metric(homa,
+				"buf_regions_retired       %15llu  "
+				"Regions retired from buffer pools\n",
+				m->buf_regions_retired);
+		homa_append_metric(homa,
+				"buf_retire_busy           %15llu  "
+				"Region retirements refused: region in use\n",
+				m->buf_retire_busy);
 		homa_append_metric(homa,
 				"grant_cycles              %15llu  "
 				"Time spent sending grants\n",
@@ -1355,10 +1982,28 @@ char *homa_print_metrics(struct homa *homa)
 				"timer_reap_cycles         %15llu  "
 				"Time in homa_timer spent reaping RPCs\n",
 				m->timer_reap_cycles);
+		homa_append_metric(homa,
+				"timer_rpc_checks          %15llu  "
+				"RPCs checked by homa_timer\n",
+				m->timer_rpc_checks);
+		homa_append_metric(homa,
+				"softirq_timer_checks      %15llu  "
+				"RPCs checked by homa_softirq instead of "
+				"homa_timer\n",
+				m->softirq_timer_checks);
 		homa_append_metric(homa,
 				"data_pkt_reap_cycles      %15llu  "
 				"Time in homa_data_pkt spent reaping RPCs\n",
 				m->data_pkt_reap_cycles);
+		homa_append_metric(homa,
+				"reaper_thread_cycles      %15llu  "
+				"Time spent in the background reaper thread\n",
+				m->reaper_thread_cycles);
+		homa_append_metric(homa,
+				"wait_reap_cycles          %15llu  "
+				"Time in homa_wait_for_message spent reaping "
+				"RPCs\n",
+				m->wait_reap_cycles);
 		homa_append_metric(homa,
 				"pacer_cycles              %15llu  "
 				"Time spent in homa_pacer_main\n",
@@ -1400,6 +2045,10 @@ char *homa_print_metrics(struct homa *homa)
 				"peer_hash_links           %15llu  "
 				"Hash chain link traversals in peer table\n",
 				m->peer_hash_links);
+		homa_append_metric(homa,
+				"peer_lookups              %15llu  "
+				"Calls to homa_peer_find\n",
+				m->peer_lookups);
 		homa_append_metric(homa,
 				"peer_new_entries          %15llu  "
 				"New entries created in peer table\n",
@@ -1414,6 +2063,19 @@ char *homa_print_metrics(struct homa *homa)
 				"Routing failures creating peer table "
 				"entries\n",
 				m->peer_route_errors);
+		homa_append_metric(homa,
+				"peer_evictions            %15llu  "
+				"Idle entries removed from peer table\n",
+				m->peer_evictions);
+		homa_append_metric(homa,
+				"peer_table_resizes        %15llu  "
+				"Times the peer table's bucket array was "
+				"resized\n",
+				m->peer_table_resizes);
+		homa_append_metric(homa,
+				"peer_gc_cycles            %15llu  "
+				"Time spent removing idle peers\n",
+				m->peer_gc_cycles);
 		homa_append_metric(homa,
 				"control_xmit_errors       %15llu  "
 				"Errors sending control packets\n",
@@ -1487,6 +2149,22 @@ char *homa_print_metrics(struct homa *homa)
 				"socket_lock_miss_cycles   %15llu  "
 				"Time lost waiting for socket locks\n",
 				m->socket_lock_miss_cycles);
+		homa_append_metric(homa,
+				"ready_lock_misses         %15llu  "
+				"Socket ready lock misses\n",
+				m->ready_lock_misses);
+		homa_append_metric(homa,
+				"ready_lock_miss_cycles    %15llu  "
+				"Time lost waiting for socket ready locks\n",
+				m->ready_lock_miss_cycles);
+		homa_append_metric(homa,
+				"dead_lock_misses          %15llu  "
+				"Socket dead lock misses\n",
+				m->dead_lock_misses);
+		homa_append_metric(homa,
+				"dead_lock_miss_cycles     %15llu  "
+				"Time lost waiting for socket dead locks\n",
+				m->dead_lock_miss_cycles);
 		homa_append_metric(homa,
 				"throttle_lock_misses      %15llu  "
 				"Throttle lock misses\n",
@@ -1504,13 +2182,10 @@ char *homa_print_metrics(struct homa *homa)
 				"Time lost waiting for grantable lock\n",
 				m->grantable_lock_miss_cycles);
 		homa_append_metric(homa,
-				"peer_ack_lock_misses      %15llu  "
-				"Misses on peer ack locks\n",
-				m->peer_ack_lock_misses);
-		homa_append_metric(homa,
-				"peer_ack_lock_miss_cycles %15llu  "
-				"Time lost waiting for peer ack locks\n",
-				m->peer_ack_lock_miss_cycles);
+				"peer_ack_retries          %15llu  "
+				"Retries due to contention for peer ack "
+				"rings\n",
+				m->peer_ack_retries);
 		homa_append_metric(homa,
 				"disabled_reaps            %15llu  "
 				"Reaper invocations that were disabled\n",
@@ -1528,6 +2203,28 @@ char *homa_print_metrics(struct homa *homa)
 				"Sum of hsk->dead_skbs across all reaper "
 				"calls\n",
 				m->reaper_dead_skbs);
+		homa_append_metric(homa,
+				"rpc_allocs                %15llu  "
+				"Homa_rpc structs allocated\n",
+				m->rpc_allocs);
+		homa_append_metric(homa,
+				"rpc_alloc_cycles          %15llu  "
+				"Time spent allocating homa_rpc structs\n",
+				m->rpc_alloc_cycles);
+		homa_append_metric(homa,
+				"rpc_recycles              %15llu  "
+				"Homa_rpc allocations satisfied from socket "
+				"free lists\n",
+				m->rpc_recycles);
+		homa_append_metric(homa,
+				"rpc_tables                %15llu  "
+				"Per-socket RPC hash tables allocated\n",
+				m->rpc_tables);
+		homa_append_metric(homa,
+				"rpc_bucket_grows          %15llu  "
+				"Times an RPC hash bucket enlarged its "
+				"chains\n",
+				m->rpc_bucket_grows);
 		homa_append_metric(homa,
 				"forced_reaps              %15llu  "
 				"Reaps forced by accumulation of dead RPCs\n",
@@ -1552,7 +2249,7 @@ char *homa_print_metrics(struct homa *homa)
 				m->fifo_grants_no_incoming);
 		homa_append_metric(homa,
 				"ack_overflows             %15llu  "
-				"Explicit ACKs sent because peer->acks was "
+				"Explicit ACKs sent because peer ack ring was "
 				"full\n",
 				m->ack_overflows);
 		homa_append_metric(homa,
@@ -1561,10 +2258,43 @@ char *homa_print_metrics(struct homa *homa)
 				"yet received\n",
 				m->ignored_need_acks);
 		homa_append_metric(homa,
-				"bpage_reuses              %15llu  "
-				"Buffer page could be reused because ref "
-				"count was zero\n",
-				m->bpage_reuses);
+				"slot_allocs               %15llu  "
+				"Message fragments allocated from size-class "
+				"slots\n",
+				m->slot_allocs);
+		homa_append_metric(homa,
+				"slot_page_adoptions       %15llu  "
+				"Partially free slot pages reused by a new "
+				"core\n",
+				m->slot_page_adoptions);
+		homa_append_metric(homa,
+				"bpage_local_allocs        %15llu  "
+				"Bpages allocated from the requester's "
+				"NUMA node\n",
+				m->bpage_local_allocs);
+		homa_append_metric(homa,
+				"bpage_remote_allocs       %15llu  "
+				"Bpages allocated from a remote NUMA node\n",
+				m->bpage_remote_allocs);
+		homa_append_metric(homa,
+				"bpage_unplaced_allocs     %15llu  "
+				"Bpages allocated whose NUMA node wasn't "
+				"known\n",
+				m->bpage_unplaced_allocs);
+		homa_append_metric(homa,
+				"bpage_late_placements     %15llu  "
+				"Bpages whose NUMA node was found after "
+				"first use\n",
+				m->bpage_late_placements);
+		homa_append_metric(homa,
+				"bpage_alloc_probes        %15llu  "
+				"Candidate bpages examined during allocation\n",
+				m->bpage_alloc_probes);
+		homa_append_metric(homa,
+				"bpage_reclaim_sweeps      %15llu  "
+				"Scans of all bpages in a pool for "
+				"free pages\n",
+				m->bpage_reclaim_sweeps);
 		for (i = 0; i < NUM_TEMP_METRICS;  i++)
 			homa_append_metric(homa,
 					"temp%-2d                  %15llu  "
@@ -50,6 +50,7 @@ int mock_import_iovec_errors = 0;
 int mock_ip6_xmit_errors = 0;
 int mock_ip_queue_xmit_errors = 0;
 int mock_kmalloc_errors = 0;
+int mock_pin_errors = 0;
 int mock_route_errors = 0;
 int mock_spin_lock_held = 0;
 int mock_trylock_errors = 0;
@@ -58,8 +59,22 @@ int mock_vmalloc_errors = 0;
 /* The return value from calls to signal_pending(). */
 int mock_signal_pending = 0;
 
+/* The return value from calls to rlimit(). */
+unsigned long mock_rlimit = RLIM_INFINITY;
+
+/* The return value from calls to capable(). */
+int mock_capable = 0;
+
+/* Address space of mock_task; its pinned_vm should be 0 at the end
+ * of each test.
+ */
+struct mm_struct mock_mm;
+
+/* Number of mmgrab calls on mock_mm not yet matched by mmdrop. */
+static int mock_mm_grabs = 0;
+
 /* Used as current task during tests. */
-struct task_struct mock_task;
+struct task_struct mock_task = {.mm = &mock_mm};
 
 /* If a test sets this variable to nonzero, ip_queue_xmit will log
  * outgoing packets using the long format rather than short.
@@ -83,6 +98,34 @@ int mock_max_grants = 10;
  */
 int mock_copy_to_user_dont_copy = 0;
 
+/* cpu_to_node will return (core / mock_cores_per_node). */
+int mock_cores_per_node = 4;
+
+/* If nonzero, mock_page_node will return 1 for addresses at or above
+ * this value (and 0 for addresses below it).
+ */
+__u64 mock_page_node_split = 0;
+
+/* If nonzero, mock_page_node will return NUMA_NO_NODE for addresses at
+ * or above this value (this takes precedence over mock_page_node_split).
+ */
+__u64 mock_page_node_unplaced = 0;
+
+/* If nonzero, mock_page_huge will report that all pages are part of
+ * huge pages.
+ */
+int mock_huge_pages = 0;
+
+/* pin_user_pages_fast returns pages from this array: the page for user
+ * address A is mock_pages[(A >> PAGE_SHIFT) % MOCK_NUM_PAGES].
+ */
+struct page mock_pages[MOCK_NUM_PAGES];
+
+/* Number of pages pinned by pin_user_pages_fast but not yet unpinned.
+ * Should be 0 at the end of each test.
+ */
+static int mock_pinned_pages = 0;
+
 /* HOMA_BPAGE_SIZE will evaluate to this. */
 int mock_bpage_size = 0x10000;
 
@@ -124,6 +167,15 @@ static int mock_active_locks = 0;
  */
 static int mock_active_rcu_locks = 0;
 
+/* The number of times local_bh_disable has been called minus the number
+ * of times local_bh_enable has been called.
+ * Should be 0 at the end of each test.
+ */
+static int mock_active_bh_disables = 0;
+
+/* Number of skbs freed by napi_consume_skb during the current test. */
+int mock_napi_consumed = 0;
+
 /* Used as the return value for calls to get_cycles. A value of ~0 means
  * return actual clock time.
  */
@@ -208,6 +260,13 @@ struct sk_buff *__alloc_skb(unsigned int size, gfp_t priority, int flags,
 	return skb;
 }
 
+void call_rcu(struct rcu_head *head, rcu_callback_t func)
+{
+	if (mock_log_rcu_sched)
+		unit_log_printf("; ", "call_rcu");
+	func(head);
+}
+
 void call_rcu_sched(struct rcu_head *head, rcu_callback_t func)
 {
 	if (mock_log_rcu_sched)
@@ -517,6 +576,18 @@ void iov_iter_init(struct iov_iter *i, unsigned int direction,
 	i->count = count;
 }
 
+void iov_iter_bvec(struct iov_iter *i, unsigned int direction,
+			const struct bio_vec *bvec, unsigned long nr_segs,
+			size_t count)
+{
+	direction &= READ | WRITE;
+	i->iter_type = ITER_BVEC | direction;
+	i->bvec = bvec;
+	i->nr_segs = nr_segs;
+	i->iov_offset = 0;
+	i->count = count;
+}
+
 void iov_iter_revert(struct iov_iter *i, size_t bytes)
 {
 	unit_log_printf("; ", "iov_iter_revert %lu", bytes);
@@ -674,6 +745,15 @@ void kfree_skb_reason(struct sk_buff *skb, enum skb_drop_reason reason)
 	free(skb);
 }
 
+void kfree_skb_list(struct sk_buff *segs)
+{
+	while (segs) {
+		struct sk_buff *next = segs->next;
+		kfree_skb(segs);
+		segs = next;
+	}
+}
+
 void *mock_kmalloc(size_t size, gfp_t flags)
 {
 	if (mock_check_error(&mock_kmalloc_errors))
@@ -689,6 +769,40 @@ void *mock_kmalloc(size_t size, gfp_t flags)
 	return block;
 }
 
+/* Mock slab caches just record the object size (the "struct kmem_cache"
+ * pointer actually refers to an unsigned int); objects are allocated
+ * with mock_kmalloc, so they are subject to mock_kmalloc_errors and
+ * leak checking.
+ */
+struct kmem_cache *mock_kmem_cache_create(const char *name, unsigned int size,
+		unsigned int align, slab_flags_t flags, void (*ctor)(void *))
+{
+	unsigned int *cache = malloc(sizeof(*cache));
+
+	*cache = size;
+	return (struct kmem_cache *) cache;
+}
+
+void *mock_kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
+{
+	return mock_kmalloc(*((unsigned int *) cache), flags);
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *objp)
+{
+	kfree(objp);
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	free(cache);
+}
+
+void kthread_bind(struct task_struct *k, unsigned int cpu)
+{
+	unit_log_printf("; ", "kthread_bind cpu %d", cpu);
+}
+
 struct task_struct *kthread_create_on_node(int (*threadfn)(void *data),
 					   void *data, int node,
 					   const char namefmt[],
@@ -697,6 +811,11 @@ struct task_struct *kthread_create_on_node(int (*threadfn)(void *data),
 	return NULL;
 }
 
+bool kthread_should_stop(void)
+{
+	return true;
+}
+
 int kthread_stop(struct task_struct *k)
 {
 	return 0;
@@ -746,6 +865,24 @@ void mutex_unlock(struct mutex *lock)
 	mock_active_locks--;
 }
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+void napi_busy_loop(unsigned int napi_id,
+		bool (*loop_end)(void *, unsigned long),
+		void *loop_end_arg, bool prefer_busy_poll, u16 budget)
+{
+	unit_log_printf("; ", "napi_busy_loop id %u, napi_polling %d",
+			napi_id, homa_cores[cpu_number]->napi_polling);
+}
+#endif
+
+void napi_consume_skb(struct sk_buff *skb, int budget)
+{
+	if (budget && (mock_active_bh_disables == 0))
+		FAIL(" napi_consume_skb called with BH enabled");
+	mock_napi_consumed++;
+	kfree_skb(skb);
+}
+
 int netif_receive_skb(struct sk_buff *skb)
 {
 	struct data_header *h = (struct data_header *)
@@ -755,6 +892,20 @@ int netif_receive_skb(struct sk_buff *skb)
 	return 0;
 }
 
+int pin_user_pages_fast(unsigned long start, int nr_pages,
+		unsigned int gup_flags, struct page **pages)
+{
+	int i;
+
+	if (mock_check_error(&mock_pin_errors))
+		return -EFAULT;
+	for (i = 0; i < nr_pages; i++)
+		pages[i] = &mock_pages[((start >> PAGE_SHIFT) + i)
+				% MOCK_NUM_PAGES];
+	mock_pinned_pages += nr_pages;
+	return nr_pages;
+}
+
 long prepare_to_wait_event(struct wait_queue_head *wq_head,
 		struct wait_queue_entry *wq_entry, int state)
 {
@@ -781,6 +932,12 @@ struct proc_dir_entry *proc_create(const char *name, umode_t mode,
 	return entry;
 }
 
+int proc_do_large_bitmap(struct ctl_table *table, int write,
+		void *buffer, size_t *lenp, loff_t *ppos)
+{
+	return 0;
+}
+
 int proc_dointvec(struct ctl_table *table, int write,
 		     void __user *buffer, size_t *lenp, loff_t *ppos)
 {
@@ -858,6 +1015,8 @@ void release_sock(struct sock *sk)
 	sk->sk_lock.owned = 0;
 }
 
+void rcu_barrier(void) {}
+
 void remove_wait_queue(struct wait_queue_head *wq_head,
 		struct wait_queue_entry *wq_entry) {}
 
@@ -888,6 +1047,29 @@ int skb_copy_datagram_iter(const struct sk_buff *from, int offset,
 				bytes_left, iter->count);
 		return 0;
 	}
+	if (iov_iter_is_bvec(iter)) {
+		while (bytes_left > 0) {
+			const struct bio_vec *bvec = iter->bvec;
+			size_t chunk_bytes = bvec->bv_len - iter->iov_offset;
+			if (chunk_bytes > bytes_left)
+				chunk_bytes = bytes_left;
+			unit_log_printf("; ",
+					"skb_copy_datagram_iter: %lu bytes to "
+					"page %ld+0x%lx: ", chunk_bytes,
+					bvec->bv_page - mock_pages,
+					bvec->bv_offset + iter->iov_offset);
+			unit_log_data(NULL, from->data + offset + size
+					- bytes_left, chunk_bytes);
+			bytes_left -= chunk_bytes;
+			iter->count -= chunk_bytes;
+			iter->iov_offset += chunk_bytes;
+			if (iter->iov_offset == bvec->bv_len) {
+				iter->bvec++;
+				iter->iov_offset = 0;
+			}
+		}
+		return 0;
+	}
 	while (bytes_left > 0) {
 		struct iovec *iov = (struct iovec *) iter->iov;
 		__u64 int_base = (__u64) iov->iov_base;
@@ -981,6 +1163,8 @@ int sock_no_socketpair(struct socket *sock1, struct socket *sock2)
 	return 0;
 }
 
+void synchronize_rcu(void) {}
+
 void synchronize_sched(void) {}
 
 void __tasklet_hi_schedule(struct tasklet_struct *t) {}
@@ -990,6 +1174,11 @@ void tasklet_init(struct tasklet_struct *t,
 
 void tasklet_kill(struct tasklet_struct *t) {}
 
+void unpin_user_pages(struct page **pages, unsigned long npages)
+{
+	mock_pinned_pages -= npages;
+}
+
 void unregister_net_sysctl_table(struct ctl_table_header *header) {}
 
 void vfree(const void *block)
@@ -1068,6 +1257,18 @@ void mock_clear_xmit_prios()
 	mock_xmit_prios[0] = 0;
 }
 
+/**
+ * mock_cpu_to_node() - Replacement for cpu_to_node; groups cores into
+ * NUMA nodes of mock_cores_per_node consecutive cores.
+ * @core:    Core number of interest.
+ *
+ * Return:   The NUMA node containing @core.
+ */
+int mock_cpu_to_node(int core)
+{
+	return core / mock_cores_per_node;
+}
+
 /**
  * mock_data_ready() - Invoked through sk->sk_data_ready; logs a message
  * to indicate that it was invoked.
@@ -1102,6 +1303,80 @@ unsigned int mock_get_mtu(const struct dst_entry *dst)
 	return mock_mtu;
 }
 
+/**
+ * mock_local_bh_disable() - Called instead of local_bh_disable when Homa
+ * is compiled for unit testing.
+ */
+void mock_local_bh_disable(void)
+{
+	mock_active_bh_disables++;
+}
+
+/**
+ * mock_local_bh_enable() - Called instead of local_bh_enable when Homa
+ * is compiled for unit testing.
+ */
+void mock_local_bh_enable(void)
+{
+	if (mock_active_bh_disables == 0)
+		FAIL(" local_bh_enable called without local_bh_disable");
+	else
+		mock_active_bh_disables--;
+}
+
+/**
+ * mock_mmdrop() - Called instead of mmdrop when Homa is compiled for
+ * unit testing.
+ * @mm:     Address space to release.
+ */
+void mock_mmdrop(struct mm_struct *mm)
+{
+	if (mock_mm_grabs == 0)
+		FAIL(" mmdrop called without mmgrab");
+	else
+		mock_mm_grabs--;
+}
+
+/**
+ * mock_mmgrab() - Called instead of mmgrab when Homa is compiled for
+ * unit testing.
+ * @mm:     Address space to hold.
+ */
+void mock_mmgrab(struct mm_struct *mm)
+{
+	mock_mm_grabs++;
+}
+
+/**
+ * mock_page_huge() - Replacement for the code in homa_pool.c that
+ * determines whether a page is part of a huge page.
+ * @page:    Page of interest.
+ *
+ * Return:   The value of mock_huge_pages.
+ */
+int mock_page_huge(struct page *page)
+{
+	return mock_huge_pages;
+}
+
+/**
+ * mock_page_node() - Replacement for the code in homa_pool.c that
+ * determines which NUMA node holds a user-space page; controlled by
+ * mock_page_node_split and mock_page_node_unplaced.
+ * @addr:    User-space address of interest.
+ *
+ * Return:   NUMA node for @addr, or NUMA_NO_NODE.
+ */
+int mock_page_node(void *addr)
+{
+	if (mock_page_node_unplaced && ((__u64) addr
+			>= mock_page_node_unplaced))
+		return NUMA_NO_NODE;
+	if (mock_page_node_split && ((__u64) addr >= mock_page_node_split))
+		return 1;
+	return 0;
+}
+
 /**
  * mock_rcu_read_lock() - Called instead of rcu_read_lock when Homa is compiled
  * for unit testing.
@@ -1274,15 +1549,21 @@ void mock_teardown(void)
 	mock_cpu_idle = 0;
 	mock_cycles = 0;
 	mock_ipv6 = mock_ipv6_default;
+	jiffies = 1100;
 	mock_import_single_range_errors = 0;
 	mock_import_iovec_errors = 0;
 	mock_ip6_xmit_errors = 0;
 	mock_ip_queue_xmit_errors = 0;
 	mock_kmalloc_errors = 0;
+	mock_pin_errors = 0;
+	mock_huge_pages = 0;
 	mock_max_grants = 10;
 	mock_copy_to_user_dont_copy = 0;
+	mock_cores_per_node = 4;
 	mock_bpage_size = 0x10000;
 	mock_bpage_shift = 16;
+	mock_page_node_split = 0;
+	mock_page_node_unplaced = 0;
 	mock_xmit_prios_offset = 0;
 	mock_xmit_prios[0] = 0;
 	mock_log_rcu_sched = 0;
@@ -1290,6 +1571,9 @@ void mock_teardown(void)
 	mock_trylock_errors = 0;
 	mock_vmalloc_errors = 0;
 	memset(&mock_task, 0, sizeof(mock_task));
+	mock_task.mm = &mock_mm;
+	mock_rlimit = RLIM_INFINITY;
+	mock_capable = 0;
 	mock_signal_pending = 0;
 	mock_xmit_log_verbose = 0;
 	mock_mtu = 0;
@@ -1325,6 +1609,18 @@ void mock_teardown(void)
 	unit_hash_free(vmallocs_in_use);
 	vmallocs_in_use = NULL;
 
+	if (mock_pinned_pages != 0)
+		FAIL(" %d page(s) still pinned after test", mock_pinned_pages);
+	mock_pinned_pages = 0;
+
+	if (atomic64_read(&mock_mm.pinned_vm) != 0)
+		FAIL(" %lld page(s) still charged to pinned_vm after test",
+				atomic64_read(&mock_mm.pinned_vm));
+	atomic64_set(&mock_mm.pinned_vm, 0);
+	if (mock_mm_grabs != 0)
+		FAIL(" %d mmgrab(s) not dropped after test", mock_mm_grabs);
+	mock_mm_grabs = 0;
+
 	if (mock_active_locks != 0)
 		FAIL(" %d locks still locked after test", mock_active_locks);
 	mock_active_locks = 0;
@@ -1334,5 +1630,11 @@ void mock_teardown(void)
 				mock_active_rcu_locks);
 	mock_active_rcu_locks = 0;
 
+	if (mock_active_bh_disables != 0)
+		FAIL(" %d local_bh_disables still active after test",
+				mock_active_bh_disables);
+	mock_active_bh_disables = 0;
+	mock_napi_consumed = 0;
+
 	unit_hook_clear();
 }
@@ -15,15 +15,21 @@
 
 /* Functions for mocking that are exported to test code. */
 
+/* Number of entries in mock_pages. */
+#define MOCK_NUM_PAGES 256
+
 extern int         cpu_number;
 extern int         mock_alloc_skb_errors;
 extern             int mock_bpage_size;
 extern             int mock_bpage_shift;
+extern int         mock_capable;
 extern int         mock_copy_data_errors;
 extern int         mock_copy_to_user_dont_copy;
 extern int         mock_copy_to_user_errors;
+extern int         mock_cores_per_node;
 extern int         mock_cpu_idle;
 extern cycles_t    mock_cycles;
+extern int         mock_huge_pages;
 extern int         mock_import_iovec_errors;
 extern int         mock_import_single_range_errors;
 extern int         mock_ip6_xmit_errors;
@@ -34,7 +40,16 @@ extern int         mock_kmalloc_errors;
 extern char        mock_xmit_prios[];
 extern int         mock_log_rcu_sched;
 extern int         mock_max_grants;
+extern struct mm_struct
+		   mock_mm;
 extern int         mock_mtu;
+extern int         mock_napi_consumed;
+extern __u64       mock_page_node_split;
+extern __u64       mock_page_node_unplaced;
+extern struct page mock_pages[];
+extern int         mock_pin_errors;
+extern unsigned long
+		   mock_rlimit;
 extern struct net_device
 		   mock_net_device;
 extern int         mock_route_errors;
@@ -47,10 +62,17 @@ extern int         mock_xmit_log_verbose;
 
 extern int         mock_check_error(int *errorMask);
 extern void        mock_clear_xmit_prios(void);
+extern int         mock_cpu_to_node(int core);
 extern void        mock_data_ready(struct sock *sk);
 extern cycles_t    mock_get_cycles(void);
 extern unsigned int
 		   mock_get_mtu(const struct dst_entry *dst);
+extern void        mock_local_bh_disable(void);
+extern void        mock_local_bh_enable(void);
+extern void        mock_mmdrop(struct mm_struct *mm);
+extern void        mock_mmgrab(struct mm_struct *mm);
+extern int         mock_page_huge(struct page *page);
+extern int         mock_page_node(void *addr);
 extern void        mock_rcu_read_lock(void);
 extern void        mock_rcu_read_unlock(void);
 extern void        mock_spin_lock(spinlock_t *lock);
@@ -108,6 +108,13 @@ void shutdown_hook(char *id)
 	homa_sock_shutdown(hook_hsk);
 }
 
+/* The following hook function makes copying to user space look slow. */
+void slow_copy_hook(char *id)
+{
+	if (strcmp(id, "copy_out") == 0)
+		mock_cycles += 1000000;
+}
+
 FIXTURE(homa_incoming) {
 	struct in6_addr client_ip[5];
 	int client_port;
@@ -352,8 +359,105 @@ TEST_F(homa_incoming, homa_copy_to_user__basics)
 			"303200-303999",
 			unit_log_get());
 	EXPECT_EQ(crpc->msgin.total_length, crpc->msgin.copied_out);
+	EXPECT_EQ(crpc->msgin.total_length, crpc->msgin.copied);
+	EXPECT_EQ(0, crpc->msgin.copiers);
 	EXPECT_EQ(NULL, skb_peek(&crpc->msgin.packets));
 	EXPECT_EQ(0, crpc->msgin.num_skbs);
+	EXPECT_EQ(4, mock_napi_consumed);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.copy_out_batches);
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.copy_out_merges);
+	EXPECT_EQ(4000, homa_cores[cpu_number]->metrics.copy_out_bytes);
+}
+TEST_F(homa_incoming, homa_copy_to_user__another_thread_still_copying)
+{
+	struct homa_rpc *crpc;
+
+	EXPECT_EQ(0, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
+			(void *) 0x1000000, 100*HOMA_BPAGE_SIZE));
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 4000);
+	ASSERT_NE(NULL, crpc);
+
+	/* Pretend another thread is copying (with the RPC unlocked). */
+	crpc->msgin.copiers = 1;
+	atomic_or(RPC_COPYING_TO_USER, &crpc->flags);
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_EQ(1400, crpc->msgin.copied_out);
+	EXPECT_EQ(0, crpc->msgin.copied);
+	EXPECT_EQ(1, crpc->msgin.copiers);
+	EXPECT_NE(0, atomic_read(&crpc->flags) & RPC_COPYING_TO_USER);
+	crpc->msgin.copiers = 0;
+	atomic_andnot(RPC_COPYING_TO_USER, &crpc->flags);
+}
+TEST_F(homa_incoming, homa_copy_to_user__pinned_region)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_rpc *crpc;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			(void *) 0x1000000, 100*HOMA_BPAGE_SIZE));
+	pool->regions[0].pages = homa_pool_pin(pool->regions[0].start,
+			100*HOMA_BPAGE_SIZE, HOMA_BUF_PIN,
+			&pool->regions[0].num_pages,
+			&pool->regions[0].mm);
+	ASSERT_FALSE(IS_ERR(pool->regions[0].pages));
+	crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 10000);
+	ASSERT_NE(NULL, crpc);
+	self->data.seg.offset = htonl(1400);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 101400), crpc, NULL, &self->incoming_delta);
+	self->data.seg.offset = htonl(2800);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1400, 202800), crpc, NULL, &self->incoming_delta);
+
+	unit_log_clear();
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_STREQ("skb_copy_datagram_iter: 1400 bytes to page 0+0x0: "
+			"0-1399; "
+			"skb_copy_datagram_iter: 1400 bytes to page 0+0x578: "
+			"101400-102799; "
+			"skb_copy_datagram_iter: 1296 bytes to page 0+0xaf0: "
+			"202800-204095; "
+			"skb_copy_datagram_iter: 104 bytes to page 1+0x0: "
+			"204096-204199",
+			unit_log_get());
+	EXPECT_EQ(4200, crpc->msgin.copied_out);
+	EXPECT_EQ(4200, homa_cores[cpu_number]->metrics.copy_out_pinned_bytes);
+}
+TEST_F(homa_incoming, homa_copy_to_user__batch_limited_by_bytes)
+{
+	struct homa_rpc *crpc;
+
+	EXPECT_EQ(0, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
+			(void *) 0x1000000, 100*HOMA_BPAGE_SIZE));
+	crpc = unit_client_rpc(&self->hsk, UNIT_OUTGOING, self->client_ip,
+			self->server_ip, self->server_port, self->client_id,
+			1000, 4000);
+	ASSERT_NE(NULL, crpc);
+	self->data.message_length = htonl(4000);
+	self->data.seg.segment_length = htonl(3000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			3000, 101000), crpc, NULL, &self->incoming_delta);
+	self->data.seg.offset = htonl(3000);
+	self->data.seg.segment_length = htonl(1000);
+	homa_data_pkt(mock_skb_new(self->server_ip, &self->data.common,
+			1000, 203000), crpc, NULL, &self->incoming_delta);
+
+	unit_log_clear();
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_copy_to_user(crpc));
+	EXPECT_STREQ("skb_copy_datagram_iter: 3000 bytes to 0x1000000: "
+			"101000-103999; "
+			"skb_copy_datagram_iter: 1000 bytes to 0x1000bb8: "
+			"203000-203999",
+			unit_log_get());
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.copy_out_batches);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.copy_out_merges);
+	EXPECT_EQ(0, crpc->msgin.num_skbs);
 }
 TEST_F(homa_incoming, homa_copy_to_user__message_data_exceeds_length)
 {
@@ -768,7 +872,8 @@ TEST_F(homa_incoming, homa_pkt_dispatch__reset_counters)
 	ASSERT_NE(NULL, crpc);
 	EXPECT_EQ(11200, crpc->msgout.granted);
 	unit_log_clear();
-	crpc->silent_ticks = 5;
+	crpc->active_ticks = 5;
+	self->homa.timer_ticks = 100;
 	crpc->peer->outstanding_resends = 2;
 
 	struct grant_header h = {.common = {.sport = htons(self->server_port),
@@ -778,16 +883,16 @@ TEST_F(homa_incoming, homa_pkt_dispatch__reset_counters)
 			.offset = htonl(12600), .priority = 3};
 	homa_pkt_dispatch(mock_skb_new(self->server_ip, &h.common, 0, 0),
 			&self->hsk, &self->lcache, &self->incoming_delta);
-	EXPECT_EQ(0, crpc->silent_ticks);
+	EXPECT_EQ(100, crpc->active_ticks);
 	EXPECT_EQ(0, crpc->peer->outstanding_resends);
 
-	/* Don't reset silent_ticks for some packet types. */
+	/* Don't update active_ticks for some packet types. */
 	h.common.type = NEED_ACK;
-	crpc->silent_ticks = 5;
+	crpc->active_ticks = 5;
 	crpc->peer->outstanding_resends = 2;
 	homa_pkt_dispatch(mock_skb_new(self->server_ip, &h.common, 0, 0),
 			&self->hsk, &self->lcache, &self->incoming_delta);
-	EXPECT_EQ(5, crpc->silent_ticks);
+	EXPECT_EQ(5, crpc->active_ticks);
 	EXPECT_EQ(0, crpc->peer->outstanding_resends);
 }
 TEST_F(homa_incoming, homa_pkt_dispatch__forced_reap)
@@ -1360,10 +1465,11 @@ TEST_F(homa_incoming, homa_need_ack_pkt__rpc_doesnt_exist)
 {
 	struct homa_peer *peer = homa_peer_find(&self->homa.peers,
 			self->server_ip, &self->hsk.inet);
-	peer->acks[0].client_port = htons(self->client_port);
-	peer->acks[0].server_port = htons(self->server_port);
-	peer->acks[0].client_id = cpu_to_be64(self->client_id+2);
-	peer->num_acks = 1;
+	struct homa_ack ack = {
+		.client_port = htons(self->client_port),
+		.server_port = htons(self->server_port),
+		.client_id = cpu_to_be64(self->client_id+2)};
+	homa_peer_push_ack(peer, &ack);
 	mock_xmit_log_verbose = 1;
 	struct need_ack_header h = {.common = {
 			.sport = htons(self->server_port),
@@ -2567,6 +2673,54 @@ TEST_F(homa_incoming, homa_register_interests__specified_id_not_ready)
 	EXPECT_EQ(NULL, (struct homa_rpc *)
 			atomic_long_read(&self->interest.ready_rpc));
 }
+TEST_F(homa_incoming, homa_register_interests__partial_server_rpc_by_id)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 20000, 100);
+	ASSERT_NE(NULL, srpc);
+
+	// Request hasn't been partially delivered yet.
+	int result = homa_register_interests(&self->interest, &self->hsk,
+			HOMA_RECVMSG_PARTIAL, srpc->id);
+	EXPECT_EQ(EINVAL, -result);
+
+	srpc->msgin.delivered = 1000;
+	result = homa_register_interests(&self->interest, &self->hsk,
+			HOMA_RECVMSG_PARTIAL, srpc->id);
+	EXPECT_EQ(0, result);
+	EXPECT_EQ(srpc, (struct homa_rpc *)
+			atomic_long_read(&self->interest.ready_rpc));
+	homa_rpc_unlock(srpc);
+}
+TEST_F(homa_incoming, homa_register_interests__partial_progress_already_copied)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 20000);
+	ASSERT_NE(NULL, crpc);
+	atomic_andnot(RPC_PKTS_READY, &crpc->flags);
+	crpc->msgin.copied_out = 1400;
+	crpc->msgin.copied = 1400;
+
+	// No new progress since last partial return.
+	crpc->msgin.delivered = 1400;
+	int result = homa_register_interests(&self->interest, &self->hsk,
+			HOMA_RECVMSG_PARTIAL, crpc->id);
+	EXPECT_EQ(0, result);
+	EXPECT_EQ(NULL, (struct homa_rpc *)
+			atomic_long_read(&self->interest.ready_rpc));
+	crpc->interest = NULL;
+
+	// Other threads copied more data.
+	crpc->msgin.delivered = 0;
+	result = homa_register_interests(&self->interest, &self->hsk,
+			HOMA_RECVMSG_PARTIAL, crpc->id);
+	EXPECT_EQ(0, result);
+	EXPECT_EQ(crpc, (struct homa_rpc *)
+			atomic_long_read(&self->interest.ready_rpc));
+	homa_rpc_unlock(crpc);
+}
 TEST_F(homa_incoming, homa_register_interests__return_queued_response)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -2677,6 +2831,50 @@ TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_while_polling)
 	EXPECT_EQ(0, self->hsk.dead_skbs);
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__use_socket_poll_cycles)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc1);
+
+	hook_rpc = crpc1;
+	poll_count = 5;
+	self->homa.poll_cycles = 1000000;
+	self->homa.poll_percentile = 90;
+	self->hsk.poll_cycles = 0;
+	unit_hook_register(poll_hook);
+	unit_log_clear();
+	rpc = homa_wait_for_message(&self->hsk, 0, self->client_id);
+	EXPECT_EQ(crpc1, rpc);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.fast_wakeups);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.slow_wakeups);
+	EXPECT_EQ(1, self->hsk.poll_samples);
+	homa_rpc_unlock(rpc);
+}
+TEST_F(homa_incoming, homa_wait_for_message__too_many_pollers)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc1);
+
+	hook_rpc = crpc1;
+	poll_count = 1;
+	self->homa.poll_cycles = 1000000;
+	self->homa.max_pollers = 2;
+	atomic_set(&self->hsk.num_pollers, 2);
+	unit_hook_register(poll_hook);
+	unit_log_clear();
+	rpc = homa_wait_for_message(&self->hsk, 0, self->client_id);
+	EXPECT_EQ(crpc1, rpc);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.pollers_limited);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.slow_wakeups);
+	EXPECT_EQ(2, atomic_read(&self->hsk.num_pollers));
+	homa_rpc_unlock(rpc);
+}
 TEST_F(homa_incoming, homa_wait_for_message__nothing_ready_nonblocking)
 {
 	struct homa_rpc *rpc;
@@ -2699,11 +2897,14 @@ TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_while_sleeping)
 			self->server_port, self->client_id, 20000, 1600);
 	ASSERT_NE(NULL, crpc1);
 
-        /* Also, check to see that reaping occurs before sleeping. */
+        /* Also, check to see that reaping occurs before sleeping if
+	 * the reaper thread is falling behind.
+	 */
 	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
 			self->server_port, self->client_id+2, 20000, 20000);
 	self->homa.reap_limit = 5;
+	self->homa.dead_buffs_limit = 30;
 	homa_rpc_free(crpc2);
 	EXPECT_EQ(30, self->hsk.dead_skbs);
 	unit_log_clear();
@@ -2719,6 +2920,23 @@ TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_while_sleeping)
 	EXPECT_EQ(0, self->hsk.dead_skbs);
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__leave_reaping_to_reaper_thread)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 20000);
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	EXPECT_EQ(30, self->hsk.dead_skbs);
+	self->homa.dead_buffs_limit = 31;
+
+	rpc = homa_wait_for_message(&self->hsk, HOMA_RECVMSG_NONBLOCKING,
+			self->client_id);
+	EXPECT_EQ(EAGAIN, -PTR_ERR(rpc));
+	EXPECT_EQ(30, self->hsk.dead_skbs);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.reaper_calls);
+}
 TEST_F(homa_incoming, homa_wait_for_message__rpc_arrives_after_giving_up)
 {
 	struct homa_rpc *rpc;
@@ -2875,6 +3093,72 @@ TEST_F(homa_incoming, homa_wait_for_message__message_complete)
 	EXPECT_EQ(2000, crpc->msgin.copied_out);
 	homa_rpc_unlock(rpc);
 }
+TEST_F(homa_incoming, homa_wait_for_message__poll_sample_excludes_copy)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 2000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(0, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
+			(char *) 0x1000000, 100*HOMA_BPAGE_SIZE));
+	mock_copy_to_user_dont_copy = -1;
+	self->homa.poll_percentile = 90;
+	mock_cycles = 1000;
+	unit_hook_register(slow_copy_hook);
+
+	rpc = homa_wait_for_message(&self->hsk, HOMA_RECVMSG_RESPONSE, 0);
+	ASSERT_FALSE(IS_ERR(rpc));
+	EXPECT_EQ(crpc, rpc);
+	EXPECT_EQ(2000, crpc->msgin.copied_out);
+	EXPECT_EQ(1, self->hsk.poll_samples);
+	EXPECT_EQ(1, self->hsk.poll_waits[0]);
+	homa_rpc_unlock(rpc);
+}
+TEST_F(homa_incoming, homa_wait_for_message__no_poll_samples_by_default)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 2000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(0, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
+			(char *) 0x1000000, 100*HOMA_BPAGE_SIZE));
+	mock_copy_to_user_dont_copy = -1;
+
+	rpc = homa_wait_for_message(&self->hsk, HOMA_RECVMSG_RESPONSE, 0);
+	ASSERT_FALSE(IS_ERR(rpc));
+	EXPECT_EQ(0, self->hsk.poll_samples);
+	homa_rpc_unlock(rpc);
+}
+TEST_F(homa_incoming, homa_wait_for_message__partial_message)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 20000);
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(0, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
+			(char *) 0x1000000, 100*HOMA_BPAGE_SIZE));
+	mock_copy_to_user_dont_copy = -1;
+	unit_log_clear();
+
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECVMSG_RESPONSE|HOMA_RECVMSG_NONBLOCKING
+			|HOMA_RECVMSG_PARTIAL, 0);
+	ASSERT_FALSE(IS_ERR(rpc));
+	EXPECT_EQ(crpc, rpc);
+	EXPECT_EQ(0, atomic_read(&crpc->flags));
+	EXPECT_EQ(1400, crpc->msgin.copied_out);
+	homa_rpc_unlock(rpc);
+
+	// No progress since the last return.
+	crpc->msgin.delivered = 1400;
+	rpc = homa_wait_for_message(&self->hsk,
+			HOMA_RECVMSG_NONBLOCKING|HOMA_RECVMSG_PARTIAL,
+			self->client_id);
+	EXPECT_EQ(EAGAIN, -PTR_ERR(rpc));
+}
 TEST_F(homa_incoming, homa_wait_for_message__signal)
 {
 	struct homa_rpc *rpc;
@@ -2884,6 +3168,207 @@ TEST_F(homa_incoming, homa_wait_for_message__signal)
 	EXPECT_EQ(EINTR, -PTR_ERR(rpc));
 }
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+TEST_F(homa_incoming, homa_napi_poll__busy_polling_not_enabled)
+{
+	self->hsk.sock.sk_ll_usec = 0;
+	self->hsk.sock.sk_napi_id = MIN_NAPI_ID;
+	EXPECT_EQ(0, homa_napi_poll(&self->hsk));
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.napi_polls);
+}
+TEST_F(homa_incoming, homa_napi_poll__no_napi_id)
+{
+	self->hsk.sock.sk_ll_usec = 50;
+	self->hsk.sock.sk_napi_id = 0;
+	EXPECT_EQ(0, homa_napi_poll(&self->hsk));
+	EXPECT_STREQ("", unit_log_get());
+}
+TEST_F(homa_incoming, homa_napi_poll__basics)
+{
+	self->hsk.sock.sk_ll_usec = 50;
+	self->hsk.sock.sk_napi_id = MIN_NAPI_ID + 3;
+	unit_log_clear();
+	EXPECT_EQ(1, homa_napi_poll(&self->hsk));
+	EXPECT_SUBSTR("napi_busy_loop id", unit_log_get());
+	EXPECT_SUBSTR("napi_polling 1", unit_log_get());
+	EXPECT_EQ(0, homa_cores[cpu_number]->napi_polling);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.napi_polls);
+}
+TEST_F(homa_incoming, homa_wait_for_message__napi_poll_while_polling)
+{
+	struct homa_rpc *rpc;
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc1);
+
+	hook_rpc = crpc1;
+	poll_count = 2;
+	self->homa.poll_cycles = 1000000;
+	self->hsk.sock.sk_ll_usec = 50;
+	self->hsk.sock.sk_napi_id = MIN_NAPI_ID;
+	unit_hook_register(poll_hook);
+	unit_log_clear();
+	rpc = homa_wait_for_message(&self->hsk, 0, self->client_id);
+	EXPECT_EQ(crpc1, rpc);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.napi_polls);
+	homa_rpc_unlock(rpc);
+}
+#endif
+TEST_F(homa_incoming, homa_poll_record__basics)
+{
+	self->homa.poll_percentile = 90;
+	homa_poll_record(&self->hsk, 500);
+	homa_poll_record(&self->hsk, 1024);
+	homa_poll_record(&self->hsk, 5000);
+	EXPECT_EQ(1, self->hsk.poll_waits[0]);
+	EXPECT_EQ(1, self->hsk.poll_waits[1]);
+	EXPECT_EQ(1, self->hsk.poll_waits[3]);
+	EXPECT_EQ(3, self->hsk.poll_samples);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.poll_budget_updates);
+}
+TEST_F(homa_incoming, homa_poll_record__long_wait_and_update)
+{
+	self->homa.poll_percentile = 90;
+	self->homa.poll_cycles = 1000000;
+	homa_poll_record(&self->hsk, 1000000000000);
+	EXPECT_EQ(1, self->hsk.poll_waits[HOMA_POLL_BUCKETS-1]);
+	homa_poll_record(&self->hsk, 100);
+	homa_poll_record(&self->hsk, 100);
+	homa_poll_record(&self->hsk, 100);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.poll_budget_updates);
+}
+TEST_F(homa_incoming, homa_poll_record__percentile_zero)
+{
+	self->homa.poll_percentile = 0;
+	homa_poll_record(&self->hsk, 500);
+	EXPECT_EQ(0, self->hsk.poll_waits[0]);
+	EXPECT_EQ(0, self->hsk.poll_samples);
+}
+TEST_F(homa_incoming, homa_poll_update__use_percentile)
+{
+	self->homa.poll_percentile = 75;
+	self->homa.poll_cycles = 100000;
+	self->hsk.poll_waits[0] = 2;
+	self->hsk.poll_waits[2] = 4;
+	self->hsk.poll_waits[4] = 2;
+	homa_poll_update(&self->hsk);
+	EXPECT_EQ(4096, self->hsk.poll_cycles);
+	EXPECT_EQ(1, self->hsk.poll_waits[0]);
+	EXPECT_EQ(2, self->hsk.poll_waits[2]);
+	EXPECT_EQ(1, self->hsk.poll_waits[4]);
+}
+TEST_F(homa_incoming, homa_poll_update__limit_to_poll_cycles)
+{
+	self->homa.poll_percentile = 90;
+	self->homa.poll_cycles = 10000;
+	self->hsk.poll_waits[0] = 6;
+	self->hsk.poll_waits[8] = 4;
+	homa_poll_update(&self->hsk);
+	EXPECT_EQ(10000, self->hsk.poll_cycles);
+}
+TEST_F(homa_incoming, homa_poll_update__most_waits_too_long)
+{
+	self->homa.poll_percentile = 90;
+	self->homa.poll_cycles = 10000;
+	self->hsk.poll_waits[0] = 4;
+	self->hsk.poll_waits[8] = 6;
+	homa_poll_update(&self->hsk);
+	EXPECT_EQ(0, self->hsk.poll_cycles);
+}
+TEST_F(homa_incoming, homa_poll_update__no_samples)
+{
+	self->hsk.poll_cycles = 12345;
+	homa_poll_update(&self->hsk);
+	EXPECT_EQ(12345, self->hsk.poll_cycles);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.poll_budget_updates);
+}
+
+TEST_F(homa_incoming, homa_choose_interest__empty_list)
+{
+	struct homa_interest *result = homa_choose_interest(
+			&self->hsk.request_interests,
+			offsetof(struct homa_interest, request_links));
+	EXPECT_EQ(NULL, result);
+}
+TEST_F(homa_incoming, homa_choose_interest__same_core)
+{
+	struct homa_interest interest1, interest2, interest3;
+	homa_interest_init(&interest1);
+	interest1.core = 6;
+	list_add_tail(&interest1.request_links, &self->hsk.request_interests);
+	homa_interest_init(&interest2);
+	interest2.core = 2;
+	list_add_tail(&interest2.request_links, &self->hsk.request_interests);
+	homa_interest_init(&interest3);
+	interest3.core = 1;
+	list_add_tail(&interest3.request_links, &self->hsk.request_interests);
+
+	cpu_number = 1;
+	struct homa_interest *result = homa_choose_interest(
+			&self->hsk.request_interests,
+			offsetof(struct homa_interest, request_links));
+	EXPECT_EQ(&interest3, result);
+}
+TEST_F(homa_incoming, homa_choose_interest__same_node)
+{
+	struct homa_interest interest1, interest2, interest3;
+	homa_interest_init(&interest1);
+	interest1.core = 6;
+	list_add_tail(&interest1.response_links, &self->hsk.response_interests);
+	homa_interest_init(&interest2);
+	interest2.core = 2;
+	list_add_tail(&interest2.response_links, &self->hsk.response_interests);
+	homa_interest_init(&interest3);
+	interest3.core = 3;
+	list_add_tail(&interest3.response_links, &self->hsk.response_interests);
+
+	cpu_number = 1;
+	struct homa_interest *result = homa_choose_interest(
+			&self->hsk.response_interests,
+			offsetof(struct homa_interest, response_links));
+	EXPECT_EQ(&interest2, result);
+}
+TEST_F(homa_incoming, homa_choose_interest__no_good_choice)
+{
+	struct homa_interest interest1, interest2;
+	homa_interest_init(&interest1);
+	interest1.core = 6;
+	list_add_tail(&interest1.request_links, &self->hsk.request_interests);
+	homa_interest_init(&interest2);
+	interest2.core = 7;
+	list_add_tail(&interest2.request_links, &self->hsk.request_interests);
+
+	cpu_number = 1;
+	struct homa_interest *result = homa_choose_interest(
+			&self->hsk.request_interests,
+			offsetof(struct homa_interest, request_links));
+	EXPECT_EQ(&interest1, result);
+}
+TEST_F(homa_incoming, homa_choose_interest__limit_scan)
+{
+	struct homa_interest interest1, interest2, interest3, interest4;
+	homa_interest_init(&interest1);
+	interest1.core = 6;
+	list_add_tail(&interest1.request_links, &self->hsk.request_interests);
+	homa_interest_init(&interest2);
+	interest2.core = 7;
+	list_add_tail(&interest2.request_links, &self->hsk.request_interests);
+	homa_interest_init(&interest3);
+	interest3.core = 5;
+	list_add_tail(&interest3.request_links, &self->hsk.request_interests);
+	homa_interest_init(&interest4);
+	interest4.core = 1;
+	list_add_tail(&interest4.request_links, &self->hsk.request_interests);
+
+	cpu_number = 1;
+	struct homa_interest *result = homa_choose_interest(
+			&self->hsk.request_interests,
+			offsetof(struct homa_interest, request_links));
+	EXPECT_EQ(&interest1, result);
+}
+
 TEST_F(homa_incoming, homa_rpc_handoff__handoff_already_in_progress)
 {
 	struct homa_interest interest;
@@ -2978,6 +3463,39 @@ TEST_F(homa_incoming, homa_rpc_handoff__response_interests)
 	EXPECT_STREQ("wake_up_process pid 0", unit_log_get());
 	atomic_andnot(RPC_HANDING_OFF, &crpc->flags);
 }
+TEST_F(homa_incoming, homa_rpc_handoff__handoff_metrics)
+{
+	struct homa_interest interest;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 1600);
+	ASSERT_NE(NULL, crpc);
+
+	homa_interest_init(&interest);
+	interest.thread = &mock_task;
+	interest.core = 5;
+	list_add_tail(&interest.response_links, &self->hsk.response_interests);
+	cpu_number = 1;
+	homa_rpc_handoff(crpc);
+	atomic_andnot(RPC_HANDING_OFF, &crpc->flags);
+
+	homa_interest_init(&interest);
+	interest.thread = &mock_task;
+	interest.core = 2;
+	list_add_tail(&interest.response_links, &self->hsk.response_interests);
+	homa_rpc_handoff(crpc);
+	atomic_andnot(RPC_HANDING_OFF, &crpc->flags);
+
+	homa_interest_init(&interest);
+	interest.thread = &mock_task;
+	list_add_tail(&interest.response_links, &self->hsk.response_interests);
+	homa_rpc_handoff(crpc);
+	atomic_andnot(RPC_HANDING_OFF, &crpc->flags);
+
+	EXPECT_EQ(1, homa_cores[1]->metrics.handoffs_same_core);
+	EXPECT_EQ(1, homa_cores[1]->metrics.handoffs_same_node);
+	EXPECT_EQ(1, homa_cores[1]->metrics.handoffs_cross_node);
+}
 TEST_F(homa_incoming, homa_rpc_handoff__queue_on_ready_responses)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -3021,6 +3539,39 @@ TEST_F(homa_incoming, homa_rpc_handoff__queue_on_ready_requests)
 	EXPECT_STREQ("sk->sk_data_ready invoked", unit_log_get());
 	EXPECT_EQ(1, unit_list_length(&self->hsk.ready_requests));
 }
+TEST_F(homa_incoming, homa_rpc_handoff__partially_delivered)
+{
+	struct homa_interest interest;
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+		        self->server_id, 20000, 100);
+	ASSERT_NE(NULL, srpc);
+	srpc->msgin.delivered = 1400;
+	unit_log_clear();
+
+	/* A generic receiver mustn't get the rest of the message. */
+	homa_interest_init(&interest);
+	interest.thread = &mock_task;
+	list_add_tail(&interest.request_links, &self->hsk.request_interests);
+	homa_rpc_handoff(srpc);
+	EXPECT_EQ(NULL, (struct homa_rpc *)
+			atomic_long_read(&interest.ready_rpc));
+	EXPECT_EQ(1, unit_list_length(&self->hsk.request_interests));
+	EXPECT_EQ(0, unit_list_length(&self->hsk.ready_requests));
+	EXPECT_STREQ("", unit_log_get());
+	list_del(&interest.request_links);
+
+	/* A thread waiting for this RPC by id gets it. */
+	homa_interest_init(&interest);
+	interest.thread = &mock_task;
+	interest.reg_rpc = srpc;
+	srpc->interest = &interest;
+	homa_rpc_handoff(srpc);
+	EXPECT_EQ(srpc, (struct homa_rpc *)
+			atomic_long_read(&interest.ready_rpc));
+	EXPECT_STREQ("wake_up_process pid 0", unit_log_get());
+	atomic_andnot(RPC_HANDING_OFF, &srpc->flags);
+}
 TEST_F(homa_incoming, homa_rpc_handoff__detach_interest)
 {
 	struct homa_interest interest;
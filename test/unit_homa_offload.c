@@ -86,6 +86,26 @@ FIXTURE_TEARDOWN(homa_offload)
 	unit_teardown();
 }
 
+/* Returns the hash that homa_gro_peer_hash computes for packets from
+ * @addr; @id is the RPC id under HOMA_GRO_RPC_AFFINE, otherwise 0.
+ */
+static __u32 gro_hash(struct in6_addr *addr, __u64 id)
+{
+	return jhash2(addr->in6_u.u6_addr32, 4,
+			homa->peers.hash_seed + (__u32) id);
+}
+
+/* Returns the index of the GRO slot used for packets from @addr. */
+static int gro_slot(struct in6_addr *addr, __u64 id)
+{
+	return gro_hash(addr, id) & (HOMA_GRO_SLOTS - 1);
+}
+
+/* Returns the preferred HOMA_GRO_RPC_AFFINE core for packets from @addr. */
+static int affine_core(struct in6_addr *addr, __u64 id)
+{
+	return reciprocal_scale(gro_hash(addr, id), nr_cpu_ids);
+}
 
 TEST_F(homa_offload, homa_gro_receive__fast_grant_optimization)
 {
@@ -173,44 +193,73 @@ TEST_F(homa_offload, homa_gro_receive__HOMA_GRO_SHORT_BYPASS)
 	kfree_skb(skb);
 	kfree_skb(skb2);
 }
+TEST_F(homa_offload, homa_gro_receive__bypass_while_napi_polling)
+{
+	struct in6_addr client_ip = unit_get_in_addr("196.168.0.1");
+	struct in6_addr server_ip = unit_get_in_addr("1.2.3.4");
+	struct sk_buff *skb;
+	struct sk_buff *result;
+
+	self->header.common.dport = htons(self->hsk.port);
+	self->header.common.sender_id = cpu_to_be64(1234);
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			&client_ip, &server_ip, 40000, 1235, 10000, 200);
+	ASSERT_NE(NULL, srpc);
+	unit_log_clear();
+
+	homa_cores[cpu_number]->napi_polling = 1;
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 4000);
+	result = homa_gro_receive(&self->empty_list, skb);
+	EXPECT_EQ(EINPROGRESS, -PTR_ERR(result));
+	EXPECT_EQ(7200, srpc->msgin.bytes_remaining);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.napi_poll_pkts);
+	homa_cores[cpu_number]->napi_polling = 0;
+}
 TEST_F(homa_offload, homa_gro_receive__no_held_skb)
 {
+	int slot = gro_slot(&self->ip, 0);
 	struct sk_buff *skb;
 	int same_flow;
 	self->header.seg.offset = htonl(6000);
 	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
 	NAPI_GRO_CB(skb)->same_flow = 0;
-	homa_cores[cpu_number]->held_skb = NULL;
-	homa_cores[cpu_number]->held_bucket = 99;
+	mock_cycles = 1000;
 	EXPECT_EQ(NULL, homa_gro_receive(&self->empty_list, skb));
 	same_flow = NAPI_GRO_CB(skb)->same_flow;
 	EXPECT_EQ(0, same_flow);
-	EXPECT_EQ(skb, homa_cores[cpu_number]->held_skb);
-	EXPECT_EQ(3, homa_cores[cpu_number]->held_bucket);
+	EXPECT_EQ(skb, homa_cores[cpu_number]->gro_slots[slot].skb);
+	EXPECT_EQ(3, homa_cores[cpu_number]->gro_slots[slot].bucket);
+	EXPECT_TRUE(ipv6_addr_equal(&self->ip,
+			&homa_cores[cpu_number]->gro_slots[slot].saddr));
+	EXPECT_EQ(1000, homa_cores[cpu_number]->gro_slots[slot].start);
 	kfree_skb(skb);
 }
 TEST_F(homa_offload, homa_gro_receive__empty_merge_list)
 {
+	int slot = gro_slot(&self->ip, 0);
 	struct sk_buff *skb;
 	int same_flow;
 	self->header.seg.offset = htonl(6000);
 	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
 	NAPI_GRO_CB(skb)->same_flow = 0;
-	homa_cores[cpu_number]->held_skb = skb;
-	homa_cores[cpu_number]->held_bucket = 3;
-	EXPECT_EQ(NULL, homa_gro_receive(&self->empty_list, skb));
+	homa_cores[cpu_number]->gro_slots[slot].skb = skb;
+	homa_cores[cpu_number]->gro_slots[slot].bucket = 3;
+	homa_cores[cpu_number]->gro_slots[slot].saddr = self->ip;
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
 	same_flow = NAPI_GRO_CB(skb)->same_flow;
 	EXPECT_EQ(0, same_flow);
-	EXPECT_EQ(skb, homa_cores[cpu_number]->held_skb);
-	EXPECT_EQ(3, homa_cores[cpu_number]->held_bucket);
+	EXPECT_EQ(skb, homa_cores[cpu_number]->gro_slots[slot].skb);
+	EXPECT_EQ(3, homa_cores[cpu_number]->gro_slots[slot].bucket);
 	kfree_skb(skb);
 }
 TEST_F(homa_offload, homa_gro_receive__merge)
 {
+	int slot = gro_slot(&self->ip, 0);
 	struct sk_buff *skb, *skb2;
 	int same_flow;
-	homa_cores[cpu_number]->held_skb = self->skb2;
-	homa_cores[cpu_number]->held_bucket = 2;
+	homa_cores[cpu_number]->gro_slots[slot].skb = self->skb2;
+	homa_cores[cpu_number]->gro_slots[slot].bucket = 2;
+	homa_cores[cpu_number]->gro_slots[slot].saddr = self->ip;
 
 	self->header.seg.offset = htonl(6000);
 	self->header.common.sender_id = cpu_to_be64(1002);
@@ -241,12 +290,14 @@ TEST_F(homa_offload, homa_gro_receive__merge)
 }
 TEST_F(homa_offload, homa_gro_receive__max_gro_skbs)
 {
+	int slot = gro_slot(&self->ip, 0);
 	struct sk_buff *skb;
 
 	// First packet: fits below the limit.
 	homa->max_gro_skbs = 3;
-	homa_cores[cpu_number]->held_skb = self->skb2;
-	homa_cores[cpu_number]->held_bucket = 2;
+	homa_cores[cpu_number]->gro_slots[slot].skb = self->skb2;
+	homa_cores[cpu_number]->gro_slots[slot].bucket = 2;
+	homa_cores[cpu_number]->gro_slots[slot].saddr = self->ip;
 	self->header.seg.offset = htonl(6000);
 	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
 	homa_gro_receive(&self->napi.gro_hash[3].list, skb);
@@ -270,7 +321,7 @@ TEST_F(homa_offload, homa_gro_receive__max_gro_skbs)
 	// Third packet also hits the limit for skb, causing the bucket
 	// to become empty.
 	homa->max_gro_skbs = 2;
-	homa_cores[cpu_number]->held_skb = self->skb;
+	homa_cores[cpu_number]->gro_slots[slot].skb = self->skb;
 	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
 	unit_log_clear();
 	EXPECT_EQ(EINPROGRESS, -PTR_ERR(homa_gro_receive(
@@ -282,7 +333,339 @@ TEST_F(homa_offload, homa_gro_receive__max_gro_skbs)
 			unit_log_get());
 	kfree_skb(self->skb);
 }
+TEST_F(homa_offload, homa_gro_receive__separate_slots_per_peer)
+{
+	struct in6_addr ip2 = unit_get_in_addr("196.168.0.2");
+	int slot = gro_slot(&self->ip, 0);
+	int slot2 = gro_slot(&ip2, 0);
+	struct sk_buff *skb, *skb2;
+	int same_flow;
+
+	ASSERT_NE(slot, slot2);
+
+	homa_cores[cpu_number]->gro_slots[slot].skb = self->skb2;
+	homa_cores[cpu_number]->gro_slots[slot].bucket = 2;
+	homa_cores[cpu_number]->gro_slots[slot].saddr = self->ip;
+
+	/* Packet from a different peer starts a new batch. */
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&ip2, &self->header.common, 1400, 0);
+	NAPI_GRO_CB(skb)->same_flow = 0;
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+	same_flow = NAPI_GRO_CB(skb)->same_flow;
+	EXPECT_EQ(0, same_flow);
+	EXPECT_EQ(skb, homa_cores[cpu_number]->gro_slots[slot2].skb);
+	EXPECT_EQ(self->skb2, homa_cores[cpu_number]->gro_slots[slot].skb);
+	EXPECT_EQ(1, NAPI_GRO_CB(self->skb2)->count);
+
+	/* Packet from the original peer still goes to its batch. */
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	NAPI_GRO_CB(skb2)->same_flow = 0;
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb2));
+	EXPECT_EQ(2, NAPI_GRO_CB(self->skb2)->count);
+	kfree_skb(skb);
+}
+TEST_F(homa_offload, homa_gro_receive__RPC_AFFINE_batches_per_rpc)
+{
+	struct sk_buff *skb, *skb2, *skb3;
+	int same_flow;
+
+	ASSERT_NE(gro_slot(&self->ip, 1003), gro_slot(&self->ip, 1005));
+	homa->gro_policy = HOMA_GRO_RPC_AFFINE;
+	self->header.seg.offset = htonl(6000);
+	self->header.common.sender_id = cpu_to_be64(1002);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	NAPI_GRO_CB(skb)->same_flow = 0;
+	NAPI_GRO_CB(skb)->last = skb;
+	NAPI_GRO_CB(skb)->count = 1;
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+	list_add_tail(&skb->list, &self->napi.gro_hash[3].list);
+	self->napi.gro_hash[3].count++;
+
+	/* Same peer, different RPC: starts a batch of its own. */
+	self->header.common.sender_id = cpu_to_be64(1004);
+	skb2 = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	NAPI_GRO_CB(skb2)->same_flow = 0;
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb2));
+	same_flow = NAPI_GRO_CB(skb2)->same_flow;
+	EXPECT_EQ(0, same_flow);
+	EXPECT_EQ(1, NAPI_GRO_CB(skb)->count);
+
+	/* Same RPC as the first packet: joins its batch. */
+	self->header.common.sender_id = cpu_to_be64(1002);
+	skb3 = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	NAPI_GRO_CB(skb3)->same_flow = 0;
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb3));
+	same_flow = NAPI_GRO_CB(skb3)->same_flow;
+	EXPECT_EQ(1, same_flow);
+	EXPECT_EQ(2, NAPI_GRO_CB(skb)->count);
+
+	list_del(&skb->list);
+	kfree_skb(skb);
+	kfree_skb(skb2);
+}
+TEST_F(homa_offload, homa_gro_receive__slot_skb_no_longer_in_list)
+{
+	int slot = gro_slot(&self->ip, 0);
+	struct sk_buff *skb;
+
+	homa_cores[cpu_number]->gro_slots[slot].skb = self->skb2;
+	homa_cores[cpu_number]->gro_slots[slot].bucket = 4;
+	homa_cores[cpu_number]->gro_slots[slot].saddr = self->ip;
+	self->napi.gro_hash[4].count = 1;
+	list_add_tail(&self->empty_list, &self->napi.gro_hash[4].list);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+	EXPECT_EQ(1, NAPI_GRO_CB(self->skb2)->count);
+	EXPECT_EQ(skb, homa_cores[cpu_number]->gro_slots[slot].skb);
+	list_del_init(&self->empty_list);
+	kfree_skb(skb);
+}
+TEST_F(homa_offload, homa_gro_receive__max_gro_usecs)
+{
+	int slot = gro_slot(&self->ip, 0);
+	struct sk_buff *skb;
+
+	homa->max_gro_cycles = 100;
+	homa_cores[cpu_number]->gro_slots[slot].skb = self->skb2;
+	homa_cores[cpu_number]->gro_slots[slot].bucket = 2;
+	homa_cores[cpu_number]->gro_slots[slot].saddr = self->ip;
+	homa_cores[cpu_number]->gro_slots[slot].start = 1000;
+
+	// First packet: batch isn't old enough yet.
+	mock_cycles = 1099;
+	self->header.seg.offset = htonl(6000);
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	EXPECT_EQ(NULL, homa_gro_receive(&self->napi.gro_hash[3].list, skb));
+	EXPECT_EQ(2, NAPI_GRO_CB(self->skb2)->count);
+
+	// Second packet: batch gets flushed.
+	mock_cycles = 1100;
+	skb = mock_skb_new(&self->ip, &self->header.common, 1400, 0);
+	unit_log_clear();
+	EXPECT_EQ(EINPROGRESS, -PTR_ERR(homa_gro_receive(
+			&self->napi.gro_hash[3].list, skb)));
+	EXPECT_EQ(3, NAPI_GRO_CB(self->skb2)->count);
+	EXPECT_EQ(1, self->napi.gro_hash[2].count);
+	EXPECT_STREQ("netif_receive_skb, id 1002, offset 4000",
+			unit_log_get());
+	EXPECT_EQ(NULL, homa_cores[cpu_number]->gro_slots[slot].skb);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.gro_age_flushes);
+	kfree_skb(self->skb2);
+}
+
+TEST_F(homa_offload, homa_gro_affine_core__use_preferred_core)
+{
+	int preferred = affine_core(&self->ip, 1001);
+
+	homa->gro_affine_max_backlog = 2;
+	atomic_set(&homa_cores[preferred]->softirq_backlog, 2);
+	EXPECT_EQ(preferred, homa_gro_affine_core(self->skb));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.gro_affine_batches);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.gro_affine_overrides);
+}
+TEST_F(homa_offload, homa_gro_affine_core__preferred_core_overloaded)
+{
+	int preferred = affine_core(&self->ip, 1001);
+	int i;
+
+	homa->gro_affine_max_backlog = 2;
+	for (i = 0; i < nr_cpu_ids; i++)
+		atomic_set(&homa_cores[i]->softirq_backlog, 4);
+	atomic_set(&homa_cores[preferred]->softirq_backlog, 3);
+	atomic_set(&homa_cores[(preferred+2) % nr_cpu_ids]->softirq_backlog,
+			1);
+	atomic_set(&homa_cores[(preferred+3) % nr_cpu_ids]->softirq_backlog,
+			2);
+	EXPECT_EQ((preferred+2) % nr_cpu_ids, homa_gro_affine_core(self->skb));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.gro_affine_overrides);
+}
+TEST_F(homa_offload, homa_gro_affine_core__no_better_core)
+{
+	int preferred = affine_core(&self->ip, 1001);
+	int i;
+
+	homa->gro_affine_max_backlog = 2;
+	for (i = 0; i < nr_cpu_ids; i++)
+		atomic_set(&homa_cores[i]->softirq_backlog, 3);
+	EXPECT_EQ(preferred, homa_gro_affine_core(self->skb));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.gro_affine_batches);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.gro_affine_overrides);
+}
+
+TEST_F(homa_offload, homa_gro_affine_core__hash_full_address)
+{
+	/* These addresses share their low-order 32 bits. */
+	struct in6_addr ip1 = unit_get_in_addr("2001:db8::1:2");
+	struct in6_addr ip2 = unit_get_in_addr("fd00::1:2");
+	struct sk_buff *skb1, *skb2;
+
+	ASSERT_NE(affine_core(&ip1, 1001), affine_core(&ip2, 1001));
+	homa->gro_affine_max_backlog = 100;
+	self->header.common.sender_id = cpu_to_be64(1000);
+	skb1 = mock_skb_new(&ip1, &self->header.common, 1400, 0);
+	skb2 = mock_skb_new(&ip2, &self->header.common, 1400, 0);
+	EXPECT_EQ(affine_core(&ip1, 1001), homa_gro_affine_core(skb1));
+	EXPECT_EQ(affine_core(&ip2, 1001), homa_gro_affine_core(skb2));
+	kfree_skb(skb1);
+	kfree_skb(skb2);
+}
+TEST_F(homa_offload, homa_softirq_load)
+{
+	homa_cores[2]->softirq_load = 1000;
+	homa_cores[2]->softirq_load_time = 500;
+	EXPECT_EQ(700, homa_softirq_load(homa_cores[2], 800));
+	EXPECT_EQ(0, homa_softirq_load(homa_cores[2], 1500));
+	EXPECT_EQ(0, homa_softirq_load(homa_cores[2], 2000));
+}
+TEST_F(homa_offload, homa_gro_least_loaded_core__idle_core_in_node)
+{
+	int bytes = self->skb->len + self->skb2->len;
+
+	mock_cycles = 100000;
+	cpu_number = 5;
+	homa_cores[6]->softirq_load = 500;
+	homa_cores[6]->softirq_load_time = 100000;
+	homa_cores[7]->softirq_kb_cycles = 2000;
+	skb_shinfo(self->skb)->frag_list = self->skb2;
+	EXPECT_EQ(7, homa_gro_least_loaded_core(self->skb));
+	skb_shinfo(self->skb)->frag_list = NULL;
+	EXPECT_EQ(2*bytes, homa_cores[7]->softirq_load);
+	EXPECT_EQ(100000, homa_cores[7]->softirq_load_time);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics
+			.gro_load_feedback_batches);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.gro_load_feedback_busy);
+}
+TEST_F(homa_offload, homa_gro_least_loaded_core__skip_excluded_cores)
+{
+	int i;
+
+	mock_cycles = 100000;
+	cpu_number = 5;
+	for (i = 0; i < nr_cpu_ids; i++) {
+		homa_cores[i]->softirq_load = 100;
+		homa_cores[i]->softirq_load_time = 100000;
+	}
+	homa_cores[4]->softirq_load = 300;
+	homa_cores[5]->softirq_load = 200;
+	set_bit(6, self->homa.softirq_excluded);
+	set_bit(7, self->homa.softirq_excluded);
+	homa_gro_candidates_changed(&self->homa);
+	EXPECT_EQ(5, homa_gro_least_loaded_core(self->skb));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.gro_load_feedback_busy);
+}
+TEST_F(homa_offload, homa_gro_least_loaded_core__core_busy_with_gro)
+{
+	mock_cycles = 100000;
+	cpu_number = 5;
+	homa->gro_busy_cycles = 1000;
+	homa_cores[6]->last_gro = 99500;
+	homa_cores[7]->softirq_load = 500;
+	homa_cores[7]->softirq_load_time = 100000;
+	homa_cores[4]->softirq_load = 800;
+	homa_cores[4]->softirq_load_time = 100000;
+	homa_cores[5]->softirq_load = 800;
+	homa_cores[5]->softirq_load_time = 100000;
+	EXPECT_EQ(7, homa_gro_least_loaded_core(self->skb));
+}
+TEST_F(homa_offload, homa_gro_least_loaded_core__all_cores_excluded)
+{
+	int i;
+
+	mock_cycles = 100000;
+	cpu_number = 5;
+	for (i = 4; i < 8; i++)
+		set_bit(i, self->homa.softirq_excluded);
+	homa_gro_candidates_changed(&self->homa);
+	EXPECT_EQ(5, homa_gro_least_loaded_core(self->skb));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.gro_load_feedback_busy);
+}
+TEST_F(homa_offload, homa_gro_least_loaded_core__poll_cores)
+{
+	mock_cycles = 100000;
+	cpu_number = 5;
+	homa_cores[1]->softirq_load = 500;
+	homa_cores[1]->softirq_load_time = 100000;
+	homa_cores[2]->softirq_load = 300;
+	homa_cores[2]->softirq_load_time = 100000;
+	set_bit(1, self->homa.poll_cores);
+	set_bit(2, self->homa.poll_cores);
+	set_bit(2, self->homa.softirq_excluded);
+	self->homa.num_poll_cores = 2;
+	homa_gro_candidates_changed(&self->homa);
+	EXPECT_EQ(2, homa_gro_least_loaded_core(self->skb));
+	self->homa.num_poll_cores = 0;
+}
+TEST_F(homa_offload, homa_gro_candidates_changed__group_by_node)
+{
+	set_bit(1, self->homa.softirq_excluded);
+	set_bit(6, self->homa.softirq_excluded);
+	homa_gro_candidates_changed(&self->homa);
+	EXPECT_EQ(0, homa_cores[2]->gro_first_candidate);
+	EXPECT_EQ(3, homa_cores[2]->gro_num_candidates);
+	EXPECT_EQ(3, homa_cores[5]->gro_first_candidate);
+	EXPECT_EQ(3, homa_cores[5]->gro_num_candidates);
+	EXPECT_EQ(0, self->homa.gro_candidates[0]);
+	EXPECT_EQ(2, self->homa.gro_candidates[1]);
+	EXPECT_EQ(3, self->homa.gro_candidates[2]);
+	EXPECT_EQ(4, self->homa.gro_candidates[3]);
+	EXPECT_EQ(5, self->homa.gro_candidates[4]);
+	EXPECT_EQ(7, self->homa.gro_candidates[5]);
+}
+TEST_F(homa_offload, homa_gro_candidates_changed__poll_cores)
+{
+	set_bit(3, self->homa.poll_cores);
+	set_bit(6, self->homa.poll_cores);
+	self->homa.num_poll_cores = 2;
+	homa_gro_candidates_changed(&self->homa);
+	EXPECT_EQ(0, homa_cores[5]->gro_first_candidate);
+	EXPECT_EQ(2, homa_cores[5]->gro_num_candidates);
+	EXPECT_EQ(3, self->homa.gro_candidates[0]);
+	EXPECT_EQ(6, self->homa.gro_candidates[1]);
+	self->homa.num_poll_cores = 0;
+}
 
+TEST_F(homa_offload, homa_gro_complete__clear_slot)
+{
+	homa->gro_policy = 0;
+	homa_cores[cpu_number]->gro_slots[1].skb = self->skb;
+	homa_cores[cpu_number]->gro_slots[2].skb = self->skb2;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(NULL, homa_cores[cpu_number]->gro_slots[1].skb);
+	EXPECT_EQ(self->skb2, homa_cores[cpu_number]->gro_slots[2].skb);
+}
+TEST_F(homa_offload, homa_gro_complete__RPC_AFFINE)
+{
+	int preferred = affine_core(&self->ip, 1001);
+
+	homa->gro_policy = HOMA_GRO_RPC_AFFINE|HOMA_GRO_IDLE_NEW;
+	mock_cycles = 1000;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(preferred, self->skb->hash - 32);
+	EXPECT_EQ(1, atomic_read(&homa_cores[preferred]->softirq_backlog));
+	EXPECT_EQ(1000, homa_cores[cpu_number]->last_gro);
+}
+TEST_F(homa_offload, homa_gro_complete__LOAD_FEEDBACK)
+{
+	homa->gro_policy = HOMA_GRO_LOAD_FEEDBACK|HOMA_GRO_IDLE_NEW;
+	mock_cycles = 100000;
+	cpu_number = 1;
+	homa_cores[2]->softirq_load = 500;
+	homa_cores[2]->softirq_load_time = 100000;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(3, self->skb->hash - 32);
+	EXPECT_EQ(100000, homa_cores[1]->last_gro);
+}
+TEST_F(homa_offload, homa_gro_complete__poll_cores)
+{
+	homa->gro_policy = HOMA_GRO_RPC_AFFINE;
+	mock_cycles = 100000;
+	set_bit(3, self->homa.poll_cores);
+	self->homa.num_poll_cores = 1;
+	homa_gro_complete(self->skb, 0);
+	EXPECT_EQ(3, self->skb->hash - 32);
+	self->homa.num_poll_cores = 0;
+}
 TEST_F(homa_offload, homa_gro_complete__GRO_IDLE_NEW)
 {
 	homa->gro_policy = HOMA_GRO_IDLE_NEW;
@@ -342,3 +725,53 @@ TEST_F(homa_offload, homa_gro_complete__GRO_IDLE)
 	homa_gro_complete(self->skb, 0);
 	EXPECT_EQ(2, self->skb->hash - 32);
 }
+
+TEST_F(homa_offload, homa_softirq_napi_id__basics)
+{
+	homa_softirq_napi_id(homa, 0);
+	homa_softirq_napi_id(homa, 100);
+	homa_softirq_napi_id(homa, 200);
+	homa_softirq_napi_id(homa, 100);
+	EXPECT_EQ(100, homa->napi_ids[0]);
+	EXPECT_EQ(200, homa->napi_ids[1]);
+	EXPECT_EQ(0, homa->napi_ids[2]);
+}
+TEST_F(homa_offload, homa_softirq_napi_id__table_full)
+{
+	int i;
+
+	for (i = 0; i < HOMA_MAX_NAPI_IDS; i++)
+		homa_softirq_napi_id(homa, 100 + i);
+	homa_softirq_napi_id(homa, 999);
+	EXPECT_EQ(100, homa->napi_ids[0]);
+	EXPECT_EQ(100 + HOMA_MAX_NAPI_IDS - 1,
+			homa->napi_ids[HOMA_MAX_NAPI_IDS - 1]);
+}
+
+TEST_F(homa_offload, homa_poll_cores_changed__start_threads)
+{
+	set_bit(2, homa->poll_cores);
+	set_bit(5, homa->poll_cores);
+	unit_log_clear();
+	homa_poll_cores_changed(homa);
+	EXPECT_STREQ("kthread_bind cpu 2; wake_up_process pid -1; "
+			"kthread_bind cpu 5; wake_up_process pid -1",
+			unit_log_get());
+	EXPECT_EQ(2, homa->num_poll_cores);
+	EXPECT_EQ(0, homa_cores[2]->poll_rank);
+	EXPECT_EQ(1, homa_cores[5]->poll_rank);
+}
+TEST_F(homa_offload, homa_poll_cores_changed__stop_threads)
+{
+	homa_cores[2]->poll_thread = (struct task_struct *) 1;
+	homa_cores[5]->poll_thread = (struct task_struct *) 2;
+	set_bit(5, homa->poll_cores);
+	unit_log_clear();
+	homa_poll_cores_changed(homa);
+	EXPECT_STREQ("", unit_log_get());
+	EXPECT_EQ(NULL, homa_cores[2]->poll_thread);
+	EXPECT_EQ((struct task_struct *) 2, homa_cores[5]->poll_thread);
+	EXPECT_EQ(1, homa->num_poll_cores);
+	EXPECT_EQ(0, homa_cores[5]->poll_rank);
+	homa_cores[5]->poll_thread = NULL;
+}
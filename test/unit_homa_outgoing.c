@@ -240,11 +240,11 @@ TEST_F(homa_outgoing, homa_message_out_init__include_acks)
 	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
 			&self->server_addr);
 	ASSERT_FALSE(crpc == NULL);
-	crpc->peer->acks[0] = (struct homa_ack) {
+	struct homa_ack ack = {
 		.client_port = htons(100),
 		.server_port = htons(200),
 		.client_id = cpu_to_be64(1000)};
-	crpc->peer->num_acks = 1;
+	homa_peer_push_ack(crpc->peer, &ack);
 	ASSERT_EQ(0, -homa_message_out_init(crpc,
 			unit_iov_iter((void *) 1000, 500), 0));
 	homa_rpc_unlock(crpc);
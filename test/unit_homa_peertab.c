@@ -60,11 +60,65 @@ static int dead_count(struct homa_peertab *peertab)
 	return count;
 }
 
-static void peer_spinlock_hook(char *id)
+static struct in6_addr peer_addr(int i)
 {
-	if (strcmp(id, "spin_lock") != 0)
+	struct in6_addr addr = {};
+
+	addr.in6_u.u6_addr32[0] = htonl(0xfc000000);
+	addr.in6_u.u6_addr32[3] = htonl(i);
+	return addr;
+}
+
+static void push_ack(struct homa_peer *peer, int port, __u64 id)
+{
+	struct homa_ack ack = {
+			.client_port = htons(port),
+			.server_port = htons(99),
+			.client_id = cpu_to_be64(id)};
+	homa_peer_push_ack(peer, &ack);
+}
+
+static int bucket_bits(struct homa_peertab *peertab)
+{
+	return rcu_dereference_protected(peertab->buckets, 1)->bits;
+}
+
+/* Used by lookup_peers and bench_hook: the table being benchmarked, the
+ * number of peers in it, the socket to pass to homa_peer_find, and the
+ * cycles per lookup measured by bench_hook.
+ */
+static struct homa_peertab *bench_peertab;
+static int bench_peers;
+static struct inet_sock *bench_inet;
+static __u64 bench_resize_cycles;
+
+/* Looks up @count pseudo-randomly chosen peers that already exist in
+ * bench_peertab; returns the average cycles per lookup.
+ */
+static __u64 lookup_peers(int count)
+{
+	static __u32 rand = 1;
+	struct in6_addr addr;
+	__u64 start;
+	int i;
+
+	start = get_cycles();
+	for (i = 0; i < count; i++) {
+		rand = rand*1103515245 + 12345;
+		addr = peer_addr((rand >> 8) % bench_peers);
+		homa_peer_find(bench_peertab, &addr, bench_inet);
+	}
+	return (get_cycles() - start)/count;
+}
+
+/* Invoked by homa_peertab_resize after it has published the new bucket
+ * array, while lookups may still be traversing the old one.
+ */
+static void bench_hook(char *id)
+{
+	if (strcmp(id, "peertab_resize") != 0)
 		return;
-	mock_cycles += 1000;
+	bench_resize_cycles = lookup_peers(1000);
 }
 
 TEST_F(homa_peertab, homa_peer_find__basics)
@@ -84,6 +138,34 @@ TEST_F(homa_peertab, homa_peer_find__basics)
 	EXPECT_NE(peer, peer2);
 
 	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.peer_new_entries);
+	EXPECT_EQ(2, self->peertab.num_peers);
+}
+TEST_F(homa_peertab, homa_peer_find__reference_counts)
+{
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	EXPECT_EQ(1, atomic_read(&peer->refs));
+	homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	EXPECT_EQ(2, atomic_read(&peer->refs));
+	jiffies = 2000;
+	homa_peer_put(peer);
+	EXPECT_EQ(1, atomic_read(&peer->refs));
+	EXPECT_EQ(2000, peer->access_jiffies);
+}
+TEST_F(homa_peertab, homa_peer_find__peer_being_evicted)
+{
+	struct homa_peer *peer;
+
+	/* The fast path can't take a reference, so the slow path must
+	 * (it runs under the table lock, so the peer can't be evicted).
+	 */
+	peer = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	atomic_set(&peer->refs, -1);
+	EXPECT_EQ(peer, homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet));
+	EXPECT_EQ(0, atomic_read(&peer->refs));
+	EXPECT_EQ(1, self->peertab.num_peers);
 }
 
 static struct _test_data_homa_peertab *test_data;
@@ -129,6 +211,221 @@ TEST_F(homa_peertab, homa_peertab_gc_dsts)
 	EXPECT_EQ(0, dead_count(&self->peertab));
 }
 
+TEST_F(homa_peertab, homa_peertab_gc__below_threshold)
+{
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	homa_peer_put(peer);
+	jiffies += 1000;
+	EXPECT_EQ(0, homa_peertab_gc(&self->peertab, 1, 100));
+	EXPECT_EQ(1, self->peertab.num_peers);
+}
+TEST_F(homa_peertab, homa_peertab_gc__evict_idle_peers)
+{
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	homa_peer_put(peer);
+	peer = homa_peer_find(&self->peertab, ip2222, &self->hsk.inet);
+	homa_peer_put(peer);
+	peer = homa_peer_find(&self->peertab, ip3333, &self->hsk.inet);
+	homa_peer_put(peer);
+	jiffies += 1000;
+	mock_log_rcu_sched = 1;
+	unit_log_clear();
+	EXPECT_EQ(2, homa_peertab_gc(&self->peertab, 1, 100));
+	EXPECT_STREQ("call_rcu; call_rcu", unit_log_get());
+	EXPECT_EQ(1, self->peertab.num_peers);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.peer_evictions);
+
+	/* The oldest peers should have been evicted. */
+	EXPECT_EQ(peer, list_first_entry(&self->peertab.lru, struct homa_peer,
+			lru_links));
+	homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	EXPECT_EQ(2, self->peertab.num_peers);
+	EXPECT_EQ(4, homa_cores[cpu_number]->metrics.peer_new_entries);
+}
+TEST_F(homa_peertab, homa_peertab_gc__skip_busy_peers)
+{
+	struct homa_peer *peer1, *peer2, *peer3;
+
+	peer1 = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	peer2 = homa_peer_find(&self->peertab, ip2222, &self->hsk.inet);
+	homa_peer_put(peer2);
+	push_ack(peer2, 1000, 90);
+	peer3 = homa_peer_find(&self->peertab, ip3333, &self->hsk.inet);
+	homa_peer_put(peer3);
+	jiffies += 1000;
+	EXPECT_EQ(1, homa_peertab_gc(&self->peertab, 2, 100));
+	EXPECT_EQ(2, self->peertab.num_peers);
+	EXPECT_EQ(1, atomic_read(&peer1->refs));
+	EXPECT_EQ(0, atomic_read(&peer2->refs));
+
+	/* Busy peers should have moved to the end of the list. */
+	EXPECT_EQ(peer1, list_first_entry(&self->peertab.lru, struct homa_peer,
+			lru_links));
+	EXPECT_EQ(peer2, list_last_entry(&self->peertab.lru, struct homa_peer,
+			lru_links));
+	homa_peer_put(peer1);
+}
+TEST_F(homa_peertab, homa_peertab_gc__skip_recently_used_peers)
+{
+	struct homa_peer *peer;
+
+	peer = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	homa_peer_put(peer);
+	jiffies += 100;
+	peer = homa_peer_find(&self->peertab, ip2222, &self->hsk.inet);
+	homa_peer_put(peer);
+	jiffies += 50;
+	EXPECT_EQ(1, homa_peertab_gc(&self->peertab, 0, 100));
+	EXPECT_EQ(1, self->peertab.num_peers);
+	EXPECT_EQ(0, atomic_read(&peer->refs));
+}
+
+TEST_F(homa_peertab, homa_peertab_resize__basics)
+{
+	struct homa_peer *peer1, *peer2, *peer3;
+
+	peer1 = homa_peer_find(&self->peertab, ip1111, &self->hsk.inet);
+	peer2 = homa_peer_find(&self->peertab, ip2222, &self->hsk.inet);
+	peer3 = homa_peer_find(&self->peertab, ip3333, &self->hsk.inet);
+	EXPECT_EQ(HOMA_PEERTAB_MIN_BUCKET_BITS, bucket_bits(&self->peertab));
+	EXPECT_EQ(0, homa_peertab_resize(&self->peertab, 10));
+	EXPECT_EQ(10, bucket_bits(&self->peertab));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_table_resizes);
+
+	/* All of the peers should still be found. */
+	EXPECT_EQ(peer1, homa_peer_find(&self->peertab, ip1111,
+			&self->hsk.inet));
+	EXPECT_EQ(peer2, homa_peer_find(&self->peertab, ip2222,
+			&self->hsk.inet));
+	EXPECT_EQ(peer3, homa_peer_find(&self->peertab, ip3333,
+			&self->hsk.inet));
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.peer_new_entries);
+}
+TEST_F(homa_peertab, homa_peertab_resize__vmalloc_error)
+{
+	mock_vmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_peertab_resize(&self->peertab, 10));
+	EXPECT_EQ(HOMA_PEERTAB_MIN_BUCKET_BITS, bucket_bits(&self->peertab));
+}
+
+TEST_F(homa_peertab, homa_peertab_check_size__grow)
+{
+	struct in6_addr addr;
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		addr = peer_addr(i);
+		homa_peer_find(&self->peertab, &addr, &self->hsk.inet);
+	}
+	homa_peertab_check_size(&self->peertab);
+	EXPECT_EQ(HOMA_PEERTAB_MIN_BUCKET_BITS, bucket_bits(&self->peertab));
+
+	addr = peer_addr(64);
+	homa_peer_find(&self->peertab, &addr, &self->hsk.inet);
+	homa_peertab_check_size(&self->peertab);
+	EXPECT_EQ(8, bucket_bits(&self->peertab));
+}
+TEST_F(homa_peertab, homa_peertab_check_size__shrink)
+{
+	struct in6_addr addr;
+	int i;
+
+	homa_peertab_resize(&self->peertab, 10);
+	for (i = 0; i < 128; i++) {
+		addr = peer_addr(i);
+		homa_peer_find(&self->peertab, &addr, &self->hsk.inet);
+	}
+	homa_peertab_check_size(&self->peertab);
+	EXPECT_EQ(10, bucket_bits(&self->peertab));
+
+	self->peertab.num_peers = 5;
+	homa_peertab_check_size(&self->peertab);
+	EXPECT_EQ(HOMA_PEERTAB_MIN_BUCKET_BITS, bucket_bits(&self->peertab));
+	self->peertab.num_peers = 128;
+}
+TEST_F(homa_peertab, homa_peertab_check_size__short_chains)
+{
+	struct in6_addr addr;
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		addr = peer_addr(i);
+		homa_peer_find(&self->peertab, &addr, &self->hsk.inet);
+	}
+	homa_peertab_check_size(&self->peertab);
+	EXPECT_EQ(11, bucket_bits(&self->peertab));
+
+	homa_cores[cpu_number]->metrics.peer_hash_links = 0;
+	for (i = 0; i < 1000; i++) {
+		addr = peer_addr(i);
+		homa_peer_find(&self->peertab, &addr, &self->hsk.inet);
+	}
+	EXPECT_GT(500, homa_cores[cpu_number]->metrics.peer_hash_links);
+	EXPECT_EQ(2000, homa_cores[cpu_number]->metrics.peer_lookups);
+}
+
+TEST_F(homa_peertab, homa_peer_find__lookup_benchmark)
+{
+	/* Measures homa_peer_find cost for tables of various sizes, both
+	 * normally and in the middle of a resize. Only the smallest size
+	 * runs by default; set the environment variable HOMA_PEERTAB_BENCH
+	 * to run all sizes (the largest needs more than 1 GB of memory)
+	 * and print the results.
+	 */
+	static const int sizes[] = {1000, 100000, 1000000};
+	struct homa_metrics *m = &homa_cores[cpu_number]->metrics;
+	struct homa_peertab peertab;
+	__u64 links, cycles, start, resize;
+	struct in6_addr addr;
+	int i, j, bits;
+
+	mock_cycles = ~0;
+	bench_peertab = &peertab;
+	bench_inet = &self->hsk.inet;
+	unit_hook_register(bench_hook);
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		if ((i > 0) && !getenv("HOMA_PEERTAB_BENCH"))
+			break;
+		ASSERT_EQ(0, homa_peertab_init(&peertab));
+		bench_peers = sizes[i];
+
+		/* Grow the table the way homa_timer would. */
+		for (j = 0; j < sizes[i]; j++) {
+			addr = peer_addr(j);
+			homa_peer_find(&peertab, &addr, bench_inet);
+			if ((j % 1000) == 999)
+				homa_peertab_check_size(&peertab);
+		}
+		homa_peertab_check_size(&peertab);
+		bits = bucket_bits(&peertab);
+
+		m->peer_new_entries = 0;
+		links = m->peer_hash_links;
+		cycles = lookup_peers(1000);
+		links = m->peer_hash_links - links;
+
+		start = get_cycles();
+		EXPECT_EQ(0, homa_peertab_resize(&peertab, bits));
+		resize = get_cycles() - start;
+
+		/* Every lookup should have found an existing peer. */
+		EXPECT_EQ(0, m->peer_new_entries);
+		EXPECT_GT(1000, links);
+		if (getenv("HOMA_PEERTAB_BENCH"))
+			printf("homa_peertab %d peers, %d bucket bits: %llu "
+					"cycles per lookup (%llu during resize), "
+					"%llu links per 1000 lookups, resize "
+					"%llu cycles\n", sizes[i], bits, cycles,
+					bench_resize_cycles, links, resize);
+		homa_peertab_destroy(&peertab);
+	}
+	mock_cycles = 0;
+}
+
 TEST_F(homa_peertab, homa_peer_find__conflicting_creates)
 {
 	struct homa_peer *peer;
@@ -273,24 +570,56 @@ TEST_F(homa_peertab, homa_peer_get_dst_ipv6)
 			homa_print_ipv6_addr(&peer->flow.u.ip6.daddr));
 }
 
-TEST_F(homa_peertab, homa_peer_lock_slow)
+TEST_F(homa_peertab, homa_peer_push_ack__basics)
 {
-	mock_cycles = 10000;
 	struct homa_peer *peer = homa_peer_find(&self->peertab, ip3333,
 			&self->hsk.inet);
 	ASSERT_NE(NULL, peer);
+	EXPECT_EQ(0, homa_peer_num_acks(peer));
+
+	push_ack(peer, 1000, 90);
+	push_ack(peer, 1001, 91);
+	EXPECT_EQ(2, homa_peer_num_acks(peer));
+	EXPECT_EQ(1, atomic_read(&peer->ack_slots[0].seq));
+	EXPECT_EQ(2, atomic_read(&peer->ack_slots[1].seq));
+	EXPECT_EQ(2, atomic_read(&peer->ack_slots[2].seq));
+	EXPECT_STREQ("client_port 1001, server_port 99, client_id 91",
+			unit_ack_string(&peer->ack_slots[1].ack));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peer_ack_retries);
+}
+TEST_F(homa_peertab, homa_peer_push_ack__ring_full)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip3333,
+			&self->hsk.inet);
+	struct homa_ack ack = {};
+	int i;
 
-	homa_peer_lock(peer);
-	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peer_ack_lock_misses);
-	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.peer_ack_lock_miss_cycles);
-	homa_peer_unlock(peer);
-
-	mock_trylock_errors = 1;
-	unit_hook_register(peer_spinlock_hook);
-	homa_peer_lock(peer);
-	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.peer_ack_lock_misses);
-	EXPECT_EQ(1000, homa_cores[cpu_number]->metrics.peer_ack_lock_miss_cycles);
-	homa_peer_unlock(peer);
+	for (i = 0; i < HOMA_PEER_ACK_SLOTS; i++)
+		push_ack(peer, 1000, 100 + i);
+	EXPECT_EQ(ENOSPC, -homa_peer_push_ack(peer, &ack));
+	EXPECT_EQ(HOMA_PEER_ACK_SLOTS, homa_peer_num_acks(peer));
+}
+TEST_F(homa_peertab, homa_peer_push_ack__wrap_around)
+{
+	struct homa_peer *peer = homa_peer_find(&self->peertab, ip3333,
+			&self->hsk.inet);
+	struct homa_ack acks[HOMA_PEER_ACK_SLOTS];
+	int i;
+
+	for (i = 0; i < HOMA_PEER_ACK_SLOTS; i++)
+		push_ack(peer, 1000, 100 + i);
+	EXPECT_EQ(3, homa_peer_get_acks(peer, 3, acks));
+	push_ack(peer, 2000, 200);
+	push_ack(peer, 2001, 201);
+	EXPECT_EQ(HOMA_PEER_ACK_SLOTS - 1, homa_peer_num_acks(peer));
+
+	EXPECT_EQ(HOMA_PEER_ACK_SLOTS - 1, homa_peer_get_acks(peer,
+			HOMA_PEER_ACK_SLOTS, acks));
+	EXPECT_STREQ("client_port 1000, server_port 99, client_id 103",
+			unit_ack_string(&acks[0]));
+	EXPECT_STREQ("client_port 2001, server_port 99, client_id 201",
+			unit_ack_string(&acks[HOMA_PEER_ACK_SLOTS - 2]));
+	EXPECT_EQ(0, homa_peer_num_acks(peer));
 }
 
 TEST_F(homa_peertab, homa_peer_add_ack)
@@ -301,85 +630,71 @@ TEST_F(homa_peertab, homa_peer_add_ack)
 	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
 		self->client_ip, self->server_ip, self->server_port,
 		102, 100, 100);
-	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk, UNIT_OUTGOING,
-		self->client_ip, self->server_ip, self->server_port,
-		103, 100, 100);
 	struct homa_peer *peer = crpc1->peer;
-	EXPECT_EQ(0, peer->num_acks);
-
-	/* Initialize 3 acks in the peer. */
-	peer->acks[0] = (struct homa_ack) {
-			.client_port = htons(1000),
-			.server_port = htons(self->server_port),
-			.client_id = cpu_to_be64(90)};
-	peer->acks[1] = (struct homa_ack) {
-			.client_port = htons(1001),
-			.server_port = htons(self->server_port),
-			.client_id = cpu_to_be64(91)};
-	peer->acks[2] = (struct homa_ack) {
-			.client_port = htons(1002),
-			.server_port = htons(self->server_port),
-			.client_id = cpu_to_be64(92)};
-	peer->num_acks = 3;
+	struct homa_ack acks[HOMA_PEER_ACK_SLOTS];
+	int i;
+
+	EXPECT_EQ(0, homa_peer_num_acks(peer));
+
+	/* Fill all but one slot in the peer. */
+	for (i = 0; i < HOMA_PEER_ACK_SLOTS - 1; i++)
+		push_ack(peer, 1000 + i, 90 + i);
 
 	/* Add one RPC to unacked (fits). */
 	homa_peer_add_ack(crpc1);
-	EXPECT_EQ(4, peer->num_acks);
+	EXPECT_EQ(HOMA_PEER_ACK_SLOTS, homa_peer_num_acks(peer));
 	EXPECT_STREQ("client_port 32768, server_port 99, client_id 101",
-			unit_ack_string(&peer->acks[3]));
+			unit_ack_string(&peer->ack_slots[
+			HOMA_PEER_ACK_SLOTS - 1].ack));
 
-	/* Add another RPC to unacked (also fits). */
-	homa_peer_add_ack(crpc2);
-	EXPECT_EQ(5, peer->num_acks);
-	EXPECT_STREQ("client_port 32768, server_port 99, client_id 102",
-			unit_ack_string(&peer->acks[4]));
-
-	/* Third RPC overflows, triggers ACK transmission. */
+	/* Second RPC overflows, triggers ACK transmission with the
+	 * oldest acks.
+	 */
 	unit_log_clear();
 	mock_xmit_log_verbose = 1;
-	homa_peer_add_ack(crpc3);
-	EXPECT_EQ(0, peer->num_acks);
-	EXPECT_STREQ("xmit ACK from 0.0.0.0:32768, dport 99, id 103, acks "
+	homa_peer_add_ack(crpc2);
+	EXPECT_EQ(HOMA_PEER_ACK_SLOTS - NUM_PEER_UNACKED_IDS,
+			homa_peer_num_acks(peer));
+	EXPECT_STREQ("xmit ACK from 0.0.0.0:32768, dport 99, id 102, acks "
 			"[cp 1000, sp 99, id 90] [cp 1001, sp 99, id 91] "
-			"[cp 1002, sp 99, id 92] [cp 32768, sp 99, id 101] "
-			"[cp 32768, sp 99, id 102]",
+			"[cp 1002, sp 99, id 92] [cp 1003, sp 99, id 93] "
+			"[cp 1004, sp 99, id 94]",
 			unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.ack_overflows);
+
+	/* The remaining acks are still available, in order. */
+	EXPECT_EQ(HOMA_PEER_ACK_SLOTS - NUM_PEER_UNACKED_IDS,
+			homa_peer_get_acks(peer, HOMA_PEER_ACK_SLOTS, acks));
+	EXPECT_STREQ("client_port 1005, server_port 99, client_id 95",
+			unit_ack_string(&acks[0]));
 }
 
 TEST_F(homa_peertab, homa_peer_get_acks)
 {
 	struct homa_peer *peer = homa_peer_find(&self->peertab, ip3333,
 			&self->hsk.inet);
+	struct homa_ack acks[2];
+
 	ASSERT_NE(NULL, peer);
-	EXPECT_EQ(0, peer->num_acks);
+	EXPECT_EQ(0, homa_peer_num_acks(peer));
 
 	// First call: nothing available.
-	struct homa_ack acks[2];
 	EXPECT_EQ(0, homa_peer_get_acks(peer, 2, acks));
 
-	// Second call: retrieve 2 out of 3.
-	peer->acks[0] = (struct homa_ack) {
-			.client_port = htons(4000),
-			.server_port = htons(5000),
-			.client_id = cpu_to_be64(100)};
-	peer->acks[1] = (struct homa_ack) {
-			.client_port = htons(4001),
-			.server_port = htons(5001),
-			.client_id = cpu_to_be64(101)};
-	peer->acks[2] = (struct homa_ack) {
-			.client_port = htons(4002),
-			.server_port = htons(5002),
-			.client_id = cpu_to_be64(102)};
-	peer->num_acks = 3;
+	// Second call: retrieve 2 out of 3 (oldest first).
+	push_ack(peer, 4000, 100);
+	push_ack(peer, 4001, 101);
+	push_ack(peer, 4002, 102);
 	EXPECT_EQ(2, homa_peer_get_acks(peer, 2, acks));
-	EXPECT_STREQ("client_port 4001, server_port 5001, client_id 101",
+	EXPECT_STREQ("client_port 4000, server_port 99, client_id 100",
 			unit_ack_string(&acks[0]));
-	EXPECT_STREQ("client_port 4002, server_port 5002, client_id 102",
+	EXPECT_STREQ("client_port 4001, server_port 99, client_id 101",
 			unit_ack_string(&acks[1]));
-	EXPECT_EQ(1, peer->num_acks);
+	EXPECT_EQ(1, homa_peer_num_acks(peer));
 
 	// Third call: retrieve final id.
 	EXPECT_EQ(1, homa_peer_get_acks(peer, 2, acks));
-	EXPECT_STREQ("client_port 4000, server_port 5000, client_id 100",
+	EXPECT_STREQ("client_port 4002, server_port 99, client_id 102",
 			unit_ack_string(&acks[0]));
+	EXPECT_EQ(0, homa_peer_num_acks(peer));
 }
@@ -262,6 +262,7 @@ TEST_F(homa_plumbing, homa_set_sock_opt__success)
 	struct homa_set_buf_args args;
 	char buffer[5000];
 
+	memset(&args, 0, sizeof(args));
 	args.start = (void *) (((__u64) (buffer + PAGE_SIZE - 1))
 			& ~(PAGE_SIZE - 1));
 	args.length = 5*HOMA_BPAGE_SIZE;
@@ -269,10 +270,174 @@ TEST_F(homa_plumbing, homa_set_sock_opt__success)
 	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
 			SO_HOMA_SET_BUF, self->optval,
 			sizeof(struct homa_set_buf_args)));
-	EXPECT_EQ(args.start, self->hsk.buffer_pool.region);
+	EXPECT_EQ(args.start, self->hsk.buffer_pool.regions[0].start);
 	EXPECT_EQ(5, self->hsk.buffer_pool.num_bpages);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.regions[0].pages);
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.so_set_buf_calls);
 }
+TEST_F(homa_plumbing, homa_set_sock_opt__args_without_flags)
+{
+	struct homa_set_buf_args args;
+
+	args.start = (void *) 0x100000;
+	args.length = 5*HOMA_BPAGE_SIZE;
+	args.flags = HOMA_BUF_PIN;
+	self->optval.user = &args;
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			offsetof(struct homa_set_buf_args, flags)));
+	EXPECT_EQ(5, self->hsk.buffer_pool.num_bpages);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.regions[0].pages);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__bad_flags)
+{
+	struct homa_set_buf_args args = {(void *) 0x100000, 5*HOMA_BPAGE_SIZE,
+			0x100};
+	self->optval.user = &args;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.regions[0].start);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__pin_region)
+{
+	struct homa_set_buf_args args = {(void *) 0x100000, 5*HOMA_BPAGE_SIZE,
+			HOMA_BUF_PIN};
+	self->optval.user = &args;
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_NE(NULL, self->hsk.buffer_pool.regions[0].pages);
+	EXPECT_EQ(5*HOMA_BPAGE_SIZE/PAGE_SIZE,
+			self->hsk.buffer_pool.regions[0].num_pages);
+	EXPECT_EQ(&mock_mm, self->hsk.buffer_pool.regions[0].mm);
+	EXPECT_EQ(5*HOMA_BPAGE_SIZE/PAGE_SIZE,
+			atomic64_read(&mock_mm.pinned_vm));
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__pin_fails)
+{
+	struct homa_set_buf_args args = {(void *) 0x100000, 5*HOMA_BPAGE_SIZE,
+			HOMA_BUF_HUGE};
+	self->optval.user = &args;
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.regions[0].start);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__pin_exceeds_memlock_limit)
+{
+	struct homa_set_buf_args args = {(void *) 0x100000, 5*HOMA_BPAGE_SIZE,
+			HOMA_BUF_PIN};
+	self->optval.user = &args;
+	mock_copy_to_user_dont_copy = -1;
+	mock_rlimit = 4*HOMA_BPAGE_SIZE;
+	EXPECT_EQ(ENOMEM, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.regions[0].start);
+	EXPECT_EQ(0, atomic64_read(&mock_mm.pinned_vm));
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__pool_init_fails_after_pin)
+{
+	struct homa_set_buf_args args = {(void *) 0x100000, 2*HOMA_BPAGE_SIZE,
+			HOMA_BUF_PIN};
+	self->optval.user = &args;
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.regions[0].start);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__pool_already_initialized)
+{
+	struct homa_set_buf_args args = {(void *) 0x100000, 5*HOMA_BPAGE_SIZE,
+			0};
+	self->optval.user = &args;
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	args.start = (void *) 0x200000;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(1, self->hsk.buffer_pool.num_regions);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__add_region)
+{
+	struct homa_set_buf_args args = {(void *) 0x100000, 5*HOMA_BPAGE_SIZE,
+			HOMA_BUF_ADD};
+	self->optval.user = &args;
+	mock_copy_to_user_dont_copy = -1;
+
+	/* First attempt fails: pool not initialized. */
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	args.flags = 0;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+
+	args.start = (void *) 0x200000;
+	args.length = 3*HOMA_BPAGE_SIZE;
+	args.flags = HOMA_BUF_ADD|HOMA_BUF_PIN;
+	EXPECT_EQ(1, homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(args.start, self->hsk.buffer_pool.regions[1].start);
+	EXPECT_EQ(8, self->hsk.buffer_pool.num_bpages);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.regions[0].pages);
+	EXPECT_EQ(3*HOMA_BPAGE_SIZE/PAGE_SIZE,
+			self->hsk.buffer_pool.regions[1].num_pages);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__region_too_large)
+{
+	struct homa_set_buf_args args = {(void *) 0x100000,
+			HOMA_MAX_REGION_SIZE + HOMA_BPAGE_SIZE, 0};
+	self->optval.user = &args;
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(0, self->hsk.buffer_pool.num_regions);
+}
+TEST_F(homa_plumbing, homa_set_sock_opt__retire_region)
+{
+	struct homa_set_buf_args args = {(void *) 0x100000, 5*HOMA_BPAGE_SIZE,
+			0};
+	self->optval.user = &args;
+	mock_copy_to_user_dont_copy = -1;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	args.start = (void *) 0x200000;
+	args.flags = HOMA_BUF_ADD|HOMA_BUF_PIN;
+	EXPECT_EQ(1, homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+
+	/* Other flags can't be combined with HOMA_BUF_RETIRE. */
+	args.flags = HOMA_BUF_RETIRE|HOMA_BUF_PIN;
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+
+	args.flags = HOMA_BUF_RETIRE;
+	EXPECT_EQ(0, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.regions[1].start);
+	EXPECT_EQ(NULL, self->hsk.buffer_pool.regions[1].pages);
+	EXPECT_EQ(0, atomic64_read(&mock_mm.pinned_vm));
+	EXPECT_EQ(5, self->hsk.buffer_pool.num_bpages);
+	EXPECT_EQ(EINVAL, -homa_setsockopt(&self->hsk.sock, IPPROTO_HOMA,
+			SO_HOMA_SET_BUF, self->optval,
+			sizeof(struct homa_set_buf_args)));
+}
 
 TEST_F(homa_plumbing, homa_sendmsg__args_not_in_user_space)
 {
@@ -465,16 +630,20 @@ TEST_F(homa_plumbing, homa_recvmsg__release_buffers)
 			(char *) 0x1000000, 100*HOMA_BPAGE_SIZE));
 	EXPECT_EQ(0, -homa_pool_get_pages(&self->hsk.buffer_pool, 2,
 			self->recvmsg_args.bpage_offsets, 0));
-	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.descriptors[0].refs));
-	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.descriptors[1].refs));
+	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.regions[0]
+			.descriptors[0].refs));
+	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.regions[0]
+			.descriptors[1].refs));
 	self->recvmsg_args.num_bpages = 2;
 	self->recvmsg_args.bpage_offsets[0] = 0;
 	self->recvmsg_args.bpage_offsets[1] = HOMA_BPAGE_SIZE;
 
 	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
 			0, 0, 0, &self->recvmsg_hdr.msg_namelen));
-	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool.descriptors[0].refs));
-	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool.descriptors[1].refs));
+	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool.regions[0]
+			.descriptors[0].refs));
+	EXPECT_EQ(0, atomic_read(&self->hsk.buffer_pool.regions[0]
+			.descriptors[1].refs));
 }
 TEST_F(homa_plumbing, homa_recvmsg__nonblocking_argument)
 {
@@ -553,6 +722,50 @@ TEST_F(homa_plumbing, homa_recvmsg__normal_completion_ipv6)
 	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
 	EXPECT_EQ(0, crpc->msgin.num_bpages);
 }
+TEST_F(homa_plumbing, homa_recvmsg__partial_message)
+{
+	EXPECT_EQ(0, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
+			(char *) 0x1000000, 100*HOMA_BPAGE_SIZE));
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 100, 20000);
+	EXPECT_NE(NULL, crpc);
+	self->recvmsg_args.flags |= HOMA_RECVMSG_PARTIAL;
+
+	EXPECT_EQ(20000, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(self->client_id, self->recvmsg_args.id);
+	EXPECT_EQ(1400, self->recvmsg_args.available);
+	EXPECT_EQ(0, self->recvmsg_args.num_bpages);
+	EXPECT_EQ(1, crpc->msgin.num_bpages);
+	EXPECT_EQ(1400, crpc->msgin.delivered);
+	EXPECT_EQ(RPC_INCOMING, crpc->state);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.partial_recvs);
+
+	/* No more data has arrived, so nothing to return. */
+	self->recvmsg_hdr.msg_control = &self->recvmsg_args;
+	EXPECT_EQ(EAGAIN, -homa_recvmsg(&self->hsk.inet.sk,
+			&self->recvmsg_hdr, 0, 0, 0,
+			&self->recvmsg_hdr.msg_namelen));
+}
+TEST_F(homa_plumbing, homa_recvmsg__available_for_complete_message)
+{
+	EXPECT_EQ(0, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
+			(char *) 0x1000000, 100*HOMA_BPAGE_SIZE));
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk, UNIT_RCVD_MSG,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id, 100, 2000);
+	EXPECT_NE(NULL, crpc);
+	self->recvmsg_args.flags |= HOMA_RECVMSG_PARTIAL;
+
+	EXPECT_EQ(2000, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
+			0, 0, 0, &self->recvmsg_hdr.msg_namelen));
+	EXPECT_EQ(2000, self->recvmsg_args.available);
+	EXPECT_EQ(1, self->recvmsg_args.num_bpages);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.partial_recvs);
+}
 TEST_F(homa_plumbing, homa_recvmsg__rpc_has_error)
 {
 	EXPECT_EQ(0, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
@@ -585,7 +798,7 @@ TEST_F(homa_plumbing, homa_recvmsg__add_ack)
 
 	EXPECT_EQ(2000, homa_recvmsg(&self->hsk.inet.sk, &self->recvmsg_hdr,
 			0, 0, 0, &self->recvmsg_hdr.msg_namelen));
-	EXPECT_EQ(1, crpc->peer->num_acks);
+	EXPECT_EQ(1, homa_peer_num_acks(crpc->peer));
 }
 TEST_F(homa_plumbing, homa_recvmsg__server_normal_completion)
 {
@@ -600,7 +813,7 @@ TEST_F(homa_plumbing, homa_recvmsg__server_normal_completion)
 			0, 0, 0, &self->recvmsg_hdr.msg_namelen));
 	EXPECT_EQ(self->server_id, self->recvmsg_args.id);
 	EXPECT_EQ(RPC_IN_SERVICE, srpc->state);
-	EXPECT_EQ(0, srpc->peer->num_acks);
+	EXPECT_EQ(0, homa_peer_num_acks(srpc->peer));
 	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
 }
 TEST_F(homa_plumbing, homa_recvmsg__delete_server_rpc_after_error)
@@ -641,8 +854,10 @@ TEST_F(homa_plumbing, homa_recvmsg__copy_back_args_even_after_error)
 			(char *) 0x1000000, 100*HOMA_BPAGE_SIZE));
 	EXPECT_EQ(0, -homa_pool_get_pages(&self->hsk.buffer_pool, 2,
 			self->recvmsg_args.bpage_offsets, 0));
-	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.descriptors[0].refs));
-	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.descriptors[1].refs));
+	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.regions[0]
+			.descriptors[0].refs));
+	EXPECT_EQ(1, atomic_read(&self->hsk.buffer_pool.regions[0]
+			.descriptors[1].refs));
 	self->recvmsg_args.num_bpages = 2;
 	self->recvmsg_args.bpage_offsets[0] = 0;
 	self->recvmsg_args.bpage_offsets[1] = HOMA_BPAGE_SIZE;
@@ -730,6 +945,60 @@ TEST_F(homa_plumbing, homa_softirq__nothing_to_reorder)
 	unit_log_active_ids(&self->hsk);
 	EXPECT_STREQ("2001 3001 5001", unit_log_get());
 }
+TEST_F(homa_plumbing, homa_softirq__control_packets_before_data)
+{
+	struct sk_buff *skb, *skb2;
+	struct resend_header h = {{.sport = htons(self->client_port),
+	                .dport = htons(self->server_port),
+			.sender_id = cpu_to_be64(self->client_id),
+			.type = RESEND},
+		        .offset = htonl(0),
+			.length = htonl(100),
+			.priority = 3};
+
+	/* The RESEND arrives after the DATA packet that creates the RPC,
+	 * but it gets processed first, so the RPC is still unknown.
+	 */
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	skb2 = mock_skb_new(self->client_ip, &h.common, 0, 0);
+	skb_shinfo(skb)->frag_list = skb2;
+	skb2->next = NULL;
+	unit_log_clear();
+	homa_softirq(skb);
+	EXPECT_SUBSTR("xmit UNKNOWN", unit_log_get());
+	EXPECT_EQ(1, unit_list_length(&self->hsk.active_rpcs));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.softirq_control_pkts);
+}
+TEST_F(homa_plumbing, homa_softirq__group_data_packets_by_rpc)
+{
+	struct sk_buff *skb, *skb2, *skb3;
+
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.common.sender_id = cpu_to_be64(self->client_id + 2);
+	skb2 = mock_skb_new(self->client_ip, &self->data.common, 1400, 0);
+	self->data.common.sender_id = cpu_to_be64(self->client_id);
+	self->data.seg.offset = htonl(1400);
+	skb3 = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
+	skb_shinfo(skb)->frag_list = skb2;
+	skb2->next = skb3;
+	skb3->next = NULL;
+	homa_softirq(skb);
+	unit_log_clear();
+	unit_log_active_ids(&self->hsk);
+	EXPECT_STREQ("1235 1237", unit_log_get());
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.softirq_data_regrouped);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.lcache_hits);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.lcache_misses);
+}
+TEST_F(homa_plumbing, homa_softirq__update_kb_cycles)
+{
+	struct sk_buff *skb;
+
+	homa_cores[cpu_number]->softirq_kb_cycles = 8000;
+	skb = mock_skb_new(self->client_ip, &self->data.common, 1400, 1400);
+	homa_softirq(skb);
+	EXPECT_EQ(7000, homa_cores[cpu_number]->softirq_kb_cycles);
+}
 TEST_F(homa_plumbing, homa_softirq__cant_pull_header)
 {
 	struct sk_buff *skb;
@@ -23,6 +23,10 @@
 
 #define REGION_SIZE (1024*HOMA_BPAGE_SIZE)
 
+/* Index of the first bpage in a given region of a pool. */
+#define REGION_INDEX(region) ((region) << (HOMA_REGION_SHIFT \
+		- HOMA_BPAGE_SHIFT))
+
 static struct homa_pool *cur_pool;
 
 FIXTURE(homa_pool) {
@@ -49,31 +53,156 @@ FIXTURE_TEARDOWN(homa_pool)
 	unit_teardown();
 }
 
+/* Returns the slot bitmap for the bpage with a given index in @pool. */
+static unsigned long *slot_map(struct homa_pool *pool, int index)
+{
+	return &pool->regions[index >> HOMA_REGION_BPAGES_SHIFT].slot_maps[
+			(index & ((1 << HOMA_REGION_BPAGES_SHIFT) - 1))
+			* HOMA_SLOT_MAP_LONGS];
+}
+
+static int hook_count;
 static void steal_bpages_hook(char *id)
 {
 	if (strcmp(id, "spin_lock") != 0)
 		return;
 	if (!cur_pool)
 		return;
-	switch (atomic_read(&cur_pool->next_scan)) {
+	hook_count++;
+	switch (hook_count) {
 	case 1:
-		atomic_set(&cur_pool->descriptors[0].refs, 1);
+		atomic_set(&cur_pool->regions[0].descriptors[0].refs, 1);
 		break;
 	case 3:
-		cur_pool->descriptors[2].owner = 0;
-		cur_pool->descriptors[2].expiration = mock_cycles + 1;
+		cur_pool->regions[0].descriptors[2].owner = 0;
+		cur_pool->regions[0].descriptors[2].expiration = mock_cycles + 1;
 	}
 }
 
+/**
+ * limit_pool() - Restrict a pool (which must be on a single NUMA node)
+ * so that only its first few bpages can be allocated.
+ * @pool:        Pool to restrict.
+ * @num_bpages:  Number of bpages to leave available.
+ */
+static void limit_pool(struct homa_pool *pool, int num_bpages)
+{
+	int i;
+
+	for (i = num_bpages; i < pool->num_bpages; i++)
+		clear_bit(i, pool->nodes[0].free_map);
+	pool->nodes[0].num_bpages = num_bpages;
+}
+
+TEST_F(homa_pool, homa_pool_pin__basics)
+{
+	struct page **pages;
+	struct mm_struct *mm;
+	int num_pages = 0;
+
+	pages = homa_pool_pin(self->buffer_region, 4*HOMA_BPAGE_SIZE,
+			HOMA_BUF_PIN, &num_pages, &mm);
+	ASSERT_FALSE(IS_ERR(pages));
+	EXPECT_EQ(4*HOMA_BPAGE_SIZE/PAGE_SIZE, num_pages);
+	EXPECT_EQ(&mock_pages[0], pages[0]);
+	EXPECT_EQ(&mock_pages[5], pages[5]);
+	EXPECT_EQ(num_pages, homa_cores[cpu_number]->metrics.buf_pinned_pages);
+	EXPECT_EQ(&mock_mm, mm);
+	EXPECT_EQ(num_pages, atomic64_read(&mock_mm.pinned_vm));
+	homa_pool_unpin(pages, num_pages, mm);
+	EXPECT_EQ(0, atomic64_read(&mock_mm.pinned_vm));
+}
+TEST_F(homa_pool, homa_pool_pin__region_not_page_aligned)
+{
+	struct mm_struct *mm;
+	int num_pages = 0;
+
+	EXPECT_EQ(EINVAL, -PTR_ERR(homa_pool_pin(
+			((char *) self->buffer_region) + 10,
+			4*HOMA_BPAGE_SIZE, HOMA_BUF_PIN, &num_pages, &mm)));
+}
+TEST_F(homa_pool, homa_pool_pin__cant_allocate_page_array)
+{
+	struct mm_struct *mm;
+	int num_pages = 0;
+
+	mock_vmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -PTR_ERR(homa_pool_pin(self->buffer_region,
+			4*HOMA_BPAGE_SIZE, HOMA_BUF_PIN, &num_pages, &mm)));
+}
+TEST_F(homa_pool, homa_pool_pin__exceeds_memlock_limit)
+{
+	struct mm_struct *mm;
+	int num_pages = 0;
+
+	/* Pages pinned earlier (by any means) count against the limit. */
+	mock_rlimit = 3*HOMA_BPAGE_SIZE;
+	atomic64_set(&mock_mm.pinned_vm, 1);
+	EXPECT_EQ(ENOMEM, -PTR_ERR(homa_pool_pin(self->buffer_region,
+			3*HOMA_BPAGE_SIZE, HOMA_BUF_PIN, &num_pages, &mm)));
+	EXPECT_EQ(1, atomic64_read(&mock_mm.pinned_vm));
+	EXPECT_EQ(0, num_pages);
+	atomic64_set(&mock_mm.pinned_vm, 0);
+}
+TEST_F(homa_pool, homa_pool_pin__memlock_limit_but_capable)
+{
+	struct page **pages;
+	struct mm_struct *mm;
+	int num_pages = 0;
+
+	mock_rlimit = 0;
+	mock_capable = 1;
+	pages = homa_pool_pin(self->buffer_region, 4*HOMA_BPAGE_SIZE,
+			HOMA_BUF_PIN, &num_pages, &mm);
+	ASSERT_FALSE(IS_ERR(pages));
+	EXPECT_EQ(num_pages, atomic64_read(&mock_mm.pinned_vm));
+	homa_pool_unpin(pages, num_pages, mm);
+}
+TEST_F(homa_pool, homa_pool_pin__pin_fails)
+{
+	struct mm_struct *mm;
+	int num_pages = 0;
+
+	mock_pin_errors = 1;
+	EXPECT_EQ(EFAULT, -PTR_ERR(homa_pool_pin(self->buffer_region,
+			4*HOMA_BPAGE_SIZE, HOMA_BUF_PIN, &num_pages, &mm)));
+	EXPECT_EQ(0, num_pages);
+	EXPECT_EQ(0, atomic64_read(&mock_mm.pinned_vm));
+}
+TEST_F(homa_pool, homa_pool_pin__huge_pages_required)
+{
+	struct page **pages;
+	struct mm_struct *mm;
+	int num_pages = 0;
+
+	/* Regular pages: error (and pages must be unpinned). */
+	EXPECT_EQ(EINVAL, -PTR_ERR(homa_pool_pin(self->buffer_region,
+			4*HOMA_BPAGE_SIZE, HOMA_BUF_HUGE, &num_pages, &mm)));
+	EXPECT_EQ(0, atomic64_read(&mock_mm.pinned_vm));
+
+	/* Huge pages: success. */
+	mock_huge_pages = 1;
+	pages = homa_pool_pin(self->buffer_region, 4*HOMA_BPAGE_SIZE,
+			HOMA_BUF_HUGE, &num_pages, &mm);
+	ASSERT_FALSE(IS_ERR(pages));
+	homa_pool_unpin(pages, num_pages, mm);
+}
+
 TEST_F(homa_pool, homa_pool_init__basics)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
 	EXPECT_EQ(100, pool->num_bpages);
-	EXPECT_EQ(4, atomic_read(&pool->active_pages));
-	EXPECT_EQ(0, atomic_read(&pool->next_scan));
-	EXPECT_EQ(-1, pool->descriptors[98].owner);
+	EXPECT_EQ(1, pool->num_regions);
+	EXPECT_EQ(self->buffer_region, pool->regions[0].start);
+	EXPECT_EQ(1024, pool->map_words);
+	EXPECT_EQ(16, pool->summary_words);
+	EXPECT_EQ(~0UL, pool->nodes[0].free_map[0]);
+	EXPECT_EQ(0xfffffffffUL, pool->nodes[0].free_map[1]);
+	EXPECT_EQ(3, pool->nodes[0].free_summary[0]);
+	EXPECT_EQ(0, pool->nodes[1].free_summary[0]);
+	EXPECT_EQ(-1, pool->regions[0].descriptors[98].owner);
 }
 TEST_F(homa_pool, homa_pool_init__region_not_page_aligned)
 {
@@ -86,17 +215,288 @@ TEST_F(homa_pool, homa_pool_init__region_too_small)
 	EXPECT_EQ(EINVAL, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
 			self->buffer_region, 3*HOMA_BPAGE_SIZE));
 }
-TEST_F(homa_pool, homa_pool_init__cant_allocate_descriptors)
+TEST_F(homa_pool, homa_pool_init__cant_allocate_core_info)
 {
 	mock_kmalloc_errors = 1;
 	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
 }
-TEST_F(homa_pool, homa_pool_init__cant_allocate_core_info)
+TEST_F(homa_pool, homa_pool_init__cant_allocate_node_info)
 {
 	mock_kmalloc_errors = 2;
 	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	mock_kmalloc_errors = 4;
+	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+}
+TEST_F(homa_pool, homa_pool_init__cant_allocate_descriptors)
+{
+	mock_kmalloc_errors = 8;
+	EXPECT_EQ(ENOMEM, -homa_pool_init(&self->hsk.buffer_pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(0, self->hsk.buffer_pool.num_regions);
+}
+TEST_F(homa_pool, homa_pool_init__partition_by_node)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	mock_page_node_split = 0x1000000 + 60*HOMA_BPAGE_SIZE;
+	mock_page_node_unplaced = 0x1000000 + 90*HOMA_BPAGE_SIZE;
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(2, pool->num_nodes);
+	EXPECT_EQ(60, pool->nodes[0].num_bpages);
+	EXPECT_EQ(30, pool->nodes[1].num_bpages);
+	EXPECT_EQ(10, pool->nodes[2].num_bpages);
+	EXPECT_EQ(1, pool->regions[0].descriptors[70].node);
+	EXPECT_EQ(NUMA_NO_NODE, pool->regions[0].descriptors[95].node);
+	EXPECT_EQ(0, test_bit(70, pool->nodes[0].free_map));
+	EXPECT_EQ(1, test_bit(70, pool->nodes[1].free_map));
+	EXPECT_EQ(1, test_bit(95, pool->nodes[2].free_map));
+}
+
+TEST_F(homa_pool, homa_pool_add_region__basics)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(1, homa_pool_add_region(pool, (void *) 0x4000000,
+			50*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(2, pool->num_regions);
+	EXPECT_EQ(150, pool->num_bpages);
+	EXPECT_EQ(150, pool->nodes[0].num_bpages);
+	EXPECT_EQ(50, pool->regions[1].num_bpages);
+	EXPECT_EQ(1, test_bit(REGION_INDEX(1) + 49, pool->nodes[0].free_map));
+	EXPECT_EQ(0, test_bit(REGION_INDEX(1) + 50, pool->nodes[0].free_map));
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.buf_regions_added);
+}
+TEST_F(homa_pool, homa_pool_add_region__bad_arguments)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(EINVAL, -homa_pool_add_region(pool, (void *) 0x4000010,
+			50*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(EINVAL, -homa_pool_add_region(pool, (void *) 0x4000000,
+			HOMA_BPAGE_SIZE - 1));
+	EXPECT_EQ(EINVAL, -homa_pool_add_region(pool, self->buffer_region,
+			50*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(1, pool->num_regions);
+}
+TEST_F(homa_pool, homa_pool_add_region__region_too_large)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(EINVAL, -homa_pool_add_region(pool, (void *) 0x40000000,
+			HOMA_MAX_REGION_SIZE + HOMA_BPAGE_SIZE));
+	EXPECT_EQ(1, pool->num_regions);
+	EXPECT_EQ(1, homa_pool_add_region(pool, (void *) 0x40000000,
+			HOMA_MAX_REGION_SIZE));
+	EXPECT_EQ(HOMA_MAX_REGION_SIZE >> HOMA_BPAGE_SHIFT,
+			pool->regions[1].num_bpages);
+	EXPECT_EQ(1, test_bit(REGION_INDEX(2) - 1, pool->nodes[0].free_map));
+}
+TEST_F(homa_pool, homa_pool_add_region__no_free_entries)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	int i;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	for (i = 1; i < HOMA_MAX_REGIONS; i++)
+		EXPECT_EQ(i, homa_pool_add_region(pool,
+				(void *) (0x10000000 + i*0x100000),
+				4*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(ENOSPC, -homa_pool_add_region(pool, (void *) 0x20000000,
+			4*HOMA_BPAGE_SIZE));
+}
+TEST_F(homa_pool, homa_pool_add_region__cant_allocate_descriptors)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	mock_kmalloc_errors = 1;
+	EXPECT_EQ(ENOMEM, -homa_pool_add_region(pool, (void *) 0x4000000,
+			50*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(1, pool->num_regions);
+	EXPECT_EQ(100, pool->num_bpages);
+}
+TEST_F(homa_pool, homa_pool_add_region__cant_allocate_slot_maps)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	mock_kmalloc_errors = 2;
+	EXPECT_EQ(ENOMEM, -homa_pool_add_region(pool, (void *) 0x4000000,
+			50*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(1, pool->num_regions);
+	EXPECT_EQ(NULL, pool->regions[1].descriptors);
+	EXPECT_EQ(0, pool->regions[1].capacity);
+}
+TEST_F(homa_pool, homa_pool_add_region__reuse_descriptors)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct homa_bpage *descriptors;
+	struct page **pages;
+	struct mm_struct *mm;
+	int num_pages;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(1, homa_pool_add_region(pool, (void *) 0x4000000,
+			50*HOMA_BPAGE_SIZE));
+	descriptors = pool->regions[1].descriptors;
+	EXPECT_EQ(0, -homa_pool_retire_region(pool, (void *) 0x4000000,
+			&pages, &num_pages, &mm));
+
+	/* First region is too large for the retired entry. */
+	EXPECT_EQ(2, homa_pool_add_region(pool, (void *) 0x5000000,
+			60*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(1, homa_pool_add_region(pool, (void *) 0x6000000,
+			40*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(descriptors, pool->regions[1].descriptors);
+	EXPECT_EQ(50, pool->regions[1].capacity);
+	EXPECT_EQ(40, pool->regions[1].num_bpages);
+	EXPECT_EQ(200, pool->num_bpages);
+	EXPECT_EQ(1, test_bit(REGION_INDEX(1) + 39, pool->nodes[0].free_map));
+	EXPECT_EQ(0, test_bit(REGION_INDEX(1) + 40, pool->nodes[0].free_map));
+}
+
+TEST_F(homa_pool, homa_pool_retire_region__basics)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct page **pages;
+	struct mm_struct *mm;
+	int num_pages;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(1, homa_pool_add_region(pool, (void *) 0x4000000,
+			50*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(0, -homa_pool_retire_region(pool, (void *) 0x4000000,
+			&pages, &num_pages, &mm));
+	EXPECT_EQ(NULL, pages);
+	EXPECT_EQ(0, num_pages);
+	EXPECT_EQ(NULL, mm);
+	EXPECT_EQ(NULL, pool->regions[1].start);
+	EXPECT_EQ(2, pool->num_regions);
+	EXPECT_EQ(100, pool->num_bpages);
+	EXPECT_EQ(100, pool->nodes[0].num_bpages);
+	EXPECT_EQ(0, test_bit(REGION_INDEX(1), pool->nodes[0].free_map));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.buf_regions_retired);
+}
+TEST_F(homa_pool, homa_pool_retire_region__unknown_region)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct page **pages;
+	struct mm_struct *mm;
+	int num_pages;
+
+	EXPECT_EQ(EINVAL, -homa_pool_retire_region(pool, self->buffer_region,
+			&pages, &num_pages, &mm));
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(EINVAL, -homa_pool_retire_region(pool, (void *) 0x4000000,
+			&pages, &num_pages, &mm));
+	EXPECT_EQ(EINVAL, -homa_pool_retire_region(pool, NULL,
+			&pages, &num_pages, &mm));
+}
+TEST_F(homa_pool, homa_pool_retire_region__region_busy)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct page **bufs;
+	struct mm_struct *mm;
+	__u32 pages[10];
+	int num_pages;
+	__u32 offset;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 4*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 4, pages, 0));
+	EXPECT_EQ(1, homa_pool_add_region(pool, (void *) 0x4000000,
+			4*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(REGION_INDEX(1), pages[0]);
+	EXPECT_EQ(1, atomic_read(&pool->regions[1].active_bpages));
+	EXPECT_EQ(EBUSY, -homa_pool_retire_region(pool, (void *) 0x4000000,
+			&bufs, &num_pages, &mm));
+	EXPECT_EQ(1, pool->regions[1].retiring);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.buf_retire_busy);
+
+	/* No more space can be allocated in the region. */
+	EXPECT_EQ(-1, homa_pool_get_pages(pool, 1, pages, 0));
+
+	/* Retirement succeeds once the region's buffers are returned. */
+	offset = REGION_INDEX(1) << HOMA_BPAGE_SHIFT;
+	homa_pool_release_buffers(pool, 1, &offset);
+	EXPECT_EQ(0, atomic_read(&pool->regions[1].active_bpages));
+	EXPECT_EQ(0, -homa_pool_retire_region(pool, (void *) 0x4000000,
+			&bufs, &num_pages, &mm));
+	EXPECT_EQ(0, test_bit(REGION_INDEX(1), pool->nodes[0].free_map));
+}
+TEST_F(homa_pool, homa_pool_retire_region__busy_is_sticky)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct page **bufs;
+	struct mm_struct *mm;
+	__u32 pages[10];
+	int num_pages;
+	__u32 offset;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 4*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 4, pages, 0));
+	EXPECT_EQ(1, homa_pool_add_region(pool, (void *) 0x4000000,
+			4*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(EBUSY, -homa_pool_retire_region(pool, (void *) 0x4000000,
+			&bufs, &num_pages, &mm));
+
+	/* Even after its buffers are returned, the region stays registered
+	 * but unusable until the retirement is retried.
+	 */
+	offset = REGION_INDEX(1) << HOMA_BPAGE_SHIFT;
+	homa_pool_release_buffers(pool, 1, &offset);
+	EXPECT_EQ(1, pool->regions[1].retiring);
+	EXPECT_EQ((void *) 0x4000000, pool->regions[1].start);
+	EXPECT_EQ(8, pool->num_bpages);
+	EXPECT_EQ(-1, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(0, -homa_pool_retire_region(pool, (void *) 0x4000000,
+			&bufs, &num_pages, &mm));
+	EXPECT_EQ(4, pool->num_bpages);
+}
+TEST_F(homa_pool, homa_pool_retire_region__pinned_pages)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct page **pages, **saved;
+	struct mm_struct *mm;
+	int num_pages;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(1, homa_pool_add_region(pool, (void *) 0x4000000,
+			4*HOMA_BPAGE_SIZE));
+	pool->regions[1].pages = homa_pool_pin((void *) 0x4000000,
+			4*HOMA_BPAGE_SIZE, HOMA_BUF_PIN,
+			&pool->regions[1].num_pages,
+			&pool->regions[1].mm);
+	ASSERT_FALSE(IS_ERR(pool->regions[1].pages));
+	saved = pool->regions[1].pages;
+	EXPECT_EQ(0, -homa_pool_retire_region(pool, (void *) 0x4000000,
+			&pages, &num_pages, &mm));
+	EXPECT_EQ(saved, pages);
+	EXPECT_EQ(4*HOMA_BPAGE_SIZE/PAGE_SIZE, num_pages);
+	EXPECT_EQ(NULL, pool->regions[1].pages);
+	EXPECT_EQ(&mock_mm, mm);
+	EXPECT_EQ(NULL, pool->regions[1].mm);
+	homa_pool_unpin(pages, num_pages, mm);
 }
 
 TEST_F(homa_pool, homa_pool_destroy__idempotent)
@@ -106,102 +506,186 @@ TEST_F(homa_pool, homa_pool_destroy__idempotent)
 	homa_pool_destroy(&self->hsk.buffer_pool);
 	homa_pool_destroy(&self->hsk.buffer_pool);
 }
+TEST_F(homa_pool, homa_pool_destroy__unpin_pages)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
 
-TEST_F(homa_pool, homa_pool_get_pages__basics)
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	pool->regions[0].pages = homa_pool_pin(pool->regions[0].start,
+			100*HOMA_BPAGE_SIZE, HOMA_BUF_PIN,
+			&pool->regions[0].num_pages,
+			&pool->regions[0].mm);
+	ASSERT_FALSE(IS_ERR(pool->regions[0].pages));
+	homa_pool_destroy(pool);
+	EXPECT_EQ(NULL, pool->regions[0].pages);
+	EXPECT_EQ(0, atomic64_read(&mock_mm.pinned_vm));
+}
+
+TEST_F(homa_pool, homa_pool_mark_free)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	__u32 pages[10];
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(0, pages[0]);
-	EXPECT_EQ(1, pages[1]);
-	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
-	EXPECT_EQ(-1, pool->descriptors[1].owner);
-	EXPECT_EQ(2, atomic_read(&pool->next_scan));
-	EXPECT_EQ(2, atomic_read(&pool->free_bpages_found));
+	pool->nodes[0].free_map[1] = 0;
+	pool->nodes[0].free_summary[0] = 1;
+	homa_pool_mark_free(pool, 70);
+	EXPECT_EQ(1UL << 6, pool->nodes[0].free_map[1]);
+	EXPECT_EQ(3, pool->nodes[0].free_summary[0]);
 }
-TEST_F(homa_pool, homa_pool_get_pages__no_buffer_space)
+
+TEST_F(homa_pool, homa_pool_reclaim)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	__u32 pages[10];
+	int i;
+
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	atomic_set(&pool->active_pages, pool->num_bpages);
-	atomic_set(&pool->next_scan, pool->num_bpages);
-	atomic_set(&pool->free_bpages_found, 0);
-	EXPECT_EQ(-1, homa_pool_get_pages(pool, 2, pages, 0));
+	mock_cycles = 5000;
+	for (i = 0; i < 100; i++)
+		atomic_set(&pool->regions[0].descriptors[i].refs, 1);
+	bitmap_zero(pool->nodes[0].free_map, 100);
+	atomic_set(&pool->regions[0].descriptors[3].refs, 0);
+	atomic_set(&pool->regions[0].descriptors[7].refs, 0);
+	pool->regions[0].descriptors[7].owner = 2;
+	pool->regions[0].descriptors[7].expiration = mock_cycles + 1;
+	atomic_set(&pool->regions[0].descriptors[9].refs, 0);
+	pool->regions[0].descriptors[9].owner = 2;
+	pool->regions[0].descriptors[9].expiration = mock_cycles - 1;
+	atomic64_set(&pool->next_reclaim, mock_cycles);
+	EXPECT_EQ(2, homa_pool_reclaim(pool));
+	EXPECT_EQ((1UL << 3) | (1UL << 9), pool->nodes[0].free_map[0]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_reclaim_sweeps);
+
+	/* Bpage 7's lease hasn't expired yet, so it's deferred again. */
+	EXPECT_EQ(mock_cycles + 1, atomic64_read(&pool->next_reclaim));
 }
-TEST_F(homa_pool, homa_pool_get_pages__grow_active_pool)
+TEST_F(homa_pool, homa_pool_reclaim__nothing_deferred)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	__u32 pages[10];
+
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	atomic_set(&pool->active_pages, 5);
-	atomic_set(&pool->next_scan, 5);
-	atomic_set(&pool->free_bpages_found, 1);
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(5, pages[0]);
-	EXPECT_EQ(6, pages[1]);
-	EXPECT_EQ(7, atomic_read(&pool->active_pages));
+	bitmap_zero(pool->nodes[0].free_map, 100);
+	EXPECT_EQ(0, homa_pool_reclaim(pool));
+	EXPECT_EQ(0, pool->nodes[0].free_map[0]);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_reclaim_sweeps);
 }
-TEST_F(homa_pool, homa_pool_get_pages__grow_fails_pool_max_size)
+TEST_F(homa_pool, homa_pool_reclaim__lease_not_yet_expired)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	__u32 pages[10];
+
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	pool->num_bpages = 5;
-	atomic_set(&pool->active_pages, 5);
-	atomic_set(&pool->next_scan, 5);
-	atomic_set(&pool->free_bpages_found, 1);
-	EXPECT_EQ(0, -homa_pool_get_pages(pool, 1, pages, 0));
-	EXPECT_EQ(0, pages[0]);
-	EXPECT_EQ(5, atomic_read(&pool->active_pages));
+	mock_cycles = 5000;
+	bitmap_zero(pool->nodes[0].free_map, 100);
+	atomic64_set(&pool->next_reclaim, mock_cycles + 1);
+	EXPECT_EQ(0, homa_pool_reclaim(pool));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_reclaim_sweeps);
 }
-TEST_F(homa_pool, homa_pool_get_pages__shrink_active_pool)
+TEST_F(homa_pool, homa_pool_reclaim__all_partitions_in_one_sweep)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	int i;
+
+	mock_page_node_split = 0x1000000 + 50*HOMA_BPAGE_SIZE;
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	for (i = 0; i < 100; i++)
+		atomic_set(&pool->regions[0].descriptors[i].refs, 1);
+	bitmap_zero(pool->nodes[0].free_map, 100);
+	bitmap_zero(pool->nodes[1].free_map, 100);
+	atomic_set(&pool->regions[0].descriptors[10].refs, 0);
+	atomic_set(&pool->regions[0].descriptors[70].refs, 0);
+	atomic64_set(&pool->next_reclaim, 0);
+	EXPECT_EQ(2, homa_pool_reclaim(pool));
+	EXPECT_EQ(1, test_bit(10, pool->nodes[0].free_map));
+	EXPECT_EQ(1, test_bit(70, pool->nodes[1].free_map));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_reclaim_sweeps);
+	EXPECT_EQ(-1, atomic64_read(&pool->next_reclaim));
+}
+
+TEST_F(homa_pool, homa_pool_get_pages__basics)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	atomic_set(&pool->active_pages, 20);
-	atomic_set(&pool->next_scan, 22);
-	atomic_set(&pool->free_bpages_found, 11);
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 	EXPECT_EQ(0, pages[0]);
 	EXPECT_EQ(1, pages[1]);
-	EXPECT_EQ(18, atomic_read(&pool->active_pages));
+	EXPECT_EQ(1, atomic_read(&pool->regions[0].descriptors[1].refs));
+	EXPECT_EQ(-1, pool->regions[0].descriptors[1].owner);
+	EXPECT_EQ(0, test_bit(1, pool->nodes[0].free_map));
+	EXPECT_EQ(1, test_bit(2, pool->nodes[0].free_map));
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bpage_alloc_probes);
 }
-TEST_F(homa_pool, homa_pool_get_pages__dont_shrink_below_MIN_ACTIVE)
+TEST_F(homa_pool, homa_pool_get_pages__no_buffer_space)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
+	int i;
+
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	atomic_set(&pool->active_pages, 4);
-	atomic_set(&pool->next_scan, 4);
-	atomic_set(&pool->free_bpages_found, 3);
-	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
-	EXPECT_EQ(0, pages[0]);
-	EXPECT_EQ(1, pages[1]);
-	EXPECT_EQ(4, atomic_read(&pool->active_pages));
+	for (i = 0; i < 100; i++)
+		atomic_set(&pool->regions[0].descriptors[i].refs, 1);
+	EXPECT_EQ(-1, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(0, pool->nodes[0].free_map[0]);
+
+	/* Nothing was deferred, so there's no need to sweep. */
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_reclaim_sweeps);
+}
+TEST_F(homa_pool, homa_pool_get_pages__stale_summary_bit)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	pool->nodes[0].free_map[0] = 0;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(64, pages[0]);
+	EXPECT_EQ(2, pool->nodes[0].free_summary[0]);
 }
-TEST_F(homa_pool, homa_pool_get_pages__basic_wraparound)
+TEST_F(homa_pool, homa_pool_get_pages__reclaim_when_map_empty)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	__u32 pages[10];
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	atomic_set(&pool->active_pages, 10);
-	atomic_set(&pool->next_scan, 10);
-	atomic_set(&pool->free_bpages_found, 3);
+	bitmap_zero(pool->nodes[0].free_map, 100);
+	atomic64_set(&pool->next_reclaim, 0);
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 	EXPECT_EQ(0, pages[0]);
 	EXPECT_EQ(1, pages[1]);
-	EXPECT_EQ(10, atomic_read(&pool->active_pages));
-	EXPECT_EQ(2, atomic_read(&pool->free_bpages_found));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_reclaim_sweeps);
+}
+TEST_F(homa_pool, homa_pool_get_pages__reclaim_after_lease_expires)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+	int i;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	mock_cycles = 1000;
+	for (i = 0; i < 100; i++)
+		atomic_set(&pool->regions[0].descriptors[i].refs, 1);
+	atomic_set(&pool->regions[0].descriptors[5].refs, 0);
+	pool->regions[0].descriptors[5].owner = 3;
+	pool->regions[0].descriptors[5].expiration = 1100;
+
+	/* Bpage 5 is still leased, so it's dropped from the free map and
+	 * deferred; a sweep now wouldn't find anything.
+	 */
+	EXPECT_EQ(-1, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(1100, atomic64_read(&pool->next_reclaim));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_reclaim_sweeps);
+
+	mock_cycles = 1200;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(5, pages[0]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_reclaim_sweeps);
 }
 TEST_F(homa_pool, homa_pool_get_pages__skip_unusable_bpages)
 {
@@ -209,14 +693,18 @@ TEST_F(homa_pool, homa_pool_get_pages__skip_unusable_bpages)
 	__u32 pages[10];
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	atomic_set(&pool->active_pages, 10);
-	atomic_set(&pool->descriptors[0].refs, 1);
-	pool->descriptors[2].owner = 3;
-	pool->descriptors[2].expiration = mock_cycles + 1;
+	atomic_set(&pool->regions[0].descriptors[0].refs, 1);
+	pool->regions[0].descriptors[2].owner = 3;
+	pool->regions[0].descriptors[2].expiration = mock_cycles + 1;
         mock_trylock_errors = 2;
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 	EXPECT_EQ(1, pages[0]);
 	EXPECT_EQ(4, pages[1]);
+	EXPECT_EQ(0, test_bit(0, pool->nodes[0].free_map));
+	EXPECT_EQ(0, test_bit(2, pool->nodes[0].free_map));
+
+	/* Bpages 2 (leased) and 3 (locked) were deferred. */
+	EXPECT_EQ(0, atomic64_read(&pool->next_reclaim));
 }
 TEST_F(homa_pool, homa_pool_get_pages__state_changes_while_locking)
 {
@@ -224,6 +712,7 @@ TEST_F(homa_pool, homa_pool_get_pages__state_changes_while_locking)
 	__u32 pages[10];
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	hook_count = 0;
 	unit_hook_register(steal_bpages_hook);
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 	EXPECT_EQ(1, pages[0]);
@@ -235,13 +724,13 @@ TEST_F(homa_pool, homa_pool_get_pages__steal_expired_page)
 	__u32 pages[10];
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	pool->descriptors[0].owner = 5;
+	pool->regions[0].descriptors[0].owner = 5;
 	mock_cycles = 5000;
-	pool->descriptors[0].expiration = mock_cycles - 1;
+	pool->regions[0].descriptors[0].expiration = mock_cycles - 1;
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
 	EXPECT_EQ(0, pages[0]);
 	EXPECT_EQ(1, pages[1]);
-	EXPECT_EQ(-1, pool->descriptors[0].owner);
+	EXPECT_EQ(-1, pool->regions[0].descriptors[0].owner);
 }
 TEST_F(homa_pool, homa_pool_get_pages__set_owner)
 {
@@ -252,9 +741,9 @@ TEST_F(homa_pool, homa_pool_get_pages__set_owner)
 	self->homa.bpage_lease_cycles = 1000;
 	mock_cycles = 5000;
 	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 1));
-	EXPECT_EQ(1, pool->descriptors[pages[0]].owner);
+	EXPECT_EQ(1, pool->regions[0].descriptors[pages[0]].owner);
 	EXPECT_EQ(mock_cycles + 1000,
-			pool->descriptors[pages[1]].expiration);
+			pool->regions[0].descriptors[pages[1]].expiration);
 }
 TEST_F(homa_pool, homa_pool_get_pages__storage_exhausted_after_bpages_allocated)
 {
@@ -262,20 +751,116 @@ TEST_F(homa_pool, homa_pool_get_pages__storage_exhausted_after_bpages_allocated)
 	__u32 pages[10], i;
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	pool->num_bpages = 5;
-	atomic_set(&pool->active_pages, pool->num_bpages);
-	for (i = 0; i < pool->num_bpages; i++) {
+	limit_pool(pool, 5);
+	for (i = 0; i < 5; i++) {
 		if ((i == 2) || (i == 3))
 			continue;
-		atomic_inc(&pool->descriptors[i].refs);
+		atomic_inc(&pool->regions[0].descriptors[i].refs);
 	}
 	EXPECT_EQ(-1, homa_pool_get_pages(pool, 3, pages, 1));
-	EXPECT_EQ(1, atomic_read(&pool->descriptors[0].refs));
-	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
-	EXPECT_EQ(0, atomic_read(&pool->descriptors[2].refs));
-	EXPECT_EQ(0, atomic_read(&pool->descriptors[3].refs));
-	EXPECT_EQ(1, atomic_read(&pool->descriptors[4].refs));
-	EXPECT_EQ(-1, pool->descriptors[2].owner);
+	EXPECT_EQ(1, atomic_read(&pool->regions[0].descriptors[0].refs));
+	EXPECT_EQ(1, atomic_read(&pool->regions[0].descriptors[1].refs));
+	EXPECT_EQ(0, atomic_read(&pool->regions[0].descriptors[2].refs));
+	EXPECT_EQ(0, atomic_read(&pool->regions[0].descriptors[3].refs));
+	EXPECT_EQ(1, atomic_read(&pool->regions[0].descriptors[4].refs));
+	EXPECT_EQ(-1, pool->regions[0].descriptors[2].owner);
+	EXPECT_EQ((1UL << 2) | (1UL << 3), pool->nodes[0].free_map[0]);
+}
+TEST_F(homa_pool, homa_pool_get_pages__use_local_node)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+
+	mock_page_node_split = 0x1000000 + 50*HOMA_BPAGE_SIZE;
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	cpu_number = 5;
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 2, pages, 0));
+	EXPECT_EQ(50, pages[0]);
+	EXPECT_EQ(51, pages[1]);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bpage_local_allocs);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_remote_allocs);
+}
+TEST_F(homa_pool, homa_pool_get_pages__unplaced_then_remote)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[20];
+	int i;
+
+	mock_page_node_split = 0x1000000 + 50*HOMA_BPAGE_SIZE;
+	mock_page_node_unplaced = 0x1000000 + 90*HOMA_BPAGE_SIZE;
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	for (i = 0; i < 50; i++)
+		atomic_set(&pool->regions[0].descriptors[i].refs, 1);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 12, pages, 0));
+	EXPECT_EQ(90, pages[0]);
+	EXPECT_EQ(99, pages[9]);
+	EXPECT_EQ(50, pages[10]);
+	EXPECT_EQ(51, pages[11]);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_local_allocs);
+	EXPECT_EQ(10, homa_cores[cpu_number]->metrics.bpage_unplaced_allocs);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.bpage_remote_allocs);
+}
+TEST_F(homa_pool, homa_pool_get_pages__occupancy_benchmark)
+{
+	/* Measures allocation cost with the pool at various fill levels,
+	 * with the free bpages scattered across the pool. Set the
+	 * environment variable HOMA_POOL_BENCH to print cycles per
+	 * allocation.
+	 */
+	static const int occupancies[] = {10, 50, 90, 99};
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	int num_bpages = REGION_SIZE >> HOMA_BPAGE_SHIFT;
+	struct homa_metrics *m = &homa_cores[cpu_number]->metrics;
+	__u64 probes, start, cycles;
+	__u32 page, offset, rand = 1;
+	int i, j, num_free;
+
+	mock_cycles = ~0;
+	for (i = 0; i < sizeof(occupancies)/sizeof(occupancies[0]); i++) {
+		EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+				self->buffer_region, REGION_SIZE));
+		for (j = 0; j < num_bpages; j++)
+			ASSERT_EQ(0, homa_pool_get_pages(pool, 1, &page, 0));
+
+		/* Free pages in a scattered pattern (multiplying by an
+		 * odd number is a permutation mod num_bpages).
+		 */
+		num_free = num_bpages - (num_bpages*occupancies[i])/100;
+		for (j = 0; j < num_bpages; j++) {
+			if (((j*7919) % num_bpages) >= num_free)
+				continue;
+			offset = j << HOMA_BPAGE_SHIFT;
+			homa_pool_release_buffers(pool, 1, &offset);
+		}
+
+		/* Each iteration allocates one bpage and frees a
+		 * pseudo-randomly chosen bpage, so occupancy stays fixed.
+		 */
+		probes = m->bpage_alloc_probes;
+		start = get_cycles();
+		for (j = 0; j < 1000; j++) {
+			ASSERT_EQ(0, homa_pool_get_pages(pool, 1, &page, 0));
+			do {
+				rand = rand*1103515245 + 12345;
+				offset = ((rand >> 8) % num_bpages);
+			} while (atomic_read(&pool->regions[0].descriptors[offset].refs)
+					== 0);
+			offset <<= HOMA_BPAGE_SHIFT;
+			homa_pool_release_buffers(pool, 1, &offset);
+		}
+		cycles = get_cycles() - start;
+		probes = m->bpage_alloc_probes - probes;
+		EXPECT_EQ(1000, probes);
+		if (getenv("HOMA_POOL_BENCH"))
+			printf("homa_pool occupancy %d%%: %llu cycles per "
+					"alloc/free, %llu probes per alloc\n",
+					occupancies[i], cycles/1000,
+					probes/1000);
+		homa_pool_destroy(pool);
+	}
+	mock_cycles = 0;
 }
 
 TEST_F(homa_pool, homa_pool_allocate__basics)
@@ -291,11 +876,43 @@ TEST_F(homa_pool, homa_pool_allocate__basics)
 	EXPECT_EQ(0, homa_pool_allocate(crpc));
 	EXPECT_EQ(3, crpc->msgin.num_bpages);
 	EXPECT_EQ(0, crpc->msgin.bpage_offsets[0]);
-	EXPECT_EQ(-1, pool->descriptors[0].owner);
+	EXPECT_EQ(-1, pool->regions[0].descriptors[0].owner);
+	EXPECT_EQ(-1, pool->regions[0].descriptors[0].size_class);
 	EXPECT_EQ(2*HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[2]);
-	EXPECT_EQ(2, pool->cores[cpu_number].page_hint);
-	EXPECT_EQ(150000 - 2*HOMA_BPAGE_SIZE,
-			pool->cores[cpu_number].allocated);
+	EXPECT_EQ(2, pool->cores[cpu_number].class_pages[7]);
+	EXPECT_EQ(7, pool->regions[0].descriptors[2].size_class);
+	EXPECT_EQ(cpu_number, pool->regions[0].descriptors[2].owner);
+	EXPECT_EQ(1, slot_map(pool, 2)[0]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.slot_allocs);
+}
+TEST_F(homa_pool, homa_pool_allocate__size_classes)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000, 100);
+	ASSERT_NE(NULL, crpc1);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 257);
+	ASSERT_NE(NULL, crpc2);
+	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 102, 1000, 2000);
+	ASSERT_NE(NULL, crpc3);
+
+	EXPECT_EQ(0, homa_pool_allocate(crpc1));
+	EXPECT_EQ(0, homa_pool_allocate(crpc2));
+	EXPECT_EQ(0, homa_pool_allocate(crpc3));
+	EXPECT_EQ(0, pool->cores[cpu_number].class_pages[0]);
+	EXPECT_EQ(1, pool->cores[cpu_number].class_pages[1]);
+	EXPECT_EQ(-1, pool->cores[cpu_number].class_pages[2]);
+	EXPECT_EQ(2, pool->cores[cpu_number].class_pages[3]);
+	EXPECT_EQ(0, pool->regions[0].descriptors[0].size_class);
+	EXPECT_EQ(1, pool->regions[0].descriptors[1].size_class);
+	EXPECT_EQ(3, pool->regions[0].descriptors[2].size_class);
 }
 TEST_F(homa_pool, homa_pool_allocate__out_of_buffer_space)
 {
@@ -306,122 +923,174 @@ TEST_F(homa_pool, homa_pool_allocate__out_of_buffer_space)
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
 			4000, 98, 1000,	150000);
 	ASSERT_NE(NULL, crpc);
-	atomic_set(&pool->descriptors[1].refs, 1);
-	atomic_set(&pool->descriptors[2].refs, 1);
-	atomic_set(&pool->descriptors[3].refs, 1);
-	atomic_set(&pool->descriptors[4].refs, 1);
+	atomic_set(&pool->regions[0].descriptors[1].refs, 1);
+	atomic_set(&pool->regions[0].descriptors[2].refs, 1);
+	atomic_set(&pool->regions[0].descriptors[3].refs, 1);
+	atomic_set(&pool->regions[0].descriptors[4].refs, 1);
 
 	EXPECT_EQ(1, -homa_pool_allocate(crpc));
 	EXPECT_EQ(0, crpc->msgin.num_bpages);
 }
+TEST_F(homa_pool, homa_pool_allocate__reuse_slot_in_owned_page)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	clear_bit(0, pool->nodes[0].free_map);
+	clear_bit(1, pool->nodes[0].free_map);
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000, 2000);
+	ASSERT_NE(NULL, crpc1);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 1500);
+	ASSERT_NE(NULL, crpc2);
+
+	EXPECT_EQ(0, homa_pool_allocate(crpc1));
+	EXPECT_EQ(0, homa_pool_allocate(crpc2));
+	EXPECT_EQ(1, crpc1->msgin.num_bpages);
+	EXPECT_EQ(1, crpc2->msgin.num_bpages);
+	EXPECT_EQ(2*HOMA_BPAGE_SIZE, crpc1->msgin.bpage_offsets[0]);
+	EXPECT_EQ(2*HOMA_BPAGE_SIZE + 2048, crpc2->msgin.bpage_offsets[0]);
+	EXPECT_EQ(2, atomic_read(&pool->regions[0].descriptors[2].refs));
+	EXPECT_EQ(3, slot_map(pool, 2)[0]);
+	EXPECT_EQ(2, pool->cores[cpu_number].class_pages[3]);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.slot_allocs);
+}
 TEST_F(homa_pool, homa_pool_allocate__owned_page_locked)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	atomic_set(&pool->next_scan, 2);
+	clear_bit(0, pool->nodes[0].free_map);
+	clear_bit(1, pool->nodes[0].free_map);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
 			4000, 98, 1000, 2000);
 	ASSERT_NE(NULL, crpc);
 
 	EXPECT_EQ(0, homa_pool_allocate(crpc));
-	EXPECT_EQ(2, pool->cores[cpu_number].page_hint);
+	EXPECT_EQ(2, pool->cores[cpu_number].class_pages[3]);
 	crpc->msgin.num_bpages = 0;
-        mock_trylock_errors = 1;
+	mock_trylock_errors = 1;
 	EXPECT_EQ(0, homa_pool_allocate(crpc));
 	EXPECT_EQ(1, crpc->msgin.num_bpages);
 	EXPECT_EQ(3*HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[0]);
-	EXPECT_EQ(3, pool->cores[cpu_number].page_hint);
-	EXPECT_EQ(2000, pool->cores[cpu_number].allocated);
-	EXPECT_EQ(1, pool->descriptors[2].owner);
-	EXPECT_EQ(1, pool->descriptors[3].owner);
+	EXPECT_EQ(3, pool->cores[cpu_number].class_pages[3]);
+	EXPECT_EQ(1, pool->regions[0].descriptors[2].owner);
+	EXPECT_EQ(1, pool->regions[0].descriptors[3].owner);
 }
-TEST_F(homa_pool, homa_pool_allocate__reuse_owned_page)
+TEST_F(homa_pool, homa_pool_allocate__page_full)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	mock_bpage_size = 2048;
+	mock_bpage_shift = 11;
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	atomic_set(&pool->next_scan, 2);
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
-			4000, 98, 1000, 2000);
+			4000, 98, 1000, 1000);
 	ASSERT_NE(NULL, crpc1);
 	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
-			4000, 100, 1000, 3000);
+			4000, 100, 1000, 1000);
 	ASSERT_NE(NULL, crpc2);
+	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 102, 1000, 1000);
+	ASSERT_NE(NULL, crpc3);
 
 	EXPECT_EQ(0, homa_pool_allocate(crpc1));
 	EXPECT_EQ(0, homa_pool_allocate(crpc2));
-	EXPECT_EQ(1, crpc1->msgin.num_bpages);
-	EXPECT_EQ(1, crpc2->msgin.num_bpages);
-	EXPECT_EQ(2, atomic_read(&pool->descriptors[2].refs));
-	EXPECT_EQ(2, pool->cores[cpu_number].page_hint);
-	EXPECT_EQ(5000, pool->cores[cpu_number].allocated);
+	EXPECT_EQ(0, homa_pool_allocate(crpc3));
+	EXPECT_EQ(0, crpc1->msgin.bpage_offsets[0]);
+	EXPECT_EQ(1024, crpc2->msgin.bpage_offsets[0]);
+	EXPECT_EQ(2048, crpc3->msgin.bpage_offsets[0]);
+	EXPECT_EQ(-1, pool->regions[0].descriptors[0].owner);
+	EXPECT_EQ(cpu_number, pool->regions[0].descriptors[1].owner);
+	EXPECT_EQ(1, pool->cores[cpu_number].class_pages[2]);
+	EXPECT_EQ(2, atomic_read(&pool->regions[0].descriptors[0].refs));
 }
-TEST_F(homa_pool, homa_pool_allocate__cant_allocate_partial_bpage)
+TEST_F(homa_pool, homa_pool_allocate__adopt_partially_free_page)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	mock_bpage_size = 2048;
+	mock_bpage_shift = 11;
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	pool->num_bpages = 5;
-	atomic_set(&pool->active_pages, 5);
-	atomic_set(&pool->next_scan, 2);
-	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
-			4000, 98, 1000, 5*HOMA_BPAGE_SIZE + 100);
-	ASSERT_NE(NULL, crpc);
+			4000, 98, 1000, 1000);
+	ASSERT_NE(NULL, crpc1);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 1000);
+	ASSERT_NE(NULL, crpc2);
+	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 102, 1000, 1000);
+	ASSERT_NE(NULL, crpc3);
+	struct homa_rpc *crpc4 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 104, 1000, 1000);
+	ASSERT_NE(NULL, crpc4);
+	EXPECT_EQ(0, homa_pool_allocate(crpc1));
+	EXPECT_EQ(0, homa_pool_allocate(crpc2));
+	EXPECT_EQ(0, homa_pool_allocate(crpc3));
+	EXPECT_EQ(-1, pool->regions[0].descriptors[0].owner);
 
-	EXPECT_EQ(-1, homa_pool_allocate(crpc));
-	EXPECT_EQ(0, crpc->msgin.num_bpages);
-	EXPECT_EQ(0, atomic_read(&pool->descriptors[0].refs));
-	EXPECT_EQ(0, atomic_read(&pool->descriptors[1].refs));
-	EXPECT_EQ(0, atomic_read(&pool->descriptors[4].refs));
+	/* Free a slot in the abandoned page, then allocate from a
+	 * different core.
+	 */
+	homa_pool_release_buffers(pool, 1, crpc2->msgin.bpage_offsets);
+	crpc2->msgin.num_bpages = 0;
+	EXPECT_EQ(0, atomic_read(&pool->class_hints[2]));
+	EXPECT_EQ(1, slot_map(pool, 0)[0]);
+	cpu_number = 2;
+	EXPECT_EQ(0, homa_pool_allocate(crpc4));
+	EXPECT_EQ(1024, crpc4->msgin.bpage_offsets[0]);
+	EXPECT_EQ(2, pool->regions[0].descriptors[0].owner);
+	EXPECT_EQ(0, pool->cores[2].class_pages[2]);
+	EXPECT_EQ(-1, atomic_read(&pool->class_hints[2]));
+	EXPECT_EQ(1, homa_cores[2]->metrics.slot_page_adoptions);
 }
-TEST_F(homa_pool, homa_pool_allocate__not_enough_space_in_owned_page)
+TEST_F(homa_pool, homa_pool_allocate__large_fragment_uses_full_page)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
-	atomic_set(&pool->next_scan, 2);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
-			4000, 98, 1000, 2000);
+			4000, 98, 1000, HOMA_BPAGE_SIZE + 40000);
 	ASSERT_NE(NULL, crpc);
 
 	EXPECT_EQ(0, homa_pool_allocate(crpc));
-	EXPECT_EQ(2, pool->cores[cpu_number].page_hint);
-	crpc->msgin.num_bpages = 0;
-	pool->cores[cpu_number].allocated = HOMA_BPAGE_SIZE-1900;
-	EXPECT_EQ(0, homa_pool_allocate(crpc));
-	EXPECT_EQ(1, crpc->msgin.num_bpages);
-	EXPECT_EQ(3*HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[0]);
-	EXPECT_EQ(3, pool->cores[cpu_number].page_hint);
-	EXPECT_EQ(2000, pool->cores[cpu_number].allocated);
-	EXPECT_EQ(-1, pool->descriptors[2].owner);
-	EXPECT_EQ(1, pool->descriptors[3].owner);
+	EXPECT_EQ(2, crpc->msgin.num_bpages);
+	EXPECT_EQ(HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[1]);
+	EXPECT_EQ(-1, pool->regions[0].descriptors[1].owner);
+	EXPECT_EQ(-1, pool->regions[0].descriptors[1].size_class);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.slot_allocs);
 }
-TEST_F(homa_pool, homa_pool_allocate__page_wrap_around)
+TEST_F(homa_pool, homa_pool_allocate__cant_allocate_partial_bpage)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	limit_pool(pool, 5);
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
 			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
-			4000, 98, 1000, 2000);
+			4000, 98, 1000, 5*HOMA_BPAGE_SIZE + 100);
 	ASSERT_NE(NULL, crpc);
-	pool->cores[cpu_number].page_hint = 2;
-	pool->cores[cpu_number].allocated = HOMA_BPAGE_SIZE-1900;
-	pool->descriptors[2].owner = cpu_number;
 
-	EXPECT_EQ(0, homa_pool_allocate(crpc));
-	EXPECT_EQ(2, pool->cores[cpu_number].page_hint);
-	EXPECT_EQ(1, crpc->msgin.num_bpages);
-	EXPECT_EQ(2*HOMA_BPAGE_SIZE, crpc->msgin.bpage_offsets[0]);
-	EXPECT_EQ(2000, pool->cores[cpu_number].allocated);
-	EXPECT_EQ(cpu_number, pool->descriptors[2].owner);
-	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_reuses);
+	EXPECT_EQ(-1, homa_pool_allocate(crpc));
+	EXPECT_EQ(0, crpc->msgin.num_bpages);
+	EXPECT_EQ(0, atomic_read(&pool->regions[0].descriptors[0].refs));
+	EXPECT_EQ(0, atomic_read(&pool->regions[0].descriptors[1].refs));
+	EXPECT_EQ(0, atomic_read(&pool->regions[0].descriptors[4].refs));
+	EXPECT_EQ(-1, pool->cores[cpu_number].class_pages[0]);
 }
 
 TEST_F(homa_pool, homa_pool_get_buffer__basics)
@@ -438,10 +1107,34 @@ TEST_F(homa_pool, homa_pool_get_buffer__basics)
 	ASSERT_NE(NULL, crpc);
 	buffer = homa_pool_get_buffer(crpc, HOMA_BPAGE_SIZE + 1000, &available);
 	EXPECT_EQ(HOMA_BPAGE_SIZE - 1000, available);
-	EXPECT_EQ((void *) (pool->region + HOMA_BPAGE_SIZE + 1000), buffer);
+	EXPECT_EQ((void *) (pool->regions[0].start + HOMA_BPAGE_SIZE + 1000),
+			buffer);
 	buffer = homa_pool_get_buffer(crpc, 2*HOMA_BPAGE_SIZE + 100, &available);
 	EXPECT_EQ((150000 & (HOMA_BPAGE_SIZE-1)) - 100, available);
-	EXPECT_EQ((void *) (pool->region + 2*HOMA_BPAGE_SIZE + 100), buffer);
+	EXPECT_EQ((void *) (pool->regions[0].start + 2*HOMA_BPAGE_SIZE + 100),
+			buffer);
+}
+TEST_F(homa_pool, homa_pool_get_buffer__second_region)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[10];
+	int available;
+	void *buffer;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 4*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 4, pages, 0));
+	EXPECT_EQ(1, homa_pool_add_region(pool, (void *) 0x4000000,
+			10*HOMA_BPAGE_SIZE));
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	2*HOMA_BPAGE_SIZE + 100);
+	ASSERT_NE(NULL, crpc);
+	buffer = homa_pool_get_buffer(crpc, HOMA_BPAGE_SIZE + 10, &available);
+	EXPECT_EQ(1, HOMA_BUF_REGION(crpc->msgin.bpage_offsets[1]));
+	EXPECT_EQ(HOMA_BPAGE_SIZE, HOMA_BUF_REGION_OFFSET(
+			crpc->msgin.bpage_offsets[1]));
+	EXPECT_EQ((void *) (0x4000000 + HOMA_BPAGE_SIZE + 10), buffer);
 }
 TEST_F(homa_pool, homa_pool_get_buffer__cant_allocate_buffers)
 {
@@ -453,10 +1146,129 @@ TEST_F(homa_pool, homa_pool_get_buffer__cant_allocate_buffers)
 	EXPECT_EQ(0, crpc->msgin.num_bpages);
 }
 
+TEST_F(homa_pool, homa_pool_get_bvecs__basics)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct bio_vec bvecs[4];
+	int num_bvecs;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	pool->regions[0].pages = homa_pool_pin(pool->regions[0].start,
+			100*HOMA_BPAGE_SIZE, HOMA_BUF_PIN,
+			&pool->regions[0].num_pages,
+			&pool->regions[0].mm);
+	ASSERT_FALSE(IS_ERR(pool->regions[0].pages));
+
+	EXPECT_EQ(2*PAGE_SIZE, homa_pool_get_bvecs(pool,
+			pool->regions[0].start + PAGE_SIZE + 100, 2*PAGE_SIZE,
+			bvecs, 4, &num_bvecs));
+	EXPECT_EQ(3, num_bvecs);
+	EXPECT_EQ(&mock_pages[1], bvecs[0].bv_page);
+	EXPECT_EQ(100, bvecs[0].bv_offset);
+	EXPECT_EQ(PAGE_SIZE - 100, bvecs[0].bv_len);
+	EXPECT_EQ(&mock_pages[2], bvecs[1].bv_page);
+	EXPECT_EQ(0, bvecs[1].bv_offset);
+	EXPECT_EQ(PAGE_SIZE, bvecs[1].bv_len);
+	EXPECT_EQ(100, bvecs[2].bv_len);
+}
+TEST_F(homa_pool, homa_pool_get_bvecs__region_not_pinned)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct bio_vec bvecs[4];
+	int num_bvecs;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(0, homa_pool_get_bvecs(pool, pool->regions[0].start,
+			1000, bvecs, 4, &num_bvecs));
+	EXPECT_EQ(0, num_bvecs);
+}
+TEST_F(homa_pool, homa_pool_get_bvecs__not_enough_bvecs)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct bio_vec bvecs[4];
+	int num_bvecs;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	pool->regions[0].pages = homa_pool_pin(pool->regions[0].start,
+			100*HOMA_BPAGE_SIZE, HOMA_BUF_PIN,
+			&pool->regions[0].num_pages,
+			&pool->regions[0].mm);
+	ASSERT_FALSE(IS_ERR(pool->regions[0].pages));
+
+	EXPECT_EQ(2*PAGE_SIZE, homa_pool_get_bvecs(pool,
+			pool->regions[0].start, 3*PAGE_SIZE, bvecs, 2,
+			&num_bvecs));
+	EXPECT_EQ(2, num_bvecs);
+}
+TEST_F(homa_pool, homa_pool_get_bvecs__past_end_of_region)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	struct bio_vec bvecs[4];
+	int num_bvecs;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	pool->regions[0].pages = homa_pool_pin(pool->regions[0].start,
+			100*HOMA_BPAGE_SIZE, HOMA_BUF_PIN,
+			&pool->regions[0].num_pages,
+			&pool->regions[0].mm);
+	ASSERT_FALSE(IS_ERR(pool->regions[0].pages));
+
+	EXPECT_EQ(1000, homa_pool_get_bvecs(pool, pool->regions[0].start
+			+ 100*HOMA_BPAGE_SIZE - 1000, 3000, bvecs, 4,
+			&num_bvecs));
+	EXPECT_EQ(1, num_bvecs);
+}
+
+TEST_F(homa_pool, homa_pool_place_buffers__touched_after_registration)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[2], offset;
+
+	/* Region is untouched when registered, so nothing is placed. */
+	mock_page_node_unplaced = 0x1000000;
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(100, pool->nodes[pool->num_nodes].num_bpages);
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(0, pages[0]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_unplaced_allocs);
+
+	/* Once the page has been touched, it becomes node-local. */
+	mock_page_node_unplaced = 0;
+	offset = pages[0] << HOMA_BPAGE_SHIFT;
+	homa_pool_place_buffers(&self->hsk, 1, &offset);
+	homa_pool_release_buffers(pool, 1, &offset);
+	EXPECT_EQ(0, pool->regions[0].descriptors[0].node);
+	EXPECT_EQ(99, pool->nodes[pool->num_nodes].num_bpages);
+	EXPECT_EQ(1, pool->nodes[0].num_bpages);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_late_placements);
+
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	EXPECT_EQ(0, pages[0]);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.bpage_local_allocs);
+}
+TEST_F(homa_pool, homa_pool_place_buffers__still_untouched)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+	__u32 pages[2], offset;
+
+	mock_page_node_unplaced = 0x1000000;
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	EXPECT_EQ(0, homa_pool_get_pages(pool, 1, pages, 0));
+	offset = pages[0] << HOMA_BPAGE_SHIFT;
+	homa_pool_place_buffers(&self->hsk, 1, &offset);
+	EXPECT_EQ(NUMA_NO_NODE, pool->regions[0].descriptors[0].node);
+	EXPECT_EQ(100, pool->nodes[pool->num_nodes].num_bpages);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.bpage_late_placements);
+}
 TEST_F(homa_pool, homa_pool_release_buffers)
 {
 	struct homa_pool *pool = &self->hsk.buffer_pool;
-	char *saved_region;
 
 	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
 			self->buffer_region, 100*HOMA_BPAGE_SIZE));
@@ -471,21 +1283,64 @@ TEST_F(homa_pool, homa_pool_release_buffers)
 
 	EXPECT_EQ(0, homa_pool_allocate(crpc1));
 	EXPECT_EQ(0, homa_pool_allocate(crpc2));
-	EXPECT_EQ(1, atomic_read(&pool->descriptors[0].refs));
-	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
-	EXPECT_EQ(2, atomic_read(&pool->descriptors[2].refs));
+	EXPECT_EQ(1, atomic_read(&pool->regions[0].descriptors[0].refs));
+	EXPECT_EQ(1, atomic_read(&pool->regions[0].descriptors[1].refs));
+	EXPECT_EQ(1, atomic_read(&pool->regions[0].descriptors[2].refs));
+	EXPECT_EQ(1, atomic_read(&pool->regions[0].descriptors[3].refs));
+	EXPECT_EQ(4, atomic_read(&pool->regions[0].active_bpages));
 
 	homa_pool_release_buffers(pool, crpc1->msgin.num_bpages,
 			crpc1->msgin.bpage_offsets);
-	EXPECT_EQ(0, atomic_read(&pool->descriptors[0].refs));
-	EXPECT_EQ(0, atomic_read(&pool->descriptors[1].refs));
-	EXPECT_EQ(1, atomic_read(&pool->descriptors[2].refs));
+	EXPECT_EQ(1, atomic_read(&pool->regions[0].active_bpages));
+	EXPECT_EQ(0, atomic_read(&pool->regions[0].descriptors[0].refs));
+	EXPECT_EQ(0, atomic_read(&pool->regions[0].descriptors[1].refs));
+	EXPECT_EQ(0, atomic_read(&pool->regions[0].descriptors[2].refs));
+	EXPECT_EQ(0, slot_map(pool, 2)[0]);
+	EXPECT_EQ(1, atomic_read(&pool->regions[0].descriptors[3].refs));
 
 	/* Ignore requests if pool not initialized. */
-	saved_region = pool->region;
-	pool->region = NULL;
+	pool->num_regions = 0;
 	homa_pool_release_buffers(pool, crpc1->msgin.num_bpages,
 			crpc1->msgin.bpage_offsets);
-	EXPECT_EQ(0, atomic_read(&pool->descriptors[0].refs));
-	pool->region = saved_region;
-}
\ No newline at end of file
+	EXPECT_EQ(0, atomic_read(&pool->regions[0].descriptors[0].refs));
+	pool->num_regions = 1;
+}
+TEST_F(homa_pool, homa_pool_release_buffers__slots)
+{
+	struct homa_pool *pool = &self->hsk.buffer_pool;
+
+	EXPECT_EQ(0, -homa_pool_init(pool, &self->homa,
+			self->buffer_region, 100*HOMA_BPAGE_SIZE));
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 98, 1000,	2000);
+	ASSERT_NE(NULL, crpc1);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, &self->client_ip, &self->server_ip,
+			4000, 100, 1000, 2000);
+	ASSERT_NE(NULL, crpc2);
+	EXPECT_EQ(0, homa_pool_allocate(crpc1));
+	EXPECT_EQ(0, homa_pool_allocate(crpc2));
+	EXPECT_EQ(3, slot_map(pool, 0)[0]);
+
+	/* Page still owned: no hint. */
+	homa_pool_release_buffers(pool, 1, crpc2->msgin.bpage_offsets);
+	EXPECT_EQ(1, slot_map(pool, 0)[0]);
+	EXPECT_EQ(1, atomic_read(&pool->regions[0].descriptors[0].refs));
+	EXPECT_EQ(-1, atomic_read(&pool->class_hints[3]));
+
+	/* Abandoned page with free slots: set hint. */
+	crpc2->msgin.num_bpages = 0;
+	EXPECT_EQ(0, homa_pool_allocate(crpc2));
+	EXPECT_EQ(2048, crpc2->msgin.bpage_offsets[0]);
+	pool->regions[0].descriptors[0].owner = -1;
+	homa_pool_release_buffers(pool, 1, crpc2->msgin.bpage_offsets);
+	EXPECT_EQ(1, slot_map(pool, 0)[0]);
+	EXPECT_EQ(0, atomic_read(&pool->class_hints[3]));
+
+	/* Last slot released: page becomes free. */
+	homa_pool_release_buffers(pool, 1, crpc1->msgin.bpage_offsets);
+	EXPECT_EQ(0, slot_map(pool, 0)[0]);
+	EXPECT_EQ(0, atomic_read(&pool->regions[0].descriptors[0].refs));
+	EXPECT_NE(0, test_bit(0, pool->nodes[0].free_map));
+}
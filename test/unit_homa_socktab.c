@@ -303,4 +303,37 @@ TEST_F(homa_socktab, homa_sock_lock_slow)
 	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.socket_lock_misses);
 	EXPECT_NE(0, homa_cores[cpu_number]->metrics.socket_lock_miss_cycles);
 	homa_sock_unlock(&self->hsk);
-}
\ No newline at end of file
+}
+
+TEST_F(homa_socktab, homa_sock_ready_lock_slow)
+{
+	mock_cycles = ~0;
+
+	homa_sock_ready_lock(&self->hsk);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.ready_lock_misses);
+	homa_sock_ready_unlock(&self->hsk);
+
+	mock_trylock_errors = 1;
+	homa_sock_ready_lock(&self->hsk);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.ready_lock_misses);
+	EXPECT_NE(0, homa_cores[cpu_number]->metrics.ready_lock_miss_cycles);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.socket_lock_misses);
+	homa_sock_ready_unlock(&self->hsk);
+}
+
+TEST_F(homa_socktab, homa_sock_dead_lock_slow)
+{
+	mock_cycles = ~0;
+
+	homa_sock_dead_lock(&self->hsk);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.dead_lock_misses);
+	homa_sock_dead_unlock(&self->hsk);
+
+	/* homa_protect_rpcs synchronizes with reaping via the dead lock. */
+	mock_trylock_errors = 1;
+	EXPECT_EQ(1, homa_protect_rpcs(&self->hsk));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.dead_lock_misses);
+	EXPECT_NE(0, homa_cores[cpu_number]->metrics.dead_lock_miss_cycles);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.socket_lock_misses);
+	homa_unprotect_rpcs(&self->hsk);
+}
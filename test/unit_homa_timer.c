@@ -55,6 +55,109 @@ FIXTURE_TEARDOWN(homa_timer)
 	unit_teardown();
 }
 
+TEST_F(homa_timer, homa_wheel_advance__cascade_from_level_1)
+{
+	struct homa_timer_wheel *wheel = &homa_cores[cpu_number]->timer_wheel;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 200);
+
+	ASSERT_NE(NULL, crpc);
+	homa_wheel_advance(wheel, 100);
+	EXPECT_TRUE(list_empty(&wheel->due));
+	homa_rpc_cancel_timer(crpc);
+	homa_rpc_arm_timer(crpc, 400);
+	EXPECT_EQ(400, crpc->timer_expires);
+	homa_wheel_advance(wheel, 399);
+	EXPECT_TRUE(list_empty(&wheel->due));
+	homa_wheel_advance(wheel, 400);
+	EXPECT_EQ(1, unit_list_length(&wheel->due));
+	EXPECT_EQ(400, wheel->now);
+	list_del_init(&crpc->timer_links);
+}
+TEST_F(homa_timer, homa_wheel_advance__clamp_far_deadlines)
+{
+	struct homa_timer_wheel *wheel = &homa_cores[cpu_number]->timer_wheel;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 200);
+
+	ASSERT_NE(NULL, crpc);
+	homa_wheel_advance(wheel, 100);
+	homa_rpc_cancel_timer(crpc);
+	homa_rpc_arm_timer(crpc, 100 + 10*HOMA_WHEEL_SPAN);
+	EXPECT_EQ(100 + HOMA_WHEEL_SPAN, crpc->timer_expires);
+	homa_wheel_advance(wheel, 99 + HOMA_WHEEL_SPAN);
+	EXPECT_TRUE(list_empty(&wheel->due));
+	homa_wheel_advance(wheel, 100 + HOMA_WHEEL_SPAN);
+	EXPECT_EQ(1, unit_list_length(&wheel->due));
+	list_del_init(&crpc->timer_links);
+}
+TEST_F(homa_timer, homa_wheel_advance__skip_more_than_span)
+{
+	struct homa_timer_wheel *wheel = &homa_cores[cpu_number]->timer_wheel;
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 200);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 5000, 200);
+
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	homa_rpc_cancel_timer(crpc2);
+	homa_rpc_arm_timer(crpc2, 2000);
+	homa_wheel_advance(wheel, 10000);
+	EXPECT_EQ(2, unit_list_length(&wheel->due));
+	EXPECT_EQ(10000, wheel->now);
+	list_del_init(&crpc1->timer_links);
+	list_del_init(&crpc2->timer_links);
+}
+
+TEST_F(homa_timer, homa_rpc_arm_timer__only_move_earlier)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 200);
+
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(101, crpc->timer_expires);
+	homa_rpc_arm_timer(crpc, 200);
+	EXPECT_EQ(101, crpc->timer_expires);
+	homa_rpc_cancel_timer(crpc);
+	EXPECT_TRUE(list_empty(&crpc->timer_links));
+	homa_rpc_arm_timer(crpc, 150);
+	EXPECT_EQ(150, crpc->timer_expires);
+	homa_rpc_arm_timer(crpc, 120);
+	EXPECT_EQ(120, crpc->timer_expires);
+	EXPECT_FALSE(list_empty(&crpc->timer_links));
+}
+TEST_F(homa_timer, homa_rpc_arm_timer__dead_rpc)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 5000, 200);
+
+	ASSERT_NE(NULL, crpc);
+	EXPECT_FALSE(list_empty(&crpc->timer_links));
+	homa_rpc_free(crpc);
+	EXPECT_TRUE(list_empty(&crpc->timer_links));
+	homa_rpc_arm_timer(crpc, 150);
+	EXPECT_TRUE(list_empty(&crpc->timer_links));
+}
+TEST_F(homa_timer, homa_rpc_arm_timer__response_transmitted)
+{
+	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->client_port,
+			self->server_id, 100, 100);
+
+	ASSERT_NE(NULL, srpc);
+	homa_rpc_cancel_timer(srpc);
+	homa_rpc_arm_timer(srpc, 150);
+	homa_xmit_data(srpc, false);
+	EXPECT_EQ(101, srpc->timer_expires);
+}
+
 TEST_F(homa_timer, homa_check_timeout__request_ack)
 {
 	struct homa_rpc *srpc = unit_server_rpc(&self->hsk, UNIT_OUTGOING,
@@ -359,6 +462,27 @@ TEST_F(homa_timer, homa_timer__reap_dead_rpcs)
 	homa_timer(&self->homa);
 	EXPECT_EQ(10, self->hsk.dead_skbs);
 }
+TEST_F(homa_timer, homa_timer__wake_reaper)
+{
+	struct homa_rpc *dead = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 20000);
+	ASSERT_NE(NULL, dead);
+	self->homa.reaper_kthread = &mock_task;
+
+	/* First call: nothing to reap. */
+	unit_log_clear();
+	homa_timer(&self->homa);
+	EXPECT_STREQ("", unit_log_get());
+
+	/* Second call: dead RPC, so wake the reaper. */
+	homa_rpc_free(dead);
+	unit_log_clear();
+	homa_timer(&self->homa);
+	EXPECT_STREQ("wake_up_process pid 0", unit_log_get());
+	EXPECT_EQ(30, self->hsk.dead_skbs);
+	self->homa.reaper_kthread = NULL;
+}
 TEST_F(homa_timer, homa_timer__rpc_ready)
 {
 	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
@@ -397,3 +521,190 @@ TEST_F(homa_timer, homa_timer__abort_server_rpc)
 	EXPECT_EQ(1, unit_list_length(&self->hsk.dead_rpcs));
 	EXPECT_STREQ("homa_remove_from_grantable invoked", unit_log_get());
 }
+TEST_F(homa_timer, homa_timer__check_only_rpcs_that_are_due)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 200, 5000);
+	int i;
+
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	homa_rpc_cancel_timer(crpc2);
+	homa_rpc_arm_timer(crpc2, 110);
+	homa_timer(&self->homa);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+	EXPECT_EQ(110, crpc2->timer_expires);
+
+	/* crpc1 is now silent enough to be checked on every tick. */
+	EXPECT_EQ(102, crpc1->timer_expires);
+	for (i = 0; i < 8; i++)
+		homa_timer(&self->homa);
+	EXPECT_EQ(109, self->homa.timer_ticks);
+	EXPECT_EQ(9, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+	homa_timer(&self->homa);
+	EXPECT_EQ(11, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+	EXPECT_EQ(10, crpc2->silent_ticks);
+}
+TEST_F(homa_timer, homa_timer__progress_postpones_check)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+
+	ASSERT_NE(NULL, crpc);
+	self->homa.resend_ticks = 5;
+	homa_rpc_cancel_timer(crpc);
+	homa_rpc_arm_timer(crpc, 104);
+	self->homa.timer_ticks = 103;
+	crpc->active_ticks = 102;
+	unit_log_clear();
+	homa_timer(&self->homa);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+	EXPECT_EQ(2, crpc->silent_ticks);
+	EXPECT_EQ(106, crpc->timer_expires);
+	EXPECT_STREQ("", unit_log_get());
+}
+TEST_F(homa_timer, homa_timer__skip_dead_rpc)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	homa_timer(&self->homa);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+}
+TEST_F(homa_timer, homa_wheel_check__limit)
+{
+	struct homa_timer_wheel *wheel = &homa_cores[cpu_number]->timer_wheel;
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 200, 5000);
+
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	self->homa.timer_ticks = 101;
+	EXPECT_EQ(1, homa_wheel_check(&self->homa, wheel, 1));
+	EXPECT_EQ(1, unit_list_length(&wheel->due));
+	EXPECT_EQ(1, homa_wheel_check(&self->homa, wheel, 5));
+	EXPECT_TRUE(list_empty(&wheel->due));
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+}
+TEST_F(homa_timer, homa_wheel_check__record_dead_peer)
+{
+	struct homa_timer_wheel *wheel = &homa_cores[cpu_number]->timer_wheel;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+
+	ASSERT_NE(NULL, crpc);
+	crpc->peer->outstanding_resends = self->homa.timeout_resends;
+	self->homa.timer_ticks = 101;
+	crpc->active_ticks = 99;
+	homa_wheel_check(&self->homa, wheel, 5);
+	EXPECT_EQ(1, wheel->num_dead_peers);
+	EXPECT_STREQ("1.2.3.4", homa_print_ipv6_addr(&wheel->dead_addrs[0]));
+	EXPECT_EQ(0, crpc->error);
+}
+TEST_F(homa_timer, homa_wheel_check__too_many_dead_peers)
+{
+	struct homa_timer_wheel *wheel = &homa_cores[cpu_number]->timer_wheel;
+	struct in6_addr server_ip;
+	struct homa_rpc *crpcs[HOMA_WHEEL_DEAD_PEERS + 1];
+	char addr[20];
+	int i, restored;
+
+	for (i = 0; i <= HOMA_WHEEL_DEAD_PEERS; i++) {
+		snprintf(addr, sizeof(addr), "1.2.3.%d", 4 + i);
+		server_ip = unit_get_in_addr(addr);
+		crpcs[i] = unit_client_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
+				self->client_ip, &server_ip, self->server_port,
+				self->client_id + 2*i, 200, 5000);
+		ASSERT_NE(NULL, crpcs[i]);
+		crpcs[i]->peer->outstanding_resends =
+				self->homa.timeout_resends;
+		crpcs[i]->active_ticks = 99;
+	}
+	self->homa.timer_ticks = 101;
+	homa_wheel_check(&self->homa, wheel, 10);
+	EXPECT_EQ(HOMA_WHEEL_DEAD_PEERS, wheel->num_dead_peers);
+
+	/* The peer that didn't fit will time out again next check. */
+	restored = 0;
+	for (i = 0; i <= HOMA_WHEEL_DEAD_PEERS; i++) {
+		if (crpcs[i]->peer->outstanding_resends
+				== self->homa.timeout_resends)
+			restored++;
+	}
+	EXPECT_EQ(1, restored);
+}
+
+TEST_F(homa_timer, homa_timer_softirq__nothing_due)
+{
+	struct homa_timer_wheel *wheel = &homa_cores[cpu_number]->timer_wheel;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+
+	ASSERT_NE(NULL, crpc);
+	homa_timer_softirq(&self->homa);
+	EXPECT_EQ(100, wheel->softirq_ticks);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+}
+TEST_F(homa_timer, homa_timer_softirq__check_due_rpcs)
+{
+	struct homa_timer_wheel *wheel = &homa_cores[cpu_number]->timer_wheel;
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+
+	ASSERT_NE(NULL, crpc);
+	self->homa.timer_ticks = 101;
+	homa_timer_softirq(&self->homa);
+	EXPECT_EQ(101, wheel->softirq_ticks);
+	EXPECT_EQ(101, wheel->now);
+	EXPECT_EQ(1, crpc->silent_ticks);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.softirq_timer_checks);
+}
+
+TEST_F(homa_timer, homa_timer__leave_wheel_to_softirq)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+
+	ASSERT_NE(NULL, crpc);
+	homa_timer_softirq(&self->homa);
+	homa_timer(&self->homa);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+
+	/* SoftIRQ hasn't run for a full tick: homa_timer takes over. */
+	homa_timer(&self->homa);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.timer_rpc_checks);
+	EXPECT_EQ(2, crpc->silent_ticks);
+}
+TEST_F(homa_timer, homa_timer__abort_peer_from_other_core)
+{
+	struct homa_rpc *crpc;
+
+	cpu_number = 3;
+	crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_ONE_PKT, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 200, 5000);
+	cpu_number = 1;
+	ASSERT_NE(NULL, crpc);
+	EXPECT_EQ(&homa_cores[3]->timer_wheel, crpc->timer_wheel);
+	crpc->peer->outstanding_resends = self->homa.timeout_resends;
+	crpc->active_ticks = 99;
+	homa_timer(&self->homa);
+	EXPECT_EQ(ETIMEDOUT, -crpc->error);
+	EXPECT_EQ(0, homa_cores[3]->timer_wheel.num_dead_peers);
+}
@@ -167,7 +167,7 @@ TEST_F(homa_utils, homa_rpc_new_server__already_exists)
 	homa_rpc_unlock(srpc1);
 	self->data.common.sender_id = cpu_to_be64(
 			be64_to_cpu(self->data.common.sender_id)
-			+ 2*HOMA_SERVER_RPC_BUCKETS);
+			+ 2*HOMA_RPC_BUCKETS);
 	struct homa_rpc *srpc2 = homa_rpc_new_server(&self->hsk,
 			self->client_ip, &self->data);
 	ASSERT_FALSE(IS_ERR(srpc2));
@@ -175,7 +175,7 @@ TEST_F(homa_utils, homa_rpc_new_server__already_exists)
 	EXPECT_NE(srpc2, srpc1);
 	self->data.common.sender_id = cpu_to_be64(
 			be64_to_cpu(self->data.common.sender_id)
-			- 2*HOMA_SERVER_RPC_BUCKETS);
+			- 2*HOMA_RPC_BUCKETS);
 	struct homa_rpc *srpc3 = homa_rpc_new_server(&self->hsk,
 			self->client_ip, &self->data);
 	ASSERT_FALSE(IS_ERR(srpc3));
@@ -235,6 +235,114 @@ TEST_F(homa_utils, homa_rpc_new_server__dont_handoff_rpc)
 	homa_rpc_free(srpc);
 }
 
+TEST_F(homa_utils, homa_rpc_table_get__allocate_on_first_use)
+{
+	EXPECT_EQ(NULL, self->hsk.client_rpcs);
+	EXPECT_EQ(NULL, homa_find_client_rpc(&self->hsk, 1234));
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc));
+	homa_rpc_unlock(crpc);
+	EXPECT_NE(NULL, self->hsk.client_rpcs);
+	EXPECT_EQ(NULL, self->hsk.server_rpcs);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.rpc_tables);
+	EXPECT_EQ(self->hsk.client_rpcs, homa_rpc_table_get(&self->hsk,
+			&self->hsk.client_rpcs, GFP_KERNEL));
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.rpc_tables);
+	homa_rpc_free(crpc);
+}
+TEST_F(homa_utils, homa_rpc_table_get__socket_shutdown)
+{
+	struct homa_rpc_table *table;
+
+	homa_sock_shutdown(&self->hsk);
+	table = homa_rpc_table_get(&self->hsk, &self->hsk.server_rpcs,
+			GFP_ATOMIC);
+	EXPECT_TRUE(IS_ERR(table));
+	EXPECT_EQ(ESHUTDOWN, -PTR_ERR(table));
+	EXPECT_EQ(NULL, self->hsk.server_rpcs);
+}
+
+TEST_F(homa_utils, homa_rpc_table_destroy)
+{
+	struct homa_rpc *crpc = homa_rpc_new_client(&self->hsk,
+			&self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc));
+	homa_rpc_free(crpc);
+	homa_rpc_unlock(crpc);
+	homa_rpc_reap(&self->hsk, 10);
+	mock_log_rcu_sched = 1;
+	unit_log_clear();
+	homa_rpc_table_destroy(&self->hsk.client_rpcs);
+	EXPECT_STREQ("call_rcu", unit_log_get());
+	EXPECT_EQ(NULL, self->hsk.client_rpcs);
+	EXPECT_EQ(NULL, homa_find_client_rpc(&self->hsk, crpc->id));
+	unit_log_clear();
+	homa_rpc_table_destroy(&self->hsk.server_rpcs);
+	EXPECT_STREQ("", unit_log_get());
+}
+
+TEST_F(homa_utils, homa_rpc_bucket_add__grow_chains)
+{
+	struct homa_rpc *crpcs[3];
+	struct homa_rpc_bucket *bucket;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		atomic64_set(&self->homa.next_outgoing_id,
+				2 + 2*i*HOMA_RPC_BUCKETS);
+		crpcs[i] = homa_rpc_new_client(&self->hsk, &self->server_addr);
+		ASSERT_FALSE(IS_ERR(crpcs[i]));
+		homa_rpc_unlock(crpcs[i]);
+	}
+	bucket = homa_client_rpc_bucket(&self->hsk, crpcs[0]->id);
+	EXPECT_EQ(3, bucket->num_rpcs);
+	EXPECT_EQ(2, bucket->bits);
+	EXPECT_EQ(2, homa_cores[cpu_number]->metrics.rpc_bucket_grows);
+	for (i = 0; i < 3; i++) {
+		EXPECT_EQ(crpcs[i], homa_find_client_rpc(&self->hsk,
+				crpcs[i]->id));
+		homa_rpc_unlock(crpcs[i]);
+	}
+	unit_log_clear();
+	unit_log_hashed_rpcs(&self->hsk);
+	EXPECT_STREQ("2 130 258", unit_log_get());
+	homa_rpc_free(crpcs[1]);
+	EXPECT_EQ(2, bucket->num_rpcs);
+	EXPECT_EQ(NULL, homa_find_client_rpc(&self->hsk, crpcs[1]->id));
+	homa_rpc_free(crpcs[0]);
+	homa_rpc_free(crpcs[2]);
+}
+TEST_F(homa_utils, homa_rpc_bucket_add__kmalloc_fails)
+{
+	struct homa_rpc *crpc1, *crpc2;
+	struct homa_rpc_bucket *bucket;
+
+	atomic64_set(&self->homa.next_outgoing_id, 2);
+	crpc1 = homa_rpc_new_client(&self->hsk, &self->server_addr);
+	ASSERT_FALSE(IS_ERR(crpc1));
+	homa_rpc_unlock(crpc1);
+	atomic64_set(&self->homa.next_outgoing_id, 2 + 2*HOMA_RPC_BUCKETS);
+	crpc2 = homa_rpc_alloc(&self->hsk);
+	ASSERT_NE(NULL, crpc2);
+	crpc2->id = 2 + 2*HOMA_RPC_BUCKETS;
+	bucket = homa_client_rpc_bucket(&self->hsk, crpc2->id);
+	mock_kmalloc_errors = 1;
+	spin_lock_bh(&bucket->lock);
+	homa_rpc_bucket_add(bucket, crpc2);
+	spin_unlock_bh(&bucket->lock);
+	EXPECT_EQ(2, bucket->num_rpcs);
+	EXPECT_EQ(0, bucket->bits);
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.rpc_bucket_grows);
+	unit_log_clear();
+	unit_log_hashed_rpcs(&self->hsk);
+	EXPECT_STREQ("130 2", unit_log_get());
+	__hlist_del(&crpc2->hash_links);
+	bucket->num_rpcs--;
+	kmem_cache_free(self->homa.rpc_cache, crpc2);
+	homa_rpc_free(crpc1);
+}
+
 TEST_F(homa_utils, homa_rpc_lock_slow)
 {
 	mock_cycles = ~0;
@@ -424,9 +532,9 @@ TEST_F(homa_utils, homa_rpc_free__release_buffers)
 	ASSERT_NE(NULL, crpc);
 
 	EXPECT_EQ(0, homa_pool_allocate(crpc));
-	EXPECT_EQ(1, atomic_read(&pool->descriptors[1].refs));
+	EXPECT_EQ(1, atomic_read(&pool->regions[0].descriptors[1].refs));
 	homa_rpc_free(crpc);
-	EXPECT_EQ(0, atomic_read(&pool->descriptors[1].refs));
+	EXPECT_EQ(0, atomic_read(&pool->regions[0].descriptors[1].refs));
 }
 TEST_F(homa_utils, homa_rpc_free__remove_from_throttled_list)
 {
@@ -475,6 +583,43 @@ TEST_F(homa_utils, homa_rpc_reap__basics)
 	unit_log_clear();
 	EXPECT_STREQ("1236 1238", dead_rpcs(&self->hsk));
 	EXPECT_EQ(4, self->hsk.dead_skbs);
+	EXPECT_EQ(7, mock_napi_consumed);
+}
+TEST_F(homa_utils, homa_rpc_reap__recycle_rpcs)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 100, 100);
+	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id+2, 100, 100);
+	ASSERT_NE(NULL, crpc1);
+	ASSERT_NE(NULL, crpc2);
+	homa_rpc_free(crpc1);
+	homa_rpc_free(crpc2);
+	self->hsk.num_free_rpcs = HOMA_MAX_FREE_RPCS - 1;
+	homa_rpc_reap(&self->hsk, 10);
+	EXPECT_EQ(HOMA_MAX_FREE_RPCS, self->hsk.num_free_rpcs);
+	EXPECT_EQ(1, unit_list_length(&self->hsk.free_rpcs));
+	self->hsk.num_free_rpcs = 1;
+
+	/* The next RPC should reuse the struct on the free list. */
+	EXPECT_EQ(crpc1, unit_client_rpc(&self->hsk, UNIT_OUTGOING,
+			self->client_ip, self->server_ip, self->server_port,
+			self->client_id+4, 100, 100));
+	EXPECT_EQ(0, self->hsk.num_free_rpcs);
+	EXPECT_EQ(3, homa_cores[cpu_number]->metrics.rpc_allocs);
+	EXPECT_EQ(1, homa_cores[cpu_number]->metrics.rpc_recycles);
+}
+TEST_F(homa_utils, homa_rpc_reap__dont_recycle_after_shutdown)
+{
+	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 100, 100);
+	ASSERT_NE(NULL, crpc1);
+	homa_sock_shutdown(&self->hsk);
+	EXPECT_EQ(0, self->hsk.num_free_rpcs);
+	EXPECT_EQ(0, unit_list_length(&self->hsk.free_rpcs));
 }
 TEST_F(homa_utils, homa_rpc_reap__protected)
 {
@@ -552,6 +697,62 @@ TEST_F(homa_utils, homa_rpc_reap__nothing_to_reap)
 {
 	EXPECT_EQ(0, homa_rpc_reap(&self->hsk, 10));
 }
+TEST_F(homa_utils, homa_rpc_reap__skb_still_referenced)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_OUTGOING, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 2000, 100);
+	struct sk_buff *skb;
+
+	ASSERT_NE(NULL, crpc);
+	skb = crpc->msgout.packets;
+	skb_get(skb);
+	homa_rpc_free(crpc);
+	unit_log_clear();
+	EXPECT_EQ(0, homa_rpc_reap(&self->hsk, 10));
+	EXPECT_STREQ("reaped 1234", unit_log_get());
+	EXPECT_EQ(1, refcount_read(&skb->users));
+	EXPECT_EQ(1, mock_napi_consumed);
+	kfree_skb(skb);
+}
+
+TEST_F(homa_utils, homa_reap_sockets__adapt_to_backlog)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 20000);
+
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	EXPECT_EQ(30, self->hsk.dead_skbs);
+	self->homa.reap_limit = 3;
+	EXPECT_EQ(1, homa_reap_sockets(&self->homa));
+	EXPECT_EQ(20, self->hsk.dead_skbs);
+	EXPECT_EQ(1, homa_reap_sockets(&self->homa));
+	EXPECT_EQ(12, self->hsk.dead_skbs);
+	self->homa.reap_limit = 100;
+	EXPECT_EQ(0, homa_reap_sockets(&self->homa));
+	EXPECT_EQ(0, self->hsk.dead_skbs);
+	EXPECT_STREQ("", dead_rpcs(&self->hsk));
+}
+TEST_F(homa_utils, homa_reap_sockets__cap_work_per_socket)
+{
+	struct homa_rpc *crpc = unit_client_rpc(&self->hsk,
+			UNIT_RCVD_MSG, self->client_ip, self->server_ip,
+			self->server_port, self->client_id, 20000, 20000);
+
+	ASSERT_NE(NULL, crpc);
+	homa_rpc_free(crpc);
+	EXPECT_EQ(30, self->hsk.dead_skbs);
+	self->homa.reap_limit = 1;
+	EXPECT_EQ(1, homa_reap_sockets(&self->homa));
+	EXPECT_EQ(30 - HOMA_MAX_REAP_SCALE, self->hsk.dead_skbs);
+}
+TEST_F(homa_utils, homa_reap_sockets__nothing_to_reap)
+{
+	EXPECT_EQ(0, homa_reap_sockets(&self->homa));
+	EXPECT_EQ(0, homa_cores[cpu_number]->metrics.reaper_calls);
+}
 
 TEST_F(homa_utils, homa_find_client_rpc)
 {
@@ -559,12 +760,12 @@ TEST_F(homa_utils, homa_find_client_rpc)
 	struct homa_rpc *crpc1 = unit_client_rpc(&self->hsk,
 			UNIT_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, self->client_id, 10000, 1000);
-	atomic64_set(&self->homa.next_outgoing_id, 3 + 3*HOMA_CLIENT_RPC_BUCKETS);
+	atomic64_set(&self->homa.next_outgoing_id, 3 + 3*HOMA_RPC_BUCKETS);
 	struct homa_rpc *crpc2 = unit_client_rpc(&self->hsk,
 			UNIT_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, self->client_id+2, 10000, 1000);
 	atomic64_set(&self->homa.next_outgoing_id,
-			3 + 10*HOMA_CLIENT_RPC_BUCKETS);
+			3 + 10*HOMA_RPC_BUCKETS);
 	struct homa_rpc *crpc3 = unit_client_rpc(&self->hsk,
 			UNIT_OUTGOING, self->client_ip, self->server_ip,
 			self->server_port, self->client_id+4, 10000, 1000);
@@ -596,12 +797,12 @@ TEST_F(homa_utils, homa_find_server_rpc)
 	ASSERT_NE(NULL, srpc1);
 	struct homa_rpc *srpc2 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
 			self->client_ip, self->server_ip, self->client_port,
-			self->server_id + 30*HOMA_SERVER_RPC_BUCKETS,
+			self->server_id + 30*HOMA_RPC_BUCKETS,
 			10000, 100);
 	ASSERT_NE(NULL, srpc2);
 	struct homa_rpc *srpc3 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
 			self->client_ip, self->server_ip, self->client_port+1,
-			self->server_id + 10*HOMA_SERVER_RPC_BUCKETS,
+			self->server_id + 10*HOMA_RPC_BUCKETS,
 			10000, 100);
 	ASSERT_NE(NULL, srpc3);
 	struct homa_rpc *srpc4 = unit_server_rpc(&self->hsk, UNIT_RCVD_ONE_PKT,
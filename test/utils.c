@@ -173,18 +173,22 @@ void unit_log_active_ids(struct homa_sock *hsk)
  */
 void unit_log_hashed_rpcs(struct homa_sock *hsk)
 {
-	int i;
+	struct homa_rpc_table *tables[] = {hsk->client_rpcs, hsk->server_rpcs};
+	struct homa_rpc_bucket *bucket;
 	struct homa_rpc *rpc;
-	for (i = 0; i < HOMA_CLIENT_RPC_BUCKETS; i++) {
-		hlist_for_each_entry_rcu(rpc, &hsk->client_rpc_buckets[i].rpcs,
-				hash_links) {
-			unit_log_printf(" ", "%llu", rpc->id);
-		}
-	}
-	for (i = 0; i < HOMA_SERVER_RPC_BUCKETS; i++) {
-		hlist_for_each_entry_rcu(rpc, &hsk->server_rpc_buckets[i].rpcs,
-				hash_links) {
-			unit_log_printf(" ", "%llu", rpc->id);
+	int i, j, k;
+
+	for (i = 0; i < 2; i++) {
+		if (!tables[i])
+			continue;
+		for (j = 0; j < HOMA_RPC_BUCKETS; j++) {
+			bucket = &tables[i]->buckets[j];
+			for (k = 0; k < (1 << bucket->bits); k++) {
+				hlist_for_each_entry_rcu(rpc, &bucket->rpcs[k],
+						hash_links) {
+					unit_log_printf(" ", "%llu", rpc->id);
+				}
+			}
 		}
 	}
 }
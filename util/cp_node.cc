@@ -84,6 +84,8 @@ const char *workload = "100";
 int unloaded = 0;
 bool client_iovec = false;
 bool server_iovec = false;
+int client_buf_flags = 0;
+int server_buf_flags = 0;
 int inet_family = AF_INET;
 int server_core = -1;
 
@@ -287,6 +289,8 @@ void print_help(const char *name)
 		"    --first-server    Id of first server node (default: %d, meaning node-%d)\n"
 		"    --gbps            Target network utilization, including only message data,\n"
 		"                      Gbps; 0 means send continuously (default: %.1f)\n"
+		"    --huge-buf        Back the Homa buffer region with huge pages and\n"
+		"                      pin it in memory\n"
 		"    --id              Id of this node; a value of I >= 0 means requests will\n"
 		"                      not be sent to node-I (default: -1)\n"
                 "    --iovec           Use homa_sendv instead of homa_send\n"
@@ -294,6 +298,7 @@ void print_help(const char *name)
 		"    --no-trunc        For TCP, allow messages longer than Homa's limit\n"
 		"    --one-way         Make all response messages 100 B, instead of the same\n"\
 		"                      size as request messages\n"
+		"    --pin-buf         Pin the Homa buffer region in memory\n"
 		"    --ports           Number of ports on which to send requests (one\n"
 		"                      sending thread per port (default: %d)\n"
 		"    --port-receivers  Number of threads to listen for responses on each\n"
@@ -320,10 +325,13 @@ void print_help(const char *name)
 		"    --level           Log level: either normal or verbose\n\n"
 		"server [options]      Start serving requests on one or more ports\n"
 		"    --first-port      Lowest port number to use (default: %d)\n"
+		"    --huge-buf        Back the Homa buffer region with huge pages and\n"
+		"                      pin it in memory\n"
                 "    --iovec           Use homa_replyv instead of homa_reply\n"
                 "    --ipv6            Use IPv6 instead of IPv4\n"
 		"    --pin             All server threads will be restricted to run only\n"
 	        "                      on the givevn core\n"
+		"    --pin-buf         Pin the Homa buffer region in memory\n"
 		"    --protocol        Transport protocol to use: homa or tcp (default: %s)\n"
 		"    --port-threads    Number of server threads to service each port\n"
 		"                      (Homa only, default: %d)\n"
@@ -1013,14 +1021,17 @@ homa_server::homa_server(int port, int id, int inet_family,
 
 	buf_size = 1000*HOMA_BPAGE_SIZE;
 	buf_region = (char *) mmap(NULL, buf_size, PROT_READ|PROT_WRITE,
-			MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
+			MAP_PRIVATE|MAP_ANONYMOUS|((server_buf_flags
+			& HOMA_BUF_HUGE) ? MAP_HUGETLB : 0), 0, 0);
 	if (buf_region == MAP_FAILED) {
 		printf("Couldn't mmap buffer region for server on port %d: %s\n",
 				port, strerror(errno));
 		exit(1);
 	}
+	memset(&arg, 0, sizeof(arg));
 	arg.start = buf_region;
 	arg.length = buf_size;
+	arg.flags = server_buf_flags;
 	int status = setsockopt(fd, IPPROTO_HOMA, SO_HOMA_SET_BUF, &arg,
 			sizeof(arg));
 	if (status < 0) {
@@ -1914,14 +1925,17 @@ homa_client::homa_client(int id)
 	}
 
 	buf_region = (char *) mmap(NULL, buf_size, PROT_READ|PROT_WRITE,
-			MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
+			MAP_PRIVATE|MAP_ANONYMOUS|((client_buf_flags
+			& HOMA_BUF_HUGE) ? MAP_HUGETLB : 0), 0, 0);
 	if (buf_region == MAP_FAILED) {
 		printf("Couldn't mmap buffer region for homa_client id %d: %s\n",
 				id, strerror(errno));
 		exit(1);
 	}
+	memset(&arg, 0, sizeof(arg));
 	arg.start = buf_region;
 	arg.length = buf_size;
+	arg.flags = client_buf_flags;
 	int status = setsockopt(fd, IPPROTO_HOMA, SO_HOMA_SET_BUF, &arg,
 			sizeof(arg));
 	if (status < 0) {
@@ -2773,6 +2787,7 @@ void log_stats()
  */
 int client_cmd(std::vector<string> &words)
 {
+	client_buf_flags = 0;
 	client_iovec = false;
 	client_max = 1;
 	client_ports = 1;
@@ -2811,6 +2826,8 @@ int client_cmd(std::vector<string> &words)
 			if (!parse(words, i+1, &id, option, "integer"))
 				return 0;
 			i++;
+		} else if (strcmp(option, "--huge-buf") == 0) {
+			client_buf_flags = HOMA_BUF_PIN|HOMA_BUF_HUGE;
 		} else if (strcmp(option, "--iovec") == 0) {
 			client_iovec = true;
 		} else if (strcmp(option, "--ipv6") == 0) {
@@ -2819,6 +2836,8 @@ int client_cmd(std::vector<string> &words)
 			tcp_trunc = false;
 		} else if (strcmp(option, "--one-way") == 0) {
 			one_way = true;
+		} else if (strcmp(option, "--pin-buf") == 0) {
+			client_buf_flags = HOMA_BUF_PIN;
 		} else if (strcmp(option, "--ports") == 0) {
 			if (!parse(words, i+1, &client_ports, option, "integer"))
 				return 0;
@@ -3078,6 +3097,7 @@ int server_cmd(std::vector<string> &words)
 	server_core = -1;
 	server_ports = 1;
 	server_iovec = false;
+	server_buf_flags = 0;
 
 	for (unsigned i = 1; i < words.size(); i++) {
 		const char *option = words[i].c_str();
@@ -3086,6 +3106,8 @@ int server_cmd(std::vector<string> &words)
 			if (!parse(words, i+1, &first_port, option, "integer"))
 				return 0;
 			i++;
+		} else if (strcmp(option, "--huge-buf") == 0) {
+			server_buf_flags = HOMA_BUF_PIN|HOMA_BUF_HUGE;
 		} else if (strcmp(option, "--iovec") == 0) {
 			server_iovec = true;
 		} else if (strcmp(option, "--ipv6") == 0) {
@@ -3094,6 +3116,8 @@ int server_cmd(std::vector<string> &words)
 			if (!parse(words, i+1, &server_core, option, "integer"))
 				return 0;
 			i++;
+		} else if (strcmp(option, "--pin-buf") == 0) {
+			server_buf_flags = HOMA_BUF_PIN;
 		} else if (strcmp(option, "--port-threads") == 0) {
 			if (!parse(words, i+1, &port_threads, option, "integer"))
 				return 0;
@@ -316,10 +316,13 @@ def init(options):
     vlog("Options: %s" % (s))
     vlog("Homa configuration:")
     for param in ['dead_buffs_limit', 'duty_cycle', 'grant_fifo_fraction',
-            'grant_increment', 'gro_policy', 'link_mbps', 'max_dead_buffs',
-            'max_gro_skbs', 'max_gso_size', 'max_nic_queue_ns',
-            'max_overcommit', 'num_priorities', 'pacer_fifo_fraction',
-            'poll_usecs', 'reap_limit', 'resend_interval', 'resend_ticks',
+            'grant_increment', 'gro_affine_max_backlog', 'gro_policy',
+            'link_mbps', 'max_dead_buffs',
+            'max_gro_skbs', 'max_gro_usecs', 'max_gso_size',
+            'max_nic_queue_ns',
+            'max_overcommit', 'max_pollers', 'num_priorities',
+            'pacer_fifo_fraction', 'poll_percentile', 'poll_usecs',
+            'reap_limit', 'resend_interval', 'resend_ticks',
             'rtt_bytes', 'throttle_min_bytes', 'timeout_resends']:
         result = subprocess.run(['sysctl', '-n', '.net.homa.' + param],
                 capture_output = True, encoding="utf-8");
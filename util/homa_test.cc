@@ -37,6 +37,7 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 
+#include <atomic>
 #include <thread>
 
 #include "homa.h"
@@ -51,6 +52,9 @@ int count = 1000;
 /* Used to generate "somewhat random but predictable" contents for buffers. */
 int seed = 12345;
 
+/* Number of threads to use for the "stress" test. */
+int num_threads = 8;
+
 /* Buffer space used for receiving messages. */
 char *buf_region;
 
@@ -129,7 +133,8 @@ void print_help(const char *name)
 		"--count      Number of times to repeat a test (default: 1000)\n"
 		"--ipv6       Use IPv6 instead of IPv4 (default: IPv4)\n"
 		"--length     Size of messages, in bytes (default: 100)\n"
-		"--seed       Used to compute message contents (default: 12345)\n",
+		"--seed       Used to compute message contents (default: 12345)\n"
+		"--threads    Number of threads for the stress test (default: 8)\n",
 		name);
 }
 
@@ -422,6 +427,75 @@ void test_send(int fd, const sockaddr_in_union *dest, char *request)
 	}
 }
 
+/**
+ * stress_thread() - Body for one of the threads in the "stress" test:
+ * issues --count RPCs one at a time, receiving any response for the socket
+ * after each request (so responses are often delivered to a different
+ * thread than the one that sent the request).
+ * @fd:        Homa socket shared by all of the threads.
+ * @dest:      Where to send requests.
+ * @request:   Request message.
+ * @received:  Incremented for each response received.
+ * @errors:    Incremented for each failed send or receive.
+ */
+void stress_thread(int fd, const sockaddr_in_union *dest, char *request,
+		std::atomic<int> *received, std::atomic<int> *errors)
+{
+	struct homa_recvmsg_args args = {};
+	sockaddr_in_union source;
+	struct msghdr hdr = {};
+	uint64_t id;
+
+	hdr.msg_name = &source;
+	hdr.msg_namelen = sizeof32(source);
+	hdr.msg_control = &args;
+	hdr.msg_controllen = sizeof(args);
+	for (int i = 0; i < count; i++) {
+		if (homa_send(fd, request, length, dest, &id, 0) < 0) {
+			printf("Error in homa_send: %s\n", strerror(errno));
+			(*errors)++;
+			continue;
+		}
+		args.id = 0;
+		args.flags = HOMA_RECVMSG_RESPONSE;
+		if (recvmsg(fd, &hdr, 0) < 0) {
+			printf("Error in recvmsg: %s\n", strerror(errno));
+			(*errors)++;
+			args.num_bpages = 0;
+			continue;
+		}
+		(*received)++;
+	}
+}
+
+/**
+ * test_stress() - Run --threads threads that issue RPCs concurrently on
+ * a single socket, in order to exercise the socket's ready queues,
+ * interests, and reaping under contention.
+ * @fd:       Homa socket.
+ * @dest:     Where to send requests.
+ * @request:  Request message.
+ */
+void test_stress(int fd, const sockaddr_in_union *dest, char *request)
+{
+	std::atomic<int> received(0), errors(0);
+	std::thread *threads[num_threads];
+	uint64_t start = rdtsc();
+
+	for (int i = 0; i < num_threads; i++)
+		threads[i] = new std::thread(stress_thread, fd, dest, request,
+				&received, &errors);
+	for (int i = 0; i < num_threads; i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+	double elapsed = to_seconds(rdtsc() - start);
+	printf("%d threads completed %d/%d RPCs (%d errors) in %.3f sec "
+			"(%.1f us/RPC)\n", num_threads, received.load(),
+			num_threads*count, errors.load(), elapsed,
+			elapsed*1e06/(received.load() ? received.load() : 1));
+}
+
 /**
  * test_set_buf() - Invoke homa_set_buf on a Homa socket.
  * @fd:       Homa socket.
@@ -431,7 +505,7 @@ void test_set_buf(int fd)
 	int status;
 	char *region = (char *) mmap(NULL, 64*HOMA_BPAGE_SIZE,
 			PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
-	struct homa_set_buf_args arg;
+	struct homa_set_buf_args arg = {};
 
 	if (region == MAP_FAILED) {
 		printf("Couldn't mmap buffer region: %s\n", strerror(errno));
@@ -882,6 +956,16 @@ int main(int argc, char** argv)
 			next_arg++;
 			seed = get_int(argv[next_arg],
 				"Bad seed %s; must be positive integer\n");
+		} else if (strcmp(argv[next_arg], "--threads") == 0) {
+			if (next_arg == (argc-1)) {
+				printf("No value provided for %s option\n",
+					argv[next_arg]);
+				exit(1);
+			}
+			next_arg++;
+			num_threads = get_int(argv[next_arg],
+				"Bad thread count %s; must be positive "
+				"integer\n");
 		} else {
 			printf("Unknown option %s; type '%s --help' for help\n",
 				argv[next_arg], argv[0]);
@@ -921,7 +1005,7 @@ int main(int argc, char** argv)
 		printf("Couldn't mmap buffer region: %s\n", strerror(errno));
 		exit(1);
 	}
-	struct homa_set_buf_args arg;
+	struct homa_set_buf_args arg = {};
 	arg.start = buf_region;
 	arg.length = 1000*HOMA_BPAGE_SIZE;
 	status = setsockopt(fd, IPPROTO_HOMA, SO_HOMA_SET_BUF, &arg,
@@ -965,6 +1049,8 @@ int main(int argc, char** argv)
 			test_set_buf(fd);
 		} else if (strcmp(argv[next_arg], "stream") == 0) {
 			test_stream(fd, &dest);
+		} else if (strcmp(argv[next_arg], "stress") == 0) {
+			test_stress(fd, &dest, buffer);
 		} else if (strcmp(argv[next_arg], "tcp") == 0) {
 			test_tcp(host, port);
 		} else if (strcmp(argv[next_arg], "tcpstream") == 0) {
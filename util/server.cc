@@ -72,7 +72,7 @@ void homa_server(int port)
 	int length;
 	struct homa_recvmsg_args recv_args;
 	struct msghdr hdr;
-	struct homa_set_buf_args arg;
+	struct homa_set_buf_args arg = {};
 	char *buf_region;
 	struct iovec vecs[HOMA_MAX_BPAGES];
 	int num_vecs;